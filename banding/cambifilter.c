@@ -1,96 +1,363 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 
 #include "internalfilters.h"
 #include "libvmaf/picture.h"
 #include "libvmaf/cambi.h"
+#include "libvmaf/numa.h"
+#include "libvmaf/timer.h"
 
 #include "VapourSynth.h"
 #include "VSHelper.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#define slot_try_acquire(p) (_InterlockedCompareExchange((p), 1, 0) == 0)
+#define slot_release(p) _InterlockedExchange((p), 0)
+#else
+#define slot_try_acquire(p) __sync_bool_compare_and_swap((p), 0, 1)
+#define slot_release(p) __sync_lock_release(p)
+#endif
+
+// Scratch state for one in-flight frame, reused across frames.
+typedef struct {
+    volatile long busy;
+    int initialized;
+    CambiState s;
+    float *c_values[NUM_SCALES];
+} CambiScratch;
+
 typedef struct {
     VSNodeRef *node;
+    // The source of clip in full-reference mode, or NULL.
+    VSNodeRef *ref;
     VSVideoInfo vi;
     CambiState s;
     int bpc;
+    int ref_bpc;
     int scores;
+    int scale_scores;
     float scaling;
+    int step;
+    char *prop_trigger;
+    int stats;
+    int cache;
+    // The area left by crop, shrunk further to the picture inside black bars with letterbox > 0.
+    CambiArea area;
+    int use_area;
+    double letterbox; // in sample units
+    // With summary, the scores of each frame (NAN until it is analyzed) for the file written by cambiFree.
+    // Every frame has its own slot, so they are stored without any locking.
+    char *summary;
+    double *summary_scores;
+    double *summary_full_reference;
+    int num_scratch;
+    CambiScratch *scratch;
 } CambiData;
 
+static int scratchInit(const CambiData *d, CambiScratch *sc) {
+    sc->s = d->s;
+    int err = cambi_init(&sc->s, d->vi.width, d->vi.height);
+    if (err != 0)
+        return err;
+    if (d->scores) {
+        unsigned int w = d->s.enc_width, h = d->s.enc_height;
+        for (int i = 0; i < NUM_SCALES; i++) {
+            sc->c_values[i] = calloc(w * h, sizeof *sc->c_values[i]);
+            scale_dimension(&w, 1);
+            scale_dimension(&h, 1);
+        }
+    }
+    sc->initialized = 1;
+    return 0;
+}
+
+static void scratchClose(CambiScratch *sc) {
+    if (!sc->initialized)
+        return;
+    cambi_close(&sc->s);
+    for (int i = 0; i < NUM_SCALES; i++)
+        free(sc->c_values[i]);
+    sc->initialized = 0;
+}
+
+// Checks out a free scratch slot. Returns NULL when all slots are in use, in
+// which case the caller has to fall back to a temporary one.
+// On a NUMA machine, slots whose buffers are on the node of the calling thread are preferred.
+static CambiScratch *scratchAcquire(CambiData *d) {
+    const int node = d->s.numa && vmaf_numa_node_count() > 1 ? vmaf_numa_current_node() : -1;
+    for (int pass = node >= 0 ? 0 : 1; pass < 2; pass++) {
+        for (int i = 0; i < d->num_scratch; i++) {
+            CambiScratch *sc = &d->scratch[i];
+            if (!slot_try_acquire(&sc->busy))
+                continue;
+            if (pass == 0 && sc->initialized && sc->s.numa_node != node) {
+                slot_release(&sc->busy);
+                continue;
+            }
+            if (!sc->initialized && scratchInit(d, sc) != 0) {
+                slot_release(&sc->busy);
+                return NULL;
+            }
+            return sc;
+        }
+    }
+    return NULL;
+}
+
+static void pictureOf(VmafPicture *pic, const VSFrameRef *f, int bpc, const VSAPI *vsapi) {
+    pic->pix_fmt = VMAF_PIX_FMT_YUV400P; // GRAY
+    pic->bpc = bpc;
+    pic->w[0] = vsapi->getFrameWidth(f, 0);
+    pic->h[0] = vsapi->getFrameHeight(f, 0);
+    pic->stride[0] = vsapi->getStride(f, 0);
+    pic->data[0] = (uint8_t *)vsapi->getReadPtr(f, 0);
+    pic->ref = NULL;
+}
+
+// Whether the n samples of plane 0 from p on, step bytes apart, are no brighter than threshold.
+static int isBlack(const uint8_t *p, ptrdiff_t step, unsigned n, int bpc, double threshold) {
+    for (unsigned i = 0; i < n; i++, p += step) {
+        const double v = bpc == 8 ? *p : bpc == 32 ? *(const float *)p : *(const uint16_t *)p;
+        if (v > threshold)
+            return 0;
+    }
+    return 1;
+}
+
+// Shrinks area to the rows and columns that are not all black. An area less than half as wide or
+// high is most likely a dark scene rather than black bars, in which case area is left as it is.
+static void detectLetterbox(CambiArea *area, const VmafPicture *pic, double threshold) {
+    const unsigned bytes = pic->bpc == 8 ? 1 : pic->bpc == 32 ? 4 : 2;
+    const ptrdiff_t stride = pic->stride[0];
+    const uint8_t *origin = (const uint8_t *)pic->data[0] + area->y * stride + area->x * bytes;
+    unsigned top = 0, bottom = area->h, left = 0, right = area->w;
+    while (top < bottom && isBlack(origin + top * stride, bytes, area->w, pic->bpc, threshold))
+        top++;
+    while (bottom > top && isBlack(origin + (bottom - 1) * stride, bytes, area->w, pic->bpc, threshold))
+        bottom--;
+    while (left < right && isBlack(origin + top * stride + left * bytes, stride, bottom - top, pic->bpc, threshold))
+        left++;
+    while (right > left && isBlack(origin + top * stride + (right - 1) * bytes, stride, bottom - top, pic->bpc, threshold))
+        right--;
+    if (2 * (bottom - top) < area->h || 2 * (right - left) < area->w)
+        return;
+    area->x += left;
+    area->y += top;
+    area->w = right - left;
+    area->h = bottom - top;
+}
+
+static int isSupportedFormat(const VSVideoInfo *vi) {
+    return isConstantFormat(vi) &&
+        (vi->format->colorFamily == cmGray || vi->format->colorFamily == cmYUV) &&
+        !(vi->format->sampleType == stInteger && (vi->format->bitsPerSample == 9 || vi->format->bitsPerSample > 16)) &&
+        !(vi->format->sampleType == stFloat && vi->format->bitsPerSample != 32);
+}
+
+static int compareDouble(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Writes the statistics of the scores of the analyzed frames as a JSON object member, and returns how many there were.
+static int writeSummary(FILE *f, const char *name, const double *scores, int num_frames) {
+    double *sorted = malloc(num_frames * sizeof *sorted);
+    int n = 0;
+    double sum = 0;
+    for (int i = 0; i < num_frames; i++) {
+        if (isnan(scores[i]))
+            continue;
+        sorted[n++] = scores[i];
+        sum += scores[i];
+    }
+    qsort(sorted, n, sizeof *sorted, compareDouble);
+    if (n > 0) {
+        // Nearest rank percentile
+        const int p95 = (int)ceil(0.95 * n) - 1;
+        fprintf(f, "  \"%s\": { \"mean\": %.17g, \"min\": %.17g, \"p95\": %.17g, \"max\": %.17g }",
+                name, sum / n, sorted[0], sorted[p95], sorted[n - 1]);
+    } else {
+        fprintf(f, "  \"%s\": null", name);
+    }
+    free(sorted);
+    return n;
+}
+
 static void VS_CC cambiInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     CambiData *d = (CambiData *) *instanceData;
     vsapi->setVideoInfo(&d->vi, 1, node);
 }
 
+// The state of a frame between the calls of cambiGetFrame.
+typedef struct CambiFrameState {
+    double requested; // with stats, the time the frame was requested
+    int ref_requested;
+} CambiFrameState;
+
 static const VSFrameRef *VS_CC cambiGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     CambiData *d = (CambiData *) *instanceData;
 
+    CambiFrameState *state = *frameData;
+    *frameData = NULL;
+
     if (activationReason == arInitial) {
+        if (d->stats || d->ref) {
+            state = calloc(1, sizeof *state);
+            state->requested = d->stats ? vmaf_timer_seconds() : 0;
+            *frameData = state;
+        }
         vsapi->requestFrameFilter(n, d->node, frameCtx);
+        // The reference frame is only fetched for the frames that are analysed. With
+        // prop_trigger, that is only known once the frame of clip is there.
+        if (d->ref && d->step > 0 && n % d->step == 0) {
+            vsapi->requestFrameFilter(n, d->ref, frameCtx);
+            state->ref_requested = 1;
+        }
     } else if (activationReason == arAllFramesReady) {
+        const double ready = vmaf_timer_seconds();
         const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+
+        int analyze = d->step > 0 && n % d->step == 0;
+        if (!analyze && d->prop_trigger) {
+            int err;
+            const VSMap *props = vsapi->getFramePropsRO(src);
+            switch (vsapi->propGetType(props, d->prop_trigger)) {
+            case ptInt: analyze = vsapi->propGetInt(props, d->prop_trigger, 0, &err) != 0; break;
+            case ptFloat: analyze = vsapi->propGetFloat(props, d->prop_trigger, 0, &err) != 0; break;
+            default: break;
+            }
+        }
+        if (!analyze) {
+            free(state);
+            return src; // skipped frames are passed through as is
+        }
+        if (d->ref && !state->ref_requested) {
+            vsapi->freeFrame(src);
+            vsapi->requestFrameFilter(n, d->ref, frameCtx);
+            state->ref_requested = 1;
+            *frameData = state;
+            return NULL;
+        }
+        const double fetch = state && d->stats ? ready - state->requested : 0;
+        free(state);
+        const VSFrameRef *ref = d->ref ? vsapi->getFrameFilter(n, d->ref, frameCtx) : NULL;
+
         const unsigned int width = vsapi->getFrameWidth(src, 0);
         const unsigned int height = vsapi->getFrameHeight(src, 0);
-        VSFrameRef *dst = vsapi->copyFrame(src, core);
+        // Only the properties are new, the planes are shared with src.
+        const VSFrameRef *planeSrc[3] = { src, src, src };
+        const int planes[3] = { 0, 1, 2 };
+        VSFrameRef *dst = vsapi->newVideoFrame2(d->vi.format, width, height, planeSrc, planes, src, core);
 
         VmafPicture pic; // shares memory with src
-        pic.pix_fmt = VMAF_PIX_FMT_YUV400P; // GRAY
-        pic.bpc = d->bpc;
-        pic.w[0] = width;
-        pic.h[0] = height;
-        pic.stride[0] = vsapi->getStride(src, 0);
-        pic.data[0] = (uint8_t *)vsapi->getReadPtr(src, 0);
-        pic.ref = NULL;
-
-        double score;
-        CambiState s = d->s; // cambiGetFrame might be called concurrently
-        int err = cambi_init(&s, pic.w[0], pic.h[0]);
-        assert(err == 0);
+        pictureOf(&pic, src, d->bpc, vsapi);
+        CambiArea area = d->area;
+        if (d->letterbox > 0)
+            detectLetterbox(&area, &pic, d->letterbox);
+        const CambiArea *parea = d->use_area ? &area : NULL;
 
-        float *c_values[NUM_SCALES];
-        if (d->scores) {
-            unsigned int w = width, h = height;
-            for (int i = 0; i < NUM_SCALES; i++) {
-                c_values[i] = calloc(w * h, sizeof *c_values[i]);
-                scale_dimension(&w, 1);
-                scale_dimension(&h, 1);
-            }
+        double score, scores_per_scale[NUM_SCALES], seconds_per_scale[NUM_SCALES];
+        double ref_score, ref_scores_per_scale[NUM_SCALES], ref_seconds_per_scale[NUM_SCALES];
+        // cambiGetFrame might be called concurrently, so each frame needs its own scratch state.
+        CambiScratch tmp = { 0 };
+        CambiScratch *sc = scratchAcquire(d);
+        if (sc == NULL) {
+            sc = &tmp;
+            int err = scratchInit(d, sc);
+            assert(err == 0);
         }
-        err = cambi_extract(&s, &pic, &score, d->scores ? c_values : NULL);
-        cambi_close(&s);
+        float **c_values = sc->c_values;
+        int err = 0;
+        // The source is computed first with the same scratch state, so that the c-scores
+        // left in it are those of clip.
+        if (ref) {
+            VmafPicture ref_pic;
+            pictureOf(&ref_pic, ref, d->ref_bpc, vsapi);
+            err = cambi_extract_area(&sc->s, &ref_pic, parea, &ref_score, ref_scores_per_scale, NULL,
+                                     d->stats ? ref_seconds_per_scale : NULL);
+            vsapi->freeFrame(ref);
+        }
+        if (err == 0)
+            err = cambi_extract_area(&sc->s, &pic, parea, &score, scores_per_scale, d->scores ? c_values : NULL,
+                                     d->stats ? seconds_per_scale : NULL);
 
         VSMap *prop = vsapi->getFramePropsRW(dst);
         if (d->scores) {
             const VSFormat *grays = vsapi->getFormatPreset(pfGrayS, core);
-            unsigned int w = width, h = height;
+            // The c-scores are at the evaluation resolution and only cover the area, outside of which they are 0.
+            unsigned int w = d->s.enc_width, h = d->s.enc_height;
+            const CambiArea enc_area = cambi_area_at(&area, width, height, w, h);
+            unsigned int aw = enc_area.w, ah = enc_area.h;
             for (int i = 0; i < NUM_SCALES; i++) {
                 VSFrameRef *f = vsapi->newVideoFrame(grays, w, h, src, core);
                 float *dst = (float *)vsapi->getWritePtr(f, 0);
                 float *src = c_values[i];
                 uintptr_t stride = vsapi->getStride(f, 0) / sizeof *dst;
+                const unsigned int ax = enc_area.x >> i, ay = enc_area.y >> i;
                 for (int y = 0; y < h; y++) {
+                        const int inside = y >= ay && y < ay + ah;
                         for (int x = 0; x < w; x++)
-                                dst[x] = src[x] * d->scaling;
-                        src += w;
+                                dst[x] = inside && x >= ax && x < ax + aw ? src[x - ax] * d->scaling : 0;
+                        if (inside)
+                                src += aw;
                         dst += stride;
                 }
-                free(c_values[i]);
                 scale_dimension(&w, 1);
                 scale_dimension(&h, 1);
+                scale_dimension(&aw, 1);
+                scale_dimension(&ah, 1);
                 char name[16];
                 sprintf(name, "CAMBI_SCALE%d", i);
                 vsapi->propSetFrame(prop, name, f, paReplace);
                 vsapi->freeFrame(f);
             }
         }
+        if (sc == &tmp)
+            scratchClose(sc);
+        else
+            slot_release(&sc->busy);
         vsapi->freeFrame(src);
         assert(err == 0);
 
         err = vsapi->propSetFloat(prop, "CAMBI", score, paReplace);
         assert(err == 0);
+        if (d->scale_scores) {
+            err = vsapi->propSetFloatArray(prop, "CAMBI_SCALES", scores_per_scale, NUM_SCALES);
+            assert(err == 0);
+        }
+        if (ref) {
+            vsapi->propSetFloat(prop, "CAMBI_SOURCE", ref_score, paReplace);
+            // As the full-reference CAMBI of libvmaf: only the banding added to the source.
+            vsapi->propSetFloat(prop, "CAMBI_FULL_REFERENCE", score > ref_score ? score - ref_score : 0, paReplace);
+            if (d->scale_scores)
+                vsapi->propSetFloatArray(prop, "CAMBI_SOURCE_SCALES", ref_scores_per_scale, NUM_SCALES);
+            if (d->stats)
+                for (int i = 0; i < NUM_SCALES; i++)
+                    seconds_per_scale[i] += ref_seconds_per_scale[i];
+        }
+        if (d->summary) {
+            d->summary_scores[n] = score;
+            if (ref)
+                d->summary_full_reference[n] = score > ref_score ? score - ref_score : 0;
+        }
+        if (d->use_area) {
+            const int64_t rect[4] = { area.x, area.y, area.w, area.h };
+            vsapi->propSetIntArray(prop, "CAMBI_AREA", rect, 4);
+        }
+        if (d->stats) {
+            vsapi->propSetFloat(prop, "_AkarinTimeFetch", fetch, paReplace);
+            vsapi->propSetFloatArray(prop, "_AkarinTimeScales", seconds_per_scale, NUM_SCALES);
+            vsapi->propSetFloat(prop, "_AkarinTimeTotal", vmaf_timer_seconds() - ready, paReplace);
+        }
 
         return dst;
+    } else if (activationReason == arError) {
+        free(state);
     }
 
     return NULL;
@@ -98,8 +365,31 @@ static const VSFrameRef *VS_CC cambiGetFrame(int n, int activationReason, void *
 
 static void VS_CC cambiFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     CambiData *d = (CambiData *)instanceData;
+    if (d->summary) {
+        FILE *f = fopen(d->summary, "w");
+        if (f) {
+            fprintf(f, "{\n");
+            int frames = writeSummary(f, "CAMBI", d->summary_scores, d->vi.numFrames);
+            if (d->ref) {
+                fprintf(f, ",\n");
+                writeSummary(f, "CAMBI_FULL_REFERENCE", d->summary_full_reference, d->vi.numFrames);
+            }
+            fprintf(f, ",\n  \"frames\": %d\n}\n", frames);
+            fclose(f);
+        } else {
+            fprintf(stderr, "Cambi: failed to write summary to %s\n", d->summary);
+        }
+    }
+    free(d->summary);
+    free(d->summary_scores);
+    free(d->summary_full_reference);
     vsapi->freeNode(d->node);
+    vsapi->freeNode(d->ref);
     cambi_close(&d->s);
+    for (int i = 0; i < d->num_scratch; i++)
+        scratchClose(&d->scratch[i]);
+    free(d->scratch);
+    free(d->prop_trigger);
     free(d);
 }
 
@@ -110,14 +400,25 @@ static void VS_CC cambiCreate(const VSMap *in, VSMap *out, void *userData, VSCor
     d.node = vsapi->propGetNode(in, "clip", 0, 0);
     d.vi = *vsapi->getVideoInfo(d.node);
 
-    if (!isConstantFormat(&d.vi) || d.vi.format->sampleType != stInteger ||
-        (d.vi.format->colorFamily != cmGray && d.vi.format->colorFamily != cmYUV) ||
-        (d.vi.format->bitsPerSample != 8 && d.vi.format->bitsPerSample != 10)) {
-        vsapi->setError(out, "Cambi: only constant Gray/YUV format with 8/10bit integer samples supported");
+    int err;
+    d.ref = vsapi->propGetNode(in, "reference", 0, &err);
+    const VSVideoInfo *ref_vi = d.ref ? vsapi->getVideoInfo(d.ref) : NULL;
+
+    if (!isSupportedFormat(&d.vi) || (ref_vi && !isSupportedFormat(ref_vi))) {
+        vsapi->setError(out, "Cambi: only constant Gray/YUV format with 8/10-16bit integer or 32bit float samples supported");
         vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
         return;
     }
+    if (ref_vi && (ref_vi->width != d.vi.width || ref_vi->height != d.vi.height)) {
+        vsapi->setError(out, "Cambi: reference must have the same dimensions as clip");
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
+        return;
+    }
+    // Everything but 8/10bit input is quantized to 10bit while decimating.
     d.bpc = d.vi.format->bitsPerSample;
+    d.ref_bpc = ref_vi ? ref_vi->format->bitsPerSample : 0;
 
     cambi_config(&d.s);
 #define GETARG(type, var, name, api, min, max) \
@@ -130,6 +431,7 @@ static void VS_CC cambiCreate(const VSMap *in, VSMap *out, void *userData, VSCor
             snprintf(errmsg, sizeof errmsg, "Cambi: argument %s=%f is out of range [%f,%f] (default=%f)", #name, (double)x, (double)min, (double)max, (double)var.name); \
             vsapi->setError(out, errmsg); \
             vsapi->freeNode(d.node); \
+            vsapi->freeNode(d.ref); \
             return; \
         } \
         var.name = x; \
@@ -139,23 +441,127 @@ static void VS_CC cambiCreate(const VSMap *in, VSMap *out, void *userData, VSCor
     GETARG(double, d.s, tvi_threshold, propGetFloat, 0.0001, 1);
     d.scores = 0;
     GETARG(int, d, scores, propGetInt, 0, 1);
+    d.scale_scores = 0;
+    GETARG(int, d, scale_scores, propGetInt, 0, 1);
     d.scaling = 1.0f / d.s.window_size;
     GETARG(int, d, scaling, propGetFloat, 0, 1);
+    GETARG(int, d.s, threads, propGetInt, 1, CAMBI_MAX_THREADS);
+    GETARG(int, d.s, tile_width, propGetInt, 0, 4096);
+    d.prop_trigger = NULL;
+    const char *prop_trigger = vsapi->propGetData(in, "prop_trigger", 0, &err);
+    d.step = prop_trigger ? 0 : 1;
+    GETARG(int, d, step, propGetInt, 0, INT_MAX);
+    d.stats = 0;
+    GETARG(int, d, stats, propGetInt, 0, 1);
+    d.letterbox = 0;
+    GETARG(double, d, letterbox, propGetFloat, 0, 1);
+    // The planes of the output frames are those of clip, so by default the output is not cached.
+    d.cache = 0;
+    GETARG(int, d, cache, propGetInt, 0, 2);
 #undef GETARG
+    const char *numa = vsapi->propGetData(in, "numa", 0, &err);
+    if (numa) {
+        if (strcmp(numa, "auto") && strcmp(numa, "off")) {
+            vsapi->setError(out, "Cambi: numa must be \"auto\" or \"off\"");
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ref);
+            return;
+        }
+        d.s.numa = !strcmp(numa, "auto");
+    }
+    // Like std.CropRel: left, right, top, bottom.
+    int64_t crop[4] = { 0, 0, 0, 0 };
+    const int num_crop = vsapi->propNumElements(in, "crop");
+    if (num_crop > 4) {
+        vsapi->setError(out, "Cambi: crop takes at most 4 values (left, right, top, bottom)");
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
+        return;
+    }
+    for (int i = 0; i < num_crop; i++)
+        crop[i] = vsapi->propGetInt(in, "crop", i, 0);
+    if (crop[0] < 0 || crop[1] < 0 || crop[2] < 0 || crop[3] < 0 ||
+        crop[0] + crop[1] >= d.vi.width || crop[2] + crop[3] >= d.vi.height) {
+        vsapi->setError(out, "Cambi: crop must be non-negative and leave a non-empty area");
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
+        return;
+    }
+    d.area.x = crop[0];
+    d.area.y = crop[2];
+    d.area.w = d.vi.width - crop[0] - crop[1];
+    d.area.h = d.vi.height - crop[2] - crop[3];
+    d.use_area = num_crop > 0 || d.letterbox > 0;
+    if (d.vi.format->sampleType == stInteger)
+        d.letterbox *= (1 << d.bpc) - 1;
+    if (d.step == 0 && !prop_trigger) {
+        vsapi->setError(out, "Cambi: step=0 requires prop_trigger");
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
+        return;
+    }
+    if (prop_trigger) {
+        d.prop_trigger = malloc(strlen(prop_trigger) + 1);
+        strcpy(d.prop_trigger, prop_trigger);
+    }
+
+    // The whole analysis runs at eval_width x eval_height, as libvmaf's enc_width and enc_height. When
+    // only one of them is given, the other keeps the aspect ratio.
+    int64_t eval_width = vsapi->propGetInt(in, "eval_width", 0, &err);
+    if (err)
+        eval_width = 0;
+    int64_t eval_height = vsapi->propGetInt(in, "eval_height", 0, &err);
+    if (err)
+        eval_height = 0;
+    if (eval_width && !eval_height)
+        eval_height = (eval_width * d.vi.height + d.vi.width / 2) / d.vi.width;
+    else if (eval_height && !eval_width)
+        eval_width = (eval_height * d.vi.width + d.vi.height / 2) / d.vi.height;
+    if (eval_width < 0 || eval_width > d.vi.width || eval_height < 0 || eval_height > d.vi.height ||
+        (eval_width && eval_height == 0)) {
+        vsapi->setError(out, "Cambi: eval_width and eval_height must be positive and at most the clip dimensions");
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
+        free(d.prop_trigger);
+        return;
+    }
+    d.s.enc_width = eval_width;
+    d.s.enc_height = eval_height;
 
-    int err = cambi_init(&d.s, d.vi.width, d.vi.height);
+    err = cambi_init(&d.s, d.vi.width, d.vi.height);
     if (err != 0) {
-        vsapi->setError(out, "cambi_init failure");
+        vsapi->setError(out, eval_width ? "Cambi: cambi_init failure (eval_width must be in [320, 4096])" : "cambi_init failure");
         vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ref);
+        free(d.prop_trigger);
         return;
     }
 
+    d.summary = NULL;
+    d.summary_scores = d.summary_full_reference = NULL;
+    const char *summary = vsapi->propGetData(in, "summary", 0, &err);
+    if (summary) {
+        d.summary = malloc(strlen(summary) + 1);
+        strcpy(d.summary, summary);
+        d.summary_scores = malloc(d.vi.numFrames * sizeof *d.summary_scores);
+        d.summary_full_reference = malloc(d.vi.numFrames * sizeof *d.summary_full_reference);
+        for (int i = 0; i < d.vi.numFrames; i++)
+            d.summary_scores[i] = d.summary_full_reference[i] = NAN;
+    }
+
+    // One scratch slot per worker thread; slots are initialized on first use.
+    VSCoreInfo info;
+    vsapi->getCoreInfo2(core, &info);
+    d.num_scratch = info.numThreads > 0 ? info.numThreads : 1;
+    d.scratch = calloc(d.num_scratch, sizeof *d.scratch);
+
     CambiData *data = malloc(sizeof(d));
     *data = d;
 
-    vsapi->createFilter(in, out, "Cambi", cambiInit, cambiGetFrame, cambiFree, fmParallel, 0, data, core);
+    const int flags = d.cache == 0 ? nfNoCache : d.cache == 2 ? nfMakeLinear : 0;
+    vsapi->createFilter(in, out, "Cambi", cambiInit, cambiGetFrame, cambiFree, fmParallel, flags, data, core);
 }
 
 void bandingInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
-    registerFunc("Cambi", "clip:clip;window_size:int:opt;topk:float:opt;tvi_threshold:float:opt;scores:int:opt;scaling:float:opt;", cambiCreate, 0, plugin);
+    registerFunc("Cambi", "clip:clip;window_size:int:opt;topk:float:opt;tvi_threshold:float:opt;scores:int:opt;scale_scores:int:opt;scaling:float:opt;threads:int:opt;step:int:opt;prop_trigger:data:opt;stats:int:opt;reference:clip:opt;crop:int[]:opt;letterbox:float:opt;eval_width:int:opt;eval_height:int:opt;summary:data:opt;tile_width:int:opt;numa:data:opt;cache:int:opt;", cambiCreate, 0, plugin);
 }
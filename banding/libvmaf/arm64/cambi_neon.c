@@ -0,0 +1,138 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+
+#include <arm_neon.h>
+
+#include "cambi_neon.h"
+
+void cambi_increment_range_neon(uint16_t *arr, int left, int right) {
+    const uint16x8_t ones = vdupq_n_u16(1);
+    int col = left;
+    for (; col + 7 < right; col += 8)
+        vst1q_u16(&arr[col], vaddq_u16(vld1q_u16(&arr[col]), ones));
+    for (; col < right; col++)
+        arr[col]++;
+}
+
+void cambi_decrement_range_neon(uint16_t *arr, int left, int right) {
+    const uint16x8_t ones = vdupq_n_u16(1);
+    int col = left;
+    for (; col + 7 < right; col += 8)
+        vst1q_u16(&arr[col], vsubq_u16(vld1q_u16(&arr[col]), ones));
+    for (; col < right; col++)
+        arr[col]--;
+}
+
+// Prefix sums of the 4 lanes.
+static inline uint32x4_t prefix_sum_u32(uint32x4_t x) {
+    const uint32x4_t zero = vdupq_n_u32(0);
+    x = vaddq_u32(x, vextq_u32(zero, x, 3));
+    return vaddq_u32(x, vextq_u32(zero, x, 2));
+}
+
+void cambi_mask_dp_row_neon(uint32_t *dp, const uint32_t *dp_prev, const uint16_t *row,
+                            const uint16_t *next_row, int width) {
+    const uint16x8_t ones = vdupq_n_u16(1);
+    uint32x4_t sum = vdupq_n_u32(0);
+    int j = 0;
+    // Stops before the last column, whose right neighbour is outside of the row.
+    for (; j + 8 < width; j += 8) {
+        uint16x8_t curr = vld1q_u16(&row[j]);
+        uint16x8_t zero = vceqq_u16(curr, vld1q_u16(&row[j + 1]));
+        if (next_row)
+            zero = vandq_u16(zero, vceqq_u16(curr, vld1q_u16(&next_row[j])));
+        uint16x8_t value = vandq_u16(zero, ones);
+        uint32x4_t low = vaddq_u32(prefix_sum_u32(vmovl_u16(vget_low_u16(value))), vdupq_laneq_u32(sum, 3));
+        sum = vaddq_u32(prefix_sum_u32(vmovl_u16(vget_high_u16(value))), vdupq_laneq_u32(low, 3));
+        vst1q_u32(&dp[j], vaddq_u32(vld1q_u32(&dp_prev[j]), low));
+        vst1q_u32(&dp[j + 4], vaddq_u32(vld1q_u32(&dp_prev[j + 4]), sum));
+    }
+    uint32_t s = j > 0 ? dp[j - 1] - dp_prev[j - 1] : 0;
+    for (; j < width; j++) {
+        s += (!next_row || row[j] == next_row[j]) && (j == width - 1 || row[j] == row[j + 1]);
+        dp[j] = dp_prev[j] + s;
+    }
+}
+
+void cambi_mask_threshold_row_neon(uint16_t *mask, const uint32_t *dp_top, const uint32_t *dp_bottom,
+                                   int width, int window, uint16_t mask_index) {
+    const int32x4_t index = vdupq_n_s32(mask_index);
+    const uint16x8_t ones = vdupq_n_u16(1);
+    int j = 0;
+    for (; j + 7 < width; j += 8) {
+        uint16x4_t gt[2];
+        for (int k = 0; k < 2; k++) {
+            const int o = j + 4 * k;
+            uint32x4_t result = vsubq_u32(vld1q_u32(&dp_bottom[o + window]), vld1q_u32(&dp_bottom[o]));
+            result = vaddq_u32(vsubq_u32(result, vld1q_u32(&dp_top[o + window])), vld1q_u32(&dp_top[o]));
+            gt[k] = vmovn_u32(vcgtq_s32(vreinterpretq_s32_u32(result), index));
+        }
+        vst1q_u16(&mask[j], vandq_u16(vcombine_u16(gt[0], gt[1]), ones));
+    }
+    for (; j < width; j++) {
+        int result = dp_bottom[j + window] - dp_bottom[j] - dp_top[j + window] + dp_top[j];
+        mask[j] = (result > mask_index);
+    }
+}
+
+// As cambi_mode_row_avx2: the maximum of (count << 10) | (1023 - value) over the 9 pixels.
+static inline uint16x8_t mode9_u16(const uint16x8_t *v) {
+    const uint16x8_t max_value = vdupq_n_u16(1023);
+    uint16x8_t count[9];
+    for (int a = 0; a < 9; a++)
+        count[a] = vdupq_n_u16(0);
+    for (int a = 0; a < 9; a++) {
+        for (int b = a + 1; b < 9; b++) {
+            uint16x8_t eq = vceqq_u16(v[a], v[b]);
+            count[a] = vsubq_u16(count[a], eq);
+            count[b] = vsubq_u16(count[b], eq);
+        }
+    }
+    uint16x8_t key = vdupq_n_u16(0);
+    for (int a = 0; a < 9; a++)
+        key = vmaxq_u16(key, vorrq_u16(vshlq_n_u16(count[a], 10), vsubq_u16(max_value, v[a])));
+    return vsubq_u16(max_value, vandq_u16(key, max_value));
+}
+
+void cambi_mode_row_neon(uint16_t *dst, const uint16_t *above, const uint16_t *row,
+                         const uint16_t *below, int width) {
+    const uint16_t *rows[3] = { above, row, below };
+    // The last block overlaps with the previous one rather than leaving a scalar tail.
+    for (int j = 1; j < width - 1; j += 8) {
+        j = j + 8 > width - 1 ? width - 9 : j;
+        uint16x8_t v[9];
+        for (int r = 0; r < 3; r++)
+            for (int c = 0; c < 3; c++)
+                v[3 * r + c] = vld1q_u16(&rows[r][j + c - 1]);
+        vst1q_u16(&dst[j], mode9_u16(v));
+    }
+}
+
+void cambi_decimate_row_neon(uint16_t *dst, const uint16_t *src, int width) {
+    int j = 0;
+    // Each block reads src[2j..2j+15] before writing dst[j..j+7], so it also works in place. Stops
+    // early enough not to read past src[2 * width - 2].
+    for (; j + 8 < width; j += 8)
+        vst1q_u16(&dst[j], vld2q_u16(&src[2 * j]).val[0]);
+    for (; j < width; j++)
+        dst[j] = src[j << 1];
+}
+
+#endif
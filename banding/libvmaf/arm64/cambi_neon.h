@@ -0,0 +1,39 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#ifndef ARM64_NEON_CAMBI_H_
+#define ARM64_NEON_CAMBI_H_
+
+#include <stdint.h>
+
+void cambi_increment_range_neon(uint16_t *arr, int left, int right);
+
+void cambi_decrement_range_neon(uint16_t *arr, int left, int right);
+
+void cambi_mask_dp_row_neon(uint32_t *dp, const uint32_t *dp_prev, const uint16_t *row,
+                            const uint16_t *next_row, int width);
+
+void cambi_mask_threshold_row_neon(uint16_t *mask, const uint32_t *dp_top, const uint32_t *dp_bottom,
+                                   int width, int window, uint16_t mask_index);
+
+void cambi_mode_row_neon(uint16_t *dst, const uint16_t *above, const uint16_t *row,
+                         const uint16_t *below, int width);
+
+void cambi_decimate_row_neon(uint16_t *dst, const uint16_t *src, int width);
+
+#endif /* ARM64_NEON_CAMBI_H_ */
@@ -0,0 +1,262 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "cambi.c"
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double spatial_pooling_quick_select(float *c_values, double topk, unsigned width, unsigned height) {
+    int num_elements = height * width;
+    int topk_num_elements = clip(topk * num_elements, 1, num_elements);
+    quick_select(c_values, num_elements, topk_num_elements);
+    return average_topk_elements(c_values, topk_num_elements);
+}
+
+/* Synthetic c-values: mostly zeros (unmasked or flat areas) plus a long tail. */
+static void fill_c_values(float *c_values, unsigned n, double zeros) {
+    unsigned seed = 1;
+    for (unsigned i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 8;
+        c_values[i] = (r & 0xffff) < zeros * 0x10000 ? 0 : (float)(r % 4096) * (r % 4096) / 4096.0f;
+    }
+}
+
+static void bench_spatial_pooling(unsigned width, unsigned height, double topk, double zeros) {
+    const unsigned n = width * height;
+    const int iters = 5;
+    float *c_values = malloc(n * sizeof *c_values);
+    float *tmp = malloc(n * sizeof *tmp);
+    uint32_t *histogram = malloc(RADIX_BINS * sizeof *histogram);
+    fill_c_values(c_values, n, zeros);
+
+    double t_qs = 0, t_hist = 0, s_qs = 0, s_hist = 0;
+    for (int i = 0; i < iters; i++) {
+        memcpy(tmp, c_values, n * sizeof *tmp);
+        double t0 = now();
+        s_qs = spatial_pooling_quick_select(tmp, topk, width, height);
+        double t1 = now();
+        s_hist = spatial_pooling(c_values, topk, width, height, histogram);
+        double t2 = now();
+        t_qs += t1 - t0;
+        t_hist += t2 - t1;
+    }
+    printf("spatial_pooling %ux%u topk=%.2f zeros=%.2f: quick_select %.2f ms, radix %.2f ms (%.6f vs %.6f)\n",
+           width, height, topk, zeros, t_qs * 1e3 / iters, t_hist * 1e3 / iters, s_qs, s_hist);
+
+    free(c_values);
+    free(tmp);
+    free(histogram);
+}
+
+/* Synthetic 8-bit gradient: a slow diagonal ramp, which bands once decimated, with sparse noise. */
+static void fill_gradient(VmafPicture *pic) {
+    unsigned seed = 1;
+    uint8_t *data = pic->data[0];
+    for (unsigned i = 0; i < pic->h[0]; i++) {
+        for (unsigned j = 0; j < pic->w[0]; j++) {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) % 64 == 0 ? (int)((seed >> 8) % 3) - 1 : 0;
+            data[i * pic->stride[0] + j] = 16 + j * 48 / pic->w[0] + i * 24 / pic->h[0] + noise;
+        }
+    }
+}
+
+static void copy_plane(VmafPicture *dst, const VmafPicture *src) {
+    for (unsigned i = 0; i < src->h[0]; i++)
+        memcpy((uint8_t *)dst->data[0] + i * dst->stride[0], (uint8_t *)src->data[0] + i * src->stride[0],
+               src->w[0] * sizeof(uint16_t));
+}
+
+static bool same_plane(const VmafPicture *a, const VmafPicture *b) {
+    for (unsigned i = 0; i < a->h[0]; i++)
+        if (memcmp((uint8_t *)a->data[0] + i * a->stride[0], (uint8_t *)b->data[0] + i * b->stride[0],
+                   a->w[0] * sizeof(uint16_t)))
+            return false;
+    return true;
+}
+
+/*
+ * Times each stage of scale 0 on its own with the scalar code (unfused spatial mask and mode filter,
+ * scalar histogram updates, one thread), then the way cambi_score runs it (fused, SIMD, threads), and
+ * checks that both give bit-exact results. Returns the number of mismatches.
+ */
+static int bench_stages(unsigned width, unsigned height, unsigned threads) {
+    const int iters = 3;
+    CambiState s;
+    cambi_config(&s);
+    s.threads = threads;
+    cambi_init(&s, width, height);
+
+    VmafPicture input, ref_image, ref_mask, simd_mask;
+    vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 8, width, height);
+    vmaf_picture_alloc(&ref_image, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    vmaf_picture_alloc(&ref_mask, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    vmaf_picture_alloc(&simd_mask, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    fill_gradient(&input);
+    const size_t n = (size_t)width * height;
+    float *ref_c_values = malloc(n * sizeof *ref_c_values);
+    uint16_t mask_index = get_mask_index(width, height, MASK_FILTER_SIZE);
+
+    double t_pre = 0, t_mask = 0, t_mode = 0, t_cv = 0, t_pool = 0, t_mask_opt = 0, t_fused = 0, t_cv_opt = 0;
+    double score = 0;
+    for (int it = 0; it < iters; it++) {
+        double t0 = now();
+        cambi_preprocessing(&input, &s.pics[0]);
+        double t1 = now();
+        copy_plane(&ref_image, &s.pics[0]);
+        double t2 = now();
+        get_spatial_mask_for_index(&ref_image, &ref_mask, s.mask_dp, mask_index, MASK_FILTER_SIZE, width, height);
+        double t3 = now();
+        SpatialMaskStream mask_stream;
+        spatial_mask_begin(&mask_stream, &ref_image, &simd_mask, s.mask_dp, mask_index, MASK_FILTER_SIZE,
+                           width, height, s.mask_dp_callback, s.mask_threshold_callback);
+        spatial_mask_advance(&mask_stream, height + mask_stream.pad_size);
+        t_mask_opt += now() - t3;
+        t3 = now();
+        filter_mode(&ref_image, width, height, s.buffer);
+        double t4 = now();
+        calculate_c_values(&ref_image, &ref_mask, ref_c_values, s.c_values_histograms, s.window_size,
+                           s.tvi_for_diff, width, height, increment_range, decrement_range);
+        double t5 = now();
+        score = spatial_pooling(ref_c_values, s.topk, width, height, s.pooling_histogram);
+        double t6 = now();
+
+        spatial_mask_begin(&mask_stream, &s.pics[0], &s.pics[1], s.mask_dp, mask_index, MASK_FILTER_SIZE,
+                           width, height, s.mask_dp_callback, s.mask_threshold_callback);
+        filter_mode_fused(&s.pics[0], &s.pics[1], width, height, s.buffer, &mask_stream, false, s.mode_row_callback,
+                          s.decimate_row_callback);
+        double t7 = now();
+        calculate_c_values_threaded(&s.pics[0], &s.pics[1], s.c_values, s.c_values_histograms, s.window_size,
+                                    s.tvi_for_diff, width, height, s.threads, s.tile_width, s.numa_node,
+                                    s.inc_range_callback, s.dec_range_callback);
+        double t8 = now();
+        t_pre += t1 - t0;
+        t_mask += t3 - t2;
+        t_mode += t4 - t3;
+        t_cv += t5 - t4;
+        t_pool += t6 - t5;
+        t_fused += t7 - t6;
+        t_cv_opt += t8 - t7;
+    }
+    printf("stages %ux%u (ms): preprocessing %.2f, spatial_mask %.2f, filter_mode %.2f, calculate_c_values %.2f, "
+           "spatial_pooling %.2f (score %.6f)\n", width, height, t_pre * 1e3 / iters, t_mask * 1e3 / iters,
+           t_mode * 1e3 / iters, t_cv * 1e3 / iters, t_pool * 1e3 / iters, score);
+    printf("optimized %ux%u (ms): spatial_mask %.2f, fused mask+mode %.2f, calculate_c_values (%u threads) %.2f\n",
+           width, height, t_mask_opt * 1e3 / iters, t_fused * 1e3 / iters, threads, t_cv_opt * 1e3 / iters);
+
+    int mismatches = 0;
+    if (!same_plane(&ref_image, &s.pics[0])) {
+        printf("MISMATCH %ux%u: fused mode filter\n", width, height);
+        mismatches++;
+    }
+    if (!same_plane(&ref_mask, &simd_mask)) {
+        printf("MISMATCH %ux%u: spatial mask\n", width, height);
+        mismatches++;
+    }
+    if (!same_plane(&ref_mask, &s.pics[1])) {
+        printf("MISMATCH %ux%u: fused spatial mask\n", width, height);
+        mismatches++;
+    }
+    if (memcmp(ref_c_values, s.c_values, n * sizeof *ref_c_values)) {
+        printf("MISMATCH %ux%u: c-values\n", width, height);
+        mismatches++;
+    }
+
+    // Column tiles of calculate_c_values, on one thread
+    const int tile_widths[] = { 0, 128, 256, 512, 1024 };
+    printf("calculate_c_values %ux%u tiles (ms):", width, height);
+    for (unsigned k = 0; k < sizeof tile_widths / sizeof tile_widths[0]; k++) {
+        double t0 = now();
+        calculate_c_values_threaded(&s.pics[0], &s.pics[1], s.c_values, s.c_values_histograms, s.window_size,
+                                    s.tvi_for_diff, width, height, 1, tile_widths[k], s.numa_node,
+                                    s.inc_range_callback, s.dec_range_callback);
+        printf(" %d: %.2f", tile_widths[k], (now() - t0) * 1e3);
+        if (memcmp(ref_c_values, s.c_values, n * sizeof *ref_c_values)) {
+            printf(" MISMATCH");
+            mismatches++;
+        }
+    }
+    printf("\n");
+
+    // Decimation to scale 1, of the filtered image of scale 0
+    unsigned sw = width, sh = height;
+    scale_dimension(&sw, 1);
+    scale_dimension(&sh, 1);
+    double t0 = now();
+    decimate(&ref_image, sw, sh);
+    double t1 = now();
+    uint16_t *data = s.pics[0].data[0];
+    ptrdiff_t stride = s.pics[0].stride[0] >> 1;
+    for (unsigned i = 0; i < sh; i++)
+        s.decimate_row_callback(data + i * stride, data + 2 * i * stride, sw);
+    double t2 = now();
+    printf("decimate %ux%u (ms): scalar %.3f, optimized %.3f\n", width, height, (t1 - t0) * 1e3, (t2 - t1) * 1e3);
+    ref_image.w[0] = s.pics[0].w[0] = sw;
+    ref_image.h[0] = s.pics[0].h[0] = sh;
+    if (!same_plane(&ref_image, &s.pics[0])) {
+        printf("MISMATCH %ux%u: decimation\n", width, height);
+        mismatches++;
+    }
+    s.pics[0].w[0] = width;
+    s.pics[0].h[0] = height;
+
+    // The whole multi-scale score, single threaded with the scalar code against cambi_extract.
+    double scores[NUM_SCALES], ref_score;
+    cambi_extract(&s, &input, &score, NULL, NULL, NULL);
+    CambiState r = s;
+    r.threads = 1;
+    r.c_values_pooling = NULL;
+    r.inc_range_callback = increment_range;
+    r.dec_range_callback = decrement_range;
+    r.mask_dp_callback = mask_dp_row;
+    r.mask_threshold_callback = mask_threshold_row;
+    r.mode_row_callback = mode_row;
+    r.decimate_row_callback = decimate_row;
+    cambi_extract(&r, &input, &ref_score, scores, NULL, NULL);
+    if (memcmp(&score, &ref_score, sizeof score)) {
+        printf("MISMATCH %ux%u: score %.17g vs %.17g\n", width, height, score, ref_score);
+        mismatches++;
+    }
+
+    free(ref_c_values);
+    vmaf_picture_unref(&input);
+    vmaf_picture_unref(&ref_image);
+    vmaf_picture_unref(&ref_mask);
+    vmaf_picture_unref(&simd_mask);
+    cambi_close(&s);
+    return mismatches;
+}
+
+int main(void) {
+    const double topks[] = { 0.6, 0.1, 0.01 };
+    for (unsigned i = 0; i < sizeof topks / sizeof topks[0]; i++) {
+        bench_spatial_pooling(1920, 1080, topks[i], 0.7);
+        bench_spatial_pooling(3840, 2160, topks[i], 0.7);
+        bench_spatial_pooling(3840, 2160, topks[i], 0.0);
+    }
+    int mismatches = bench_stages(1920, 1080, 4) + bench_stages(3840, 2160, 4);
+    return mismatches != 0;
+}
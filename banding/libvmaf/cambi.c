@@ -25,14 +25,31 @@
 #include "feature_collector.h"
 #include "feature_extractor.h"
 #include "mem.h"
+#include "numa.h"
 #include "picture.h"
+#include "thread.h"
+#include "timer.h"
 
 #define CAMBI_IMPL
 #include "cambi.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CAMBI_HAVE_X86 1
+#include "x86/cambi_avx2.h"
+#include "x86/cambi_avx512.h"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CAMBI_HAVE_NEON 1
+#include "arm64/cambi_neon.h"
+#endif
+
 /* Ratio of pixels for computation, must be 0 > topk >= 1.0 */
 #define DEFAULT_CAMBI_TOPK_POOLING (0.6)
 
+/* Width of the column tiles of calculate_c_values, so that their histograms stay in L2 (0 for the whole width).
+ * Off by default: the range updates stream through the histograms, which prefetching handles well, so on
+ * common CPUs the halos cost more than the misses they save. */
+#define DEFAULT_CAMBI_TILE_WIDTH (0)
+
 /* Window size to compute CAMBI: 63 corresponds to approximately 1 degree at 4k scale */
 #define DEFAULT_CAMBI_WINDOW_SIZE (63)
 
@@ -66,6 +83,10 @@ static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
 
 #define MASK_FILTER_SIZE 7
 
+/* Digit size of the radix select used for the spatial pooling */
+#define RADIX_BITS 16
+#define RADIX_BINS (1 << RADIX_BITS)
+
 static const VmafOption options[] = {
     {
         .name = "enc_width",
@@ -112,6 +133,31 @@ static const VmafOption options[] = {
         .min = 0.0001,
         .max = 1.0,
     },
+    {
+        .name = "threads",
+        .help = "Number of threads used to process a single frame",
+        .offset = offsetof(CambiState, threads),
+        .type = VMAF_OPT_TYPE_INT,
+        .default_val.i = 1,
+        .min = 1,
+        .max = CAMBI_MAX_THREADS,
+    },
+    {
+        .name = "tile_width",
+        .help = "Width of the column tiles the c-values are computed in, 0 for the whole width",
+        .offset = offsetof(CambiState, tile_width),
+        .type = VMAF_OPT_TYPE_INT,
+        .default_val.i = DEFAULT_CAMBI_TILE_WIDTH,
+        .min = 0,
+        .max = CAMBI_MAX_WIDTH,
+    },
+    {
+        .name = "numa",
+        .help = "Allocate the buffers on the NUMA node of the initialising thread and process the frames on that node",
+        .offset = offsetof(CambiState, numa),
+        .type = VMAF_OPT_TYPE_BOOL,
+        .default_val.b = true,
+    },
     { 0 }
 };
 
@@ -222,12 +268,100 @@ static FORCE_INLINE inline void adjust_window_size(uint16_t *window_size, unsign
     (*window_size) = ((*window_size) * input_width) / CAMBI_4K_WIDTH;
 }
 
+/*
+* c_value_pixel only reads the histogram bins up to the largest tvi threshold plus its diff.
+* Higher values never contribute to the c-values, so their histograms are not tracked at all.
+*/
+static FORCE_INLINE inline uint16_t get_num_bins(const uint16_t *tvi_for_diff) {
+    uint16_t num_bins = 0;
+    for (int d = 0; d < NUM_DIFFS; d++)
+        num_bins = MAX(num_bins, tvi_for_diff[d] + g_diffs_to_consider[d] + 1);
+    return num_bins;
+}
+
+static void increment_range(uint16_t *arr, int left, int right) {
+    for (int i = left; i < right; i++) {
+        arr[i]++;
+    }
+}
+
+static void decrement_range(uint16_t *arr, int left, int right) {
+    for (int i = left; i < right; i++) {
+        arr[i]--;
+    }
+}
+
+/*
+* A pixel has zero derivative if it is equal to its right and bottom neighbours (edges count as equal).
+* As dp[-1] = dp_prev[-1] = 0, dp[j] is dp_prev[j] plus the number of such pixels in row[0..j].
+*/
+static void mask_dp_row(uint32_t *dp, const uint32_t *dp_prev, const uint16_t *row,
+                        const uint16_t *next_row, int width) {
+    uint32_t sum = 0;
+    for (int j = 0; j < width; j++) {
+        sum += (!next_row || row[j] == next_row[j]) && (j == width - 1 || row[j] == row[j + 1]);
+        dp[j] = dp_prev[j] + sum;
+    }
+}
+
+// The dp pointers are at the column left of the window of mask[0].
+static void mask_threshold_row(uint16_t *mask, const uint32_t *dp_top, const uint32_t *dp_bottom,
+                               int width, int window, uint16_t mask_index) {
+    for (int j = 0; j < width; j++) {
+        int result = dp_bottom[j + window] - dp_bottom[j] - dp_top[j + window] + dp_top[j];
+        mask[j] = (result > mask_index);
+    }
+}
+
+static void mode_row(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below, int width);
+static void decimate_row(uint16_t *dst, const uint16_t *src, int width);
+
+static void init_range_callbacks(CambiState *s) {
+    s->inc_range_callback = increment_range;
+    s->dec_range_callback = decrement_range;
+    s->mask_dp_callback = mask_dp_row;
+    s->mask_threshold_callback = mask_threshold_row;
+    s->mode_row_callback = mode_row;
+    s->decimate_row_callback = decimate_row;
+#if CAMBI_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        s->inc_range_callback = cambi_increment_range_avx512;
+        s->dec_range_callback = cambi_decrement_range_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        s->inc_range_callback = cambi_increment_range_avx2;
+        s->dec_range_callback = cambi_decrement_range_avx2;
+    }
+    // The spatial mask gains nothing from the wider AVX-512 vectors, as its prefix sums are serial.
+    if (__builtin_cpu_supports("avx2")) {
+        s->mask_dp_callback = cambi_mask_dp_row_avx2;
+        s->mask_threshold_callback = cambi_mask_threshold_row_avx2;
+        s->mode_row_callback = cambi_mode_row_avx2;
+        s->decimate_row_callback = cambi_decimate_row_avx2;
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+        s->mode_row_callback = cambi_mode_row_avx512;
+        s->decimate_row_callback = cambi_decimate_row_avx512;
+    }
+#elif CAMBI_HAVE_NEON
+    s->inc_range_callback = cambi_increment_range_neon;
+    s->dec_range_callback = cambi_decrement_range_neon;
+    s->mask_dp_callback = cambi_mask_dp_row_neon;
+    s->mask_threshold_callback = cambi_mask_threshold_row_neon;
+    s->mode_row_callback = cambi_mode_row_neon;
+    s->decimate_row_callback = cambi_decimate_row_neon;
+#endif
+}
+
 void cambi_config(CambiState *s)
 {
     memset(s, 0, sizeof *s);
     s->window_size = DEFAULT_CAMBI_WINDOW_SIZE;
     s->topk = DEFAULT_CAMBI_TOPK_POOLING;
     s->tvi_threshold = DEFAULT_CAMBI_TVI;
+    s->threads = 1;
+    s->tile_width = DEFAULT_CAMBI_TILE_WIDTH;
+    s->numa = true;
 }
 
 int cambi_init(CambiState *s, unsigned w, unsigned h)
@@ -242,6 +376,19 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
 
     if (w < CAMBI_MIN_WIDTH || w > CAMBI_MAX_WIDTH)
         return -EINVAL;
+    if (s->threads < 1 || s->threads > CAMBI_MAX_THREADS)
+        return -EINVAL;
+
+    // On a NUMA machine the buffers are allocated and first touched on the node of the calling thread,
+    // and every frame is then processed by threads of that node.
+    VmafNumaAffinity affinity = { 0 };
+    s->numa_node = -1;
+    if (s->numa && vmaf_numa_node_count() > 1) {
+        int node = vmaf_numa_current_node();
+        if (vmaf_numa_bind(node, &affinity) == 0)
+            s->numa_node = node;
+    }
+
     int err = 0;
     for (unsigned i = 0; i < PICS_BUFFER_SIZE; i++)
         err |= vmaf_picture_alloc(&s->pics[i], VMAF_PIX_FMT_YUV400P, 10, w, h);
@@ -255,15 +402,36 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
 
     adjust_window_size(&s->window_size, w);
     s->c_values = aligned_malloc(ALIGN_CEIL(w * sizeof(float)) * h, 32);
+    // With threads > 1 the pooling of one scale overlaps with the next scale, which needs a second buffer.
+    s->c_values_pooling = s->threads > 1 ? aligned_malloc(ALIGN_CEIL(w * sizeof(float)) * h, 32) : NULL;
 
-    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
-    s->c_values_histograms = aligned_malloc(ALIGN_CEIL(w * num_bins * sizeof(uint16_t)), 32);
+    // Each thread needs its own set of histograms
+    const uint16_t num_bins = get_num_bins(s->tvi_for_diff);
+    s->c_values_histograms = aligned_malloc(ALIGN_CEIL(w * num_bins * sizeof(uint16_t)) * s->threads, 32);
+    s->pooling_histogram = aligned_malloc(RADIX_BINS * sizeof(uint32_t), 32);
 
     int pad_size = MASK_FILTER_SIZE >> 1;
     int dp_width = w + 2 * pad_size + 1;
     int dp_height = 2 * pad_size + 2;
     s->mask_dp = aligned_malloc(ALIGN_CEIL(dp_height * dp_width * sizeof(uint32_t)), 32);
 
+    s->buffer = aligned_malloc(ALIGN_CEIL(3 * w * sizeof(uint16_t)), 32);
+
+    if (s->numa_node >= 0) {
+        // The pictures are already cleared by vmaf_picture_alloc.
+        const size_t c_values_size = ALIGN_CEIL(w * sizeof(float)) * h;
+        const size_t histograms_size = ALIGN_CEIL(w * num_bins * sizeof(uint16_t)) * s->threads;
+        if (s->c_values) memset(s->c_values, 0, c_values_size);
+        if (s->c_values_pooling) memset(s->c_values_pooling, 0, c_values_size);
+        if (s->c_values_histograms) memset(s->c_values_histograms, 0, histograms_size);
+        if (s->pooling_histogram) memset(s->pooling_histogram, 0, RADIX_BINS * sizeof(uint32_t));
+        if (s->mask_dp) memset(s->mask_dp, 0, ALIGN_CEIL(dp_height * dp_width * sizeof(uint32_t)));
+        if (s->buffer) memset(s->buffer, 0, ALIGN_CEIL(3 * w * sizeof(uint16_t)));
+        vmaf_numa_restore(&affinity);
+    }
+
+    init_range_callbacks(s);
+
     return err;
 }
 
@@ -290,7 +458,8 @@ static void decimate_generic_10b(const VmafPicture *pic, VmafPicture *out_pic) {
 
     // if the input and output sizes are the same
     if (in_w == out_w && in_h == out_h){
-        memcpy(out_data, data, stride * pic->h[0] * sizeof(uint16_t));
+        for (unsigned i = 0; i < out_h; i++)
+            memcpy(out_data + i * out_stride, data + i * stride, out_w * sizeof(uint16_t));
         return;
     }
 
@@ -313,7 +482,40 @@ static void decimate_generic_10b(const VmafPicture *pic, VmafPicture *out_pic) {
     }
 }
 
-static void decimate_generic_8b_and_convert_to_10b(const VmafPicture *pic, VmafPicture *out_pic) {
+static FORCE_INLINE inline void anti_dithering_row(uint16_t *data, ptrdiff_t stride, unsigned w,
+                                                   unsigned i, bool last_row) {
+    uint16_t *row = data + i * stride;
+    if (last_row) {
+        for (unsigned j = 0; j < w - 1; j++)
+            row[j] = (row[j] + row[j + 1]) >> 1;
+        return;
+    }
+
+    uint16_t *next = row + stride;
+    for (unsigned j = 0; j < w - 1; j++)
+        row[j] = (row[j] + row[j + 1] + next[j] + next[j + 1]) >> 2;
+
+    // Last column
+    row[w - 1] = (row[w - 1] + next[w - 1]) >> 1;
+}
+
+static inline void anti_dithering_filter(VmafPicture *pic) {
+    uint16_t *data = pic->data[0];
+    int stride = pic->stride[0] >> 1;
+
+    for (unsigned i = 0; i < pic->h[0] - 1; i++)
+        anti_dithering_row(data, stride, pic->w[0], i, false);
+
+    // Last row
+    anti_dithering_row(data, stride, pic->w[0], pic->h[0] - 1, true);
+}
+
+/*
+ * With anti_dither set, the anti-dithering filter is applied in the same pass: row i - 1 only
+ * depends on rows i - 1 and i, so it is filtered right after row i has been converted.
+ */
+static void decimate_generic_8b_and_convert_to_10b(const VmafPicture *pic, VmafPicture *out_pic,
+                                                   bool anti_dither) {
     uint8_t *data = pic->data[0];
     uint16_t *out_data = out_pic->data[0];
     ptrdiff_t stride = pic->stride[0];
@@ -325,9 +527,56 @@ static void decimate_generic_8b_and_convert_to_10b(const VmafPicture *pic, VmafP
 
     // if the input and output sizes are the same
     if (in_w == out_w && in_h == out_h) {
-        for (unsigned i = 0; i < out_h; i++)
+        for (unsigned i = 0; i < out_h; i++) {
             for (unsigned j = 0; j < out_w; j++)
                 out_data[i * out_stride + j] = data[i * stride + j] << 2;
+            if (anti_dither && i > 0)
+                anti_dithering_row(out_data, out_stride, out_w, i - 1, false);
+        }
+    } else {
+        float ratio_x = (float)in_w / out_w;
+        float ratio_y = (float)in_h / out_h;
+
+        float start_x = ratio_x / 2 - 0.5;
+        float start_y = ratio_y / 2 - 0.5;
+
+        float y = start_y;
+        for (unsigned i = 0; i < out_h; i++) {
+            unsigned ori_y = (int)(y + 0.5);
+            float x = start_x;
+            for (unsigned j = 0; j < out_w; j++) {
+                unsigned ori_x = (int)(x + 0.5);
+                out_data[i * out_stride + j] = data[ori_y * stride + ori_x] << 2;
+                x += ratio_x;
+            }
+            y += ratio_y;
+            if (anti_dither && i > 0)
+                anti_dithering_row(out_data, out_stride, out_w, i - 1, false);
+        }
+    }
+
+    if (anti_dither)
+        anti_dithering_row(out_data, out_stride, out_w, out_h - 1, true);
+}
+
+/* High bitdepth input is rounded to 10b */
+static void decimate_generic_hbd_and_convert_to_10b(const VmafPicture *pic, VmafPicture *out_pic) {
+    uint16_t *data = pic->data[0];
+    uint16_t *out_data = out_pic->data[0];
+    ptrdiff_t stride = pic->stride[0] >> 1;
+    ptrdiff_t out_stride = out_pic->stride[0] >> 1;
+    unsigned in_w = pic->w[0];
+    unsigned in_h = pic->h[0];
+    unsigned out_w = out_pic->w[0];
+    unsigned out_h = out_pic->h[0];
+    const int shift = pic->bpc - 10;
+    const int round = 1 << (shift - 1);
+
+    // if the input and output sizes are the same
+    if (in_w == out_w && in_h == out_h) {
+        for (unsigned i = 0; i < out_h; i++)
+            for (unsigned j = 0; j < out_w; j++)
+                out_data[i * out_stride + j] = MIN((data[i * stride + j] + round) >> shift, 1023);
         return;
     }
 
@@ -343,43 +592,64 @@ static void decimate_generic_8b_and_convert_to_10b(const VmafPicture *pic, VmafP
         float x = start_x;
         for (unsigned j = 0; j < out_w; j++) {
             unsigned ori_x = (int)(x + 0.5);
-            out_data[i * out_stride + j] = data[ori_y * stride + ori_x] << 2;
+            out_data[i * out_stride + j] = MIN((data[ori_y * stride + ori_x] + round) >> shift, 1023);
             x += ratio_x;
         }
         y += ratio_y;
     }
 }
 
-static void anti_dithering_filter(VmafPicture *pic) {
-    uint16_t *data = pic->data[0];
-    int stride = pic->stride[0] >> 1;
+/* Float input in [0, 1] is mapped to the 10b limited range, as resize does by default for YUV */
+static FORCE_INLINE inline uint16_t float_to_10b(float v) {
+    return clip((int)(64.0f + v * 876.0f + 0.5f), 0, 1023);
+}
 
-    for (unsigned i = 0; i < pic->h[0] - 1; i++) {
-        for (unsigned j = 0; j < pic->w[0] - 1; j++) {
-            data[i * stride + j] = (data[i * stride + j] +
-                                    data[i * stride + j + 1] +
-                                    data[(i + 1) * stride + j] +
-                                    data[(i + 1) * stride + j + 1]) >> 2;
-        }
+static void decimate_generic_float_and_convert_to_10b(const VmafPicture *pic, VmafPicture *out_pic) {
+    float *data = pic->data[0];
+    uint16_t *out_data = out_pic->data[0];
+    ptrdiff_t stride = pic->stride[0] >> 2;
+    ptrdiff_t out_stride = out_pic->stride[0] >> 1;
+    unsigned in_w = pic->w[0];
+    unsigned in_h = pic->h[0];
+    unsigned out_w = out_pic->w[0];
+    unsigned out_h = out_pic->h[0];
 
-        // Last column
-        unsigned j = pic->w[0] - 1;
-        data[i * stride + j] = (data[i * stride + j] +
-                                data[(i + 1) * stride + j]) >> 1;
+    // if the input and output sizes are the same
+    if (in_w == out_w && in_h == out_h) {
+        for (unsigned i = 0; i < out_h; i++)
+            for (unsigned j = 0; j < out_w; j++)
+                out_data[i * out_stride + j] = float_to_10b(data[i * stride + j]);
+        return;
     }
 
-    // Last row
-    unsigned i = pic->h[0] - 1;
-    for (unsigned j = 0; j < pic->w[0] - 1; j++) {
-        data[i * stride + j] = (data[i * stride + j] +
-                                data[i * stride + j + 1]) >> 1;
+    float ratio_x = (float)in_w / out_w;
+    float ratio_y = (float)in_h / out_h;
+
+    float start_x = ratio_x / 2 - 0.5;
+    float start_y = ratio_y / 2 - 0.5;
+
+    float y = start_y;
+    for (unsigned i = 0; i < out_h; i++) {
+        unsigned ori_y = (int)(y + 0.5);
+        float x = start_x;
+        for (unsigned j = 0; j < out_w; j++) {
+            unsigned ori_x = (int)(x + 0.5);
+            out_data[i * out_stride + j] = float_to_10b(data[ori_y * stride + ori_x]);
+            x += ratio_x;
+        }
+        y += ratio_y;
     }
 }
 
 int cambi_preprocessing(const VmafPicture *image, VmafPicture *preprocessed) {
     if (image->bpc == 8) {
-        decimate_generic_8b_and_convert_to_10b(image, preprocessed);
-        anti_dithering_filter(preprocessed);
+        decimate_generic_8b_and_convert_to_10b(image, preprocessed, true);
+    }
+    else if (image->bpc == 32) {
+        decimate_generic_float_and_convert_to_10b(image, preprocessed);
+    }
+    else if (image->bpc > 10) {
+        decimate_generic_hbd_and_convert_to_10b(image, preprocessed);
     }
     else {
         decimate_generic_10b(image, preprocessed);
@@ -389,7 +659,7 @@ int cambi_preprocessing(const VmafPicture *image, VmafPicture *preprocessed) {
 }
 
 /* Banding detection functions */
-static void decimate(VmafPicture *image, unsigned width, unsigned height) {
+static inline void decimate(VmafPicture *image, unsigned width, unsigned height) {
     uint16_t *data = image->data[0];
     ptrdiff_t stride = image->stride[0] >> 1;
     for (unsigned i = 0; i < height; i++) {
@@ -422,35 +692,17 @@ static FORCE_INLINE inline uint16_t mode_selection(uint16_t *elems, uint8_t *his
     return max_mode;
 }
 
-static void filter_mode(const VmafPicture *image, int width, int height) {
-    uint16_t *data = image->data[0];
-    ptrdiff_t stride = image->stride[0] >> 1;
+static void mode_row(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below, int width) {
     uint16_t curr[9];
-    uint8_t *hist = malloc(1024 * sizeof(uint8_t));
-    uint16_t *buffer = malloc(3 * width * sizeof(uint16_t));
-    for (int i = 0; i < height + 2; i++) {
-        if (i < height) {
-            for (int j = 0; j < width; j++) {
-                // Get the 9 elements into an array for cache optimization
-                for (int row = 0; row < 3; row++) {
-                    for (int col = 0; col < 3; col++) {
-                        int clamped_row = CLAMP(i + row - 1, 0, height - 1);
-                        int clamped_col = CLAMP(j + col - 1, 0, width - 1);
-                        curr[3 * row + col] = data[clamped_row * stride + clamped_col];
-                    }
-                }
-                buffer[(i % 3) * width + j] = mode_selection(curr, hist);
-            }
-        }
-        if (i >= 2) {
-            uint16_t *dest = data + (i - 2) * stride;
-            uint16_t *src = buffer + ((i + 1) % 3) * width;
-            memcpy(dest, src, width * sizeof(uint16_t));
+    uint8_t hist[1024];
+    for (int j = 1; j < width - 1; j++) {
+        for (int k = 0; k < 3; k++) {
+            curr[k] = above[j + k - 1];
+            curr[3 + k] = row[j + k - 1];
+            curr[6 + k] = below[j + k - 1];
         }
+        dst[j] = mode_selection(curr, hist);
     }
-
-    free(hist);
-    free(buffer);
 }
 
 static FORCE_INLINE inline uint16_t get_mask_index(unsigned input_width, unsigned input_height,
@@ -471,78 +723,184 @@ static FORCE_INLINE inline bool get_derivative_data(const uint16_t *data, int wi
 * We say a pixel has zero_derivative=1 if it's equal to its right and bottom neighbours, and =0 otherwise (edges also count as "equal").
 * This function then computes the sum of zero_derivative on the filter_size x filter_size square around each pixel
 * and stores 1 into the corresponding mask index iff this number is larger than mask_index.
-* To calculate the square sums, it uses a dynamic programming algorithm based on inclusion-exclusion.
+* To calculate the square sums, it uses a dynamic programming algorithm based on inclusion-exclusion (a summed-area table),
+* whose rows are computed by mask_dp_callback and whose sums are thresholded by mask_threshold_callback.
 * To save memory, it uses a DP matrix of only the necessary size, rather than the full matrix, and indexes its rows cyclically.
+* The computation is split in spatial_mask_begin and spatial_mask_advance so that it can be streamed
+* along with other row based passes, see filter_mode_fused.
 */
-static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *mask,
-                                       uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
-                                       int width, int height) {
-    uint16_t pad_size = filter_size >> 1;
-    uint16_t *image_data = image->data[0];
-    uint16_t *mask_data = mask->data[0];
-    ptrdiff_t stride = image->stride[0] >> 1;
+typedef struct SpatialMaskStream {
+    const uint16_t *image_data;
+    uint16_t *mask_data;
+    ptrdiff_t stride;
+    uint32_t *dp;
+    int dp_width, dp_height;
+    uint16_t pad_size, mask_index;
+    int width, height;
+    int next_row, curr_row, curr_compute;
+    VmafMaskDpUpdater dp_row;
+    VmafMaskThreshold threshold_row;
+} SpatialMaskStream;
+
+// Computes the dp row curr_row from the previous one for image row i.
+static void spatial_mask_dp_row(const SpatialMaskStream *m, int i, int curr_row) {
+    int prev_row = (curr_row + m->dp_height - 1) % m->dp_height;
+    uint32_t *dp = m->dp + curr_row * m->dp_width + m->pad_size + 1;
+    const uint32_t *dp_prev = m->dp + prev_row * m->dp_width + m->pad_size + 1;
+    if (i >= m->height) {
+        // No zero derivatives left
+        memcpy(dp, dp_prev, (m->width + m->pad_size) * sizeof *dp);
+        return;
+    }
+    const uint16_t *row = m->image_data + i * m->stride;
+    m->dp_row(dp, dp_prev, row, i + 1 < m->height ? row + m->stride : NULL, m->width);
+    const uint32_t sum = dp[m->width - 1] - dp_prev[m->width - 1];
+    for (int j = m->width; j < m->width + m->pad_size; j++)
+        dp[j] = dp_prev[j] + sum;
+}
 
-    int dp_width = width + 2 * pad_size + 1;
-    int dp_height = 2 * pad_size + 2;
-    memset(dp, 0, dp_width * dp_height * sizeof(uint32_t));
+static void spatial_mask_begin(SpatialMaskStream *m, const VmafPicture *image, VmafPicture *mask,
+                               uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
+                               int width, int height, VmafMaskDpUpdater dp_row, VmafMaskThreshold threshold_row) {
+    uint16_t pad_size = filter_size >> 1;
+    m->image_data = image->data[0];
+    m->mask_data = mask->data[0];
+    m->stride = image->stride[0] >> 1;
+    m->dp = dp;
+    m->dp_width = width + 2 * pad_size + 1;
+    m->dp_height = 2 * pad_size + 2;
+    m->pad_size = pad_size;
+    m->mask_index = mask_index;
+    m->width = width;
+    m->height = height;
+    m->dp_row = dp_row;
+    m->threshold_row = threshold_row;
+
+    memset(dp, 0, m->dp_width * m->dp_height * sizeof(uint32_t));
 
     // Initial computation: fill dp except for the last row
-    for (int i = 0; i < pad_size; i++) {
-        for (int j = 0; j < width + pad_size; j++) {
-            int value = (i < height && j < width ? get_derivative_data(image_data, width, height, i, j, stride) : 0);
-            int curr_row = i + pad_size + 1;
-            int curr_col = j + pad_size + 1;
-            dp[curr_row * dp_width + curr_col] =
-                value
-                + dp[(curr_row - 1) * dp_width + curr_col]
-                + dp[curr_row * dp_width + curr_col - 1]
-                - dp[(curr_row - 1) * dp_width + curr_col - 1];
-        }
-    }
+    for (int i = 0; i < pad_size; i++)
+        spatial_mask_dp_row(m, i, i + pad_size + 1);
 
     // Start from the last row in the dp matrix
-    int curr_row = dp_height - 1;
-    int curr_compute = pad_size + 1;
-    for (int i = pad_size; i < height + pad_size; i++) {
+    m->next_row = pad_size;
+    m->curr_row = m->dp_height - 1;
+    m->curr_compute = pad_size + 1;
+}
+
+/*
+* Consumes the image rows < end (clamped to the image), emitting the mask rows that become complete.
+* Reads image rows up to end, so a caller may modify row end - 1 and above only afterwards.
+*/
+static void spatial_mask_advance(SpatialMaskStream *m, int end) {
+    uint16_t *mask_data = m->mask_data;
+    ptrdiff_t stride = m->stride;
+    uint32_t *dp = m->dp;
+    int dp_width = m->dp_width;
+    int dp_height = m->dp_height;
+    uint16_t pad_size = m->pad_size;
+    int curr_row = m->curr_row;
+    int curr_compute = m->curr_compute;
+
+    end = MIN(end, m->height + pad_size);
+    for (int i = m->next_row; i < end; i++) {
         // First compute the values of dp for curr_row
-        for (int j = 0; j < width + pad_size; j++) {
-            int value = (i < height && j < width ? get_derivative_data(image_data, width, height, i, j, stride) : 0);
-            int curr_col = j + pad_size + 1;
-            int prev_row = (curr_row + dp_height - 1) % dp_height;
-            dp[curr_row * dp_width + curr_col] =
-                value
-                + dp[prev_row * dp_width + curr_col]
-                + dp[curr_row * dp_width + curr_col - 1]
-                - dp[prev_row * dp_width + curr_col - 1];
-        }
+        spatial_mask_dp_row(m, i, curr_row);
         curr_row = (curr_row + 1) % dp_height;
 
         // Then use the values to compute the square sum for the curr_compute row.
-        for (int j = 0; j < width; j++) {
-            int curr_col = j + pad_size + 1;
-            int bottom = (curr_compute + pad_size) % dp_height;
-            int top = (curr_compute + dp_height - pad_size - 1) % dp_height;
-            int right = curr_col + pad_size;
-            int left = curr_col - pad_size - 1;
-            int result =
-                dp[bottom * dp_width + right]
-                - dp[bottom * dp_width + left]
-                - dp[top * dp_width + right]
-                + dp[top * dp_width + left];
-            mask_data[(i - pad_size) * stride + j] = (result > mask_index);
-        }
+        int bottom = (curr_compute + pad_size) % dp_height;
+        int top = (curr_compute + dp_height - pad_size - 1) % dp_height;
+        m->threshold_row(mask_data + (i - pad_size) * stride, dp + top * dp_width, dp + bottom * dp_width,
+                         m->width, 2 * pad_size + 1, m->mask_index);
         curr_compute = (curr_compute + 1) % dp_height;
     }
+    m->next_row = MAX(m->next_row, end);
+    m->curr_row = curr_row;
+    m->curr_compute = curr_compute;
+}
+
+static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *mask,
+                                       uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
+                                       int width, int height) {
+    SpatialMaskStream m;
+    spatial_mask_begin(&m, image, mask, dp, mask_index, filter_size, width, height, mask_dp_row, mask_threshold_row);
+    spatial_mask_advance(&m, height + m.pad_size);
 }
 
-static void get_spatial_mask(const VmafPicture *image, VmafPicture *mask,
-                             uint32_t *dp, unsigned width, unsigned height) {
+static inline void get_spatial_mask(const VmafPicture *image, VmafPicture *mask,
+                                    uint32_t *dp, unsigned width, unsigned height) {
     unsigned input_width = image->w[0];
     unsigned input_height = image->h[0];
     uint16_t mask_index = get_mask_index(input_width, input_height, MASK_FILTER_SIZE);
     get_spatial_mask_for_index(image, mask, dp, mask_index, MASK_FILTER_SIZE, width, height);
 }
 
+static void decimate_row(uint16_t *dst, const uint16_t *src, int width) {
+    for (int j = 0; j < width; j++)
+        dst[j] = src[j << 1];
+}
+
+/*
+* Mode filter that streams the other per-scale passes along with it, so each row is only brought into cache once.
+* Row i of the output needs rows i - 1 .. i + 1 of the input and is written back once row i + 2 has been computed.
+* - With mask_stream set (scale 0), the spatial mask consumes each row before the mode filter overwrites it.
+* - With decimate_mask set (scales > 0), image and mask rows are decimated right before they are needed.
+*   The decimation is in place: row i reads row 2i, which none of the rows written so far can have reached.
+*/
+static void filter_mode_fused(const VmafPicture *image, VmafPicture *mask, int width, int height,
+                              uint16_t *buffer, SpatialMaskStream *mask_stream, bool decimate_mask,
+                              VmafModeRow mode_row_callback, VmafDecimateRow decimate_row_callback) {
+    uint16_t *data = image->data[0];
+    ptrdiff_t stride = image->stride[0] >> 1;
+    uint16_t *mask_data = mask ? mask->data[0] : NULL;
+    ptrdiff_t mask_stride = mask ? mask->stride[0] >> 1 : 0;
+    uint16_t curr[9];
+    uint8_t hist[1024];
+    int decimated = 0;
+    // The columns whose neighbours are outside of the image are clamped here, the others are left to
+    // mode_row_callback if the image is wide enough for it.
+    const int use_row_callback = width >= CAMBI_MODE_ROW_MIN_WIDTH;
+    for (int i = 0; i < height + 2; i++) {
+        if (decimate_mask) {
+            for (; decimated < MIN(i + 2, height); decimated++) {
+                decimate_row_callback(data + decimated * stride, data + 2 * decimated * stride, width);
+                decimate_row_callback(mask_data + decimated * mask_stride, mask_data + 2 * decimated * mask_stride, width);
+            }
+        }
+        if (i < height) {
+            uint16_t *dst = buffer + (i % 3) * width;
+            if (use_row_callback)
+                mode_row_callback(dst, data + MAX(i - 1, 0) * stride, data + i * stride,
+                                  data + MIN(i + 1, height - 1) * stride, width);
+            for (int j = 0; j < width; j += use_row_callback && j == 0 ? width - 1 : 1) {
+                // Get the 9 elements into an array for cache optimization
+                for (int row = 0; row < 3; row++) {
+                    for (int col = 0; col < 3; col++) {
+                        int clamped_row = CLAMP(i + row - 1, 0, height - 1);
+                        int clamped_col = CLAMP(j + col - 1, 0, width - 1);
+                        curr[3 * row + col] = data[clamped_row * stride + clamped_col];
+                    }
+                }
+                dst[j] = mode_selection(curr, hist);
+            }
+        }
+        if (i >= 2) {
+            if (mask_stream)
+                spatial_mask_advance(mask_stream, i - 1);
+            uint16_t *dest = data + (i - 2) * stride;
+            uint16_t *src = buffer + ((i + 1) % 3) * width;
+            memcpy(dest, src, width * sizeof(uint16_t));
+        }
+    }
+    if (mask_stream)
+        spatial_mask_advance(mask_stream, height + mask_stream->pad_size);
+}
+
+static inline void filter_mode(const VmafPicture *image, int width, int height, uint16_t *buffer) {
+    filter_mode_fused(image, NULL, width, height, buffer, NULL, false, mode_row, decimate_row);
+}
+
 static float c_value_pixel(const uint16_t *histograms, uint16_t value, const int *diff_weights,
                            const int *diffs, uint16_t num_diffs, const uint16_t *tvi_thresholds, int histogram_col, int histogram_width) {
     uint16_t p_0 = histograms[value * histogram_width + histogram_col];
@@ -567,97 +925,188 @@ static float c_value_pixel(const uint16_t *histograms, uint16_t value, const int
     return c_value;
 }
 
-static FORCE_INLINE inline void update_histogram_subtract(uint16_t *histograms, uint16_t *image, uint16_t *mask,
-                                                          int i, int j, int width, ptrdiff_t stride, uint16_t pad_size) {
-    uint16_t mask_val = mask[(i - pad_size - 1) * stride + j];
-    if (mask_val) {
-        uint16_t val = image[(i - pad_size - 1) * stride + j] + g_c_value_histogram_offset;
-        for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-            histograms[val * width + col]--;
-        }
-    }
-}
-
-static FORCE_INLINE inline void update_histogram_add(uint16_t *histograms, uint16_t *image, uint16_t *mask,
-                                                     int i, int j, int width, ptrdiff_t stride, uint16_t pad_size) {
-    uint16_t mask_val = mask[(i + pad_size) * stride + j];
-    if (mask_val) {
-        uint16_t val = image[(i + pad_size) * stride + j] + g_c_value_histogram_offset;
-        for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-            histograms[val * width + col]++;
-        }
+// The histograms only cover the columns [col_begin, col_end) of a tile, and pixel j adds to those of its window in the tile.
+static FORCE_INLINE inline void update_histogram(uint16_t *histograms, uint16_t mask_val, uint16_t val, int j,
+                                                 int col_begin, int col_end, uint16_t pad_size, uint16_t num_bins,
+                                                 const VmafRangeUpdater range_callback) {
+    if (mask_val && val < num_bins) {
+        range_callback(&histograms[val * (col_end - col_begin)], MAX(j - pad_size, col_begin) - col_begin,
+                       MIN(j + pad_size + 1, col_end) - col_begin);
     }
 }
 
 static FORCE_INLINE inline void calculate_c_values_row(float *c_values, uint16_t *histograms, uint16_t *image,
                                                        uint16_t *mask, int row, int width, ptrdiff_t stride,
-                                                       const uint16_t *tvi_for_diff) {
-    for (int col = 0; col < width; col++) {
-        if (mask[row * stride + col]) {
+                                                       int col_begin, int col_end,
+                                                       const uint16_t *tvi_for_diff, uint16_t num_bins) {
+    for (int col = col_begin; col < col_end; col++) {
+        uint16_t value = image[row * stride + col] + g_c_value_histogram_offset;
+        if (mask[row * stride + col] && value < num_bins) {
             c_values[row * width + col] = c_value_pixel(
-                histograms, image[row * stride + col] + g_c_value_histogram_offset, g_diffs_weights, g_all_diffs, NUM_DIFFS, tvi_for_diff, col, width
+                histograms, value, g_diffs_weights, g_all_diffs, NUM_DIFFS, tvi_for_diff, col - col_begin,
+                col_end - col_begin
             );
         }
     }
 }
 
-static void calculate_c_values(VmafPicture *pic, const VmafPicture *mask_pic,
-                               float *c_values, uint16_t *histograms, uint16_t window_size,
-                               const uint16_t *tvi_for_diff, int width, int height) {
+/*
+* Calculates the c-values of rows [row_begin, row_end) and columns [col_begin, col_end). The histograms are first
+* filled with the pad_size rows above row_begin (the halo), so that any horizontal stripe of the image can be
+* processed independently of the others, and the pixels up to pad_size columns left and right of the tile are
+* counted too, so that it can be processed independently of the other tiles.
+*/
+static void calculate_c_values_tile(VmafPicture *pic, const VmafPicture *mask_pic,
+                                    float *c_values, uint16_t *histograms, uint16_t window_size,
+                                    const uint16_t *tvi_for_diff, int width, int height,
+                                    int row_begin, int row_end, int col_begin, int col_end,
+                                    VmafRangeUpdater inc_range_callback, VmafRangeUpdater dec_range_callback) {
     uint16_t pad_size = window_size >> 1;
-    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    const uint16_t num_bins = get_num_bins(tvi_for_diff);
 
     uint16_t *image = pic->data[0];
     uint16_t *mask = mask_pic->data[0];
     ptrdiff_t stride = pic->stride[0] >> 1;
+    const int j_begin = MAX(col_begin - pad_size, 0);
+    const int j_end = MIN(col_end + pad_size, width);
 
-    memset(c_values, 0.0, sizeof(float) * width * height);
-
-    // Use a histogram for each pixel in width
-    // histograms[i * width + j] accesses the j'th histogram, i'th value
+    // Use a histogram for each pixel in the tile
+    // histograms[i * (col_end - col_begin) + j] accesses the j'th histogram, i'th value
     // This is done for cache optimization reasons
-    memset(histograms, 0, width * num_bins * sizeof(uint16_t));
-
-    // First pass: first pad_size rows
-    for (int i = 0; i < pad_size; i++) {
-        for (int j = 0; j < width; j++) {
-            uint16_t mask_val = mask[i * stride + j];
-            if (mask_val) {
-                uint16_t val = image[i * stride + j] + g_c_value_histogram_offset;
-                for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-                    histograms[val * width + col]++;
-                }
-            }
+    memset(histograms, 0, (col_end - col_begin) * num_bins * sizeof(uint16_t));
+
+    // First pass: the pad_size rows above and below row_begin, excluding the last one
+    for (int i = MAX(row_begin - pad_size, 0); i < MIN(row_begin + pad_size, height); i++) {
+        for (int j = j_begin; j < j_end; j++) {
+            update_histogram(histograms, mask[i * stride + j], image[i * stride + j] + g_c_value_histogram_offset,
+                             j, col_begin, col_end, pad_size, num_bins, inc_range_callback);
         }
     }
 
-    // Iterate over all rows, unrolled into 3 loops to avoid conditions
-    for (int i = 0; i < pad_size + 1; i++) {
+    for (int i = row_begin; i < row_end; i++) {
+        if (i > row_begin && i - pad_size - 1 >= 0) {
+            const int r = i - pad_size - 1;
+            for (int j = j_begin; j < j_end; j++) {
+                update_histogram(histograms, mask[r * stride + j], image[r * stride + j] + g_c_value_histogram_offset,
+                                 j, col_begin, col_end, pad_size, num_bins, dec_range_callback);
+            }
+        }
         if (i + pad_size < height) {
-            for (int j = 0; j < width; j++) {
-                update_histogram_add(histograms, image, mask, i, j, width, stride, pad_size);
+            const int r = i + pad_size;
+            for (int j = j_begin; j < j_end; j++) {
+                update_histogram(histograms, mask[r * stride + j], image[r * stride + j] + g_c_value_histogram_offset,
+                                 j, col_begin, col_end, pad_size, num_bins, inc_range_callback);
             }
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, col_begin, col_end,
+                               tvi_for_diff, num_bins);
     }
-    for (int i = pad_size + 1; i < height - pad_size; i++) {
-        for (int j = 0; j < width; j++) {
-            update_histogram_subtract(histograms, image, mask, i, j, width, stride, pad_size);
-            update_histogram_add(histograms, image, mask, i, j, width, stride, pad_size);
-        }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+}
+
+/*
+* Calculates the c-values of rows [row_begin, row_end), in tiles of tile_width columns (0 for the whole width).
+* Narrower tiles keep the histograms in cache, at the cost of counting the pad_size columns around each tile twice.
+*/
+static void calculate_c_values_rows(VmafPicture *pic, const VmafPicture *mask_pic,
+                                    float *c_values, uint16_t *histograms, uint16_t window_size,
+                                    const uint16_t *tvi_for_diff, int width, int height,
+                                    int row_begin, int row_end, int tile_width,
+                                    VmafRangeUpdater inc_range_callback, VmafRangeUpdater dec_range_callback) {
+    memset(c_values + row_begin * width, 0.0, sizeof(float) * width * (row_end - row_begin));
+
+    // Tiles narrower than the window would mostly count halos, and a last tile narrower than half of one
+    // is merged into the previous one.
+    if (tile_width <= 0 || tile_width >= width)
+        tile_width = width;
+    tile_width = MAX(tile_width, window_size);
+    int tiles = MAX((width + tile_width / 2) / tile_width, 1);
+    for (int t = 0; t < tiles; t++) {
+        int col_begin = t * tile_width;
+        int col_end = t == tiles - 1 ? width : col_begin + tile_width;
+        calculate_c_values_tile(pic, mask_pic, c_values, histograms, window_size, tvi_for_diff, width, height,
+                                row_begin, row_end, col_begin, col_end, inc_range_callback, dec_range_callback);
     }
-    for (int i = height - pad_size; i < height; i++) {
-        if (i - pad_size - 1 >= 0) {
-            for (int j = 0; j < width; j++) {
-                update_histogram_subtract(histograms, image, mask, i, j, width, stride, pad_size);
-            }
-        }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+}
+
+static void calculate_c_values(VmafPicture *pic, const VmafPicture *mask_pic,
+                               float *c_values, uint16_t *histograms, uint16_t window_size,
+                               const uint16_t *tvi_for_diff, int width, int height,
+                               VmafRangeUpdater inc_range_callback, VmafRangeUpdater dec_range_callback) {
+    calculate_c_values_rows(pic, mask_pic, c_values, histograms, window_size, tvi_for_diff,
+                            width, height, 0, height, 0, inc_range_callback, dec_range_callback);
+}
+
+typedef struct CValuesStripe {
+    VmafPicture *pic;
+    const VmafPicture *mask_pic;
+    float *c_values;
+    uint16_t *histograms;
+    uint16_t window_size;
+    const uint16_t *tvi_for_diff;
+    int width, height;
+    int row_begin, row_end;
+    int tile_width;
+    int numa_node;
+    VmafRangeUpdater inc_range_callback;
+    VmafRangeUpdater dec_range_callback;
+} CValuesStripe;
+
+static void calculate_c_values_stripe(void *arg) {
+    CValuesStripe *t = arg;
+    // Windows threads do not inherit the affinity of the thread that starts them
+    if (t->numa_node >= 0)
+        vmaf_numa_bind(t->numa_node, NULL);
+    calculate_c_values_rows(t->pic, t->mask_pic, t->c_values, t->histograms, t->window_size,
+                            t->tvi_for_diff, t->width, t->height, t->row_begin, t->row_end, t->tile_width,
+                            t->inc_range_callback, t->dec_range_callback);
+}
+
+/*
+* Splits the image into horizontal stripes, one per thread, each at least window_size rows high.
+* histograms must hold a set of width * get_num_bins(tvi_for_diff) histograms per thread.
+* The threads are bound to numa_node, unless it is -1.
+*/
+static void calculate_c_values_threaded(VmafPicture *pic, const VmafPicture *mask_pic,
+                                        float *c_values, uint16_t *histograms, uint16_t window_size,
+                                        const uint16_t *tvi_for_diff, int width, int height, unsigned threads,
+                                        int tile_width, int numa_node,
+                                        VmafRangeUpdater inc_range_callback, VmafRangeUpdater dec_range_callback) {
+    const uint16_t num_bins = get_num_bins(tvi_for_diff);
+    int stripes = MIN((int)threads, MAX(height / window_size, 1));
+    if (stripes <= 1) {
+        calculate_c_values_rows(pic, mask_pic, c_values, histograms, window_size, tvi_for_diff,
+                                width, height, 0, height, tile_width, inc_range_callback, dec_range_callback);
+        return;
     }
+
+    CValuesStripe args[CAMBI_MAX_THREADS];
+    VmafThread workers[CAMBI_MAX_THREADS];
+    for (int k = 0; k < stripes; k++) {
+        CValuesStripe *t = &args[k];
+        t->pic = pic;
+        t->mask_pic = mask_pic;
+        t->c_values = c_values;
+        t->histograms = histograms + (size_t)k * width * num_bins;
+        t->window_size = window_size;
+        t->tvi_for_diff = tvi_for_diff;
+        t->width = width;
+        t->height = height;
+        t->row_begin = height * k / stripes;
+        t->row_end = height * (k + 1) / stripes;
+        t->tile_width = tile_width;
+        t->numa_node = numa_node;
+        t->inc_range_callback = inc_range_callback;
+        t->dec_range_callback = dec_range_callback;
+    }
+    // The calling thread processes the first stripe itself
+    for (int k = 1; k < stripes; k++)
+        vmaf_thread_start(&workers[k], calculate_c_values_stripe, &args[k]);
+    calculate_c_values_stripe(&args[0]);
+    for (int k = 1; k < stripes; k++)
+        vmaf_thread_join(&workers[k]);
 }
 
-static double average_topk_elements(const float *arr, int topk_elements) {
+static inline double average_topk_elements(const float *arr, int topk_elements) {
     double sum = 0;
     for (int i = 0; i < topk_elements; i++)
         sum += arr[i];
@@ -665,7 +1114,7 @@ static double average_topk_elements(const float *arr, int topk_elements) {
     return (double)sum / topk_elements;
 }
 
-static void quick_select(float *arr, int n, int k) {
+static inline void quick_select(float *arr, int n, int k) {
     int left = 0;
     int right = n - 1;
     while (left < right) {
@@ -694,11 +1143,90 @@ static void quick_select(float *arr, int n, int k) {
     }
 }
 
-static double spatial_pooling(float *c_values, double topk, unsigned width, unsigned height) {
+static FORCE_INLINE inline uint32_t float_bits(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof bits);
+    return bits;
+}
+
+/*
+* Computes the exact average of the topk_elements largest values without reordering arr.
+* The values must be non-negative, so that they compare like their bit patterns do as
+* unsigned integers.
+*
+* Most c-values are zero, so a first pass counts and sums the nonzero values: if they all
+* fit in the top k, that is the answer already. Otherwise a radix select finds the bits of
+* the topk-th largest value, 16 bits at a time: a histogram of the upper halves locates the
+* bin holding it, and a second pass sums everything above that bin while counting the lower
+* halves of the values in it.
+*/
+static double average_topk_elements_radix(const float *arr, int n, int topk_elements, uint32_t *counts) {
+    double partial[4] = { 0 };
+    int nonzero[4] = { 0 };
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int w = 0; w < 4; w++) {
+            partial[w] += arr[i + w];
+            nonzero[w] += arr[i + w] != 0;
+        }
+    }
+    for (; i < n; i++) {
+        partial[0] += arr[i];
+        nonzero[0] += arr[i] != 0;
+    }
+    if (nonzero[0] + nonzero[1] + nonzero[2] + nonzero[3] <= topk_elements)
+        return (partial[0] + partial[1] + partial[2] + partial[3]) / topk_elements;
+
+    memset(counts, 0, RADIX_BINS * sizeof *counts);
+    for (i = 0; i < n; i++)
+        counts[float_bits(arr[i]) >> RADIX_BITS]++;
+
+    uint32_t remaining = topk_elements;
+    uint32_t hi = RADIX_BINS - 1;
+    for (; counts[hi] < remaining; hi--)
+        remaining -= counts[hi];
+
+    memset(partial, 0, sizeof partial);
+    memset(counts, 0, RADIX_BINS * sizeof *counts);
+    for (i = 0; i + 4 <= n; i += 4) {
+        for (int w = 0; w < 4; w++) {
+            const uint32_t bits = float_bits(arr[i + w]);
+            const uint32_t top = bits >> RADIX_BITS;
+            // branchless, as these won't predict well
+            const uint32_t above = bits & (0u - (uint32_t)(top > hi));
+            float v;
+            memcpy(&v, &above, sizeof v);
+            partial[w] += v;
+            if (top == hi)
+                counts[bits & (RADIX_BINS - 1)]++;
+        }
+    }
+    for (; i < n; i++) {
+        const uint32_t bits = float_bits(arr[i]);
+        if ((bits >> RADIX_BITS) > hi)
+            partial[0] += arr[i];
+        else if ((bits >> RADIX_BITS) == hi)
+            counts[bits & (RADIX_BINS - 1)]++;
+    }
+    double sum = partial[0] + partial[1] + partial[2] + partial[3];
+
+    // Each bin of the lower halves holds a single value
+    for (uint32_t lo = RADIX_BINS - 1; remaining > 0; lo--) {
+        const uint32_t bits = (hi << RADIX_BITS) | lo;
+        const uint32_t count = MIN(counts[lo], remaining);
+        float v;
+        memcpy(&v, &bits, sizeof v);
+        sum += (double)count * v;
+        remaining -= count;
+    }
+    return sum / topk_elements;
+}
+
+static double spatial_pooling(const float *c_values, double topk, unsigned width, unsigned height,
+                              uint32_t *histogram) {
     int num_elements = height * width;
     int topk_num_elements = clip(topk * num_elements, 1, num_elements);
-    quick_select(c_values, num_elements, topk_num_elements);
-    return average_topk_elements(c_values, topk_num_elements);
+    return average_topk_elements_radix(c_values, num_elements, topk_num_elements, histogram);
 }
 
 static FORCE_INLINE inline uint16_t get_pixels_in_window(uint16_t window_length) {
@@ -714,50 +1242,143 @@ static FORCE_INLINE inline double weight_scores_per_scale(double *scores_per_sca
     return score / normalization;
 }
 
-static int cambi_score(VmafPicture *pics, uint32_t *mask_dp, uint16_t window_size, double topk,
-                       const uint16_t *tvi_for_diff, float *c_values, uint16_t *c_values_histograms, double *score,
-                       float **c_values_ret) {
+typedef struct SpatialPoolingTask {
+    const float *c_values;
+    double topk;
+    unsigned width, height;
+    uint32_t *histogram;
+    double *score;
+    int numa_node;
+} SpatialPoolingTask;
+
+static void spatial_pooling_task(void *arg) {
+    SpatialPoolingTask *t = arg;
+    if (t->numa_node >= 0)
+        vmaf_numa_bind(t->numa_node, NULL);
+    *t->score = spatial_pooling(t->c_values, t->topk, t->width, t->height, t->histogram);
+}
+
+static int cambi_score(VmafPicture *pics, uint32_t *mask_dp, uint16_t mask_index, uint16_t *buffer, uint16_t window_size, double topk,
+                       const uint16_t *tvi_for_diff, float *c_values, float *c_values_pooling,
+                       uint16_t *c_values_histograms, uint32_t *pooling_histogram, unsigned threads, int tile_width,
+                       int numa_node, double *score, double *scores_per_scale_ret, float **c_values_ret, double *seconds_per_scale_ret,
+                       VmafRangeUpdater inc_range_callback, VmafRangeUpdater dec_range_callback,
+                       VmafMaskDpUpdater mask_dp_callback, VmafMaskThreshold mask_threshold_callback,
+                       VmafModeRow mode_row_callback, VmafDecimateRow decimate_row_callback) {
     double scores_per_scale[NUM_SCALES];
     VmafPicture *image = &pics[0];
     VmafPicture *mask = &pics[1];
 
+    // When a second c_values buffer is available, the spatial pooling of each scale
+    // runs on its own thread while the next scale is being computed.
+    // The pooling does not modify the c-values, so if they are requested they are computed in place.
+    float *c_values_buf[2] = { c_values, c_values_pooling ? c_values_pooling : c_values };
+    SpatialPoolingTask pooling;
+    VmafThread pooling_thread = { 0 };
+
+    // The pooling of a scale overlaps with the next one, so the time spent waiting for it
+    // counts towards the next scale.
+    double start = seconds_per_scale_ret ? vmaf_timer_seconds() : 0;
+
     unsigned scaled_width = image->w[0];
     unsigned scaled_height = image->h[0];
     for (unsigned scale = 0; scale < NUM_SCALES; scale++) {
         if (scale > 0) {
             scale_dimension(&scaled_width, 1);
             scale_dimension(&scaled_height, 1);
-            decimate(image, scaled_width, scaled_height);
-            decimate(mask, scaled_width, scaled_height);
+            filter_mode_fused(image, mask, scaled_width, scaled_height, buffer, NULL, true, mode_row_callback,
+                              decimate_row_callback);
         } else {
-            get_spatial_mask(image, mask, mask_dp, scaled_width, scaled_height);
+            SpatialMaskStream mask_stream;
+            spatial_mask_begin(&mask_stream, image, mask, mask_dp, mask_index, MASK_FILTER_SIZE,
+                               scaled_width, scaled_height, mask_dp_callback, mask_threshold_callback);
+            filter_mode_fused(image, mask, scaled_width, scaled_height, buffer, &mask_stream, false, mode_row_callback,
+                              decimate_row_callback);
         }
 
-        filter_mode(image, scaled_width, scaled_height);
-
-        calculate_c_values(image, mask, c_values, c_values_histograms, window_size,
-                           tvi_for_diff, scaled_width, scaled_height);
-
-        if (c_values_ret && c_values_ret[scale])
-            memcpy(c_values_ret[scale], c_values, scaled_width * scaled_height * sizeof *c_values);
+        float *cv = c_values_ret && c_values_ret[scale] ? c_values_ret[scale] : c_values_buf[scale & 1];
+        calculate_c_values_threaded(image, mask, cv, c_values_histograms, window_size,
+                                    tvi_for_diff, scaled_width, scaled_height, threads, tile_width,
+                                    numa_node, inc_range_callback, dec_range_callback);
+
+        vmaf_thread_join(&pooling_thread);
+        if (c_values_pooling) {
+            pooling.c_values = cv;
+            pooling.topk = topk;
+            pooling.width = scaled_width;
+            pooling.height = scaled_height;
+            pooling.histogram = pooling_histogram;
+            pooling.score = &scores_per_scale[scale];
+            pooling.numa_node = numa_node;
+            vmaf_thread_start(&pooling_thread, spatial_pooling_task, &pooling);
+        } else {
+            scores_per_scale[scale] =
+                spatial_pooling(cv, topk, scaled_width, scaled_height, pooling_histogram);
+        }
 
-        scores_per_scale[scale] =
-            spatial_pooling(c_values, topk, scaled_width, scaled_height);
+        if (seconds_per_scale_ret) {
+            double now = vmaf_timer_seconds();
+            seconds_per_scale_ret[scale] = now - start;
+            start = now;
+        }
     }
+    vmaf_thread_join(&pooling_thread);
+    if (seconds_per_scale_ret)
+        seconds_per_scale_ret[NUM_SCALES - 1] += vmaf_timer_seconds() - start;
 
     uint16_t pixels_in_window = get_pixels_in_window(window_size);
     *score = weight_scores_per_scale(scores_per_scale, pixels_in_window);
+    if (scores_per_scale_ret) {
+        for (unsigned scale = 0; scale < NUM_SCALES; scale++)
+            scores_per_scale_ret[scale] = scores_per_scale[scale] / pixels_in_window;
+    }
     return 0;
 }
 
-int cambi_extract(CambiState *s, VmafPicture *pic, double *score, float **c_values) {
-    int err = cambi_preprocessing(pic, &s->pics[0]);
-    if (err) return err;
+int cambi_extract_area(CambiState *s, VmafPicture *pic, const CambiArea *area, double *score,
+                       double *scores_per_scale, float **c_values, double *seconds_per_scale) {
+    // The area is analysed in the top left corner of the working pictures, as if it was the whole picture.
+    VmafPicture input = *pic;
+    VmafPicture pics[PICS_BUFFER_SIZE];
+    memcpy(pics, s->pics, sizeof pics);
+    if (area) {
+        if (area->w == 0 || area->h == 0 || area->x + area->w > pic->w[0] || area->y + area->h > pic->h[0])
+            return -EINVAL;
+        const unsigned bytes = pic->bpc == 8 ? 1 : pic->bpc == 32 ? 4 : 2;
+        input.data[0] = (uint8_t *)pic->data[0] + area->y * pic->stride[0] + area->x * bytes;
+        input.w[0] = area->w;
+        input.h[0] = area->h;
+        CambiArea enc_area = cambi_area_at(area, pic->w[0], pic->h[0], s->enc_width, s->enc_height);
+        for (unsigned i = 0; i < PICS_BUFFER_SIZE; i++) {
+            pics[i].w[0] = enc_area.w;
+            pics[i].h[0] = enc_area.h;
+        }
+    }
 
-    err = cambi_score(s->pics, s->mask_dp, s->window_size, s->topk, s->tvi_for_diff, s->c_values, s->c_values_histograms, score, c_values);
-    if (err) return err;
+    // The calling thread moves to the node of the buffers for the frame.
+    VmafNumaAffinity affinity = { 0 };
+    if (s->numa_node >= 0)
+        vmaf_numa_bind(s->numa_node, &affinity);
+
+    int err = cambi_preprocessing(&input, &pics[0]);
+    if (!err) {
+        // The mask threshold depends on the viewing resolution, which an area does not change.
+        uint16_t mask_index = get_mask_index(s->enc_width, s->enc_height, MASK_FILTER_SIZE);
+        err = cambi_score(pics, s->mask_dp, mask_index, s->buffer, s->window_size, s->topk, s->tvi_for_diff,
+                          s->c_values, s->c_values_pooling, s->c_values_histograms, s->pooling_histogram, s->threads, s->tile_width,
+                          s->numa_node, score, scores_per_scale, c_values,
+                          seconds_per_scale, s->inc_range_callback, s->dec_range_callback,
+                          s->mask_dp_callback, s->mask_threshold_callback, s->mode_row_callback,
+                          s->decimate_row_callback);
+    }
 
-    return 0;
+    vmaf_numa_restore(&affinity);
+    return err;
+}
+
+int cambi_extract(CambiState *s, VmafPicture *pic, double *score, double *scores_per_scale, float **c_values,
+                  double *seconds_per_scale) {
+    return cambi_extract_area(s, pic, NULL, score, scores_per_scale, c_values, seconds_per_scale);
 }
 
 static int extract(VmafFeatureExtractor *fex,
@@ -771,7 +1392,7 @@ static int extract(VmafFeatureExtractor *fex,
     CambiState *s = fex->priv;
 
     double score;
-    int err = cambi_extract(s, dist_pic, &score, NULL);
+    int err = cambi_extract(s, dist_pic, &score, NULL, NULL, NULL);
     err = vmaf_feature_collector_append(feature_collector, "cambi", score, index);
     if (err) return err;
 
@@ -784,8 +1405,11 @@ int cambi_close(CambiState *s) {
         err |= vmaf_picture_unref(&s->pics[i]);
 
     aligned_free(s->c_values);
+    aligned_free(s->c_values_pooling);
     aligned_free(s->c_values_histograms);
+    aligned_free(s->pooling_histogram);
     aligned_free(s->mask_dp);
+    aligned_free(s->buffer);
     return err;
 }
 
@@ -1,6 +1,7 @@
 #ifndef __VMAF_CAMBI_H__
 #define __VMAF_CAMBI_H__
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #ifdef __cplusplus
@@ -16,6 +17,21 @@ static const int g_diffs_weights[NUM_DIFFS] = {1, 2, 3, 4};
 #endif
 
 #define PICS_BUFFER_SIZE 2
+#define CAMBI_MAX_THREADS 64
+
+typedef void (*VmafRangeUpdater)(uint16_t *arr, int left, int right);
+// Spatial mask: computes a row of the summed-area table of the zero derivatives from the previous one
+// (next_row is NULL for the last image row), and thresholds the window sums of a row of the mask.
+typedef void (*VmafMaskDpUpdater)(uint32_t *dp, const uint32_t *dp_prev, const uint16_t *row,
+                                  const uint16_t *next_row, int width);
+// Mode filter: computes the 3x3 modes of row[1..width-2] (width >= CAMBI_MODE_ROW_MIN_WIDTH), ties going to the lowest value.
+#define CAMBI_MODE_ROW_MIN_WIDTH 18
+typedef void (*VmafModeRow)(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                            int width);
+// Decimation of the scales > 0: dst[j] = src[2 * j] for j < width, where dst may be src.
+typedef void (*VmafDecimateRow)(uint16_t *dst, const uint16_t *src, int width);
+typedef void (*VmafMaskThreshold)(uint16_t *mask, const uint32_t *dp_top, const uint32_t *dp_bottom,
+                                  int width, int window, uint16_t mask_index);
 
 typedef struct CambiState {
     VmafPicture pics[PICS_BUFFER_SIZE];
@@ -25,16 +41,53 @@ typedef struct CambiState {
     uint16_t window_size;
     double topk;
     double tvi_threshold;
+    unsigned threads;
+    int tile_width;
+    bool numa;
+    // The NUMA node the buffers were allocated on and the frame is processed on, -1 if none
+    int numa_node;
     float *c_values;
+    float *c_values_pooling;
     uint16_t *c_values_histograms;
+    uint32_t *pooling_histogram;
     uint32_t *mask_dp;
+    uint16_t *buffer;
+    VmafRangeUpdater inc_range_callback;
+    VmafRangeUpdater dec_range_callback;
+    VmafMaskDpUpdater mask_dp_callback;
+    VmafMaskThreshold mask_threshold_callback;
+    VmafModeRow mode_row_callback;
+    VmafDecimateRow decimate_row_callback;
 } CambiState;
 
 void cambi_config(CambiState *s);
 int cambi_init(CambiState *s, unsigned w, unsigned h);
-int cambi_extract(CambiState *s, VmafPicture *pic, double *score, float **c_values);
+// scores_per_scale (NUM_SCALES entries, unweighted), c_values and seconds_per_scale (NUM_SCALES
+// entries of wall time) are optional outputs
+int cambi_extract(CambiState *s, VmafPicture *pic, double *score, double *scores_per_scale, float **c_values,
+                  double *seconds_per_scale);
+// Only analyses the area of pic, which is analysed at the encoding resolution as cambi_area_at(area, pic
+// size, encoding size). The c_values are those of the latter, with its scaled width as stride.
+typedef struct CambiArea {
+    unsigned x, y, w, h;
+} CambiArea;
+int cambi_extract_area(CambiState *s, VmafPicture *pic, const CambiArea *area, double *score,
+                       double *scores_per_scale, float **c_values, double *seconds_per_scale);
 int cambi_close(CambiState *s);
 
+// The area of a w x h picture that covers area of a from_w x from_h one.
+static inline CambiArea cambi_area_at(const CambiArea *area, unsigned from_w, unsigned from_h,
+                                      unsigned w, unsigned h) {
+    CambiArea a;
+    a.x = (unsigned long long)area->x * w / from_w;
+    a.y = (unsigned long long)area->y * h / from_h;
+    a.w = (unsigned long long)(area->x + area->w) * w / from_w - a.x;
+    a.h = (unsigned long long)(area->y + area->h) * h / from_h - a.y;
+    a.w = a.w ? a.w : 1;
+    a.h = a.h ? a.h : 1;
+    return a;
+}
+
 static inline void scale_dimension(unsigned *width, unsigned int scale) {
     for (unsigned i = 0; i < scale; i++)
         *width = (*width + 1) >> 1;
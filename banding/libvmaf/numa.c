@@ -0,0 +1,182 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#elif defined(_WIN32) && (!defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0601)
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601
+#endif
+
+#include <string.h>
+
+#include "numa.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#define MAX_NODES 64
+
+_Static_assert(sizeof(cpu_set_t) <= sizeof(((VmafNumaAffinity *)0)->mask), "cpu_set_t does not fit");
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int node_count = 1;
+// The CPUs of each node that this process may run on
+static cpu_set_t node_cpus[MAX_NODES];
+
+// Parses a sysfs cpu list such as "0-15,32-47" into set.
+static void parse_cpu_list(const char *path, cpu_set_t *set) {
+    CPU_ZERO(set);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    unsigned first, last;
+    int n;
+    while ((n = fscanf(f, "%u-%u", &first, &last)) >= 1) {
+        if (n == 1)
+            last = first;
+        for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+        if (fgetc(f) != ',')
+            break;
+    }
+    fclose(f);
+}
+
+static void init_topology(void) {
+    cpu_set_t allowed, online;
+    if (sched_getaffinity(0, sizeof allowed, &allowed))
+        return;
+    parse_cpu_list("/sys/devices/system/node/online", &online);
+
+    // Nodes without CPUs (memory only) or whose CPUs are all excluded from this process are left out.
+    int count = 0;
+    for (int node = 0; node < CPU_SETSIZE && count < MAX_NODES; node++) {
+        if (!CPU_ISSET(node, &online))
+            continue;
+        char path[64];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        parse_cpu_list(path, &node_cpus[count]);
+        CPU_AND(&node_cpus[count], &node_cpus[count], &allowed);
+        if (CPU_COUNT(&node_cpus[count]) > 0)
+            count++;
+    }
+    if (count > 1)
+        node_count = count;
+}
+
+int vmaf_numa_node_count(void) {
+    pthread_once(&topology_once, init_topology);
+    return node_count;
+}
+
+int vmaf_numa_current_node(void) {
+    int cpu = sched_getcpu();
+    int nodes = vmaf_numa_node_count();
+    for (int node = 0; node < nodes && cpu >= 0; node++) {
+        if (CPU_ISSET(cpu, &node_cpus[node]))
+            return node;
+    }
+    return 0;
+}
+
+int vmaf_numa_bind(int node, VmafNumaAffinity *saved) {
+    if (saved)
+        saved->saved = 0;
+    if (vmaf_numa_node_count() <= 1 || node < 0 || node >= node_count)
+        return -1;
+    if (saved) {
+        if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t *)saved->mask))
+            return -1;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node]))
+        return -1;
+    if (saved)
+        saved->saved = 1;
+    return 0;
+}
+
+void vmaf_numa_restore(const VmafNumaAffinity *saved) {
+    if (saved->saved)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (const cpu_set_t *)saved->mask);
+}
+
+#elif defined(_WIN32)
+#include <windows.h>
+
+_Static_assert(sizeof(GROUP_AFFINITY) <= sizeof(((VmafNumaAffinity *)0)->mask), "GROUP_AFFINITY does not fit");
+
+int vmaf_numa_node_count(void) {
+    ULONG highest;
+    if (!GetNumaHighestNodeNumber(&highest))
+        return 1;
+    return (int)highest + 1;
+}
+
+int vmaf_numa_current_node(void) {
+    PROCESSOR_NUMBER processor;
+    USHORT node;
+    GetCurrentProcessorNumberEx(&processor);
+    if (!GetNumaProcessorNodeEx(&processor, &node) || node == 0xffff)
+        return 0;
+    return node;
+}
+
+int vmaf_numa_bind(int node, VmafNumaAffinity *saved) {
+    if (saved)
+        saved->saved = 0;
+    GROUP_AFFINITY affinity;
+    if (vmaf_numa_node_count() <= 1 || node < 0 || !GetNumaNodeProcessorMaskEx((USHORT)node, &affinity)
+        || affinity.Mask == 0)
+        return -1;
+    memset(affinity.Reserved, 0, sizeof affinity.Reserved);
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, saved ? (GROUP_AFFINITY *)saved->mask : NULL))
+        return -1;
+    if (saved)
+        saved->saved = 1;
+    return 0;
+}
+
+void vmaf_numa_restore(const VmafNumaAffinity *saved) {
+    if (saved->saved)
+        SetThreadGroupAffinity(GetCurrentThread(), (const GROUP_AFFINITY *)saved->mask, NULL);
+}
+
+#else
+
+int vmaf_numa_node_count(void) {
+    return 1;
+}
+
+int vmaf_numa_current_node(void) {
+    return 0;
+}
+
+int vmaf_numa_bind(int node, VmafNumaAffinity *saved) {
+    (void)node;
+    if (saved)
+        saved->saved = 0;
+    return -1;
+}
+
+void vmaf_numa_restore(const VmafNumaAffinity *saved) {
+    (void)saved;
+}
+#endif
@@ -0,0 +1,50 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#ifndef __VMAF_NUMA_H__
+#define __VMAF_NUMA_H__
+
+#include <stdint.h>
+
+/*
+ * NUMA placement of threads, for Linux and Windows. Elsewhere, or on machines with a single node
+ * with CPUs this process may use, there is one node and binding does nothing.
+ */
+
+/* The affinity of a thread before vmaf_numa_bind. */
+typedef struct VmafNumaAffinity {
+    int saved;
+    uint64_t mask[16];
+} VmafNumaAffinity;
+
+/* Number of NUMA nodes, at least 1. */
+int vmaf_numa_node_count(void);
+
+/* Node of the CPU the calling thread is running on. */
+int vmaf_numa_current_node(void);
+
+/*
+ * Restricts the calling thread to the CPUs of node, storing its previous affinity in saved if it is not NULL.
+ * Returns 0 on success.
+ */
+int vmaf_numa_bind(int node, VmafNumaAffinity *saved);
+
+/* Restores the affinity saved by vmaf_numa_bind, if it succeeded. */
+void vmaf_numa_restore(const VmafNumaAffinity *saved);
+
+#endif /* __VMAF_NUMA_H__ */
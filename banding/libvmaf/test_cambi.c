@@ -189,13 +189,42 @@ static char *test_decimate_generic()
     VmafPicture pic_8b;
     get_sample_image_8b(&pic_8b);
 
-    decimate_generic_8b_and_convert_to_10b(&pic_8b, &out_pic);
+    decimate_generic_8b_and_convert_to_10b(&pic_8b, &out_pic, false);
 
     mu_assert("decimate generic 8b to 10b wrong pixel value (0,0)", data[0]==8);
     mu_assert("decimate generic 8b to 10b wrong pixel value (0,1)", data[1]==400);
     mu_assert("decimate generic 8b to 10b wrong pixel value (1,0)", data[stride]==8);
     mu_assert("decimate generic 8b to 10b wrong pixel value (1,1)", data[1+stride]==400);
 
+    VmafPicture pic_12b;
+    err = vmaf_picture_alloc(&pic_12b, VMAF_PIX_FMT_YUV400P, 12, 4, 4);
+    uint16_t *data_12b = pic_12b.data[0];
+    ptrdiff_t stride_12b = pic_12b.stride[0] >> 1;
+    for (unsigned i = 0; i < 4; i++)
+        for (unsigned j = 0; j < 4; j++)
+            data_12b[i * stride_12b + j] = 4 * (i * 4 + j) + (j & 1) * 2;
+    data_12b[3 * stride_12b + 3] = 4095;
+
+    decimate_generic_hbd_and_convert_to_10b(&pic_12b, &out_pic);
+
+    mu_assert("decimate generic 12b to 10b wrong pixel value (0,0)", data[0]==6);
+    mu_assert("decimate generic 12b to 10b wrong pixel value (0,1)", data[1]==8);
+    mu_assert("decimate generic 12b to 10b wrong pixel value (1,0)", data[stride]==14);
+    mu_assert("decimate generic 12b to 10b wrong pixel value (1,1)", data[1+stride]==1023);
+
+    float data_float[16] = {0, 0, 0, 0, 0, 0, 0, 0.5, 0, 0, 0, 0, 0, 1.0, 0, 2.0};
+    VmafPicture pic_float = pic_12b;
+    pic_float.bpc = 32;
+    pic_float.data[0] = data_float;
+    pic_float.stride[0] = 4 * sizeof(float);
+
+    decimate_generic_float_and_convert_to_10b(&pic_float, &out_pic);
+
+    mu_assert("decimate generic float to 10b wrong pixel value (0,0)", data[0]==64);
+    mu_assert("decimate generic float to 10b wrong pixel value (0,1)", data[1]==502);
+    mu_assert("decimate generic float to 10b wrong pixel value (1,0)", data[stride]==940);
+    mu_assert("decimate generic float to 10b wrong pixel value (1,1)", data[1+stride]==1023);
+
     return NULL;
 }
 
@@ -203,6 +232,7 @@ static char *test_filter_mode()
 {
     VmafPicture filtered_image, image;
     unsigned w = 5, h = 5;
+    uint16_t buffer[3 * 5];
 
     int err = vmaf_picture_alloc(&filtered_image, VMAF_PIX_FMT_YUV400P, 10, w, h);
     err |= vmaf_picture_alloc(&image, VMAF_PIX_FMT_YUV400P, 10, w, h);
@@ -216,12 +246,12 @@ static char *test_filter_mode()
     data[2 * stride + 2] = 1; data[3 * stride + 2] = 1;
     data[2 * stride + 3] = 1; data[3 * stride + 3] = 1;
     memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&filtered_image, w, h, buffer);
     mu_assert("filter_mode: all zeros", data_pic_sum(&filtered_image)==0);
 
     data[3 * stride + 4] = 1;
     memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&filtered_image, w, h, buffer);
     mu_assert("filter_mode: two ones sum check", data_pic_sum(&filtered_image)==2);
     mu_assert("filter_mode: two ones (3,3) check", filtered_data[3 * output_stride + 3]==1);
     mu_assert("filter_mode: two ones (2,3) check", filtered_data[2 * output_stride + 3]==1);
@@ -229,20 +259,73 @@ static char *test_filter_mode()
     data[0 * stride + 0] = 2;
     data[0 * stride + 1] = 1;
     memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&filtered_image, w, h, buffer);
     mu_assert("filter_mode: two in the corner check", filtered_data[0 * output_stride + 0]==2);
     data[1 * stride + 0] = 1;
     memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&filtered_image, w, h, buffer);
     mu_assert("filter_mode: two in the corner and adjacent ones check", filtered_data[0 * output_stride + 0]==1);
     data[2 * stride + 0] = 2;
     memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&filtered_image, w, h, buffer);
     mu_assert("filter_mode: two in corner and edge check", filtered_data[1 * output_stride + 0]==2);
 
     return NULL;
 }
 
+static char *test_filter_mode_fused()
+{
+    unsigned w = 37, h = 23, sw = 19, sh = 12;
+    uint16_t buffer[3 * 37];
+    uint32_t mask_dp[(37 + 2 * 3 + 1) * (2 * 3 + 2)];
+    VmafPicture image, mask, ref_image, ref_mask;
+
+    int err = vmaf_picture_alloc(&image, VMAF_PIX_FMT_YUV400P, 10, w, h);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 10, w, h);
+    err |= vmaf_picture_alloc(&ref_image, VMAF_PIX_FMT_YUV400P, 10, w, h);
+    err |= vmaf_picture_alloc(&ref_mask, VMAF_PIX_FMT_YUV400P, 10, w, h);
+    mu_assert("problem during vmaf_picture_alloc", !err);
+
+    uint16_t *data = image.data[0];
+    ptrdiff_t stride = image.stride[0] >> 1;
+    for (unsigned i = 0; i < h; i++)
+        for (unsigned j = 0; j < w; j++)
+            data[i * stride + j] = ((i * 7 + j * 3) / 29 + (j < 10 ? (j * 13 + i) % 3 / 2 : 0)) % 4;
+    memcpy(ref_image.data[0], image.data[0], image.stride[0] * h);
+
+    // Scale 0: spatial mask streamed along with the mode filter
+    get_spatial_mask_for_index(&ref_image, &ref_mask, mask_dp, 30, MASK_FILTER_SIZE, w, h);
+    filter_mode(&ref_image, w, h, buffer);
+
+    // with the SIMD kernels of the CPU, if any
+    CambiState s;
+    init_range_callbacks(&s);
+    SpatialMaskStream mask_stream;
+    spatial_mask_begin(&mask_stream, &image, &mask, mask_dp, 30, MASK_FILTER_SIZE, w, h,
+                       s.mask_dp_callback, s.mask_threshold_callback);
+    filter_mode_fused(&image, &mask, w, h, buffer, &mask_stream, false, s.mode_row_callback,
+                      s.decimate_row_callback);
+
+    mu_assert("filter_mode_fused: wrong image for scale 0", pic_data_equality(&image, &ref_image));
+    mu_assert("filter_mode_fused: wrong mask for scale 0", pic_data_equality(&mask, &ref_mask));
+    mu_assert("filter_mode_fused: trivial mask for scale 0",
+              data_pic_sum(&ref_mask) > 0 && data_pic_sum(&ref_mask) < (int)(w * h));
+
+    // Scale 1: image and mask decimated along with the mode filter
+    decimate(&ref_image, sw, sh);
+    decimate(&ref_mask, sw, sh);
+    filter_mode(&ref_image, sw, sh, buffer);
+
+    filter_mode_fused(&image, &mask, sw, sh, buffer, NULL, true, s.mode_row_callback, s.decimate_row_callback);
+
+    image.w[0] = mask.w[0] = sw;
+    image.h[0] = mask.h[0] = sh;
+    mu_assert("filter_mode_fused: wrong image for scale 1", pic_data_equality(&image, &ref_image));
+    mu_assert("filter_mode_fused: wrong mask for scale 1", pic_data_equality(&mask, &ref_mask));
+
+    return NULL;
+}
+
 static char *test_get_mask_index()
 {
     uint16_t index = get_mask_index(1980, 1080, 7);
@@ -300,7 +383,8 @@ static char *test_calculate_c_values()
     get_sample_image(&input, 0);
     get_sample_image(&mask, 8);
     calculate_c_values(&input, &mask, combined_c_values, histograms,
-                       window_size, tvi_for_diff, width, height);
+                       window_size, tvi_for_diff, width, height,
+                       increment_range, decrement_range);
 
     for (unsigned i=0; i<16; i++) {
         mu_assert("calculate_c_values error ws=3",
@@ -314,7 +398,8 @@ static char *test_calculate_c_values()
     window_size = 9;
     uint16_t histograms_8x8[8*1032];
     calculate_c_values(&input_8x8, &mask_8x8, combined_c_values_8x8, histograms_8x8,
-                       window_size, tvi_for_diff, 8, 8);
+                       window_size, tvi_for_diff, 8, 8,
+                       increment_range, decrement_range);
 
     double sum = 0;
     for (unsigned i=0; i<64; i++)
@@ -324,6 +409,97 @@ static char *test_calculate_c_values()
     return NULL;
 }
 
+static char *test_get_num_bins()
+{
+    uint16_t tvi_for_diff[4] = {178, 305, 432, 559};
+    mu_assert("get_num_bins error", get_num_bins(tvi_for_diff)==564);
+
+    uint16_t tvi_for_diff_max[4] = {1027, 1027, 1027, 1027};
+    mu_assert("get_num_bins exceeds the full 10b histogram", get_num_bins(tvi_for_diff_max)==1032);
+
+    return NULL;
+}
+
+static char *test_calculate_c_values_threaded()
+{
+    VmafPicture input_8x8, mask_8x8;
+    float c_values[64], c_values_threaded[64];
+    uint16_t tvi_for_diff[4] = {178, 305, 432, 559};
+    uint16_t histograms[4 * 8 * 1032];
+
+    get_sample_image_8x8(&input_8x8, 0);
+    get_sample_image_8x8(&mask_8x8, 1);
+    for (uint16_t window_size = 1; window_size <= 9; window_size += 2) {
+        calculate_c_values(&input_8x8, &mask_8x8, c_values, histograms,
+                           window_size, tvi_for_diff, 8, 8,
+                           increment_range, decrement_range);
+        for (unsigned threads = 1; threads <= 4; threads++) {
+            // column tiles of 2, 3 and 4 columns (no narrower than the window), or the whole width
+            for (int tile_width = 0; tile_width <= 4; tile_width += tile_width ? 1 : 2) {
+                calculate_c_values_threaded(&input_8x8, &mask_8x8, c_values_threaded, histograms,
+                                            window_size, tvi_for_diff, 8, 8, threads, tile_width, -1,
+                                            increment_range, decrement_range);
+                mu_assert("calculate_c_values_threaded differs from calculate_c_values",
+                          !memcmp(c_values, c_values_threaded, sizeof c_values));
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static char *test_range_callbacks()
+{
+    CambiState s;
+    uint16_t ref[80], arr[80];
+    init_range_callbacks(&s);
+
+    for (int left = 0; left < 40; left += 3) {
+        for (int right = left; right <= 80; right += 7) {
+            for (int i = 0; i < 80; i++)
+                ref[i] = arr[i] = i + 1;
+            increment_range(ref, left, right);
+            s.inc_range_callback(arr, left, right);
+            mu_assert("inc_range_callback differs from increment_range", !memcmp(ref, arr, sizeof ref));
+            decrement_range(ref, left / 2, right);
+            s.dec_range_callback(arr, left / 2, right);
+            mu_assert("dec_range_callback differs from decrement_range", !memcmp(ref, arr, sizeof ref));
+        }
+    }
+
+    return NULL;
+}
+
+static char *test_row_callbacks()
+{
+    CambiState s;
+    uint16_t rows[3][80], ref[160], dst[160];
+    init_range_callbacks(&s);
+
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 80; j++)
+            rows[i][j] = (j * 7 + i * 5) / 11 % 3 + (j % 13 == i ? 1020 : 0);
+
+    for (int width = CAMBI_MODE_ROW_MIN_WIDTH; width <= 80; width++) {
+        memset(ref, 0, sizeof ref);
+        memset(dst, 0, sizeof dst);
+        mode_row(ref, rows[0], rows[1], rows[2], width);
+        s.mode_row_callback(dst, rows[0], rows[1], rows[2], width);
+        mu_assert("mode_row_callback differs from mode_row", !memcmp(ref, dst, sizeof ref));
+    }
+
+    for (int width = 1; width <= 80; width++) {
+        for (int j = 0; j < 160; j++)
+            ref[j] = dst[j] = j * 3 + 1;
+        // in place, as filter_mode_fused does
+        decimate_row(ref, ref, width);
+        s.decimate_row_callback(dst, dst, width);
+        mu_assert("decimate_row_callback differs from decimate_row", !memcmp(ref, dst, sizeof ref));
+    }
+
+    return NULL;
+}
+
 static char *test_c_value_pixel()
 {
     uint16_t histogram[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
@@ -351,22 +527,49 @@ static char *test_c_value_pixel()
 static char *test_spatial_pooling()
 {
     float arr[12] = {0, 1, 2, 3, 4, 5, 10, 7, 8, 9, 6, 11};
+    static uint32_t histogram[RADIX_BINS];
 
-    double average = spatial_pooling(arr, 0, 4, 3);
+    double average = spatial_pooling(arr, 0, 4, 3, histogram);
     mu_assert("spatial_pooling for topk=0", average==11);
 
-    average = spatial_pooling(arr, 0.1, 4, 3);
+    average = spatial_pooling(arr, 0.1, 4, 3, histogram);
     mu_assert("spatial_pooling for topk=0.1", average==11);
 
-    average = spatial_pooling(arr, 0.2, 4, 3);
+    average = spatial_pooling(arr, 0.2, 4, 3, histogram);
     mu_assert("spatial_pooling for topk=0.2", average==10.5);
 
-    average = spatial_pooling(arr, 1.0, 4, 3);
+    average = spatial_pooling(arr, 1.0, 4, 3, histogram);
     mu_assert("spatial_pooling for topk=1.0", average==5.5);
 
     return NULL;
 }
 
+static char *test_average_topk_elements_radix()
+{
+    enum { n = 5000 };
+    static float arr[n], sorted[n];
+    static uint32_t histogram[RADIX_BINS];
+    unsigned seed = 1;
+
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1103515245 + 12345;
+            // few distinct values, lots of duplicates and zeros, as in c-values
+            arr[i] = round == 0 ? (seed >> 16) % 7 : (round == 1 ? 0 : (float)((seed >> 8) % 100000) / (round * 7));
+        }
+        memcpy(sorted, arr, sizeof arr);
+        for (int topk = 1; topk <= n; topk = topk * 3 + 1) {
+            quick_select(sorted, n, topk);
+            double expected = average_topk_elements(sorted, topk);
+            double average = average_topk_elements_radix(arr, n, topk, histogram);
+            mu_assert("average_topk_elements_radix differs from quick_select",
+                      fabs(average - expected) <= 1e-9 * fabs(expected));
+        }
+    }
+
+    return NULL;
+}
+
 static char *test_quick_select()
 {
     float arr[12] = {0, 1, 2, 3, 4, 5, 10, 7, 8, 9, 6, 11};
@@ -574,12 +777,18 @@ char *run_tests()
 
     mu_run_test(test_get_mask_index);
     mu_run_test(test_get_spatial_mask_for_index);
+    mu_run_test(test_filter_mode_fused);
 
     mu_run_test(test_calculate_c_values);
+    mu_run_test(test_get_num_bins);
+    mu_run_test(test_calculate_c_values_threaded);
+    mu_run_test(test_range_callbacks);
+    mu_run_test(test_row_callbacks);
     mu_run_test(test_c_value_pixel);
 
     mu_run_test(test_spatial_pooling);
     mu_run_test(test_quick_select);
+    mu_run_test(test_average_topk_elements_radix);
     mu_run_test(test_average_topk_elements);
 
     mu_run_test(test_get_pixels_in_window);
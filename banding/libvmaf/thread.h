@@ -0,0 +1,82 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#ifndef __VMAF_THREAD_H__
+#define __VMAF_THREAD_H__
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef void (*VmafThreadFunc)(void *arg);
+
+typedef struct VmafThread {
+    VmafThreadFunc func;
+    void *arg;
+    int started;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} VmafThread;
+
+#ifdef _WIN32
+static unsigned __stdcall vmaf_thread_entry(void *p) {
+    VmafThread *t = p;
+    t->func(t->arg);
+    return 0;
+}
+#else
+static void *vmaf_thread_entry(void *p) {
+    VmafThread *t = p;
+    t->func(t->arg);
+    return NULL;
+}
+#endif
+
+/* Runs func(arg) on a new thread, or synchronously if no thread could be created. */
+static inline void vmaf_thread_start(VmafThread *t, VmafThreadFunc func, void *arg) {
+    t->func = func;
+    t->arg = arg;
+#ifdef _WIN32
+    t->handle = (HANDLE)_beginthreadex(NULL, 0, vmaf_thread_entry, t, 0, NULL);
+    t->started = t->handle != 0;
+#else
+    t->started = pthread_create(&t->handle, NULL, vmaf_thread_entry, t) == 0;
+#endif
+    if (!t->started)
+        func(arg);
+}
+
+static inline void vmaf_thread_join(VmafThread *t) {
+    if (!t->started)
+        return;
+#ifdef _WIN32
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle, NULL);
+#endif
+    t->started = 0;
+}
+
+#endif /* __VMAF_THREAD_H__ */
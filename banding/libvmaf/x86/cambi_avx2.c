@@ -0,0 +1,165 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#include "cambi_avx2.h"
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+TARGET_AVX2 void cambi_increment_range_avx2(uint16_t *arr, int left, int right) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    int col = left;
+    for (; col + 15 < right; col += 16) {
+        __m256i data = _mm256_loadu_si256((__m256i *)&arr[col]);
+        _mm256_storeu_si256((__m256i *)&arr[col], _mm256_add_epi16(data, ones));
+    }
+    if (col + 7 < right) {
+        __m128i data = _mm_loadu_si128((__m128i *)&arr[col]);
+        _mm_storeu_si128((__m128i *)&arr[col], _mm_add_epi16(data, _mm256_castsi256_si128(ones)));
+        col += 8;
+    }
+    for (; col < right; col++)
+        arr[col]++;
+}
+
+TARGET_AVX2 void cambi_decrement_range_avx2(uint16_t *arr, int left, int right) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    int col = left;
+    for (; col + 15 < right; col += 16) {
+        __m256i data = _mm256_loadu_si256((__m256i *)&arr[col]);
+        _mm256_storeu_si256((__m256i *)&arr[col], _mm256_sub_epi16(data, ones));
+    }
+    if (col + 7 < right) {
+        __m128i data = _mm_loadu_si128((__m128i *)&arr[col]);
+        _mm_storeu_si128((__m128i *)&arr[col], _mm_sub_epi16(data, _mm256_castsi256_si128(ones)));
+        col += 8;
+    }
+    for (; col < right; col++)
+        arr[col]--;
+}
+
+// Prefix sums of the 8 lanes.
+static TARGET_AVX2 inline __m256i prefix_sum_epi32(__m256i x) {
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    // Add the last sum of the lower lane to the upper one
+    __m256i low = _mm256_permute2x128_si256(x, x, 0x08);
+    return _mm256_add_epi32(x, _mm256_shuffle_epi32(low, 0xff));
+}
+
+TARGET_AVX2 void cambi_mask_dp_row_avx2(uint32_t *dp, const uint32_t *dp_prev, const uint16_t *row,
+                                        const uint16_t *next_row, int width) {
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m256i last = _mm256_set1_epi32(7);
+    __m256i sum = _mm256_setzero_si256();
+    int j = 0;
+    // Stops before the last column, whose right neighbour is outside of the row.
+    for (; j + 8 < width; j += 8) {
+        __m128i curr = _mm_loadu_si128((const __m128i *)&row[j]);
+        __m128i zero = _mm_cmpeq_epi16(curr, _mm_loadu_si128((const __m128i *)&row[j + 1]));
+        if (next_row)
+            zero = _mm_and_si128(zero, _mm_cmpeq_epi16(curr, _mm_loadu_si128((const __m128i *)&next_row[j])));
+        __m256i value = _mm256_cvtepu16_epi32(_mm_and_si128(zero, ones));
+        sum = _mm256_add_epi32(prefix_sum_epi32(value), _mm256_permutevar8x32_epi32(sum, last));
+        __m256i prev = _mm256_loadu_si256((const __m256i *)&dp_prev[j]);
+        _mm256_storeu_si256((__m256i *)&dp[j], _mm256_add_epi32(prev, sum));
+    }
+    uint32_t s = j > 0 ? dp[j - 1] - dp_prev[j - 1] : 0;
+    for (; j < width; j++) {
+        s += (!next_row || row[j] == next_row[j]) && (j == width - 1 || row[j] == row[j + 1]);
+        dp[j] = dp_prev[j] + s;
+    }
+}
+
+TARGET_AVX2 void cambi_mask_threshold_row_avx2(uint16_t *mask, const uint32_t *dp_top, const uint32_t *dp_bottom,
+                                               int width, int window, uint16_t mask_index) {
+    const __m256i index = _mm256_set1_epi32(mask_index);
+    const __m128i ones = _mm_set1_epi16(1);
+    int j = 0;
+    for (; j + 7 < width; j += 8) {
+        __m256i result = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)&dp_bottom[j + window]),
+                                          _mm256_loadu_si256((const __m256i *)&dp_bottom[j]));
+        result = _mm256_sub_epi32(result, _mm256_loadu_si256((const __m256i *)&dp_top[j + window]));
+        result = _mm256_add_epi32(result, _mm256_loadu_si256((const __m256i *)&dp_top[j]));
+        __m256i gt = _mm256_cmpgt_epi32(result, index);
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(gt), _mm256_extracti128_si256(gt, 1));
+        _mm_storeu_si128((__m128i *)&mask[j], _mm_and_si128(packed, ones));
+    }
+    for (; j < width; j++) {
+        int result = dp_bottom[j + window] - dp_bottom[j] - dp_top[j + window] + dp_top[j];
+        mask[j] = (result > mask_index);
+    }
+}
+
+/*
+* Mode of the 9 pixels of each lane: each pixel is counted against the 8 others, and the pixel with the highest
+* count wins, ties going to the lowest value, by taking the maximum of (count << 10) | (1023 - value).
+* The 10-bit values keep the keys positive in 16-bit lanes.
+*/
+static TARGET_AVX2 inline __m256i mode9_epu16(const __m256i *v) {
+    const __m256i max_value = _mm256_set1_epi16(1023);
+    __m256i count[9];
+    for (int a = 0; a < 9; a++)
+        count[a] = _mm256_setzero_si256();
+    for (int a = 0; a < 9; a++) {
+        for (int b = a + 1; b < 9; b++) {
+            __m256i eq = _mm256_cmpeq_epi16(v[a], v[b]);
+            count[a] = _mm256_sub_epi16(count[a], eq);
+            count[b] = _mm256_sub_epi16(count[b], eq);
+        }
+    }
+    __m256i key = _mm256_setzero_si256();
+    for (int a = 0; a < 9; a++)
+        key = _mm256_max_epi16(key, _mm256_or_si256(_mm256_slli_epi16(count[a], 10), _mm256_sub_epi16(max_value, v[a])));
+    return _mm256_sub_epi16(max_value, _mm256_and_si256(key, max_value));
+}
+
+TARGET_AVX2 void cambi_mode_row_avx2(uint16_t *dst, const uint16_t *above, const uint16_t *row,
+                                     const uint16_t *below, int width) {
+    const uint16_t *rows[3] = { above, row, below };
+    // The last block overlaps with the previous one rather than leaving a scalar tail.
+    for (int j = 1; j < width - 1; j += 16) {
+        j = j + 16 > width - 1 ? width - 17 : j;
+        __m256i v[9];
+        for (int r = 0; r < 3; r++)
+            for (int c = 0; c < 3; c++)
+                v[3 * r + c] = _mm256_loadu_si256((const __m256i *)&rows[r][j + c - 1]);
+        _mm256_storeu_si256((__m256i *)&dst[j], mode9_epu16(v));
+    }
+}
+
+TARGET_AVX2 void cambi_decimate_row_avx2(uint16_t *dst, const uint16_t *src, int width) {
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    int j = 0;
+    // Each block reads src[2j..2j+31] before writing dst[j..j+15], so it also works in place. Stops
+    // early enough not to read past src[2 * width - 2].
+    for (; j + 16 < width; j += 16) {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&src[2 * j]), low);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&src[2 * j + 16]), low);
+        // packus interleaves the 128-bit lanes of a and b
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)&dst[j], packed);
+    }
+    for (; j < width; j++)
+        dst[j] = src[j << 1];
+}
+
+#endif
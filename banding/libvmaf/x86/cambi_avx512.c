@@ -0,0 +1,102 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#include "cambi_avx512.h"
+
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+// The tail is handled with a masked load/store, so no scalar loop is needed.
+TARGET_AVX512 void cambi_increment_range_avx512(uint16_t *arr, int left, int right) {
+    const __m512i ones = _mm512_set1_epi16(1);
+    int col = left;
+    for (; col + 31 < right; col += 32) {
+        __m512i data = _mm512_loadu_si512((__m512i *)&arr[col]);
+        _mm512_storeu_si512((__m512i *)&arr[col], _mm512_add_epi16(data, ones));
+    }
+    if (col < right) {
+        __mmask32 mask = (__mmask32)((1ull << (right - col)) - 1);
+        __m512i data = _mm512_maskz_loadu_epi16(mask, &arr[col]);
+        _mm512_mask_storeu_epi16(&arr[col], mask, _mm512_add_epi16(data, ones));
+    }
+}
+
+TARGET_AVX512 void cambi_decrement_range_avx512(uint16_t *arr, int left, int right) {
+    const __m512i ones = _mm512_set1_epi16(1);
+    int col = left;
+    for (; col + 31 < right; col += 32) {
+        __m512i data = _mm512_loadu_si512((__m512i *)&arr[col]);
+        _mm512_storeu_si512((__m512i *)&arr[col], _mm512_sub_epi16(data, ones));
+    }
+    if (col < right) {
+        __mmask32 mask = (__mmask32)((1ull << (right - col)) - 1);
+        __m512i data = _mm512_maskz_loadu_epi16(mask, &arr[col]);
+        _mm512_mask_storeu_epi16(&arr[col], mask, _mm512_sub_epi16(data, ones));
+    }
+}
+
+// The mode of cambi_mode_row_avx2, with the equal pairs counted through opmasks.
+static TARGET_AVX512 inline __m512i mode9_epu16(const __m512i *v) {
+    const __m512i max_value = _mm512_set1_epi16(1023);
+    const __m512i ones = _mm512_set1_epi16(1);
+    __m512i count[9];
+    for (int a = 0; a < 9; a++)
+        count[a] = _mm512_setzero_si512();
+    for (int a = 0; a < 9; a++) {
+        for (int b = a + 1; b < 9; b++) {
+            __mmask32 eq = _mm512_cmpeq_epi16_mask(v[a], v[b]);
+            count[a] = _mm512_mask_add_epi16(count[a], eq, count[a], ones);
+            count[b] = _mm512_mask_add_epi16(count[b], eq, count[b], ones);
+        }
+    }
+    __m512i key = _mm512_setzero_si512();
+    for (int a = 0; a < 9; a++)
+        key = _mm512_max_epi16(key, _mm512_or_si512(_mm512_slli_epi16(count[a], 10), _mm512_sub_epi16(max_value, v[a])));
+    return _mm512_sub_epi16(max_value, _mm512_and_si512(key, max_value));
+}
+
+// The last block is masked, so any width >= 3 works.
+TARGET_AVX512 void cambi_mode_row_avx512(uint16_t *dst, const uint16_t *above, const uint16_t *row,
+                                         const uint16_t *below, int width) {
+    const uint16_t *rows[3] = { above, row, below };
+    for (int j = 1; j < width - 1; j += 32) {
+        int n = width - 1 - j;
+        __mmask32 mask = n >= 32 ? (__mmask32)-1 : (__mmask32)((1u << n) - 1);
+        __m512i v[9];
+        for (int r = 0; r < 3; r++)
+            for (int c = 0; c < 3; c++)
+                v[3 * r + c] = _mm512_maskz_loadu_epi16(mask, &rows[r][j + c - 1]);
+        _mm512_mask_storeu_epi16(&dst[j], mask, mode9_epu16(v));
+    }
+}
+
+TARGET_AVX512 void cambi_decimate_row_avx512(uint16_t *dst, const uint16_t *src, int width) {
+    int j = 0;
+    // Each block reads src[2j..2j+31] before writing dst[j..j+15], so it also works in place.
+    for (; j + 16 < width; j += 16)
+        _mm256_storeu_si256((__m256i *)&dst[j], _mm512_cvtepi32_epi16(_mm512_loadu_si512((const __m512i *)&src[2 * j])));
+    // The 1 to 16 last pixels, without reading past src[2 * width - 2].
+    int n = width - j;
+    __m512i tail = _mm512_maskz_loadu_epi16((__mmask32)((1ull << (2 * n - 1)) - 1), &src[2 * j]);
+    _mm512_mask_cvtepi32_storeu_epi16(&dst[j], (__mmask16)((1u << n) - 1), tail);
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*
+* Copyright (c) 2012-2019 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// Compile time and throughput of the jitasm ExprCompiler128/256/512 and of the interpreter,
+// over the corpus shared with the lexpr benchmark (expr2/bench_corpus.h). No core is
+// needed, the code is called the way exprGetFrame does.
+//
+// usage: bench_expr [name...]
+
+#include "exprfilter.cpp"
+#include "../expr2/bench_corpus.h"
+
+namespace {
+
+struct Bench {
+    const BenchExpr &e;
+    const BenchFormat &f;
+    BenchPlane dst, x, y;
+    const VSVideoInfo *vi[2] = { &x.vi, &y.vi };
+
+    Bench(const BenchExpr &e, const BenchFormat &f) : e(e), f(f), dst(f), x(f), y(f) {
+        x.fill(1);
+        y.fill(2);
+    }
+
+    // Compiles the bytecode, and returns the constants: N and Y followed by the properties,
+    // which are all 0.5.
+    std::vector<float> parse(ExprData &d) {
+        auto tree = parseExpr(e.expr, vi, 2);
+        d.bytecode[0] = compile(tree, dst.vi.format);
+        d.pa[0] = tree.getPropAccess();
+        std::vector<float> consts(CONST_FIRST_PROP, 0.0f);
+        consts.resize(CONST_FIRST_PROP + d.pa[0].size(), 0.5f);
+        return consts;
+    }
+
+#ifdef VS_TARGET_CPU_X86
+    void compiled(int cpulevel, const char *backend) {
+        ExprData d;
+        std::vector<float> consts;
+        double start = benchNow();
+        try {
+            consts = parse(d);
+            std::unique_ptr<ExprCompiler> compiler = make_compiler(2, cpulevel);
+            compiler->addInstructions(d.bytecode[0]);
+            std::tie(d.proc[0], d.procSize[0]) = compiler->getCode();
+        } catch (std::runtime_error &) {
+            benchUnsupported(e, f, backend);
+            return;
+        }
+        double compile = benchNow() - start;
+
+        intptr_t ptroffsets[MAX_EXPR_INPUTS + 1 + 1] = { dst.format.bytesPerSample * 8, x.format.bytesPerSample * 8, y.format.bytesPerSample * 8, 8 * sizeof(float) };
+        const int niterations = (benchWidth + 7) / 8;
+        double rate = benchRate([&] {
+            for (int row = 0; row < benchHeight; row++) {
+                consts[CONST_Y] = row;
+                alignas(32) uint8_t *rwptrs[((MAX_EXPR_INPUTS + 1 + 1) + 7) & ~7] = {
+                    dst.data() + (size_t)dst.stride * row, x.data() + (size_t)x.stride * row, y.data() + (size_t)y.stride * row
+                };
+                d.proc[0](rwptrs, ptroffsets, consts.data(), niterations);
+            }
+        });
+        benchReport(e, f, backend, compile, rate);
+    }
+#endif
+
+    void interpreted() {
+        ExprData d;
+        std::vector<float> consts;
+        double start = benchNow();
+        try {
+            consts = parse(d);
+        } catch (std::runtime_error &) {
+            benchUnsupported(e, f, "interp");
+            return;
+        }
+        double compile = benchNow() - start;
+
+        ExprInterpreter interpreter(d.bytecode[0].data(), d.bytecode[0].size());
+        double rate = benchRate([&] {
+            const uint8_t *srcp[MAX_EXPR_INPUTS] = { x.data(), y.data() };
+            uint8_t *dstp = dst.data();
+            for (int row = 0; row < benchHeight; row++) {
+                consts[CONST_Y] = row;
+                for (int col = 0; col < benchWidth; col += ExprInterpreter::blockSize)
+                    interpreter.eval(srcp, dstp, consts.data(), col, std::min(benchWidth - col, ExprInterpreter::blockSize));
+                srcp[0] += x.stride;
+                srcp[1] += y.stride;
+                dstp += dst.stride;
+            }
+        });
+        benchReport(e, f, "interp", compile, rate);
+    }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+    benchHeader();
+    for (const BenchExpr &e : benchCorpus) {
+        if (!benchSelected(argc, argv, e.name))
+            continue;
+        for (const BenchFormat &f : benchFormats) {
+            Bench b(e, f);
+#ifdef VS_TARGET_CPU_X86
+            if (getCPUFeatures()->avx512_f)
+                b.compiled(VS_CPU_LEVEL_AVX512, "jitasm512");
+            if (getCPUFeatures()->avx2)
+                b.compiled(VS_CPU_LEVEL_AVX2, "jitasm256");
+            b.compiled(VS_CPU_LEVEL_SSE2, "jitasm128");
+#endif
+            b.interpreted();
+        }
+    }
+    return 0;
+}
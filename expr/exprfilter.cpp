@@ -2152,18 +2152,810 @@ public:
 
 constexpr ExprUnion ExprCompiler256::constData alignas(32)[55][8];
 
+class ExprCompiler512 : public ExprCompiler, private jitasm::function<void, ExprCompiler512, uint8_t *, const intptr_t *, const float *, intptr_t> {
+    typedef jitasm::function<void, ExprCompiler512, uint8_t *, const intptr_t *, const float *, intptr_t> jit;
+    friend struct jitasm::function<void, ExprCompiler512, uint8_t *, const intptr_t *, const float *, intptr_t>;
+    friend struct jitasm::function_cdecl<void, ExprCompiler512, uint8_t *, const intptr_t *, const float *, intptr_t>;
+
+#define SPLAT(x) { (x), (x), (x), (x), (x), (x), (x), (x), (x), (x), (x), (x), (x), (x), (x), (x) }
+    static constexpr ExprUnion constData alignas(64)[55][16] = {
+        SPLAT(0x7FFFFFFF), // absmask
+        SPLAT(0x80000000), // negmask
+        SPLAT(0x7F), // x7F
+        SPLAT(0x00800000), // min_norm_pos
+        SPLAT(~0x7F800000), // inv_mant_mask
+        SPLAT(1.0f), // float_one
+        SPLAT(0.5f), // float_half
+        SPLAT(255.0f), // float_255
+        SPLAT(511.0f), // float_511
+        SPLAT(1023.0f), // float_1023
+        SPLAT(2047.0f), // float_2047
+        SPLAT(4095.0f), // float_4095
+        SPLAT(8191.0f), // float_8191
+        SPLAT(16383.0f), // float_16383
+        SPLAT(32767.0f), // float_32767
+        SPLAT(65535.0f), // float_65535
+        SPLAT(static_cast<int32_t>(0x80008000)), // i16min_epi16
+        SPLAT(static_cast<int32_t>(0xFFFF8000)), // i16min_epi32
+        SPLAT(88.3762626647949f), // exp_hi
+        SPLAT(-88.3762626647949f), // exp_lo
+        SPLAT(1.44269504088896341f), // log2e
+        SPLAT(0.693359375f), // exp_c1
+        SPLAT(-2.12194440e-4f), // exp_c2
+        SPLAT(1.9875691500E-4f), // exp_p0
+        SPLAT(1.3981999507E-3f), // exp_p1
+        SPLAT(8.3334519073E-3f), // exp_p2
+        SPLAT(4.1665795894E-2f), // exp_p3
+        SPLAT(1.6666665459E-1f), // exp_p4
+        SPLAT(5.0000001201E-1f), // exp_p5
+        SPLAT(0.707106781186547524f), // sqrt_1_2
+        SPLAT(7.0376836292E-2f), // log_p0
+        SPLAT(-1.1514610310E-1f), // log_p1
+        SPLAT(1.1676998740E-1f), // log_p2
+        SPLAT(-1.2420140846E-1f), // log_p3
+        SPLAT(+1.4249322787E-1f), // log_p4
+        SPLAT(-1.6668057665E-1f), // log_p5
+        SPLAT(+2.0000714765E-1f), // log_p6
+        SPLAT(-2.4999993993E-1f), // log_p7
+        SPLAT(+3.3333331174E-1f), // log_p8
+        { 0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f }, // float_0to15
+        SPLAT(16.0f), // float_16
+        SPLAT(0x3ea2f983), // float_invpi, 1/pi
+        SPLAT(0x4b400000), // float_rintf
+        SPLAT(0x40490000), // float_pi1
+        SPLAT(0x3a7da000), // float_pi2
+        SPLAT(0x34222000), // float_pi3
+        SPLAT(0x2cb4611a), // float_pi4
+        SPLAT(0xbe2aaaa6), // float_sinC3
+        SPLAT(0x3c08876a), // float_sinC5
+        SPLAT(0xb94fb7ff), // float_sinC7
+        SPLAT(0x362edef8), // float_sinC9
+        SPLAT(static_cast<int32_t>(0xBEFFFFE2)), // float_cosC2
+        SPLAT(0x3D2AA73C), // float_cosC4
+        SPLAT(static_cast<int32_t>(0XBAB58D50)), // float_cosC6
+        SPLAT(0x37C1AD76), // float_cosC8
+    };
+
+    struct ConstantIndex {
+        static constexpr int absmask = 0;
+        static constexpr int negmask = 1;
+        static constexpr int x7F = 2;
+        static constexpr int min_norm_pos = 3;
+        static constexpr int inv_mant_mask = 4;
+        static constexpr int float_one = 5;
+        static constexpr int float_half = 6;
+        static constexpr int float_255 = 7;
+        static constexpr int float_511 = 8;
+        static constexpr int float_1023 = 9;
+        static constexpr int float_2047 = 10;
+        static constexpr int float_4095 = 11;
+        static constexpr int float_8191 = 12;
+        static constexpr int float_16383 = 13;
+        static constexpr int float_32767 = 14;
+        static constexpr int float_65535 = 15;
+        static constexpr int i16min_epi16 = 16;
+        static constexpr int i16min_epi32 = 17;
+        static constexpr int exp_hi = 18;
+        static constexpr int exp_lo = 19;
+        static constexpr int log2e = 20;
+        static constexpr int exp_c1 = 21;
+        static constexpr int exp_c2 = 22;
+        static constexpr int exp_p0 = 23;
+        static constexpr int exp_p1 = 24;
+        static constexpr int exp_p2 = 25;
+        static constexpr int exp_p3 = 26;
+        static constexpr int exp_p4 = 27;
+        static constexpr int exp_p5 = 28;
+        static constexpr int sqrt_1_2 = 29;
+        static constexpr int log_p0 = 30;
+        static constexpr int log_p1 = 31;
+        static constexpr int log_p2 = 32;
+        static constexpr int log_p3 = 33;
+        static constexpr int log_p4 = 34;
+        static constexpr int log_p5 = 35;
+        static constexpr int log_p6 = 36;
+        static constexpr int log_p7 = 37;
+        static constexpr int log_p8 = 38;
+        static constexpr int log_q1 = exp_c2;
+        static constexpr int log_q2 = exp_c1;
+        static constexpr int float_0to15 = 39;
+        static constexpr int float_16 = 40;
+        static constexpr int float_invpi = 41;
+        static constexpr int float_rintf = 42;
+        static constexpr int float_pi1 = 43;
+        static constexpr int float_pi2 = float_pi1 + 1;
+        static constexpr int float_pi3 = float_pi1 + 2;
+        static constexpr int float_pi4 = float_pi1 + 3;
+        static constexpr int float_sinC3 = 47;
+        static constexpr int float_sinC5 = float_sinC3 + 1;
+        static constexpr int float_sinC7 = float_sinC3 + 2;
+        static constexpr int float_sinC9 = float_sinC3 + 3;
+        static constexpr int float_cosC2 = 51;
+        static constexpr int float_cosC4 = float_cosC2 + 1;
+        static constexpr int float_cosC6 = float_cosC2 + 2;
+        static constexpr int float_cosC8 = float_cosC2 + 3;
+    };
+#undef SPLAT
+
+    // JitASM compiles everything from main(), so record the operations for later.
+    std::vector<std::function<void(Reg, ZmmReg, Reg, ZmmReg, ZmmReg, Reg, std::unordered_map<int, ZmmReg> &)>> deferred, prolog;
+
+    // Opmask registers: k1 masks the loads and stores of the row, k2 and k3 hold compare results.
+    const KReg k1{jitasm::K1}, k2{jitasm::K2}, k3{jitasm::K3};
+
+    CPUFeatures cpuFeatures;
+    int numInputs;
+    int curLabel;
+    bool usedX;
+
+#define EMIT() [this, insn](Reg regptrs, ZmmReg zero, Reg constants, ZmmReg regXs, ZmmReg sixteen, Reg fconsts, std::unordered_map<int, ZmmReg> &bytecodeRegs)
+
+    void load8(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.dst];
+            Reg a;
+            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
+            vpmovzxbd(t1, xmmword_ptr[a], k1.z());
+            vcvtdq2ps(t1, t1);
+        });
+    }
+
+    void load16(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.dst];
+            Reg a;
+            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
+            vpmovzxwd(t1, ymmword_ptr[a], k1.z());
+            vcvtdq2ps(t1, t1);
+        });
+    }
+
+    void loadF16(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.dst];
+            Reg a;
+            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
+            vcvtph2ps(t1, ymmword_ptr[a], k1.z());
+        });
+    }
+
+    void loadF32(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.dst];
+            if (insn.op.imm.u == CLIP_X) {
+                vmovaps(t1, regXs);
+            } else {
+                Reg a;
+                mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
+                vmovups(t1, zmmword_ptr[a], k1.z());
+            }
+        });
+    }
+
+    void loadConst(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.dst];
+
+            if (insn.op.imm.f == 0.0f) {
+                vmovaps(t1, zero);
+                return;
+            }
+
+            Reg32 a;
+            mov(a, insn.op.imm.u);
+            vpbroadcastd(t1, a);
+        });
+    }
+
+    void loadMemConst(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.dst];
+
+            vbroadcastss(t1, dword_ptr[fconsts + sizeof(float) * insn.op.imm.u]);
+        });
+    }
+
+    void store8(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            ZmmReg r1;
+            Reg a;
+            vminps(r1, t1, zmmword_ptr[constants + ConstantIndex::float_255 * 64]);
+            vmaxps(r1, r1, zero);
+            vcvtps2dq(r1, r1);
+            mov(a, ptr[regptrs]);
+            vpmovusdb(xmmword_ptr[a], r1, k1);
+        });
+    }
+
+    void store16(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            int depth = insn.op.imm.u;
+            auto t1 = bytecodeRegs[insn.src1];
+            ZmmReg r1;
+            Reg a;
+            vminps(r1, t1, zmmword_ptr[constants + (ConstantIndex::float_255 + depth - 8) * 64]);
+            vmaxps(r1, r1, zero);
+            vcvtps2dq(r1, r1);
+            mov(a, ptr[regptrs]);
+            vpmovusdw(ymmword_ptr[a], r1, k1);
+        });
+    }
+
+    void storeF16(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            Reg a;
+            mov(a, ptr[regptrs]);
+            vcvtps2ph(ymmword_ptr[a], t1, 0, k1);
+        });
+    }
+
+    void storeF32(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            Reg a;
+            mov(a, ptr[regptrs]);
+            vmovups(zmmword_ptr[a], t1, k1);
+        });
+    }
+
+#define BINARYOP(op) \
+do { \
+  auto t1 = bytecodeRegs[insn.src1]; \
+  auto t2 = bytecodeRegs[insn.src2]; \
+  auto t3 = bytecodeRegs[insn.dst]; \
+  op(t3, t1, t2); \
+} while (0)
+    void add(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            BINARYOP(vaddps);
+        });
+    }
+
+    void sub(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            BINARYOP(vsubps);
+        });
+    }
+
+    void mul(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            BINARYOP(vmulps);
+        });
+    }
+
+    void div(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            BINARYOP(vdivps);
+        });
+    }
+
+    void mod(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto s1 = bytecodeRegs[insn.src1];
+            auto s2 = bytecodeRegs[insn.src2];
+            auto dst = bytecodeRegs[insn.dst];
+            ZmmReg t0, t1;
+            vmovaps(t1, s2);
+            vmovaps(dst, s1);
+            vdivps(t0, dst, t1);
+            vcvttps2dq(t0, t0);
+            vcvtdq2ps(t0, t0);
+            vfnmadd231ps(dst, t0, t1);
+        });
+    }
+
+    void fma(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            FMAType type = static_cast<FMAType>(insn.op.imm.u);
+
+            // t1 + t2 * t3
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.src2];
+            auto t3 = bytecodeRegs[insn.src3];
+            auto t4 = bytecodeRegs[insn.dst];
+
+#define FMA3(op) \
+do { \
+  if (insn.dst == insn.src1) { \
+    op##231ps(t1, t2, t3); \
+  } else if (insn.dst == insn.src2) { \
+    op##132ps(t2, t1, t3); \
+  } else if (insn.dst == insn.src3) { \
+    op##132ps(t3, t1, t2); \
+  } else { \
+    vmovaps(t4, t1); \
+    op##231ps(t4, t2, t3); \
+  } \
+} while (0)
+            switch (type) {
+            case FMAType::FMADD: FMA3(vfmadd); break;
+            case FMAType::FMSUB: FMA3(vfmsub); break;
+            case FMAType::FNMADD: FMA3(vfnmadd); break;
+            case FMAType::FNMSUB: FMA3(vfnmsub); break;
+            }
+#undef FMA3
+        });
+    }
+
+    void max(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            BINARYOP(vmaxps);
+        });
+    }
+
+    void min(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            BINARYOP(vminps);
+        });
+    }
+#undef BINARYOP
+
+    void truncround_(bool istrunc, const ExprInstruction &insn, std::unordered_map<int, ZmmReg> &bytecodeRegs)
+    {
+        auto src = bytecodeRegs[insn.src1];
+        auto dst = bytecodeRegs[insn.dst];
+        if (istrunc)
+            vcvttps2dq(dst, src);
+        else
+            vcvtps2dq(dst, src);
+        vcvtdq2ps(dst, dst);
+    }
+    void trunc(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            truncround_(true, insn, bytecodeRegs);
+        });
+    }
+    void round(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            truncround_(false, insn, bytecodeRegs);
+        });
+    }
+
+    void sqrt(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.dst];
+            vmaxps(t2, t1, zero);
+            vsqrtps(t2, t2);
+        });
+    }
+
+    void abs(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.dst];
+            vpandd(t2, t1, zmmword_ptr[constants + ConstantIndex::absmask * 64]);
+        });
+    }
+
+    void neg(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.dst];
+            vpxord(t2, t1, zmmword_ptr[constants + ConstantIndex::negmask * 64]);
+        });
+    }
+
+    void not_(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.dst];
+            vcmpps(k2, t1, zero, _CMP_LE_OS);
+            vmovaps(t2, zmmword_ptr[constants + ConstantIndex::float_one * 64], k2.z());
+        });
+    }
+
+#define LOGICOP(op) \
+do { \
+  auto t1 = bytecodeRegs[insn.src1]; \
+  auto t2 = bytecodeRegs[insn.src2]; \
+  auto t3 = bytecodeRegs[insn.dst]; \
+  ZmmReg tmp; \
+  vcmpps(k2, t1, zero, _CMP_NLE_US); \
+  vmovaps(tmp, zmmword_ptr[constants + ConstantIndex::float_one * 64], k2.z()); \
+  vcmpps(k2, t2, zero, _CMP_NLE_US); \
+  vmovaps(t3, zmmword_ptr[constants + ConstantIndex::float_one * 64], k2.z()); \
+  op(t3, t3, tmp); \
+} while (0)
+
+    void and_(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            LOGICOP(vpandd);
+        });
+    }
+
+    void or_(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            LOGICOP(vpord);
+        });
+    }
+
+    void xor_(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            LOGICOP(vpxord);
+        });
+    }
+#undef LOGICOP
+
+    void cmp(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.src2];
+            auto t3 = bytecodeRegs[insn.dst];
+            vcmpps(k2, t1, t2, insn.op.imm.u);
+            vmovaps(t3, zmmword_ptr[constants + ConstantIndex::float_one * 64], k2.z());
+        });
+    }
+
+    void ternary(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.src2];
+            auto t3 = bytecodeRegs[insn.src3];
+            auto t4 = bytecodeRegs[insn.dst];
+            vcmpps(k2, t1, zero, _CMP_NLE_US);
+            vblendmps(t4, t3, t2, k2);
+        });
+    }
+
+    void exp_(ZmmReg x, ZmmReg one, Reg constants, ZmmReg regXs, Reg fconsts)
+    {
+        ZmmReg fx, emm0, etmp, y, mask, z;
+        vminps(x, x, zmmword_ptr[constants + ConstantIndex::exp_hi * 64]);
+        vmaxps(x, x, zmmword_ptr[constants + ConstantIndex::exp_lo * 64]);
+        vmovaps(fx, zmmword_ptr[constants + ConstantIndex::log2e * 64]);
+        vfmadd213ps(fx, x, zmmword_ptr[constants + ConstantIndex::float_half * 64]);
+        vcvttps2dq(emm0, fx);
+        vcvtdq2ps(etmp, emm0);
+        vcmpps(k3, etmp, fx, _CMP_NLE_US);
+        vmovaps(mask, one, k3.z());
+        vsubps(fx, etmp, mask);
+        vfnmadd231ps(x, fx, zmmword_ptr[constants + ConstantIndex::exp_c1 * 64]);
+        vfnmadd231ps(x, fx, zmmword_ptr[constants + ConstantIndex::exp_c2 * 64]);
+        vmulps(z, x, x);
+        vmovaps(y, zmmword_ptr[constants + ConstantIndex::exp_p0 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::exp_p1 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::exp_p2 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::exp_p3 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::exp_p4 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::exp_p5 * 64]);
+        vfmadd213ps(y, z, x);
+        vaddps(y, y, one);
+        vcvttps2dq(emm0, fx);
+        vpaddd(emm0, emm0, zmmword_ptr[constants + ConstantIndex::x7F * 64]);
+        vpslld(emm0, emm0, 23);
+        vmulps(x, y, emm0);
+    }
+
+    void log_(ZmmReg x, ZmmReg zero, ZmmReg one, Reg constants, ZmmReg regXs, Reg fconsts)
+    {
+        ZmmReg emm0, mask, y, etmp, z;
+        vcmpps(k2, zero, x, _CMP_NLT_US);
+        vmaxps(x, x, zmmword_ptr[constants + ConstantIndex::min_norm_pos * 64]);
+        vpsrld(emm0, x, 23);
+        vpandd(x, x, zmmword_ptr[constants + ConstantIndex::inv_mant_mask * 64]);
+        vpord(x, x, zmmword_ptr[constants + ConstantIndex::float_half * 64]);
+        vpsubd(emm0, emm0, zmmword_ptr[constants + ConstantIndex::x7F * 64]);
+        vcvtdq2ps(emm0, emm0);
+        vaddps(emm0, emm0, one);
+        vcmpps(k3, x, zmmword_ptr[constants + ConstantIndex::sqrt_1_2 * 64], _CMP_LT_OS);
+        vmovaps(etmp, x, k3.z());
+        vsubps(x, x, one);
+        vmovaps(mask, one, k3.z());
+        vsubps(emm0, emm0, mask);
+        vaddps(x, x, etmp);
+        vmulps(z, x, x);
+        vmovaps(y, zmmword_ptr[constants + ConstantIndex::log_p0 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p1 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p2 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p3 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p4 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p5 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p6 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p7 * 64]);
+        vfmadd213ps(y, x, zmmword_ptr[constants + ConstantIndex::log_p8 * 64]);
+        vmulps(y, y, x);
+        vmulps(y, y, z);
+        vfmadd231ps(y, emm0, zmmword_ptr[constants + ConstantIndex::log_q1 * 64]);
+        vfnmadd231ps(y, z, zmmword_ptr[constants + ConstantIndex::float_half * 64]);
+        vaddps(x, x, y);
+        vfmadd231ps(x, emm0, zmmword_ptr[constants + ConstantIndex::log_q2 * 64]);
+        // NaN where x <= 0
+        vpternlogd(x, x, x, 0xFF, k2);
+    }
+
+    void exp(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.dst];
+            ZmmReg one;
+            vmovaps(one, zmmword_ptr[constants + ConstantIndex::float_one * 64]);
+            vmovaps(t1, t2);
+            exp_(t1, one, constants, regXs, fconsts);
+        });
+    }
+
+    void log(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.dst];
+            ZmmReg one;
+            vmovaps(one, zmmword_ptr[constants + ConstantIndex::float_one * 64]);
+            vmovaps(t1, t2);
+            log_(t1, zero, one, constants, regXs, fconsts);
+        });
+    }
+
+    void pow(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            auto t1 = bytecodeRegs[insn.src1];
+            auto t2 = bytecodeRegs[insn.src2];
+            auto t3 = bytecodeRegs[insn.dst];
+
+            ZmmReg r1, one;
+            vmovaps(one, zmmword_ptr[constants + ConstantIndex::float_one * 64]);
+            vmovaps(r1, t1);
+            log_(r1, zero, one, constants, regXs, fconsts);
+            vmulps(r1, r1, t2);
+            exp_(r1, one, constants, regXs, fconsts);
+            vmovaps(t3, r1);
+        });
+    }
+
+    void sincos_(bool issin, const ExprInstruction &insn, Reg constants, std::unordered_map<int, ZmmReg> &bytecodeRegs)
+    {
+        auto x = bytecodeRegs[insn.src1];
+        auto y = bytecodeRegs[insn.dst];
+        ZmmReg t1, sign, t2, t3, t4;
+        // Remove sign
+        vmovaps(t1, zmmword_ptr[constants + ConstantIndex::absmask * 64]);
+        if (issin) {
+            vmovaps(sign, t1);
+            vpandnd(sign, sign, x);
+        } else {
+            vpxord(sign, sign, sign);
+        }
+        vpandd(t1, t1, x);
+        // Range reduction
+        vmovaps(t3, zmmword_ptr[constants + ConstantIndex::float_rintf * 64]);
+        vmulps(t2, t1, zmmword_ptr[constants + ConstantIndex::float_invpi * 64]);
+        vaddps(t2, t2, t3);
+        vpslld(t4, t2, 31);
+        vpxord(sign, sign, t4);
+        vsubps(t2, t2, t3);
+        vfnmadd231ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_pi1 * 64]);
+        vfnmadd231ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_pi2 * 64]);
+        vfnmadd231ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_pi3 * 64]);
+        vfnmadd231ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_pi4 * 64]);
+        if (issin) {
+            // Evaluate minimax polynomial for sin(x) in [-pi/2, pi/2] interval
+            // Y <- X + X * X^2 * (C3 + X^2 * (C5 + X^2 * (C7 + X^2 * C9)))
+            vmulps(t2, t1, t1);
+            vmovaps(t3, zmmword_ptr[constants + ConstantIndex::float_sinC7 * 64]);
+            vfmadd231ps(t3, t2, zmmword_ptr[constants + ConstantIndex::float_sinC9 * 64]);
+            vfmadd213ps(t3, t2, zmmword_ptr[constants + ConstantIndex::float_sinC5 * 64]);
+            vfmadd213ps(t3, t2, zmmword_ptr[constants + ConstantIndex::float_sinC3 * 64]);
+            vmulps(t3, t3, t2);
+            vfmadd231ps(t1, t1, t3);
+        } else {
+            // Evaluate minimax polynomial for cos(x) in [-pi/2, pi/2] interval
+            // Y <- 1 + X^2 * (C2 + X^2 * (C4 + X^2 * (C6 + X^2 * C8)))
+            vmulps(t2, t1, t1);
+            vmovaps(t1, zmmword_ptr[constants + ConstantIndex::float_cosC6 * 64]);
+            vfmadd231ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_cosC8 * 64]);
+            vfmadd213ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_cosC4 * 64]);
+            vfmadd213ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_cosC2 * 64]);
+            vfmadd213ps(t1, t2, zmmword_ptr[constants + ConstantIndex::float_one * 64]);
+        }
+        // Apply sign
+        vpxord(y, t1, sign);
+    }
+
+    void sin(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            sincos_(true, insn, constants, bytecodeRegs);
+        });
+    }
+
+    void cos(const ExprInstruction &insn) override
+    {
+        deferred.push_back(EMIT()
+        {
+            sincos_(false, insn, constants, bytecodeRegs);
+        });
+    }
+
+    void main(Reg regptrs, Reg regoffs, Reg frame_consts, Reg niter)
+    {
+        std::unordered_map<int, ZmmReg> bytecodeRegs;
+        ZmmReg zero;
+        vpxord(zero, zero, zero);
+        Reg constants;
+        mov(constants, (uintptr_t)constData);
+        ZmmReg regXs, sixteen;
+
+        for (const auto &f : prolog) {
+            f(regptrs, zero, constants, regXs, sixteen, frame_consts, bytecodeRegs);
+        }
+
+        L("wloop");
+
+        // Each iteration computes two of the groups of 8 pixels of exprGetFrame, so when only
+        // one is left the loads and stores are masked by k1 to those of ExprCompiler256.
+        Reg32 wmask, halfmask;
+        mov(wmask, 0xFFFF);
+        mov(halfmask, 0xFF);
+        jit::cmp(niter, 1);
+        cmove(wmask, halfmask);
+        kmovw(k1, wmask);
+
+        for (const auto &f : deferred) {
+            f(regptrs, zero, constants, regXs, sixteen, frame_consts, bytecodeRegs);
+        }
+
+#if UINTPTR_MAX > UINT32_MAX
+        for (int i = 0; i < numInputs / 4 + 1; i++) {
+            YmmReg r1, r2;
+            vmovdqu(r1, ymmword_ptr[regptrs + 32 * i]);
+            vmovdqu(r2, ymmword_ptr[regoffs + 32 * i]);
+            vpaddq(r1, r1, r2);
+            vpaddq(r1, r1, r2);
+            vmovdqu(ymmword_ptr[regptrs + 32 * i], r1);
+        }
+#else
+        for (int i = 0; i < numInputs / 8 + 1; i++) {
+            YmmReg r1, r2;
+            vmovdqu(r1, ymmword_ptr[regptrs + 32 * i]);
+            vmovdqu(r2, ymmword_ptr[regoffs + 32 * i]);
+            vpaddd(r1, r1, r2);
+            vpaddd(r1, r1, r2);
+            vmovdqu(ymmword_ptr[regptrs + 32 * i], r1);
+        }
+#endif
+
+        jit::sub(niter, 2);
+        jg("wloop");
+    }
+
+    void prologue(const std::vector<ExprInstruction> &bytecode) override {
+        for (const auto &insn : bytecode) {
+            if (insn.op.type == ExprOpType::MEM_LOAD_F32 && insn.op.imm.u == CLIP_X) {
+                usedX = true;
+                break;
+            }
+        }
+        if (usedX) {
+            ExprInstruction insn(ExprOpType::MEM_LOAD_F32); // dummy
+            prolog.push_back(EMIT()
+            {
+                (void)insn;
+                vmovaps(regXs, zmmword_ptr[constants + ConstantIndex::float_0to15 * 64]);
+                vmovaps(sixteen, zmmword_ptr[constants + ConstantIndex::float_16 * 64]);
+            });
+        }
+    }
+    void epilogue(const std::vector<ExprInstruction> &bytecode) override {
+        if (usedX) {
+            ExprInstruction insn(ExprOpType::MEM_LOAD_F32); // dummy
+            deferred.push_back(EMIT()
+            {
+                (void)insn;
+                vaddps(regXs, regXs, sixteen);
+            });
+        }
+    }
+
+public:
+    explicit ExprCompiler512(int numInputs) : cpuFeatures(*getCPUFeatures()), numInputs(numInputs), usedX(false) {}
+
+    std::pair<ExprData::ProcessLineProc, size_t> getCode() override
+    {
+        size_t size;
+        if (jit::GetCode(true) && (size = GetCodeSize())) {
+#ifdef VS_TARGET_OS_WINDOWS
+            void *ptr = VirtualAlloc(nullptr, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+#else
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
+#endif
+            memcpy(ptr, jit::GetCode(true), size);
+            return {reinterpret_cast<ExprData::ProcessLineProc>(ptr), size};
+        }
+        return {nullptr, 0};
+    }
+#undef EMIT
+};
+
+constexpr ExprUnion ExprCompiler512::constData alignas(64)[55][16];
+
 std::unique_ptr<ExprCompiler> make_compiler(int numInputs, int cpulevel)
 {
-    if (getCPUFeatures()->avx2 && cpulevel >= VS_CPU_LEVEL_AVX2)
+    if (getCPUFeatures()->avx512_f && cpulevel >= VS_CPU_LEVEL_AVX512)
+        return std::unique_ptr<ExprCompiler>(new ExprCompiler512(numInputs));
+    else if (getCPUFeatures()->avx2 && cpulevel >= VS_CPU_LEVEL_AVX2)
         return std::unique_ptr<ExprCompiler>(new ExprCompiler256(numInputs));
     else
         return std::unique_ptr<ExprCompiler>(new ExprCompiler128(numInputs));
 }
 #endif
 
+// Runs the bytecode on blocks of up to blockSize pixels of a row, each instruction over the
+// whole block before the next one, so that the dispatch is amortized over the block and
+// the compiler can vectorize the loops. This is the fallback where there is no JIT.
 class ExprInterpreter {
+public:
+    static constexpr int blockSize = 64;
+private:
     const ExprInstruction *bytecode;
     size_t numInsns;
+    // blockSize values per register.
     std::vector<float> registers;
 
     template <class T>
@@ -2175,6 +2967,8 @@ class ExprInterpreter {
 
     static float bool2float(bool x) { return x ? 1.0f : 0.0f; }
     static bool float2bool(float x) { return x > 0.0f; }
+
+    float *reg(int r) { return r < 0 ? nullptr : &registers[static_cast<size_t>(r) * blockSize]; }
 public:
     ExprInterpreter(const ExprInstruction *bytecode, size_t numInsns) : bytecode(bytecode), numInsns(numInsns)
     {
@@ -2182,76 +2976,83 @@ public:
         for (size_t i = 0; i < numInsns; ++i) {
             maxreg = std::max(maxreg, bytecode[i].dst);
         }
-        registers.resize(maxreg + 1);
+        registers.resize(static_cast<size_t>(maxreg + 1) * blockSize);
     }
 
-    void eval(const uint8_t * const *srcp, uint8_t *dstp, const float *consts, int x)
+    // Computes the n <= blockSize pixels of the row from x.
+    void eval(const uint8_t * const *srcp, uint8_t *dstp, const float *consts, int x, int n)
     {
-        for (size_t i = 0; i < numInsns; ++i) {
-            const ExprInstruction &insn = bytecode[i];
-
-#define SRC1 registers[insn.src1]
-#define SRC2 registers[insn.src2]
-#define SRC3 registers[insn.src3]
-#define DST registers[insn.dst]
+        for (size_t k = 0; k < numInsns; ++k) {
+            const ExprInstruction &insn = bytecode[k];
+            float *d = reg(insn.dst);
+            const float *s1 = reg(insn.src1), *s2 = reg(insn.src2), *s3 = reg(insn.src3);
+
+#define SRC1 s1[i]
+#define SRC2 s2[i]
+#define SRC3 s3[i]
+#define DST d[i]
+#define EACH(stmt) for (int i = 0; i < n; i++) { stmt; }
             switch (insn.op.type) {
-            case ExprOpType::MEM_LOAD_U8: DST = reinterpret_cast<const uint8_t *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::MEM_LOAD_U16: DST = reinterpret_cast<const uint16_t *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::MEM_LOAD_F16: DST = 0; break;
+            case ExprOpType::MEM_LOAD_U8: { const uint8_t *p = reinterpret_cast<const uint8_t *>(srcp[insn.op.imm.u]) + x; EACH(DST = p[i]); break; }
+            case ExprOpType::MEM_LOAD_U16: { const uint16_t *p = reinterpret_cast<const uint16_t *>(srcp[insn.op.imm.u]) + x; EACH(DST = p[i]); break; }
+            case ExprOpType::MEM_LOAD_F16: EACH(DST = 0); break;
             case ExprOpType::MEM_LOAD_F32:
-                if (insn.op.imm.u == CLIP_X)
-                    DST = x;
-                else
-                    DST = reinterpret_cast<const float *>(srcp[insn.op.imm.u])[x];
+                if (insn.op.imm.u == CLIP_X) {
+                    EACH(DST = static_cast<float>(x + i));
+                } else {
+                    const float *p = reinterpret_cast<const float *>(srcp[insn.op.imm.u]) + x;
+                    EACH(DST = p[i]);
+                }
                 break;
-            case ExprOpType::CONSTANT: DST = insn.op.imm.f; break;
-            case ExprOpType::MEM_LOAD_CONST: DST = consts[insn.op.imm.u]; break;
-            case ExprOpType::ADD: DST = SRC1 + SRC2; break;
-            case ExprOpType::SUB: DST = SRC1 - SRC2; break;
-            case ExprOpType::MUL: DST = SRC1 * SRC2; break;
-            case ExprOpType::DIV: DST = SRC1 / SRC2; break;
-            case ExprOpType::MOD: DST = std::fmod(SRC1, SRC2); break;
+            case ExprOpType::CONSTANT: EACH(DST = insn.op.imm.f); break;
+            case ExprOpType::MEM_LOAD_CONST: { const float c = consts[insn.op.imm.u]; EACH(DST = c); break; }
+            case ExprOpType::ADD: EACH(DST = SRC1 + SRC2); break;
+            case ExprOpType::SUB: EACH(DST = SRC1 - SRC2); break;
+            case ExprOpType::MUL: EACH(DST = SRC1 * SRC2); break;
+            case ExprOpType::DIV: EACH(DST = SRC1 / SRC2); break;
+            case ExprOpType::MOD: EACH(DST = std::fmod(SRC1, SRC2)); break;
             case ExprOpType::FMA:
                 switch (static_cast<FMAType>(insn.op.imm.u)) {
-                case FMAType::FMADD: DST = SRC2 * SRC3 + SRC1; break;
-                case FMAType::FMSUB: DST = SRC2 * SRC3 - SRC1; break;
-                case FMAType::FNMADD: DST = -(SRC2 * SRC3) + SRC1; break;
-                case FMAType::FNMSUB: DST = -(SRC2 * SRC3) - SRC1; break;
+                case FMAType::FMADD: EACH(DST = SRC2 * SRC3 + SRC1); break;
+                case FMAType::FMSUB: EACH(DST = SRC2 * SRC3 - SRC1); break;
+                case FMAType::FNMADD: EACH(DST = -(SRC2 * SRC3) + SRC1); break;
+                case FMAType::FNMSUB: EACH(DST = -(SRC2 * SRC3) - SRC1); break;
                 };
                 break;
-            case ExprOpType::MAX: DST = std::max(SRC1, SRC2); break;
-            case ExprOpType::MIN: DST = std::min(SRC1, SRC2); break;
-            case ExprOpType::EXP: DST = std::exp(SRC1); break;
-            case ExprOpType::LOG: DST = std::log(SRC1); break;
-            case ExprOpType::POW: DST = std::pow(SRC1, SRC2); break;
-            case ExprOpType::SQRT: DST = std::sqrt(SRC1); break;
-            case ExprOpType::SIN: DST = std::sin(SRC1); break;
-            case ExprOpType::COS: DST = std::cos(SRC1); break;
-            case ExprOpType::ABS: DST = std::fabs(SRC1); break;
-            case ExprOpType::NEG: DST = -SRC1; break;
+            case ExprOpType::MAX: EACH(DST = std::max(SRC1, SRC2)); break;
+            case ExprOpType::MIN: EACH(DST = std::min(SRC1, SRC2)); break;
+            case ExprOpType::EXP: EACH(DST = std::exp(SRC1)); break;
+            case ExprOpType::LOG: EACH(DST = std::log(SRC1)); break;
+            case ExprOpType::POW: EACH(DST = std::pow(SRC1, SRC2)); break;
+            case ExprOpType::SQRT: EACH(DST = std::sqrt(SRC1)); break;
+            case ExprOpType::SIN: EACH(DST = std::sin(SRC1)); break;
+            case ExprOpType::COS: EACH(DST = std::cos(SRC1)); break;
+            case ExprOpType::ABS: EACH(DST = std::fabs(SRC1)); break;
+            case ExprOpType::NEG: EACH(DST = -SRC1); break;
             case ExprOpType::CMP:
                 switch (static_cast<ComparisonType>(insn.op.imm.u)) {
-                case ComparisonType::EQ: DST = bool2float(SRC1 == SRC2); break;
-                case ComparisonType::LT: DST = bool2float(SRC1 < SRC2); break;
-                case ComparisonType::LE: DST = bool2float(SRC1 <= SRC2); break;
-                case ComparisonType::NEQ: DST = bool2float(SRC1 != SRC2); break;
-                case ComparisonType::NLT: DST = bool2float(SRC1 >= SRC2); break;
-                case ComparisonType::NLE: DST = bool2float(SRC1 > SRC2); break;
+                case ComparisonType::EQ: EACH(DST = bool2float(SRC1 == SRC2)); break;
+                case ComparisonType::LT: EACH(DST = bool2float(SRC1 < SRC2)); break;
+                case ComparisonType::LE: EACH(DST = bool2float(SRC1 <= SRC2)); break;
+                case ComparisonType::NEQ: EACH(DST = bool2float(SRC1 != SRC2)); break;
+                case ComparisonType::NLT: EACH(DST = bool2float(SRC1 >= SRC2)); break;
+                case ComparisonType::NLE: EACH(DST = bool2float(SRC1 > SRC2)); break;
                 }
                 break;
-            case ExprOpType::TRUNC: DST = std::trunc(SRC1); break;
-            case ExprOpType::ROUND: DST = std::round(SRC1); break;
-            case ExprOpType::TERNARY: DST = float2bool(SRC1) ? SRC2 : SRC3; break;
-            case ExprOpType::AND: DST = bool2float((float2bool(SRC1) && float2bool(SRC2))); break;
-            case ExprOpType::OR:  DST = bool2float((float2bool(SRC1) || float2bool(SRC2))); break;
-            case ExprOpType::XOR: DST = bool2float((float2bool(SRC1) != float2bool(SRC2))); break;
-            case ExprOpType::NOT: DST = bool2float(!float2bool(SRC1)); break;
-            case ExprOpType::MEM_STORE_U8:  reinterpret_cast<uint8_t *>(dstp)[x] = clamp_int<uint8_t>(SRC1); return;
-            case ExprOpType::MEM_STORE_U16: reinterpret_cast<uint16_t *>(dstp)[x] = clamp_int<uint16_t>(SRC1, insn.op.imm.u); return;
-            case ExprOpType::MEM_STORE_F16: reinterpret_cast<uint16_t *>(dstp)[x] = 0; return;
-            case ExprOpType::MEM_STORE_F32: reinterpret_cast<float *>(dstp)[x] = SRC1; return;
+            case ExprOpType::TRUNC: EACH(DST = std::trunc(SRC1)); break;
+            case ExprOpType::ROUND: EACH(DST = std::round(SRC1)); break;
+            case ExprOpType::TERNARY: EACH(DST = float2bool(SRC1) ? SRC2 : SRC3); break;
+            case ExprOpType::AND: EACH(DST = bool2float((float2bool(SRC1) && float2bool(SRC2)))); break;
+            case ExprOpType::OR:  EACH(DST = bool2float((float2bool(SRC1) || float2bool(SRC2)))); break;
+            case ExprOpType::XOR: EACH(DST = bool2float((float2bool(SRC1) != float2bool(SRC2)))); break;
+            case ExprOpType::NOT: EACH(DST = bool2float(!float2bool(SRC1))); break;
+            case ExprOpType::MEM_STORE_U8:  EACH(reinterpret_cast<uint8_t *>(dstp)[x + i] = clamp_int<uint8_t>(SRC1)); return;
+            case ExprOpType::MEM_STORE_U16: EACH(reinterpret_cast<uint16_t *>(dstp)[x + i] = clamp_int<uint16_t>(SRC1, insn.op.imm.u)); return;
+            case ExprOpType::MEM_STORE_F16: EACH(reinterpret_cast<uint16_t *>(dstp)[x + i] = 0); return;
+            case ExprOpType::MEM_STORE_F32: EACH(reinterpret_cast<float *>(dstp)[x + i] = SRC1); return;
             default: vsFatal("illegal opcode"); return;
             }
+#undef EACH
 #undef DST
 #undef SRC3
 #undef SRC2
@@ -3811,8 +4612,8 @@ static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **
 
                 for (int y = 0; y < h; y++) {
                     frame_consts[CONST_Y] = y;
-                    for (int x = 0; x < w; x++) {
-                        interpreter.eval(srcp, dstp, &frame_consts[0], x);
+                    for (int x = 0; x < w; x += ExprInterpreter::blockSize) {
+                        interpreter.eval(srcp, dstp, &frame_consts[0], x, std::min(w - x, ExprInterpreter::blockSize));
                     }
 
                     for (int i = 0; i < numInputs; i++) {
@@ -0,0 +1,161 @@
+/*
+* Copyright (c) 2021-     Akarin
+*
+* lexpr is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 3 of the License, or (at your option) any later version.
+*
+* lexpr is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with lexpr; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// Expressions and formats timed by the benchmarks of both Expr backends (expr2/bench_expr.cpp
+// and expr/bench_expr.cpp), which print the same lines so that their results can be compared.
+
+#ifndef BENCH_CORPUS_H
+#define BENCH_CORPUS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "VapourSynth.h"
+
+struct BenchExpr {
+    const char *name;
+    const char *expr; // of clips x and y
+};
+
+static const BenchExpr benchCorpus[] = {
+    { "copy", "x" },
+    { "arith", "x y + 2 / 3 *" },
+    { "poly", "x x * 0.001 * y 0.5 * + x y * 0.0001 * -" },
+    { "cond", "x y - abs 10 > x y ?" },
+    { "sincos", "x 0.01 * sin y 0.01 * cos * 64 * 128 +" },
+    { "pow", "x 0.004 * 2.2 pow 200 *" },
+    { "props", "x x.PlaneStatsAverage * y.PlaneStatsMax -" },
+    { "coords", "X Y + 2 / x +" },
+    { "relative", "x[-1,0] x[1,0] + x[0,-1] + x[0,1] + 4 /" },
+    { "median3x3", "x[-1,-1] x[0,-1] x[1,-1] x[-1,0] x x[1,0] x[-1,1] x[0,1] x[1,1] sort9 drop4 swap4 drop4" },
+    // The log of x <= 0 is NaN, which exp saturates, and which max, min and clamp replace
+    // with their other (constant, so second) operand. Nothing cancels or folds it.
+    { "expnan", "0 x - log 2 * exp" },
+    { "minmaxnan", "0 x - log 1 max 0 y - log 0 min + 0 x - log 0 255 clamp +" },
+};
+
+struct BenchFormat {
+    const char *name;
+    int sampleType;
+    int bitsPerSample;
+};
+
+static const BenchFormat benchFormats[] = {
+    { "u8", stInteger, 8 },
+    { "u16", stInteger, 16 },
+    { "f32", stFloat, 32 },
+};
+
+static const int benchWidth = 1920;
+static const int benchHeight = 1080;
+static const int benchFrames = 1000; // of the clips, which the routines may be specialized for
+static const double benchSeconds = 0.25; // spent running each routine
+
+// A gray frame of the format, allocated by hand as there is no core.
+struct BenchPlane {
+    VSFormat format;
+    VSVideoInfo vi;
+    int stride;
+    std::vector<uint8_t> buf;
+
+    explicit BenchPlane(const BenchFormat &f) : format(), vi() {
+        std::snprintf(format.name, sizeof(format.name), "Gray%s", f.name);
+        format.colorFamily = cmGray;
+        format.sampleType = f.sampleType;
+        format.bitsPerSample = f.bitsPerSample;
+        format.bytesPerSample = (f.bitsPerSample + 7) / 8;
+        format.numPlanes = 1;
+        vi.format = &format;
+        vi.width = benchWidth;
+        vi.height = benchHeight;
+        vi.numFrames = benchFrames;
+        vi.fpsNum = 24;
+        vi.fpsDen = 1;
+        stride = (benchWidth * format.bytesPerSample + 63) & ~63;
+        buf.resize((size_t)stride * benchHeight + 64);
+    }
+
+    uint8_t *data() {
+        return buf.data() + (-reinterpret_cast<uintptr_t>(buf.data()) & 63);
+    }
+
+    // Deterministic noise over the whole range of integer formats, or in [0, 256) for float.
+    void fill(unsigned seed) {
+        uint8_t *p = data();
+        for (int y = 0; y < benchHeight; y++) {
+            for (int x = 0; x < benchWidth; x++) {
+                seed = seed * 1103515245 + 12345;
+                unsigned r = seed >> 8;
+                if (format.sampleType == stFloat)
+                    reinterpret_cast<float *>(p)[x] = (r & 0xffff) / 256.0f;
+                else if (format.bytesPerSample == 1)
+                    p[x] = static_cast<uint8_t>(r);
+                else
+                    reinterpret_cast<uint16_t *>(p)[x] = static_cast<uint16_t>(r & ((1 << format.bitsPerSample) - 1));
+            }
+            p += stride;
+        }
+    }
+};
+
+static double benchNow() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Megapixels per second of run, which processes one frame, over at least benchSeconds.
+template<typename F>
+static double benchRate(F run) {
+    run(); // warm up
+    int frames = 0;
+    double start = benchNow(), elapsed;
+    do {
+        run();
+        frames++;
+        elapsed = benchNow() - start;
+    } while (elapsed < benchSeconds);
+    return (double)benchWidth * benchHeight * frames / elapsed / 1e6;
+}
+
+// Only the expressions named on the command line are run, all of them if there are none.
+static bool benchSelected(int argc, char **argv, const char *name) {
+    if (argc < 2)
+        return true;
+    for (int i = 1; i < argc; i++)
+        if (!std::strcmp(argv[i], name))
+            return true;
+    return false;
+}
+
+static void benchHeader() {
+    std::printf("%-10s %-4s %-10s %12s %10s\n", "expr", "fmt", "backend", "compile(ms)", "Mpix/s");
+}
+
+static void benchReport(const BenchExpr &e, const BenchFormat &f, const char *backend, double compileSeconds, double rate, const char *note = "") {
+    std::printf("%-10s %-4s %-10s %12.3f %10.1f %s\n", e.name, f.name, backend, compileSeconds * 1e3, rate, note);
+    std::fflush(stdout);
+}
+
+static void benchUnsupported(const BenchExpr &e, const BenchFormat &f, const char *backend) {
+    std::printf("%-10s %-4s %-10s %12s %10s\n", e.name, f.name, backend, "-", "unsupported");
+    std::fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+* Copyright (c) 2021-     Akarin
+*
+* lexpr is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 3 of the License, or (at your option) any later version.
+*
+* lexpr is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with lexpr; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// Compile time and throughput of the lexpr Compiler for every lane count the host can
+// run, and of its interpreter, over the corpus of bench_corpus.h. No core is needed, the
+// routines are called the way exprGetFrame does on a single thread. The output of the
+// interpreter is also checked against that of lexpr4, as lazy=True mixes the two.
+//
+// usage: bench_expr [name...]
+
+#include "exprfilter.cpp"
+#include "bench_corpus.h"
+
+namespace {
+
+struct Bench {
+    const BenchExpr &e;
+    const BenchFormat &f;
+    BenchPlane dst, x, y;
+    const VSVideoInfo *vi[2] = { &x.vi, &y.vi };
+    void *rwptrs[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS];
+    int strides[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS];
+    // The output of lexpr4, see agrees().
+    std::vector<uint8_t> reference;
+
+    Bench(const BenchExpr &e, const BenchFormat &f) : e(e), f(f), dst(f), x(f), y(f), rwptrs(), strides() {
+        x.fill(1);
+        y.fill(2);
+        BenchPlane *planes[] = { &dst, &x, &y };
+        for (int i = 0; i < 3; i++) {
+            rwptrs[i] = planes[i]->data();
+            strides[i] = planes[i]->stride;
+        }
+    }
+
+    // N followed by the properties, which are all 0.5.
+    std::vector<ExprUnion> props(const std::vector<Compiled::PropAccess> &propAccess) const {
+        std::vector<ExprUnion> consts(propAccess.size() + 1, ExprUnion(0.5f));
+        consts[0] = static_cast<int32_t>(0);
+        return consts;
+    }
+
+    template<int lanes>
+    void compiled(const char *backend) {
+        Compiled c;
+        double start = benchNow();
+        try {
+            c = Compiler<lanes>({ e.expr }, &dst.vi, vi, 2).compile();
+        } catch (std::runtime_error &) {
+            benchUnsupported(e, f, backend);
+            return;
+        }
+        double compile = benchNow() - start;
+
+        auto proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(c.code()));
+        const Compiled::Lut *lut = c.lut.get();
+        std::vector<ExprUnion> consts = props(c.propAccess);
+        float *p = reinterpret_cast<float *>(consts.data());
+        double rate = benchRate([&] {
+            if (lut)
+                lut->lookup(*lut, reinterpret_cast<uint8_t *const *>(rwptrs), strides, benchWidth, 0, benchHeight);
+            else
+                proc(rwptrs, strides, p, benchWidth, benchHeight, 0, benchHeight, nullptr);
+        });
+        benchReport(e, f, backend, compile, rate, lut ? "(table)" : "");
+        if (lanes == 4)
+            reference.assign(dst.data(), dst.data() + (size_t)dst.stride * benchHeight);
+    }
+
+    // Whether the output matches the reference, up to the last bits of the float results
+    // (and so 1 for integer formats), with NaN matching NaN.
+    bool agrees() {
+        const uint8_t *out = dst.data();
+        for (int y = 0; y < benchHeight; y++) {
+            for (int x = 0; x < benchWidth; x++) {
+                const size_t offset = (size_t)y * dst.stride + (size_t)x * dst.format.bytesPerSample;
+                double a, b;
+                if (dst.format.sampleType == stFloat) {
+                    float fa, fb;
+                    std::memcpy(&fa, &reference[offset], sizeof fa);
+                    std::memcpy(&fb, out + offset, sizeof fb);
+                    a = fa, b = fb;
+                } else if (dst.format.bytesPerSample == 1) {
+                    a = reference[offset], b = out[offset];
+                } else {
+                    uint16_t ia, ib;
+                    std::memcpy(&ia, &reference[offset], sizeof ia);
+                    std::memcpy(&ib, out + offset, sizeof ib);
+                    a = ia, b = ib;
+                }
+                const bool same = dst.format.sampleType == stFloat ?
+                    (std::isnan(a) && std::isnan(b)) || std::abs(a - b) <= 1e-4 * std::max(1.0, std::abs(a)) :
+                    std::abs(a - b) <= 1;
+                if (!same) {
+                    std::printf("# %s %s: interp gives %g instead of %g at (%d, %d)\n", e.name, f.name, b, a, x, y);
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Returns false if the output does not agree with that of lexpr4.
+    bool interpreted() {
+        std::unique_ptr<Compiler<4>> compiler;
+        std::unique_ptr<ExprInterpreter> interpreter;
+        double start = benchNow();
+        try {
+            compiler.reset(new Compiler<4>({ e.expr }, &dst.vi, vi, 2));
+            interpreter.reset(new ExprInterpreter(compiler->getGraph(), &dst.vi, vi, 2));
+        } catch (std::runtime_error &) {
+            benchUnsupported(e, f, "interp");
+            return true;
+        }
+        double compile = benchNow() - start;
+
+        std::vector<ExprUnion> consts = props(interpreter->propAccess);
+        float *p = reinterpret_cast<float *>(consts.data());
+        double rate = benchRate([&] {
+            interpreter->process(rwptrs, strides, p, benchWidth, benchHeight, 0, benchHeight, nullptr);
+        });
+        benchReport(e, f, "interp", compile, rate);
+        return reference.empty() || agrees();
+    }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const int host = hostLanes();
+    // The CPU the code is generated for, to tell apart the results of different hosts
+    // (e.g. x86 and AArch64).
+    std::printf("# target %s, %d lanes\n", rr::getTargetCPU().c_str(), host);
+    benchHeader();
+    int disagree = 0;
+    for (const BenchExpr &e : benchCorpus) {
+        if (!benchSelected(argc, argv, e.name))
+            continue;
+        for (const BenchFormat &f : benchFormats) {
+            Bench b(e, f);
+            if (host >= 16)
+                b.compiled<16>("lexpr16");
+            if (host >= 8)
+                b.compiled<8>("lexpr8");
+            b.compiled<4>("lexpr4");
+            disagree += !b.interpreted();
+        }
+    }
+    return disagree ? 1 : 0;
+}
@@ -18,17 +18,26 @@
 */
 
 #define USE_EXPR_CACHE
+// Default limit of the memory held by cached routines, see AKARIN_EXPR_CACHE_SIZE.
+#define EXPR_CACHE_LIMIT (64 << 20)
 
 #include <algorithm>
 #include <cmath>
 #include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
 #include <limits>
+#include <list>
 #include <map>
 #include <memory>
-#include <regex>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <tuple>
 #include <unordered_map>
@@ -39,21 +48,46 @@
 #include "version.h"
 
 #include "Module.hpp"
+#include "CPUID.hpp"
 #include "Debug.hpp"
+#include "ExecutableMemory.hpp"
+#include "threadpool.hpp"
+#include "lexpr.h"
 
 namespace {
 
 #define MAX_EXPR_INPUTS 26
-#define LANES 8
-#define UNROLL 1
+#define MAX_EXPR_OUTPUTS 8
+#define EXPR_OUTPUTS_PROP "_AkarinExprOutputs" /* frames of the outputs but the first */
+#define MAX_UNROLL 8
+#define DEFAULT_JIT_LEVEL 2 /* the pipeline of initExpr(), see jitConfig() */
+#define MAX_JIT_LEVEL 3
+#define MAX_PRECISION 2 /* see ExprPrecision */
+#define MAX_EXPR_THREADS 256
+#define MAX_STACK_CONSTS 32
+#define EXPR_TILE_BYTES (128 << 10) /* working set of a column tile, see tileWidth() */
+#define EXPR_MIN_TILE 256 /* pixels */
+#define MAX_FUSED_TOKENS 1024 /* per plane, see fuseInputs() */
+#define MAX_LUT_BITS 12 /* of the input of table lookups, see lutInputs() */
 
 #define ALIGNMENT 32 /* VapourSynth should guarantee at least this for all data */
 
+// The accuracy of the approximations of exp, log, pow, sin and cos (the precision argument):
+// Fast has relative errors up to about 1e-4, Default about that of single precision, and
+// Accurate also computes pow without the rounding error of log(x) growing with y.
+enum class ExprPrecision { Fast, Default, Accurate };
+
 enum class ExprOpType {
     // Terminals.
     MEM_LOAD, CONSTANTI, CONSTANTF, CONST_LOAD,
     VAR_LOAD, VAR_STORE,
 
+    // Accumulates the values of all pixels into a frame property.
+    REDUCE,
+
+    // Loads the pixel of a clip at the coordinates of its operands.
+    MEM_GATHER,
+
     // Arithmetic primitives.
     ADD, SUB, MUL, DIV, MOD, SQRT, ABS, MAX, MIN, CLAMP, CMP,
 
@@ -69,8 +103,8 @@ enum class ExprOpType {
     // Ternary operator
     TERNARY,
 
-    // Rank-order operator
-    SORT,
+    // Rank-order operators
+    SORT, SELECT,
 
     // Stack helpers.
     DUP, SWAP, DROP,
@@ -83,11 +117,34 @@ std::vector<std::string> features = {
     "N", "X", "Y", "pi", "width", "height",
     "trunc", "round", "floor",
     "var@", "var!",
-    "x[x,y]", "x[x,y]:m",
+    "x[x,y]", "x[x,y]:m", "x[x,y,t]",
+    "x[]", "x[]:m",
     "drop",
-    "sort",
+    "sort", "median", "select",
+    "sum!prop", "min!prop", "max!prop", "avg!prop",
+};
+
+enum class ReductionType {
+    SUM, MIN, MAX, AVG,
 };
 
+static float reductionIdentity(ReductionType type) {
+    if (type == ReductionType::MIN)
+        return std::numeric_limits<float>::infinity();
+    if (type == ReductionType::MAX)
+        return -std::numeric_limits<float>::infinity();
+    return 0;
+}
+
+template<typename T>
+static T reduce(ReductionType type, T a, T b) {
+    if (type == ReductionType::MIN)
+        return std::min(a, b);
+    if (type == ReductionType::MAX)
+        return std::max(a, b);
+    return a + b;
+}
+
 enum class ComparisonType {
     EQ = 0,
     LT = 1,
@@ -157,45 +214,187 @@ struct Compiled {
         std::string name;
     };
     std::vector<PropAccess> propAccess;
+    // The results of the routine for every sample value of the input clips, which the
+    // plane is a function of, looked up by lookup for rows [ystart, yend) of the plane.
+    // The table is indexed by the samples of clips[0], plus those of the 8-bit clips[1]
+    // (if not -1) times 256. rwptrs and strides are those of the routine.
+    struct Lut {
+        int clips[2];
+        uint32_t maxIndex;
+        std::vector<uint8_t> table;
+        void (*lookup)(const Lut &lut, uint8_t *const *rwptrs, const int *strides, int width, int ystart, int yend);
+    };
+    std::shared_ptr<const Lut> lut;
+    // The routine may be shared by batchSize expressions compiled together, see ExprBatch.
+    int entry = 0;
+    int batchSize = 1;
+
+    const void *code() const { return routine->getEntry(entry); }
+};
+
+// The values of node for all pixels of an output are reduced into its frame property name.
+struct ExprReduction {
+    int output;
+    ReductionType type;
+    std::string name;
+    int node;
 };
 
+class ExprInterpreter;
+
 struct ExprData {
     VSNodeRef *node[MAX_EXPR_INPUTS];
+    // Input i is frame n + frameOffset[i] (clamped to the clip) for frame n, see temporalInputs().
+    int frameOffset[MAX_EXPR_INPUTS];
     VSVideoInfo vi;
-    int plane[3];
+    int numOutputs;
+    int plane[MAX_EXPR_OUTPUTS][3];
+    // The outputs computed by each plane's routine, in the order of their destinations.
+    std::vector<int> planeOutputs[3];
     int numInputs;
+    int threads;
+    // Whether the stripes run on workers of the NUMA node of the thread that requested the frame.
+    bool numa;
     Compiled compiled[3];
-    typedef void (*ProcessProc)(void *rwptrs, int strides[MAX_EXPR_INPUTS + 1], float *props, int width, int height);
+    // With output referring to the real output instead of those of the plane.
+    std::vector<ExprReduction> reductions[3];
+    // Rows [ystart, yend) of the width x height plane are processed. rwptrs and strides
+    // hold the destinations followed by the inputs. The reductions of each row y are
+    // combined with rowReductions[y * numReductions + i].
+    typedef void (*ProcessProc)(void *rwptrs, int strides[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS], float *props, int width, int height, int ystart, int yend, float *rowReductions);
     ProcessProc proc[3];
+    // Planes compiled in the background (lazy=1) are set before pending becomes ready,
+    // until then they are evaluated by the interpreter.
+    std::shared_future<void> pending[3];
+    std::unique_ptr<ExprInterpreter> interpreter[3];
+    // Whether the first row of the plane is computed and copied to the others, see uniformOutputs().
+    bool uniform[3];
+    // Set if other Exprs may compute this one themselves, see fuseInputs().
+    const VSVideoInfo *fusionKey;
+    // Whether the time spent on each frame is attached to it, see setTimeProps().
+    bool stats;
+    // Frames for which it is not true are those of the first clip, see exprCondition().
+    std::unique_ptr<ExprInterpreter> condition;
+    // The inputs the condition reads (the first clip included), which are the only ones
+    // requested until it is known to be true. All of them if the condition reads every input.
+    bool conditionInput[MAX_EXPR_INPUTS];
+    // The frame properties read by any plane, which are loaded once per frame (after N),
+    // and the index in them of each of those of the plane.
+    std::vector<Compiled::PropAccess> frameProps;
+    std::vector<int> propIndex[3];
+
+    ExprData() : node(), frameOffset(), vi(), numOutputs(1), plane(), numInputs(), threads(1), numa(true), proc(), uniform(), fusionKey(), stats(), conditionInput() {}
+
+    void setCompiled(int plane, const Compiled &c) {
+        compiled[plane] = c;
+        proc[plane] = reinterpret_cast<ProcessProc>(const_cast<void *>(c.code()));
+    }
 
-    ExprData() : node(), vi(), plane(), numInputs(), proc() {}
-};
+    void addProps(int plane, const std::vector<Compiled::PropAccess> &props) {
+        for (const auto &pa : props) {
+            size_t k = 0;
+            while (k < frameProps.size() && (frameProps[k].clip != pa.clip || frameProps[k].name != pa.name))
+                k++;
+            if (k == frameProps.size())
+                frameProps.push_back(pa);
+            propIndex[plane].push_back((int)k);
+        }
+    }
 
-std::vector<std::string> tokenize(const std::string &expr)
-{
-    std::vector<std::string> tokens;
-    auto it = expr.begin();
-    auto prev = expr.begin();
+    // Whether the plane reads all of frameProps in their order, so that they can be passed as they are.
+    bool readsFrameProps(int plane) const {
+        if (propIndex[plane].size() != frameProps.size())
+            return false;
+        for (size_t k = 0; k < frameProps.size(); k++)
+            if (propIndex[plane][k] != (int)k)
+                return false;
+        return true;
+    }
 
-    while (it != expr.end()) {
-        char c = *it;
+    // Whether the plane can be processed without waiting for the compiler.
+    bool isCompiled(int plane) const {
+        return !pending[plane].valid() || pending[plane].wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+};
 
-        if (std::isspace(c)) {
-            if (it != prev)
-                tokens.push_back(expr.substr(prev - expr.begin(), it - prev));
-            prev = it + 1;
-        }
-        ++it;
+// Calls fn(token) for each of the tokens of expr (separated by white space), which refer to it.
+template<typename F>
+static void forEachToken(std::string_view expr, F &&fn)
+{
+    size_t begin = 0;
+    for (size_t i = 0; i <= expr.size(); i++) {
+        if (i < expr.size() && !std::isspace(static_cast<unsigned char>(expr[i])))
+            continue;
+        if (i > begin)
+            fn(expr.substr(begin, i - begin));
+        begin = i + 1;
     }
-    if (prev != expr.end())
-        tokens.push_back(expr.substr(prev - expr.begin(), expr.end() - prev));
+}
 
+// The tokens refer to expr, which must outlive them.
+std::vector<std::string_view> tokenize(std::string_view expr)
+{
+    std::vector<std::string_view> tokens;
+    forEachToken(expr, [&tokens](std::string_view token) { tokens.push_back(token); });
     return tokens;
 }
+std::vector<std::string_view> tokenize(std::string &&expr) = delete;
+
+// Token i of expr, for error messages.
+static std::string tokenAt(std::string_view expr, size_t i)
+{
+    std::string_view found;
+    size_t k = 0;
+    forEachToken(expr, [&](std::string_view token) {
+        if (k++ == i)
+            found = token;
+    });
+    return std::string(found);
+}
+
+static int clipIndex(char c) { return c >= 'x' ? c - 'x' : c - 'a' + 3; }
+
+// Removes the leading digits of s (at least one, after a minus sign if sign is set) and
+// returns their value as atoi does, or returns false if there are none.
+static bool consumeInt(std::string_view &s, bool sign, int &value)
+{
+    size_t end = sign && !s.empty() && s[0] == '-' ? 1 : 0;
+    const size_t first = end;
+    while (end < s.size() && s[end] >= '0' && s[end] <= '9')
+        end++;
+    if (end == first)
+        return false;
+    value = atoi(std::string(s.substr(0, end)).c_str());
+    s.remove_prefix(end);
+    return true;
+}
+
+// Removes c from the front of s if it is there.
+static bool consume(std::string_view &s, char c)
+{
+    if (s.empty() || s[0] != c)
+        return false;
+    s.remove_prefix(1);
+    return true;
+}
+
+// The boundary condition suffix (":c" or ":m") that is all that is left of s, if any.
+static bool consumeBoundary(std::string_view s, BoundaryCondition &bc)
+{
+    if (s.empty())
+        bc = BoundaryCondition::Unspecified;
+    else if (s == ":m")
+        bc = BoundaryCondition::Mirrored;
+    else if (s == ":c")
+        bc = BoundaryCondition::Clamped;
+    else
+        return false;
+    return true;
+}
 
-ExprOp decodeToken(const std::string &token)
+ExprOp decodeToken(std::string_view token)
 {
-    static const std::unordered_map<std::string, ExprOp> simple{
+    static const std::unordered_map<std::string_view, ExprOp> simple{
         { "+",    { ExprOpType::ADD } },
         { "-",    { ExprOpType::SUB } },
         { "*",    { ExprOpType::MUL } },
@@ -236,29 +435,28 @@ ExprOp decodeToken(const std::string &token)
         { "width",{ ExprOpType::CONST_LOAD, static_cast<int>(LoadConstType::Width) } },
         {"height",{ ExprOpType::CONST_LOAD, static_cast<int>(LoadConstType::Height) } },
     };
-    static const std::regex relpixelRe { "^([a-z])\\[(-?[0-9]+),(-?[0-9]+)\\](:[cm])?$" };
-    std::smatch match;
+    auto startsWith = [&token](std::string_view prefix) { return token.substr(0, prefix.size()) == prefix; };
+    auto illegal = [&token]() { return std::runtime_error("illegal token: " + std::string(token)); };
 
     auto it = simple.find(token);
     if (it != simple.end()) {
         return it->second;
     } else if (token.size() == 1 && token[0] >= 'a' && token[0] <= 'z') {
-        return{ ExprOpType::MEM_LOAD, token[0] >= 'x' ? token[0] - 'x' : token[0] - 'a' + 3 };
+        return{ ExprOpType::MEM_LOAD, clipIndex(token[0]) };
     } else if ((token.back() != '@' && token.back() != '!') &&
-               (token.substr(0, 3) == "dup" || token.substr(0, 4) == "swap" ||
-                token.substr(0, 4) == "drop" || token.substr(0, 4) == "sort")) {
+               (startsWith("dup") || startsWith("swap") || startsWith("drop") || startsWith("sort"))) {
         size_t prefix = token[1] == 'u' ? 3 : 4;
         size_t count = 0;
         int idx = -1;
 
         try {
-            idx = std::stoi(token.substr(prefix), &count);
+            idx = std::stoi(std::string(token.substr(prefix)), &count);
         } catch (...) {
             // ...
         }
 
         if (idx < 0 || prefix + count != token.size())
-            throw std::runtime_error("illegal token: " + token);
+            throw illegal();
         if (token[1] == 'u')
             return{ ExprOpType::DUP, idx };
         else if (token[1] == 'w')
@@ -267,248 +465,2008 @@ ExprOp decodeToken(const std::string &token)
             return{ ExprOpType::DROP, idx };
         else //if (token[1] == 'o')
             return{ ExprOpType::SORT, idx };
+    } else if (token.size() >= 5 && token[3] == '!' && token.back() != '@' && token.back() != '!' &&
+               (startsWith("sum") || startsWith("min") || startsWith("max") || startsWith("avg"))) {
+        // 'sum!prop' and friends: reduce into frame property prop.
+        static const std::unordered_map<std::string_view, ReductionType> reductions{
+            { "sum", ReductionType::SUM }, { "min", ReductionType::MIN }, { "max", ReductionType::MAX }, { "avg", ReductionType::AVG },
+        };
+        return{ ExprOpType::REDUCE, static_cast<int>(reductions.at(token.substr(0, 3))), std::string(token.substr(4)) };
     } else if (token.size() >= 2 && (token.back() == '@' || token.back() == '!')) {
         // 'name@' load variable; 'name!' store to variable.
-        return{ token.back() == '@' ? ExprOpType::VAR_LOAD : ExprOpType::VAR_STORE, -1, token.substr(0, token.size()-1) };
+        return{ token.back() == '@' ? ExprOpType::VAR_LOAD : ExprOpType::VAR_STORE, -1, std::string(token.substr(0, token.size()-1)) };
     } else if (token.size() >= 3 && token[0] >= 'a' && token[0] <= 'z' && token[1] == '.') {
         // frame property access
-        return{ ExprOpType::CONST_LOAD, static_cast<int>(LoadConstType::LAST) + (token[0] >= 'x' ? token[0] - 'x' : token[0] - 'a' + 3), token.substr(2) };
-    } else if (std::regex_match(token, match, relpixelRe)) {
-        ASSERT(match.size() == 5);
-        auto clip = match[1].str(), sx = match[2].str(), sy = match[3].str(), flag = match[4].str();
-        BoundaryCondition bc = flag.size() == 0 ? BoundaryCondition::Unspecified :
-            (flag[1] == 'm' ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped);
-        return{ ExprOpType::MEM_LOAD, clip[0] >= 'x' ? clip[0] - 'x' : clip[0] - 'a' + 3, "", atoi(sx.c_str()), atoi(sy.c_str()), bc };
-    } else {
-        size_t pos = 0;
-        long long l = 0;
-        float f = 0;
-        const size_t len = token.size();
-        try {
-            l = std::stoll(token, &pos, 0);
-        } catch (...) {
-            pos = 0;
-        }
-        if (pos == len) {
-            if ((int32_t)l == l) return { ExprOpType::CONSTANTI, (int32_t)l };
-            else if ((uint32_t)l == l) return { ExprOpType::CONSTANTI, (uint32_t)l };
-            return { ExprOpType::CONSTANTF, (float)l };
-        }
-        try {
-            f = std::stof(token, &pos);
-        } catch (...) {
-            pos = 0;
-        }
-        if (pos == len)
-            return { ExprOpType::CONSTANTF, f };
-        else if (pos > 0)
-            throw std::runtime_error("failed to convert '" + token + "' to float, not the whole token could be converted");
-        else
-            throw std::runtime_error("failed to convert '" + token + "' to float");
+        return{ ExprOpType::CONST_LOAD, static_cast<int>(LoadConstType::LAST) + clipIndex(token[0]), std::string(token.substr(2)) };
     }
-}
-
-template<int lanes>
-struct VectorTypes {
-    typedef rr::Void Byte;
-    typedef rr::Void UShort;
-    typedef rr::Void Int;
-    typedef rr::Void Float;
-};
 
-template<>
-struct VectorTypes<4> {
-    typedef rr::Byte4 Byte;
-    typedef rr::UShort4 UShort;
-    typedef rr::Int4 Int;
-    typedef rr::Float4 Float;
-    typedef uint16_t SwizzleMask;
-};
+    BoundaryCondition bc;
+    int a, b;
+    if (token.size() >= 3 && token[0] >= 'a' && token[0] <= 'z' && token[1] == '[') {
+        std::string_view s = token.substr(2);
+        // 'x[dx,dy]' reads the pixel at the relative position.
+        if (std::string_view r = s; consumeInt(r, true, a) && consume(r, ',') && consumeInt(r, true, b) && consume(r, ']') && consumeBoundary(r, bc))
+            return{ ExprOpType::MEM_LOAD, clipIndex(token[0]), "", a, b, bc };
+        // 'x[]' pops the absolute coordinates of the pixel, y on top.
+        if (consume(s, ']') && consumeBoundary(s, bc))
+            return{ ExprOpType::MEM_GATHER, clipIndex(token[0]), "", 0, 0, bc };
+    } else if (startsWith("median") || startsWith("select")) {
+        // 'medianN' is 'selectN,k' for the middle (or lower middle) rank k of the N items.
+        std::string_view s = token.substr(6);
+        const bool median = token[0] == 'm';
+        if (consumeInt(s, false, a) && (median || (consume(s, ',') && consumeInt(s, false, b))) && s.empty()) {
+            int n = a;
+            int k = median ? (n - 1) / 2 : b;
+            if (n < 1 || k >= n)
+                throw illegal();
+            return{ ExprOpType::SELECT, n, "", k };
+        }
+    }
 
-template<>
-struct VectorTypes<8> {
-public:
-    typedef rr::Byte8 Byte;
-    typedef rr::UShort8 UShort;
-    typedef rr::Int8 Int;
-    typedef rr::Float8 Float;
-    typedef uint32_t SwizzleMask;
-};
+    const std::string str(token);
+    size_t pos = 0;
+    long long l = 0;
+    float f = 0;
+    const size_t len = str.size();
+    try {
+        l = std::stoll(str, &pos, 0);
+    } catch (...) {
+        pos = 0;
+    }
+    if (pos == len) {
+        if ((int32_t)l == l) return { ExprOpType::CONSTANTI, (int32_t)l };
+        else if ((uint32_t)l == l) return { ExprOpType::CONSTANTI, (uint32_t)l };
+        return { ExprOpType::CONSTANTF, (float)l };
+    }
+    try {
+        f = std::stof(str, &pos);
+    } catch (...) {
+        pos = 0;
+    }
+    if (pos == len)
+        return { ExprOpType::CONSTANTF, f };
+    else if (pos > 0)
+        throw std::runtime_error("failed to convert '" + str + "' to float, not the whole token could be converted");
+    else
+        throw std::runtime_error("failed to convert '" + str + "' to float");
+}
 
-static std::unordered_map<std::string, Compiled> exprCache;
+typedef std::vector<std::pair<int, int>> SortingNetwork;
+static const SortingNetwork &buildSortNet(int n) {
+    static std::mutex lock;
+    static std::map<int, SortingNetwork> built;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = built.find(n);
+    if (it != built.end()) return it->second;
 
-template<int lanes>
-class Compiler {
-    struct Context {
-        const std::string expr;
-        std::vector<std::string> tokens;
-        std::vector<ExprOp> ops;
-        const VSVideoInfo *vo;
-        const VSVideoInfo * const *vi;
-        int numInputs;
-        int optMask;
-        bool mirror;
-        bool cached;
-        Context(const std::string &expr, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, int opt, int mirror):
-            expr(expr), vo(vo), vi(vi), numInputs(numInputs), optMask(opt), mirror(!!mirror), cached(false) {
-            auto iter = exprCache.find(key());
-            if (iter != exprCache.end()) {
-                cached = true;
-                return;
-            }
+    built.insert({ n, {} });
+    auto &sn = built.find(n)->second;
 
-            tokens = tokenize(expr);
-            for (const auto &tok: tokens) {
-                auto op = decodeToken(tok);
-                if (op.bc == BoundaryCondition::Unspecified)
-                    op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
-                ops.push_back(op);
-            }
-        }
-        enum {
-            flagUseInteger = 1<<0,
-        };
-        static std::string videoInfoKey(const VSVideoInfo *vi) {
-            std::stringstream ss;
-            ss << vi->format->name << ";";
-            return ss.str();
-        }
-        std::string key() const {
-            std::stringstream ss;
-            ss << "n=" << numInputs << "|opt=" << optMask << "|mirror=" << mirror
-                << "|expr=" << expr << "|vo=" << videoInfoKey(vo);
-            for (int i = 0; i < numInputs; i++)
-                ss << "|vi" << i << "=" << videoInfoKey(vi[i]);
-            return ss.str();
+    int t = 0;
+    while (n > (1<<t)) t++;
+    int p = 1 << (t - 1);
+    while (p > 0) {
+        int q = 1 << (t - 1), r = 0, d = p;
+        while (d > 0) {
+            for (int i = 0; i < n - d; i++)
+                if ((i & p) == r)
+                    sn.emplace_back(i, i+d);
+            d = q - p;
+            q >>= 1;
+            r = p;
         }
-        Compiled getCached() { return exprCache[key()]; }
-
-        bool forceFloat() const { return !(optMask & flagUseInteger); }
-    } ctx;
+        p >>= 1;
+    }
+    return sn;
+}
 
-    using pointer = rr::Pointer<rr::Byte>;
-    using Types = VectorTypes<lanes>;
-    using ByteV = typename Types::Byte;
-    using UShortV = typename Types::UShort;
-    using IntV = typename Types::Int;
-    using FloatV = typename Types::Float;
+// The number of min and max operations of net that the value it leaves in item k depends on.
+static size_t selectCost(const SortingNetwork &net, int n, int k) {
+    std::vector<std::pair<int, int>> args; // of the min and max of each comparator
+    std::vector<int> wire(n);
+    for (int i = 0; i < n; i++)
+        wire[i] = i;
+    for (auto cmp: net) {
+        args.emplace_back(wire[cmp.first], wire[cmp.second]);
+        args.emplace_back(wire[cmp.first], wire[cmp.second]);
+        wire[cmp.first] = n + (int)args.size() - 2;
+        wire[cmp.second] = n + (int)args.size() - 1;
+    }
+    std::vector<bool> used(args.size());
+    std::vector<int> pending { wire[k] };
+    size_t cost = 0;
+    while (!pending.empty()) {
+        int v = pending.back() - n;
+        pending.pop_back();
+        if (v < 0 || used[v])
+            continue;
+        used[v] = true;
+        cost++;
+        pending.push_back(args[v].first);
+        pending.push_back(args[v].second);
+    }
+    return cost;
+}
 
-    struct Helper {
-        using ftype = rr::ModuleFunction<FloatV(FloatV)>;
-        using ftype2 = rr::ModuleFunction<FloatV(FloatV, FloatV)>;
-        std::unique_ptr<ftype> Exp;
-        std::unique_ptr<ftype> Log;
-        std::unique_ptr<ftype> Sin;
-        std::unique_ptr<ftype> Cos;
-        std::unique_ptr<ftype2> Pow;
+// A network that leaves the item of rank k (the k-th smallest, from 0) of n in item k, the
+// cheapest of those below, as far as that item depends on it.
+//  - The best known median networks for common window sizes (Paeth for 3x3, Smith for 5x5).
+//  - The sorting network.
+//  - Keeping the k + 1 smallest items sorted while inserting the others one by one, which is
+//    cheaper for ranks near either end (where the largest ones are kept instead).
+static const SortingNetwork &buildSelectNet(int n, int k) {
+    static const std::map<std::pair<int, int>, SortingNetwork> medians {
+    { { 5, 2 }, {
+        { 0, 1 }, { 3, 4 }, { 0, 3 }, { 1, 4 }, { 1, 2 }, { 2, 3 }, { 1, 2 } } },
+    { { 7, 3 }, {
+        { 0, 5 }, { 0, 3 }, { 1, 6 }, { 2, 4 }, { 0, 1 }, { 3, 5 }, { 2, 6 }, { 2, 3 }, { 3, 6 },
+        { 4, 5 }, { 1, 4 }, { 1, 3 }, { 3, 4 } } },
+    { { 9, 4 }, {
+        { 1, 2 }, { 4, 5 }, { 7, 8 }, { 0, 1 }, { 3, 4 }, { 6, 7 }, { 1, 2 }, { 4, 5 }, { 7, 8 },
+        { 0, 3 }, { 5, 8 }, { 4, 7 }, { 3, 6 }, { 1, 4 }, { 2, 5 }, { 4, 7 }, { 4, 2 }, { 6, 4 },
+        { 4, 2 } } },
+    { { 25, 12 }, {
+        { 0, 1 }, { 3, 4 }, { 2, 4 }, { 2, 3 }, { 6, 7 }, { 5, 7 }, { 5, 6 }, { 9, 10 }, { 8, 10 },
+        { 8, 9 }, { 12, 13 }, { 11, 13 }, { 11, 12 }, { 15, 16 }, { 14, 16 }, { 14, 15 },
+        { 18, 19 }, { 17, 19 }, { 17, 18 }, { 21, 22 }, { 20, 22 }, { 20, 21 }, { 23, 24 },
+        { 2, 5 }, { 3, 6 }, { 0, 6 }, { 0, 3 }, { 4, 7 }, { 1, 7 }, { 1, 4 }, { 11, 14 },
+        { 8, 14 }, { 8, 11 }, { 12, 15 }, { 9, 15 }, { 9, 12 }, { 13, 16 }, { 10, 16 }, { 10, 13 },
+        { 20, 23 }, { 17, 23 }, { 17, 20 }, { 21, 24 }, { 18, 24 }, { 18, 21 }, { 19, 22 },
+        { 8, 17 }, { 9, 18 }, { 0, 18 }, { 0, 9 }, { 10, 19 }, { 1, 19 }, { 1, 10 }, { 11, 20 },
+        { 2, 20 }, { 2, 11 }, { 12, 21 }, { 3, 21 }, { 3, 12 }, { 13, 22 }, { 4, 22 }, { 4, 13 },
+        { 14, 23 }, { 5, 23 }, { 5, 14 }, { 15, 24 }, { 6, 24 }, { 6, 15 }, { 7, 16 }, { 7, 19 },
+        { 13, 21 }, { 15, 23 }, { 7, 13 }, { 7, 15 }, { 1, 9 }, { 3, 11 }, { 5, 17 }, { 11, 17 },
+        { 9, 17 }, { 4, 10 }, { 6, 12 }, { 7, 14 }, { 4, 6 }, { 4, 7 }, { 12, 14 }, { 10, 14 },
+        { 6, 7 }, { 10, 12 }, { 6, 10 }, { 6, 17 }, { 12, 17 }, { 7, 17 }, { 7, 10 }, { 12, 18 },
+        { 7, 12 }, { 10, 18 }, { 12, 20 }, { 10, 20 }, { 10, 12 } } },
     };
-    rr::RValue<FloatV> Exp_(rr::RValue<FloatV>);
-    rr::RValue<FloatV> Log_(rr::RValue<FloatV>);
-    rr::RValue<FloatV> SinCos_(rr::RValue<FloatV>, bool issin);
-
-    class Value {
-        std::variant<IntV, FloatV> v;
-        bool constant;
+    static std::mutex lock;
+    static std::map<std::pair<int, int>, SortingNetwork> built;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = built.find({ n, k });
+    if (it != built.end())
+        return it->second;
 
-    public:
-        bool isFloat() { return std::holds_alternative<FloatV>(v); }
-        bool isConst() { return constant; }
+    auto med = medians.find({ n, k });
+    if (med != medians.end())
+        return built.insert({ { n, k }, med->second }).first->second;
+
+    SortingNetwork best = n > 1 ? buildSortNet(n) : SortingNetwork();
+    // For the largest items, comparators leave the maximum in their first item instead, and
+    // the result in item m is moved to item k.
+    const int m = std::min(k, n - 1 - k);
+    const bool largest = m != k;
+    SortingNetwork insert;
+    if (m > 0)
+        insert = buildSortNet(m + 1);
+    for (int i = m + 1; i < n; i++) {
+        insert.emplace_back(m, i);
+        for (int j = m; j > 0; j--)
+            insert.emplace_back(j - 1, j);
+    }
+    for (auto &cmp: insert) {
+        auto move = [&](int i) { return i == m ? k : i == k ? m : i; };
+        cmp = largest ? std::make_pair(move(cmp.second), move(cmp.first)) : cmp;
+    }
+    if (selectCost(insert, n, k) < selectCost(best, n, k))
+        best = insert;
+    return built.insert({ { n, k }, best }).first->second;
+}
 
-        Value(int x) : v(IntV(x)), constant(true) {}
-        Value(float x) : v(FloatV(x)), constant(true) {}
+// Expression graph used between parsing and code generation.
+//
+// The RPN program is evaluated symbolically, so that the stack manipulation operators and the
+// variables disappear and only a DAG of operations remains. Nodes are hash-consed, which gives us
+// value numbering for free: equal subexpressions end up as a single node no matter whether they
+// were spelled out twice or reused with dup or var!/var@. Each node is also simplified as it is
+// created, with its operands already in simplified form: constant folding, algebraic identities,
+// reassociation of constant terms and strength reduction of pow with constant exponents.
+// These rewrites follow the value types used by the code generator (see buildIters), and a
+// rewrite that would change the type of a value is not applied.
+struct ExprNode {
+    ExprOp op;
+    int args[3];
+    int numArgs;
+    bool isFloat;
+};
 
-        Value(IntV i) : v(i), constant(false) {}
-        Value(rr::RValue<IntV> i) : v(IntV(i)), constant(false) {}
-        Value(rr::Reference<IntV> i) : v(IntV(i)), constant(false) {}
-        Value(FloatV f) : v(f), constant(false) {}
-        Value(rr::RValue<FloatV> f) : v(FloatV(f)), constant(false) {}
-        Value(rr::Reference<FloatV> f) : v(FloatV(f)), constant(false) {}
+class ExprGraph {
+    std::vector<ExprNode> nodes;
+    std::map<std::tuple<int, uint32_t, int, int, int, int, int, int>, int> index;
+    const VSVideoInfo * const *vi;
+    bool forceFloat;
+    bool optimize;
+
+    bool isConst(int n) const { return nodes[n].op.type == ExprOpType::CONSTANTI || nodes[n].op.type == ExprOpType::CONSTANTF; }
+    bool isConst(int n, float v) const { return isConst(n) && constF(n) == v; }
+    float constF(int n) const { return nodes[n].op.type == ExprOpType::CONSTANTI ? static_cast<float>(nodes[n].op.imm.i) : nodes[n].op.imm.f; }
+    bool is(int n, ExprOpType type) const { return nodes[n].op.type == type; }
+    const int *args(int n) const { return nodes[n].args; }
+
+    bool resultIsFloat(const ExprOp &op, const int *a) const;
+    int fold(const ExprOp &op, const int *a, bool isFloat);
+    int simplify(const ExprOp &op, const int *a, bool isFloat);
+    int intern(const ExprOp &op, const int *a, int numArgs, bool isFloat);
+
+    int constant(int32_t v) { return make({ ExprOpType::CONSTANTI, v }); }
+    int constant(float v) { return make({ ExprOpType::CONSTANTF, v }); }
+    int constant(float v, bool isFloat) { return isFloat ? constant(v) : constant(static_cast<int32_t>(v)); }
+    int toFloat(int n) { return nodes[n].isFloat ? n : make(ExprOpType::MUL, n, constant(1.0f)); }
+    int powi(int n, int e);
 
-        FloatV f() { return std::get<FloatV>(v); }
-        IntV i() { return std::get<IntV>(v); }
+public:
+    // The result of each expression, which may share nodes with the others.
+    std::vector<int> roots;
+    std::vector<Compiled::PropAccess> propAccess;
+    // Evaluated like the roots, with the outputs referring to them.
+    std::vector<ExprReduction> reductions;
+
+    ExprGraph(const std::vector<std::vector<ExprOp>> &ops, const std::vector<std::string> &exprs,
+              const VSVideoInfo * const *vi, int numInputs, bool forceFloat, bool optimize);
+
+    int make(const ExprOp &op, int a = -1, int b = -1, int c = -1);
+
+    const ExprNode &operator[](int n) const { return nodes[n]; }
+    size_t size() const { return nodes.size(); }
+    // Nodes reachable from the roots and reductions, operands before their users.
+    std::vector<int> schedule() const;
+    // Whether each node has the same value for all pixels of a frame.
+    std::vector<bool> frameInvariant() const;
+};
 
-        FloatV ensureFloat() { return isFloat() ? f() : FloatV(i()); }
+bool ExprGraph::resultIsFloat(const ExprOp &op, const int *a) const
+{
+    auto f = [&](int i) { return nodes[a[i]].isFloat; };
+    switch (op.type) {
+    case ExprOpType::MEM_LOAD: case ExprOpType::MEM_GATHER: return forceFloat || vi[op.imm.i]->format->sampleType == stFloat;
+    case ExprOpType::CONSTANTI: return false;
+    case ExprOpType::CONSTANTF: return true;
+    case ExprOpType::CONST_LOAD: return op.imm.i >= static_cast<int>(LoadConstType::LAST);
+    case ExprOpType::ADD: case ExprOpType::SUB: case ExprOpType::MUL: return f(0) || f(1);
+    case ExprOpType::MAX: case ExprOpType::MIN: return forceFloat || f(0) || f(1);
+    case ExprOpType::ABS: return forceFloat || f(0);
+    case ExprOpType::CLAMP: return forceFloat || f(0) || f(1) || f(2);
+    case ExprOpType::CMP: case ExprOpType::AND: case ExprOpType::OR: case ExprOpType::XOR: case ExprOpType::NOT: return false;
+    case ExprOpType::TERNARY: return f(1) || f(2);
+    default: return true;
+    }
+}
 
-        Value Max(Value &rhs) { return (isFloat() || rhs.isFloat()) ? Value(rr::Max(f(), rhs.f())) : Value(rr::Max(i(), rhs.i())); }
-        Value Min(Value &rhs) { return (isFloat() || rhs.isFloat()) ? Value(rr::Min(f(), rhs.f())) : Value(rr::Min(i(), rhs.i())); }
-    };
+int ExprGraph::intern(const ExprOp &op, const int *a, int numArgs, bool isFloat)
+{
+    auto key = std::make_tuple(static_cast<int>(op.type), op.imm.u, op.x, op.y, static_cast<int>(op.bc),
+                               numArgs > 0 ? a[0] : -1, numArgs > 1 ? a[1] : -1, numArgs > 2 ? a[2] : -1);
+    auto it = index.find(key);
+    if (it != index.end())
+        return it->second;
+    ExprNode node{ op, { -1, -1, -1 }, numArgs, isFloat };
+    for (int i = 0; i < numArgs; i++)
+        node.args[i] = a[i];
+    nodes.push_back(node);
+    index.insert({ key, (int)nodes.size() - 1 });
+    return (int)nodes.size() - 1;
+}
 
-    struct State {
-        std::vector<pointer> wptrs;
-        rr::Int strides[MAX_EXPR_INPUTS+1];
-        rr::Pointer<rr::Float> consts;
-        rr::Int width;
-        rr::Int height;
-        IntV xvec;
+int ExprGraph::fold(const ExprOp &op, const int *a, bool isFloat)
+{
+    switch (op.type) {
+    case ExprOpType::ADD: case ExprOpType::SUB: case ExprOpType::MUL: case ExprOpType::DIV: case ExprOpType::MOD:
+    case ExprOpType::SQRT: case ExprOpType::ABS: case ExprOpType::MAX: case ExprOpType::MIN: case ExprOpType::CLAMP:
+    case ExprOpType::CMP: case ExprOpType::AND: case ExprOpType::OR: case ExprOpType::XOR: case ExprOpType::NOT:
+    case ExprOpType::TRUNC: case ExprOpType::ROUND: case ExprOpType::FLOOR: case ExprOpType::TERNARY:
+        break;
+    default:
+        // exp/log/pow/sin/cos are approximated by the generated code, leave them alone.
+        return -1;
+    }
+    int numArgs = op.type == ExprOpType::CLAMP || op.type == ExprOpType::TERNARY ? 3 :
+        (op.type == ExprOpType::SQRT || op.type == ExprOpType::ABS || op.type == ExprOpType::NOT ||
+         op.type == ExprOpType::TRUNC || op.type == ExprOpType::ROUND || op.type == ExprOpType::FLOOR) ? 1 : 2;
+    for (int i = 0; i < numArgs; i++)
+        if (!isConst(a[i]))
+            return -1;
+
+    auto F = [&](int i) { return constF(a[i]); };
+    auto I = [&](int i) { return static_cast<uint32_t>(nodes[a[i]].op.imm.i); };
+    auto truthy = [&](int i) { return nodes[a[i]].isFloat ? F(i) > 0 : nodes[a[i]].op.imm.i > 0; };
+    bool anyFloat = nodes[a[0]].isFloat || (numArgs > 1 && nodes[a[1]].isFloat);
+
+    switch (op.type) {
+    case ExprOpType::ADD: return isFloat ? constant(F(0) + F(1)) : constant(static_cast<int32_t>(I(0) + I(1)));
+    case ExprOpType::SUB: return isFloat ? constant(F(0) - F(1)) : constant(static_cast<int32_t>(I(0) - I(1)));
+    case ExprOpType::MUL: return isFloat ? constant(F(0) * F(1)) : constant(static_cast<int32_t>(I(0) * I(1)));
+    case ExprOpType::DIV: return constant(F(0) / F(1));
+    case ExprOpType::MOD: return constant(std::fmod(F(0), F(1)));
+    case ExprOpType::SQRT: return constant(std::sqrt(std::max(F(0), 0.0f)));
+    case ExprOpType::ABS: return isFloat ? constant(std::fabs(F(0))) : constant(static_cast<int32_t>(I(0) & 0x80000000u ? 0u - I(0) : I(0)));
+    case ExprOpType::MAX: return isFloat ? constant(std::max(F(0), F(1))) : constant(std::max(nodes[a[0]].op.imm.i, nodes[a[1]].op.imm.i));
+    case ExprOpType::MIN: return isFloat ? constant(std::min(F(0), F(1))) : constant(std::min(nodes[a[0]].op.imm.i, nodes[a[1]].op.imm.i));
+    case ExprOpType::CLAMP:
+        if (isFloat)
+            return constant(std::max(std::min(F(0), F(2)), F(1)));
+        return constant(std::max(std::min(nodes[a[0]].op.imm.i, nodes[a[2]].op.imm.i), nodes[a[1]].op.imm.i));
+    case ExprOpType::CMP: {
+        bool r = false;
+        float lf = F(0), rf = F(1);
+        int32_t li = nodes[a[0]].op.imm.i, ri = nodes[a[1]].op.imm.i;
+        switch (static_cast<ComparisonType>(op.imm.u)) {
+        case ComparisonType::EQ:  r = anyFloat ? lf == rf : li == ri; break;
+        case ComparisonType::LT:  r = anyFloat ? lf < rf : li < ri; break;
+        case ComparisonType::LE:  r = anyFloat ? lf <= rf : li <= ri; break;
+        case ComparisonType::NEQ: r = anyFloat ? !(lf == rf) : li != ri; break;
+        case ComparisonType::NLT: r = anyFloat ? !(lf < rf) : li >= ri; break;
+        case ComparisonType::NLE: r = anyFloat ? !(lf <= rf) : li > ri; break;
+        }
+        return constant(static_cast<int32_t>(r));
+    }
+    case ExprOpType::AND: return constant(static_cast<int32_t>(truthy(0) && truthy(1)));
+    case ExprOpType::OR: return constant(static_cast<int32_t>(truthy(0) || truthy(1)));
+    case ExprOpType::XOR: return constant(static_cast<int32_t>(truthy(0) != truthy(1)));
+    case ExprOpType::NOT: return constant(static_cast<int32_t>(!truthy(0)));
+    case ExprOpType::TRUNC: return constant(std::trunc(F(0)));
+    case ExprOpType::ROUND: return constant(std::nearbyint(F(0)));
+    case ExprOpType::FLOOR: return constant(std::floor(F(0)));
+    case ExprOpType::TERNARY: {
+        int n = a[truthy(0) ? 1 : 2];
+        return isFloat ? constant(constF(n)) : n;
+    }
+    default: return -1;
+    }
+}
 
-        rr::Int y;
-        rr::Int x;
+// x ** e for integer e > 0 by repeated squaring; the shared halves are merged by hash-consing.
+int ExprGraph::powi(int n, int e)
+{
+    if (e == 1)
+        return n;
+    int half = powi(n, e / 2);
+    int sq = make(ExprOpType::MUL, half, half);
+    return e & 1 ? make(ExprOpType::MUL, sq, n) : sq;
+}
 
-        std::vector<Value> variables;
+int ExprGraph::simplify(const ExprOp &op, const int *a, bool isFloat)
+{
+    // Replace the node with n, but only if that preserves its type.
+    auto same = [&](int n) { return nodes[n].isFloat == isFloat ? n : -1; };
+    // Reassociation must not change the type of any intermediate result, e.g. (x * 0.5) * x must
+    // not become (x * x) * 0.5 with integer x, as x * x would then be computed in 32-bit integers.
+    auto reassociable = [&](ExprOpType type, int n) {
+        return is(n, type) && isConst(args(n)[1]) && nodes[n].isFloat == isFloat;
     };
+    auto sameType = [&](ExprOpType type, int x, int y) {
+        int a[2] = { x, y };
+        return resultIsFloat(type, a) == isFloat;
+    };
+    auto negate = [&](int n) {
+        return nodes[n].isFloat ? constant(-constF(n)) : constant(static_cast<int32_t>(0u - static_cast<uint32_t>(nodes[n].op.imm.i)));
+    };
+    switch (op.type) {
+    case ExprOpType::ADD:
+        if (isConst(a[1], 0.0f))
+            return same(a[0]);
+        // Move constant terms outwards so that they can be combined: (a + c1) + c2, (a + c) + b
+        if (reassociable(ExprOpType::ADD, a[0]))
+            return isConst(a[1]) ? make(ExprOpType::ADD, args(a[0])[0], make(ExprOpType::ADD, args(a[0])[1], a[1])) :
+                   sameType(ExprOpType::ADD, args(a[0])[0], a[1]) ? make(ExprOpType::ADD, make(ExprOpType::ADD, args(a[0])[0], a[1]), args(a[0])[1]) : -1;
+        if (reassociable(ExprOpType::ADD, a[1]) && sameType(ExprOpType::ADD, a[0], args(a[1])[0]))
+            return make(ExprOpType::ADD, make(ExprOpType::ADD, a[0], args(a[1])[0]), args(a[1])[1]);
+        break;
+    case ExprOpType::SUB:
+        if (a[0] == a[1])
+            return constant(0.0f, isFloat);
+        if (isConst(a[1]))
+            return make(ExprOpType::ADD, a[0], negate(a[1]));
+        if (reassociable(ExprOpType::ADD, a[0]) && sameType(ExprOpType::SUB, args(a[0])[0], a[1]))
+            return make(ExprOpType::ADD, make(ExprOpType::SUB, args(a[0])[0], a[1]), args(a[0])[1]);
+        if (reassociable(ExprOpType::ADD, a[1]) && sameType(ExprOpType::SUB, a[0], args(a[1])[0]))
+            return make(ExprOpType::ADD, make(ExprOpType::SUB, a[0], args(a[1])[0]), negate(args(a[1])[1]));
+        break;
+    case ExprOpType::MUL:
+        if (isConst(a[1], 1.0f))
+            return same(a[0]);
+        if (isConst(a[1], 0.0f))
+            return constant(0.0f, isFloat);
+        if (reassociable(ExprOpType::MUL, a[0]))
+            return isConst(a[1]) ? make(ExprOpType::MUL, args(a[0])[0], make(ExprOpType::MUL, args(a[0])[1], a[1])) :
+                   sameType(ExprOpType::MUL, args(a[0])[0], a[1]) ? make(ExprOpType::MUL, make(ExprOpType::MUL, args(a[0])[0], a[1]), args(a[0])[1]) : -1;
+        if (reassociable(ExprOpType::MUL, a[1]) && sameType(ExprOpType::MUL, a[0], args(a[1])[0]))
+            return make(ExprOpType::MUL, make(ExprOpType::MUL, a[0], args(a[1])[0]), args(a[1])[1]);
+        break;
+    case ExprOpType::DIV:
+        if (isConst(a[1], 1.0f))
+            return same(a[0]);
+        // x / c = x * (1 / c)
+        if (isConst(a[1]) && constF(a[1]) != 0.0f)
+            return make(ExprOpType::MUL, a[0], constant(1.0f / constF(a[1])));
+        break;
+    case ExprOpType::MAX: case ExprOpType::MIN:
+        if (a[0] == a[1])
+            return same(a[0]);
+        break;
+    case ExprOpType::CMP:
+        if (a[0] == a[1]) {
+            ComparisonType type = static_cast<ComparisonType>(op.imm.u);
+            return constant(static_cast<int32_t>(type == ComparisonType::EQ || type == ComparisonType::LE || type == ComparisonType::NLT));
+        }
+        break;
+    case ExprOpType::NOT:
+        // !(a < b) --> a >= b
+        if (is(a[0], ExprOpType::CMP)) {
+            ExprOp cmp = nodes[a[0]].op;
+            cmp.imm.u ^= 4; // EQ <-> NEQ, LT <-> NLT, LE <-> NLE
+            return make(cmp, args(a[0])[0], args(a[0])[1]);
+        }
+        break;
+    case ExprOpType::TERNARY: {
+        if (isConst(a[0]))
+            return same(a[(nodes[a[0]].isFloat ? constF(a[0]) > 0 : nodes[a[0]].op.imm.i > 0) ? 1 : 2]);
+        if (a[1] == a[2])
+            return same(a[1]);
+        // !a ? b : c --> a ? c : b
+        if (is(a[0], ExprOpType::NOT))
+            return make(ExprOpType::TERNARY, args(a[0])[0], a[2], a[1]);
+        // a < b ? a : b --> min(a, b)    a > b ? a : b --> max(a, b)
+        if (is(a[0], ExprOpType::CMP)) {
+            ComparisonType type = static_cast<ComparisonType>(nodes[a[0]].op.imm.u);
+            int l = args(a[0])[0], r = args(a[0])[1];
+            bool less = type == ComparisonType::LT || type == ComparisonType::LE;
+            bool greater = type == ComparisonType::NLE || type == ComparisonType::NLT;
+            if ((less || greater) && ((a[1] == l && a[2] == r) || (a[1] == r && a[2] == l))) {
+                bool min = less == (a[1] == l);
+                ExprOp mm(min ? ExprOpType::MIN : ExprOpType::MAX);
+                return resultIsFloat(mm, args(a[0])) == isFloat ? make(mm, l, r) : -1;
+            }
+        }
+        break;
+    }
+    // exp(log x) and log(exp x) are not x: log is NaN for x <= 0 and exp saturates.
+    case ExprOpType::POW: {
+        // (a ** b) ** c = a ** (b * c)
+        if (is(a[0], ExprOpType::POW) && isConst(a[1]) && isConst(args(a[0])[1]))
+            return make(ExprOpType::POW, args(a[0])[0], constant(constF(a[1]) * constF(args(a[0])[1])));
+        if (!isConst(a[1]))
+            break;
+        float e = constF(a[1]);
+        if (e == 0.0f)
+            return constant(1.0f);
+        // x ** N = x * x * ...    x ** (N + 0.5) = x ** N * sqrt(x)    x ** -e = 1 / x ** e
+        // x ** (N + 0.25) = x ** N * sqrt(sqrt(x))    x ** (N + 0.75) = x ** N * sqrt(x) * sqrt(sqrt(x))
+        float ae = std::fabs(e);
+        if (ae > 16.0f || std::floor(ae * 4.0f) != ae * 4.0f)
+            break;
+        int base = toFloat(a[0]);
+        int n = static_cast<int>(ae);
+        int r = n > 0 ? powi(base, n) : -1;
+        if (ae != n) {
+            const float frac = ae - n;
+            int sq = make(ExprOpType::SQRT, base);
+            int root = sq;
+            if (frac != 0.5f) {
+                int qr = make(ExprOpType::SQRT, sq);
+                root = frac == 0.25f ? qr : make(ExprOpType::MUL, sq, qr);
+            }
+            r = r >= 0 ? make(ExprOpType::MUL, r, root) : root;
+        }
+        return e < 0 ? make(ExprOpType::DIV, constant(1.0f), r) : r;
+    }
+    default:
+        break;
+    }
+    return -1;
+}
 
-    Helper buildHelpers(rr::Module &mod);
-    void buildOneIter(const Helper &helpers, State &state);
-
-public:
-    Compiler(const std::string &expr, const VSVideoInfo *vo, const VSVideoInfo * const *vi, int numInputs, int opt = 0, int mirror = 0) :
-        ctx(expr, vo, vi, numInputs, opt, mirror) {}
-
-    Compiled compile();
-};
-
-template<int lanes>
-rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Exp_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+int ExprGraph::make(const ExprOp &op_, int a0, int a1, int a2)
 {
-    FloatV x = x_;
-    using namespace rr;
-    const float exp_hi = 88.3762626647949f, exp_lo = -88.3762626647949f, log2e  = 1.44269504088896341f,
-          exp_c1 = 0.693359375f, exp_c2 = -2.12194440e-4f, exp_p0 = 1.9875691500E-4f, exp_p1 = 1.3981999507E-3f,
-          exp_p2 = 8.3334519073E-3f, exp_p3 = 4.1665795894E-2f, exp_p4 = 1.6666665459E-1f, exp_p5 = 5.0000001201E-1f;
-    x = Min(x, FloatV(exp_hi));
-    x = Max(x, FloatV(exp_lo));
-    FloatV fx = FloatV(log2e);
-    fx = FMA(fx, x, FloatV(0.5f));
-    IntV emm0 = RoundInt(fx);
-    FloatV etmp = FloatV(emm0);
-    FloatV mask = As<FloatV>(As<IntV>(FloatV(1.0f)) & CmpGT(etmp, fx));
-    fx = etmp - mask;
-    x = FMA(fx, FloatV(-exp_c1), x);
-    x = FMA(fx, FloatV(-exp_c2), x);
-    FloatV z = x * x;
-    FloatV y = FloatV(exp_p0);
-    y = FMA(y, x, FloatV(exp_p1));
-    y = FMA(y, x, FloatV(exp_p2));
-    y = FMA(y, x, FloatV(exp_p3));
-    y = FMA(y, x, FloatV(exp_p4));
-    y = FMA(y, x, FloatV(exp_p5));
-    y = FMA(y, z, x);
-    y = y + FloatV(1.0f);
-    emm0 = RoundInt(fx);
-    emm0 = emm0 + IntV(0x7f);
-    emm0 = emm0 << 23;
-    x = y * As<FloatV>(emm0);
-    return x;
+    ExprOp op = op_;
+    int a[3] = { a0, a1, a2 };
+    int numArgs = a2 >= 0 ? 3 : a1 >= 0 ? 2 : a0 >= 0 ? 1 : 0;
+    bool isFloat = resultIsFloat(op, a);
+
+    if (optimize) {
+        int r = fold(op, a, isFloat);
+        if (r >= 0)
+            return r;
+
+        // Canonical operand order for commutative operators: constants last, otherwise by value number.
+        bool commutative = op.type == ExprOpType::ADD || op.type == ExprOpType::MUL || op.type == ExprOpType::MAX ||
+            op.type == ExprOpType::MIN || op.type == ExprOpType::AND || op.type == ExprOpType::OR || op.type == ExprOpType::XOR ||
+            (op.type == ExprOpType::CMP && (op.imm.u == static_cast<unsigned>(ComparisonType::EQ) || op.imm.u == static_cast<unsigned>(ComparisonType::NEQ)));
+        if (commutative && (isConst(a[0]) ? !isConst(a[1]) : (!isConst(a[1]) && a[0] > a[1])))
+            std::swap(a[0], a[1]);
+
+        r = simplify(op, a, isFloat);
+        if (r >= 0)
+            return r;
+    }
+
+    return intern(op, a, numArgs, isFloat);
 }
 
-template<int lanes>
-rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Log_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+ExprGraph::ExprGraph(const std::vector<std::vector<ExprOp>> &ops, const std::vector<std::string> &exprs,
+                     const VSVideoInfo * const *vi, int numInputs, bool forceFloat, bool optimize) :
+    vi(vi), forceFloat(forceFloat), optimize(optimize)
 {
-    FloatV x = x_;
-    using namespace rr;
-    const uint32_t min_norm_pos = 0x00800000, inv_mant_mask = ~0x7F800000;
-    const float float_half = 0.5f, sqrt_1_2 = 0.707106781186547524f, log_p0 = 7.0376836292E-2f, log_p1 = -1.1514610310E-1f,
-          log_p2 = 1.1676998740E-1f, log_p3 = -1.2420140846E-1f, log_p4 = +1.4249322787E-1f, log_p5 = -1.6668057665E-1f,
-          log_p6 = +2.0000714765E-1f, log_p7 = -2.4999993993E-1f, log_p8 = +3.3333331174E-1f, log_q2 = 0.693359375f,
-          log_q1 = -2.12194440e-4f;
-    const float zero = 0.0f, one = 1.0f;
-    IntV invalid_mask = CmpLE(x, FloatV(zero));
-    x = Max(x, As<FloatV>(IntV(min_norm_pos)));
-    IntV emm0i = As<IntV>(x) >> 23;
-    x = As<FloatV>(As<IntV>(x) & IntV(inv_mant_mask));
-    x = As<FloatV>(As<IntV>(x) | As<IntV>(FloatV(float_half)));
-    emm0i = emm0i - IntV(0x7f);
-    FloatV emm0 = FloatV(emm0i);
+    constexpr unsigned char numOperands[] = {
+        0, // MEM_LOAD
+        0, // CONSTANTI
+        0, // CONSTANTF
+        0, // CONST_LOAD
+        0, // VAR_LOAD
+        1, // VAR_STORE
+        1, // REDUCE
+        2, // MEM_GATHER
+        2, // ADD
+        2, // SUB
+        2, // MUL
+        2, // DIV
+        2, // MOD
+        1, // SQRT
+        1, // ABS
+        2, // MAX
+        2, // MIN
+        3, // CLAMP
+        2, // CMP
+        1, // TRUNC
+        1, // ROUND
+        1, // FLOOR
+        2, // AND
+        2, // OR
+        2, // XOR
+        1, // NOT
+        1, // EXP
+        1, // LOG
+        2, // POW
+        1, // SIN
+        1, // COS
+        3, // TERNARY
+        0, // SORT
+        0, // SELECT
+        0, // DUP
+        0, // SWAP
+        0, // DROP
+    };
+    static_assert(sizeof(numOperands) == static_cast<unsigned>(ExprOpType::DROP) + 1, "invalid table");
+
+    std::map<std::pair<int, std::string>, int> paMap;
+
+    // Every expression has its own stack and variables, only the nodes are shared.
+    for (size_t e = 0; e < exprs.size(); e++) {
+    const std::string &expr = exprs[e];
+    std::vector<int> stack;
+    std::map<std::string, int> variables;
+
+    for (size_t i = 0; i < ops[e].size(); i++) {
+        // Op i is token i of the expression, which is only looked up for errors.
+        auto tok = [&expr, i] { return tokenAt(expr, i); };
+        ExprOp op = ops[e][i];
+
+        // Check validity.
+        if ((op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::MEM_GATHER) && op.imm.i >= numInputs)
+            throw std::runtime_error("reference to undefined clip: " + tok());
+        if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
+            throw std::runtime_error("insufficient values on stack: " + tok());
+        if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT || op.type == ExprOpType::SELECT) && op.imm.u > stack.size())
+            throw std::runtime_error("insufficient values on stack: " + tok());
+        if (stack.size() < numOperands[static_cast<size_t>(op.type)])
+            throw std::runtime_error("insufficient values on stack: " + tok());
+
+        auto pop = [&stack]() { int n = stack.back(); stack.pop_back(); return n; };
+        switch (op.type) {
+        case ExprOpType::DUP:
+            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+            break;
+        case ExprOpType::SWAP:
+            std::swap(stack[stack.size() - 1], stack[stack.size() - 1 - op.imm.u]);
+            break;
+        case ExprOpType::DROP:
+            stack.resize(stack.size() - op.imm.u);
+            break;
+        case ExprOpType::SORT: {
+            // "3 7 1 2 0 4 6 5 sort8" -> "7 6 5 4 3 2 1 0"
+            auto at = [&stack](int i) -> int& { return stack.at(stack.size() - 1 - i); };
+            for (auto cmp: buildSortNet(op.imm.u)) {
+                int &a = at(cmp.first), &b = at(cmp.second);
+                int min = make(ExprOpType::MIN, a, b), max = make(ExprOpType::MAX, a, b);
+                a = min, b = max;
+            }
+            break;
+        }
+        case ExprOpType::SELECT: {
+            // "3 7 1 2 0 4 6 5 select8,2" -> "2", only computing what that rank depends on.
+            auto at = [&stack](int i) -> int& { return stack.at(stack.size() - 1 - i); };
+            for (auto cmp: buildSelectNet(op.imm.u, op.x)) {
+                int &a = at(cmp.first), &b = at(cmp.second);
+                int min = make(ExprOpType::MIN, a, b), max = make(ExprOpType::MAX, a, b);
+                a = min, b = max;
+            }
+            int v = at(op.x);
+            stack.resize(stack.size() - op.imm.u);
+            stack.push_back(v);
+            break;
+        }
+        case ExprOpType::VAR_LOAD: {
+            auto it = variables.find(op.name);
+            if (it == variables.end())
+                throw std::runtime_error("reference to uninitialized variable: " + tok());
+            stack.push_back(it->second);
+            break;
+        }
+        case ExprOpType::VAR_STORE:
+            variables[op.name] = pop();
+            break;
+        case ExprOpType::REDUCE:
+            reductions.push_back({ (int)e, static_cast<ReductionType>(op.imm.u), op.name, pop() });
+            break;
+        case ExprOpType::CONST_LOAD: {
+            constexpr int last = static_cast<int>(LoadConstType::LAST);
+            if (op.imm.i >= last) {
+                int id = op.imm.i - last;
+                if (id >= numInputs)
+                    throw std::runtime_error("reference to undefined clip: " + tok());
+                auto key = std::make_pair(id, op.name);
+                auto it = paMap.find(key);
+                if (it == paMap.end()) {
+                    it = paMap.insert({ key, (int)paMap.size() }).first;
+                    propAccess.push_back(Compiled::PropAccess{ id, op.name });
+                }
+                op.imm.i = last + it->second;
+            }
+            stack.push_back(make(op));
+            break;
+        }
+        case ExprOpType::CONSTANTF:
+            // Integral constants are integers.
+            if (std::fabs(op.imm.f) < 2147483648.0f && op.imm.f == (float)(int)op.imm.f)
+                op = ExprOp(ExprOpType::CONSTANTI, (int)op.imm.f);
+            stack.push_back(make(op));
+            break;
+        default: {
+            int n = numOperands[static_cast<size_t>(op.type)];
+            int a[3] = { -1, -1, -1 };
+            for (int k = n - 1; k >= 0; k--)
+                a[k] = pop();
+            stack.push_back(make(op, a[0], a[1], a[2]));
+            break;
+        }
+        }
+    }
+
+    if (stack.empty())
+        throw std::runtime_error("empty expression: " + expr);
+    if (stack.size() > 1)
+        throw std::runtime_error("unconsumed values on stack: " + expr);
+    roots.push_back(stack.back());
+    }
+}
+
+std::vector<int> ExprGraph::schedule() const
+{
+    // Iterative post-order DFS.
+    std::vector<int> order;
+    std::vector<char> visited(nodes.size());
+    std::vector<std::pair<int, int>> work;
+    std::vector<int> sinks = roots;
+    for (const auto &r: reductions)
+        sinks.push_back(r.node);
+    for (int root: sinks) {
+        if (visited[root])
+            continue;
+        visited[root] = 1;
+        work.push_back({ root, 0 });
+        while (!work.empty()) {
+            auto &top = work.back();
+            const ExprNode &node = nodes[top.first];
+            if (top.second < node.numArgs) {
+                int arg = node.args[top.second++];
+                if (!visited[arg]) {
+                    visited[arg] = 1;
+                    work.push_back({ arg, 0 });
+                }
+            } else {
+                order.push_back(top.first);
+                work.pop_back();
+            }
+        }
+    }
+    return order;
+}
+
+// IEEE half precision conversions, rounding to nearest even like F16C.
+static float halfToFloat(uint16_t h)
+{
+    const uint32_t sign = (h & 0x8000u) << 16, exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        float f = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -f : f;
+    }
+    uint32_t bits = sign | mantissa << 13 | (exponent == 0x1f ? 0x7f800000u : (exponent + 112) << 23);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint16_t floatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+    if (x > 0x7f800000) // NaN, keep it quiet
+        return sign | 0x7e00 | ((x >> 13) & 0x3ff);
+    if (x >= 0x477ff000) // Rounds to infinity.
+        return sign | 0x7c00;
+    if (x < 0x38800000) { // Subnormal, the scaled value is exact.
+        float a;
+        memcpy(&a, &x, sizeof(a));
+        return sign | static_cast<uint16_t>(std::nearbyint(a * 16777216.0f));
+    }
+    return sign | static_cast<uint16_t>((x - (112u << 23) + 0xfff + ((x >> 13) & 1)) >> 13);
+}
+
+// How inputs of another subsampling than the output are read at the pixels of the output
+// plane, instead of at the same coordinates. scale holds log2 of the size of the plane of
+// each input over that of the output plane, horizontally and vertically. Chroma is sited
+// at the left of the pixels it covers horizontally and at their center vertically, as is
+// usual for 4:2:0 (and the default of the resizers), and either the sample at or above
+// left of the position is read, or the nearest ones are interpolated bilinearly.
+struct InputSampling {
+    std::vector<std::pair<int, int>> scale;
+    bool bilinear = false;
+
+    bool resampled(int clip) const { return clip < (int)scale.size() && (scale[clip].first || scale[clip].second); }
+    bool any() const {
+        for (int i = 0; i < (int)scale.size(); i++)
+            if (resampled(i))
+                return true;
+        return false;
+    }
+    std::string key() const {
+        std::stringstream ss;
+        for (const auto &s : scale)
+            ss << s.first << "," << s.second << ";";
+        ss << (bilinear ? "bilinear" : "nearest");
+        return ss.str();
+    }
+};
+
+static InputSampling inputSampling(const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, int plane, bool bilinear) {
+    InputSampling s;
+    s.bilinear = bilinear;
+    for (int i = 0; i < numInputs; i++) {
+        if (plane == 0)
+            s.scale.emplace_back(0, 0);
+        else
+            s.scale.emplace_back(vo->format->subSamplingW - vi[i]->format->subSamplingW, vo->format->subSamplingH - vi[i]->format->subSamplingH);
+    }
+    return s;
+}
+
+// The samples i0 and i1 of a plane of 2^scale times the size of the output plane that are
+// interpolated with weight w of i1 for pixel p of the output plane, see InputSampling.
+struct SamplePosition {
+    int i0, i1;
+    float w;
+};
+
+static SamplePosition samplePosition(int p, int scale, bool centered, int size) {
+    int num, shift;
+    if (!centered) {
+        num = scale >= 0 ? p << scale : p;
+        shift = std::max(-scale, 0);
+    } else if (scale >= 0) {
+        num = ((2 * p + 1) << scale) - 1;
+        shift = 1;
+    } else {
+        num = 2 * p + 1 - (1 << -scale);
+        shift = 1 - scale;
+    }
+    const int i0 = num >> shift;
+    return { std::max(i0, 0), std::min(i0 + 1, size - 1), static_cast<float>(num & ((1 << shift) - 1)) / (1 << shift) };
+}
+
+// The threshold at (x, y) of the 8x8 Bayer matrix of ordered dithering, from the bits of
+// x ^ y and y interleaved in reverse order. Compiler::ditherOffset() computes the same.
+static inline int bayer8(int x, int y) {
+    const int v = x ^ y;
+    return (v & 1) << 5 | (y & 1) << 4 | (v & 2) << 2 | (y & 2) << 1 | (v & 4) >> 1 | (y & 4) >> 2;
+}
+
+// Added to the float results stored to integer formats with dither, within +-0.5. Both
+// terms are exact, so the sum is rounded once like in the generated code.
+static inline float ditherOffset(int x, int y) {
+    return static_cast<float>(bayer8(x, y)) * (1.0f / 64) + (0.5f / 64 - 0.5f);
+}
+
+// Max and Min of floats as in the generated code (maxps and minps): the second operand
+// unless the first one compares greater (less), so that a NaN first operand is replaced.
+static inline float interpretedMax(float x, float y) { return x > y ? x : y; }
+static inline float interpretedMin(float x, float y) { return x < y ? x : y; }
+
+// Evaluates an ExprGraph without generating code, for the frames that are requested
+// while the plane is still being compiled in the background. The values have the same
+// types as in the generated code (see buildIters), but the transcendental functions are
+// taken from the C library, so the results may differ in the last bits.
+//
+// Every node is evaluated for a block of pixels of a row at a time, which amortizes the
+// dispatch and lets the compiler vectorize the inner loops.
+class ExprInterpreter {
+    static constexpr int blockSize = 64;
+
+    struct Insn {
+        ExprOp op;
+        int args[3];
+        bool isFloat;
+        bool argFloat[3];
+    };
+    std::vector<Insn> insns;
+    std::vector<int> results; // instruction of each output
+    std::vector<std::pair<int, ReductionType>> reductions; // instruction and type
+    const VSFormat *dstFormat;
+    std::vector<const VSFormat *> srcFormats;
+    InputSampling sampling;
+    bool dither;
+
+    ExprUnion sample(int clip, const uint8_t *const *rwptrs, const int *strides, int x, int y) const;
+    void load(const Insn &insn, const uint8_t *const *rwptrs, const int *strides, int x0, int n, int y, int width, int height, ExprUnion *dst) const;
+    void gather(const Insn &insn, const uint8_t *const *rwptrs, const int *strides, const ExprUnion *xs, const ExprUnion *ys, int n, int width, int height, ExprUnion *dst) const;
+    void store(const ExprUnion *src, bool isFloat, uint8_t *dstp, int x0, int n, int y) const;
+
+public:
+    std::vector<Compiled::PropAccess> propAccess;
+
+    ExprInterpreter(const ExprGraph &graph, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, const InputSampling &sampling = InputSampling(),
+                    bool dither = false);
+
+    // Same interface as the generated code, see ExprData::ProcessProc.
+    void process(void *rwptrs, const int *strides, const float *props, int width, int height, int ystart, int yend, float *rowReductions) const;
+};
+
+ExprInterpreter::ExprInterpreter(const ExprGraph &graph, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, const InputSampling &sampling,
+                                 bool dither) :
+    dstFormat(vo->format), sampling(sampling), dither(dither), propAccess(graph.propAccess)
+{
+    for (int i = 0; i < numInputs; i++)
+        srcFormats.push_back(vi[i]->format);
+
+    // Operands refer to instructions instead of graph nodes.
+    std::vector<int> slot(graph.size(), -1);
+    for (int n: graph.schedule()) {
+        const ExprNode &node = graph[n];
+        Insn insn{ node.op, { -1, -1, -1 }, node.isFloat, {} };
+        for (int i = 0; i < node.numArgs; i++) {
+            insn.args[i] = slot[node.args[i]];
+            insn.argFloat[i] = graph[node.args[i]].isFloat;
+        }
+        slot[n] = (int)insns.size();
+        insns.push_back(insn);
+    }
+    for (int root: graph.roots)
+        results.push_back(slot[root]);
+    for (const auto &r: graph.reductions)
+        reductions.push_back({ slot[r.node], r.type });
+}
+
+ExprUnion ExprInterpreter::sample(int clip, const uint8_t *const *rwptrs, const int *strides, int x, int y) const
+{
+    const VSFormat *format = srcFormats[clip];
+    const int k = (int)results.size() + clip;
+    const uint8_t *row = rwptrs[k] + (ptrdiff_t)y * strides[k];
+    if (format->sampleType == stFloat && format->bytesPerSample == 2)
+        return halfToFloat(reinterpret_cast<const uint16_t *>(row)[x]);
+    else if (format->sampleType == stFloat)
+        return reinterpret_cast<const float *>(row)[x];
+    else if (format->bytesPerSample == 1)
+        return static_cast<int32_t>(row[x]);
+    else if (format->bytesPerSample == 2)
+        return static_cast<int32_t>(reinterpret_cast<const uint16_t *>(row)[x]);
+    return reinterpret_cast<const int32_t *>(row)[x];
+}
+
+void ExprInterpreter::load(const Insn &insn, const uint8_t *const *rwptrs, const int *strides, int x0, int n, int y, int width, int height, ExprUnion *dst) const
+{
+    const ExprOp &op = insn.op;
+    const VSFormat *format = srcFormats[op.imm.i];
+    auto mirror = [](int v, int size) { return v < 0 ? -1 - v : v >= size ? 2 * size - 1 - v : v; };
+    int sy;
+    if (op.bc == BoundaryCondition::Clamped)
+        sy = std::min(std::max(y + op.y, 0), height - 1);
+    else
+        sy = mirror(y + std::min(std::max(op.y, -height), height), height);
+    auto sample = [&](int y, int x) { return this->sample(op.imm.i, rwptrs, strides, x, y); };
+    auto sampleF = [&](int y, int x) {
+        ExprUnion v = sample(y, x);
+        return format->sampleType == stInteger ? static_cast<float>(v.i) : v.f;
+    };
+
+    for (int i = 0; i < n; i++) {
+        int sx;
+        if (op.bc == BoundaryCondition::Clamped)
+            sx = std::min(std::max(x0 + i + op.x, 0), width - 1);
+        else
+            sx = mirror(x0 + i + std::min(std::max(op.x, -width), width), width);
+
+        ExprUnion v;
+        if (sampling.resampled(op.imm.i)) {
+            const auto scale = sampling.scale[op.imm.i];
+            if (sampling.bilinear) {
+                // In the same order as Compiler::loadResampled().
+                const int w = scale.first >= 0 ? width << scale.first : width >> -scale.first;
+                const int h = scale.second >= 0 ? height << scale.second : height >> -scale.second;
+                const SamplePosition px = samplePosition(sx, scale.first, false, w), py = samplePosition(sy, scale.second, true, h);
+                auto row = [&](int y) {
+                    float a = sampleF(y, px.i0);
+                    if (scale.first < 0)
+                        a = a + (sampleF(y, px.i1) - a) * px.w;
+                    return a;
+                };
+                float f = row(py.i0);
+                if (scale.second != 0)
+                    f = f + (row(py.i1) - f) * py.w;
+                dst[i] = insn.isFloat ? ExprUnion(f) : ExprUnion(static_cast<int32_t>(std::nearbyint(f)));
+                continue;
+            }
+            v = sample(scale.second >= 0 ? sy << scale.second : sy >> -scale.second, scale.first >= 0 ? sx << scale.first : sx >> -scale.first);
+        } else
+            v = sample(sy, sx);
+        if (insn.isFloat && format->sampleType == stInteger)
+            v = static_cast<float>(v.i);
+        dst[i] = v;
+    }
+}
+
+// As in Compiler::loadGather(), float coordinates beyond the int32 range become INT32_MIN.
+void ExprInterpreter::gather(const Insn &insn, const uint8_t *const *rwptrs, const int *strides, const ExprUnion *xs, const ExprUnion *ys, int n, int width, int height, ExprUnion *dst) const
+{
+    const ExprOp &op = insn.op;
+    const VSFormat *format = srcFormats[op.imm.i];
+    auto coordinate = [&](const ExprUnion &v, bool isFloat, int size) {
+        int32_t c = v.i;
+        if (isFloat)
+            c = std::fabs(v.f) < 2147483648.0f ? static_cast<int32_t>(std::nearbyint(v.f)) : INT32_MIN;
+        if (op.bc == BoundaryCondition::Mirrored)
+            c = c < 0 ? -1 - c : c >= size ? 2 * size - 1 - c : c;
+        return std::min(std::max(c, 0), size - 1);
+    };
+
+    for (int i = 0; i < n; i++) {
+        int sx = coordinate(xs[i], insn.argFloat[0], width), sy = coordinate(ys[i], insn.argFloat[1], height);
+        if (sampling.resampled(op.imm.i)) {
+            const auto scale = sampling.scale[op.imm.i];
+            sx = scale.first >= 0 ? sx << scale.first : sx >> -scale.first;
+            sy = scale.second >= 0 ? sy << scale.second : sy >> -scale.second;
+        }
+        ExprUnion v = sample(op.imm.i, rwptrs, strides, sx, sy);
+        if (insn.isFloat && format->sampleType == stInteger)
+            v = static_cast<float>(v.i);
+        dst[i] = v;
+    }
+}
+
+void ExprInterpreter::store(const ExprUnion *src, bool isFloat, uint8_t *dstp, int x0, int n, int y) const
+{
+    if (dstFormat->sampleType == stFloat) {
+        for (int i = 0; i < n; i++) {
+            float f = isFloat ? src[i].f : static_cast<float>(src[i].i);
+            if (dstFormat->bytesPerSample == 2)
+                reinterpret_cast<uint16_t *>(dstp)[x0 + i] = floatToHalf(f);
+            else
+                reinterpret_cast<float *>(dstp)[x0 + i] = f;
+        }
+        return;
+    }
+
+    const int bits = dstFormat->bitsPerSample;
+    const float maxval = static_cast<float>((1u << bits) - 1);
+    for (int i = 0; i < n; i++) {
+        int32_t v;
+        if (isFloat) {
+            float f = dither ? src[i].f + ditherOffset(x0 + i, y) : src[i].f;
+            // NaN becomes 0 like in the generated code.
+            f = f > 0 ? f : 0.0f;
+            v = static_cast<int32_t>(std::lrint(std::min(f, maxval)));
+        } else if (bits < 32)
+            v = std::min(std::max(src[i].i, 0), static_cast<int32_t>((1u << bits) - 1));
+        else
+            v = src[i].i;
+
+        if (dstFormat->bytesPerSample == 1)
+            dstp[x0 + i] = static_cast<uint8_t>(v);
+        else if (dstFormat->bytesPerSample == 2)
+            reinterpret_cast<uint16_t *>(dstp)[x0 + i] = static_cast<uint16_t>(v);
+        else
+            reinterpret_cast<int32_t *>(dstp)[x0 + i] = v;
+    }
+}
+
+void ExprInterpreter::process(void *rwptrs_, const int *strides, const float *props, int width, int height, int ystart, int yend, float *rowReductions) const
+{
+    const uint8_t *const *rwptrs = static_cast<const uint8_t *const *>(rwptrs_);
+    std::vector<ExprUnion> regs(insns.size() * blockSize);
+    constexpr int bias = static_cast<int>(LoadConstIndex::LAST) - static_cast<int>(LoadConstType::LAST);
+
+    std::vector<float> acc(reductions.size());
+    for (int y = ystart; y < yend; y++) {
+        for (size_t r = 0; r < reductions.size(); r++)
+            acc[r] = reductionIdentity(reductions[r].second);
+        for (int x0 = 0; x0 < width; x0 += blockSize) {
+            const int n = std::min(blockSize, width - x0);
+
+            for (size_t k = 0; k < insns.size(); k++) {
+                const Insn &insn = insns[k];
+                const ExprOp &op = insn.op;
+                ExprUnion *dst = &regs[k * blockSize];
+                const ExprUnion *a = insn.args[0] >= 0 ? &regs[insn.args[0] * blockSize] : nullptr;
+                const ExprUnion *b = insn.args[1] >= 0 ? &regs[insn.args[1] * blockSize] : nullptr;
+                const ExprUnion *c = insn.args[2] >= 0 ? &regs[insn.args[2] * blockSize] : nullptr;
+                // Operand j of pixel i as a float, or as a truth value.
+                auto F = [&](const ExprUnion *v, int j, int i) { return insn.argFloat[j] ? v[i].f : static_cast<float>(v[i].i); };
+                auto T = [&](const ExprUnion *v, int j, int i) { return insn.argFloat[j] ? v[i].f > 0 : v[i].i > 0; };
+#define FOR_EACH(expr) for (int i = 0; i < n; i++) dst[i] = (expr)
+#define FLOAT_OR_INT(fexpr, iexpr) do { if (insn.isFloat) FOR_EACH(fexpr); else FOR_EACH(iexpr); } while (0)
+#define UNARYF(f) FOR_EACH(static_cast<float>(f(F(a, 0, i))))
+
+                switch (op.type) {
+                case ExprOpType::MEM_LOAD:
+                    load(insn, rwptrs, strides, x0, n, y, width, height, dst);
+                    break;
+                case ExprOpType::MEM_GATHER:
+                    gather(insn, rwptrs, strides, a, b, n, width, height, dst);
+                    break;
+                case ExprOpType::CONSTANTI:
+                case ExprOpType::CONSTANTF:
+                    FOR_EACH(op.imm);
+                    break;
+                case ExprOpType::CONST_LOAD:
+                    switch (static_cast<LoadConstType>(op.imm.i)) {
+                    case LoadConstType::N: FOR_EACH(reinterpret_cast<const ExprUnion *>(props)[static_cast<int>(LoadConstIndex::N)]); break;
+                    case LoadConstType::X: FOR_EACH(static_cast<int32_t>(x0 + i)); break;
+                    case LoadConstType::Y: FOR_EACH(static_cast<int32_t>(y)); break;
+                    case LoadConstType::Width: FOR_EACH(static_cast<int32_t>(width)); break;
+                    case LoadConstType::Height: FOR_EACH(static_cast<int32_t>(height)); break;
+                    default: FOR_EACH(props[op.imm.i + bias]); break;
+                    }
+                    break;
+                // Integer arithmetic wraps around.
+                case ExprOpType::ADD: FLOAT_OR_INT(F(a, 0, i) + F(b, 1, i), static_cast<int32_t>(a[i].u + b[i].u)); break;
+                case ExprOpType::SUB: FLOAT_OR_INT(F(a, 0, i) - F(b, 1, i), static_cast<int32_t>(a[i].u - b[i].u)); break;
+                case ExprOpType::MUL: FLOAT_OR_INT(F(a, 0, i) * F(b, 1, i), static_cast<int32_t>(a[i].u * b[i].u)); break;
+                case ExprOpType::DIV: FOR_EACH(F(a, 0, i) / F(b, 1, i)); break;
+                case ExprOpType::MOD: FOR_EACH(std::fmod(F(a, 0, i), F(b, 1, i))); break;
+                case ExprOpType::SQRT: FOR_EACH(std::sqrt(std::max(F(a, 0, i), 0.0f))); break;
+                case ExprOpType::ABS: FLOAT_OR_INT(std::fabs(F(a, 0, i)), static_cast<int32_t>(a[i].i < 0 ? 0u - a[i].u : a[i].u)); break;
+                case ExprOpType::MAX: FLOAT_OR_INT(interpretedMax(F(a, 0, i), F(b, 1, i)), std::max(a[i].i, b[i].i)); break;
+                case ExprOpType::MIN: FLOAT_OR_INT(interpretedMin(F(a, 0, i), F(b, 1, i)), std::min(a[i].i, b[i].i)); break;
+                case ExprOpType::CLAMP:
+                    FLOAT_OR_INT(interpretedMax(interpretedMin(F(a, 0, i), F(c, 2, i)), F(b, 1, i)), std::max(std::min(a[i].i, c[i].i), b[i].i));
+                    break;
+                case ExprOpType::CMP: {
+                    const bool anyFloat = insn.argFloat[0] || insn.argFloat[1];
+                    for (int i = 0; i < n; i++) {
+                        float lf = F(a, 0, i), rf = F(b, 1, i);
+                        int32_t li = a[i].i, ri = b[i].i;
+                        bool r = false;
+                        switch (static_cast<ComparisonType>(op.imm.u)) {
+                        case ComparisonType::EQ:  r = anyFloat ? lf == rf : li == ri; break;
+                        case ComparisonType::LT:  r = anyFloat ? lf < rf : li < ri; break;
+                        case ComparisonType::LE:  r = anyFloat ? lf <= rf : li <= ri; break;
+                        case ComparisonType::NEQ: r = anyFloat ? !(lf == rf) : li != ri; break;
+                        case ComparisonType::NLT: r = anyFloat ? !(lf < rf) : li >= ri; break;
+                        case ComparisonType::NLE: r = anyFloat ? !(lf <= rf) : li > ri; break;
+                        }
+                        dst[i] = static_cast<int32_t>(r);
+                    }
+                    break;
+                }
+                case ExprOpType::AND: FOR_EACH(static_cast<int32_t>(T(a, 0, i) && T(b, 1, i))); break;
+                case ExprOpType::OR: FOR_EACH(static_cast<int32_t>(T(a, 0, i) || T(b, 1, i))); break;
+                case ExprOpType::XOR: FOR_EACH(static_cast<int32_t>(T(a, 0, i) != T(b, 1, i))); break;
+                case ExprOpType::NOT: FOR_EACH(static_cast<int32_t>(!T(a, 0, i))); break;
+                case ExprOpType::TRUNC: UNARYF(std::trunc); break;
+                case ExprOpType::ROUND: UNARYF(std::nearbyint); break;
+                case ExprOpType::FLOOR: UNARYF(std::floor); break;
+                // Like Exp_ and Log_, which saturate (NaN included) and return NaN for x <= 0.
+                case ExprOpType::EXP: FOR_EACH(std::exp(interpretedMax(interpretedMin(F(a, 0, i), 88.3762626647949f), -88.3762626647949f))); break;
+                case ExprOpType::LOG: FOR_EACH(F(a, 0, i) > 0 ? std::log(F(a, 0, i)) : std::numeric_limits<float>::quiet_NaN()); break;
+                case ExprOpType::POW: FOR_EACH(static_cast<float>(std::pow(F(a, 0, i), F(b, 1, i)))); break;
+                case ExprOpType::SIN: UNARYF(std::sin); break;
+                case ExprOpType::COS: UNARYF(std::cos); break;
+                case ExprOpType::TERNARY:
+                    FLOAT_OR_INT(T(a, 0, i) ? F(b, 1, i) : F(c, 2, i), T(a, 0, i) ? b[i].i : c[i].i);
+                    break;
+                default:
+                    // Stack manipulation and variables are resolved by ExprGraph.
+                    abort();
+                }
+#undef UNARYF
+#undef FLOAT_OR_INT
+#undef FOR_EACH
+            }
+
+            for (size_t j = 0; j < results.size(); j++) {
+                uint8_t *dstp = const_cast<uint8_t *>(rwptrs[j]) + (ptrdiff_t)y * strides[j];
+                store(&regs[results[j] * blockSize], insns[results[j]].isFloat, dstp, x0, n, y);
+            }
+            for (size_t r = 0; r < reductions.size(); r++) {
+                const int k = reductions[r].first;
+                const ExprUnion *v = &regs[k * blockSize];
+                for (int i = 0; i < n; i++)
+                    acc[r] = reduce(reductions[r].second, acc[r], insns[k].isFloat ? v[i].f : static_cast<float>(v[i].i));
+            }
+        }
+        for (size_t r = 0; r < reductions.size(); r++) {
+            float &row = rowReductions[(size_t)y * reductions.size() + r];
+            row = reduce(reductions[r].second, row, acc[r]);
+        }
+    }
+}
+
+std::vector<bool> ExprGraph::frameInvariant() const
+{
+    std::vector<bool> invariant(nodes.size());
+    for (int n: schedule()) {
+        const ExprNode &node = nodes[n];
+        switch (node.op.type) {
+        case ExprOpType::MEM_LOAD: case ExprOpType::MEM_GATHER:
+            break;
+        case ExprOpType::CONST_LOAD:
+            invariant[n] = node.op.imm.i != static_cast<int>(LoadConstType::X) && node.op.imm.i != static_cast<int>(LoadConstType::Y);
+            break;
+        default:
+            invariant[n] = true;
+            for (int i = 0; i < node.numArgs; i++)
+                invariant[n] = invariant[n] && invariant[node.args[i]];
+        }
+    }
+    return invariant;
+}
+
+template<int lanes>
+struct VectorTypes {
+    typedef rr::Void Byte;
+    typedef rr::Void UShort;
+    typedef rr::Void Int;
+    typedef rr::Void Float;
+};
+
+template<>
+struct VectorTypes<4> {
+    typedef rr::Byte4 Byte;
+    typedef rr::UShort4 UShort;
+    typedef rr::Int4 Int;
+    typedef rr::Float4 Float;
+    typedef uint16_t SwizzleMask;
+    // No 16-bit code, see narrowRanges().
+    typedef rr::Void NarrowByte;
+    typedef rr::Void Short;
+};
+
+template<>
+struct VectorTypes<8> {
+public:
+    typedef rr::Byte8 Byte;
+    typedef rr::UShort8 UShort;
+    typedef rr::Int8 Int;
+    typedef rr::Float8 Float;
+    typedef uint32_t SwizzleMask;
+    // Vectors of twice as many 16-bit lanes.
+    typedef rr::Byte16 NarrowByte;
+    typedef rr::Short16 Short;
+};
+
+template<>
+struct VectorTypes<16> {
+public:
+    typedef rr::Byte16 Byte;
+    typedef rr::UShort16 UShort;
+    typedef rr::Int16 Int;
+    typedef rr::Float16 Float;
+    typedef uint64_t SwizzleMask;
+    // Vectors of twice as many 16-bit lanes.
+    typedef rr::Byte32 NarrowByte;
+    typedef rr::Short32 Short;
+};
+
+// Short expressions are latency bound, so several independent vectors are processed per
+// iteration to keep the execution units busy. Longer ones have enough parallelism already
+// and would only run out of registers.
+static int autoUnroll(const ExprGraph &graph) {
+    int work = 0;
+    for (int n: graph.schedule()) {
+        switch (graph[n].op.type) {
+        case ExprOpType::MEM_LOAD: case ExprOpType::CONSTANTI:
+        case ExprOpType::CONSTANTF: case ExprOpType::CONST_LOAD:
+            break;
+        default:
+            work++;
+        }
+    }
+    if (work <= 4)
+        return 4;
+    if (work <= 16)
+        return 2;
+    return 1;
+}
+
+// The optimization pipeline of jit_level, as an edit of the default set up by initExpr().
+// 0 only promotes the variables to registers, for the shortest compile, 1 also folds and
+// merges the obvious and 3 adds the loop and straight line vectorizers and unrolling.
+static rr::Config::Edit jitConfig(int level) {
+    rr::Config::Edit cfg;
+    switch (level) {
+    case 0:
+        cfg.set(rr::Optimization::Level::None)
+            .clearOptimizationPasses()
+            .add(rr::Optimization::Pass::ScalarReplAggregates);
+        break;
+    case 1:
+        cfg.set(rr::Optimization::Level::Less)
+            .clearOptimizationPasses()
+            .add(rr::Optimization::Pass::ScalarReplAggregates)
+            .add(rr::Optimization::Pass::InstructionCombining)
+            .add(rr::Optimization::Pass::EarlyCSEPass)
+            .add(rr::Optimization::Pass::CFGSimplification);
+        break;
+    case 3:
+        cfg.add(rr::Optimization::Pass::LoopRotate)
+            .add(rr::Optimization::Pass::LoopVectorize)
+            .add(rr::Optimization::Pass::LoopUnroll)
+            .add(rr::Optimization::Pass::SLPVectorize)
+            .add(rr::Optimization::Pass::InstructionCombining)
+            .add(rr::Optimization::Pass::CFGSimplification);
+        break;
+    }
+    return cfg;
+}
+
+// The largest offsets of the relative pixel accesses in each direction.
+struct RelativeExtent {
+    int minX = 0, maxX = 0, minY = 0, maxY = 0;
+    bool any() const { return minX || maxX || minY || maxY; }
+};
+
+static RelativeExtent relativeExtent(const ExprGraph &graph) {
+    RelativeExtent e;
+    for (int n: graph.schedule()) {
+        const ExprOp &op = graph[n].op;
+        if (op.type != ExprOpType::MEM_LOAD)
+            continue;
+        e.minX = std::min(e.minX, op.x);
+        e.maxX = std::max(e.maxX, op.x);
+        e.minY = std::min(e.minY, op.y);
+        e.maxY = std::max(e.maxY, op.y);
+    }
+    return e;
+}
+
+// Vertical relative accesses read every row of an input several times, which only hits the
+// cache if all rows in between are still there. For wide planes the rows are processed in
+// column tiles instead, each narrow enough for the rows involved to fit in half of a typical
+// L2. Returns the tile width (a multiple of step), or 0 if the plane is processed whole.
+static int tileWidth(const ExprGraph &graph, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int step) {
+    std::map<int, std::pair<int, int>> rows; // input -> [min, max] relative row
+    for (int n: graph.schedule()) {
+        const ExprOp &op = graph[n].op;
+        if (op.type != ExprOpType::MEM_LOAD)
+            continue;
+        auto it = rows.emplace(op.imm.i, std::make_pair(op.y, op.y)).first;
+        it->second.first = std::min(it->second.first, op.y);
+        it->second.second = std::max(it->second.second, op.y);
+    }
+    bool reused = false;
+    int bytesPerColumn = (int)graph.roots.size() * vo->format->bytesPerSample;
+    for (const auto &r: rows) {
+        int span = r.second.second - r.second.first + 1;
+        reused |= span > 1;
+        bytesPerColumn += span * vi[r.first]->format->bytesPerSample;
+    }
+    if (!reused)
+        return 0;
+    int tile = EXPR_TILE_BYTES / bytesPerColumn / step * step;
+    return std::max(tile, (EXPR_MIN_TILE + step - 1) / step * step);
+}
+
+// [min, max] of an integer value.
+typedef std::pair<int32_t, int32_t> ValueRange;
+
+// The range of each node, if all nodes of the plane are integers representable in 16 bits,
+// so that it can be computed with twice as many (16-bit) lanes per vector, or an empty
+// vector otherwise. The results are exactly those of both the float and the integer (opt=1)
+// evaluation, as nothing can overflow or be rounded.
+static std::vector<ValueRange> narrowRanges(const ExprGraph &graph, const VSVideoInfo *vo, const VSVideoInfo *const *vi) {
+    const VSFormat *fo = vo->format;
+    if (fo->sampleType != stInteger || fo->bitsPerSample > 16 || !graph.reductions.empty())
+        return {};
+    std::vector<ValueRange> ranges(graph.size());
+    for (int n: graph.schedule()) {
+        const ExprNode &node = graph[n];
+        const ExprOp &op = node.op;
+        auto lo = [&](int i) -> int64_t { return ranges[node.args[i]].first; };
+        auto hi = [&](int i) -> int64_t { return ranges[node.args[i]].second; };
+        int64_t min, max;
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD: {
+            const VSFormat *f = vi[op.imm.i]->format;
+            if (op.x || op.y || f->sampleType != stInteger || f->bitsPerSample > 16)
+                return {};
+            min = 0;
+            max = (1 << f->bitsPerSample) - 1;
+            break;
+        }
+        case ExprOpType::CONSTANTI:
+            min = max = op.imm.i;
+            break;
+        case ExprOpType::CONSTANTF:
+            if (!(std::fabs(op.imm.f) <= 32768) || std::trunc(op.imm.f) != op.imm.f)
+                return {};
+            min = max = static_cast<int64_t>(op.imm.f);
+            break;
+        case ExprOpType::ADD:
+            min = lo(0) + lo(1);
+            max = hi(0) + hi(1);
+            break;
+        case ExprOpType::SUB:
+            min = lo(0) - hi(1);
+            max = hi(0) - lo(1);
+            break;
+        case ExprOpType::MUL: {
+            int64_t p[] = { lo(0) * lo(1), lo(0) * hi(1), hi(0) * lo(1), hi(0) * hi(1) };
+            min = *std::min_element(p, p + 4);
+            max = *std::max_element(p, p + 4);
+            break;
+        }
+        case ExprOpType::ABS:
+            min = lo(0) >= 0 ? lo(0) : hi(0) <= 0 ? -hi(0) : 0;
+            max = std::max(-lo(0), hi(0));
+            break;
+        case ExprOpType::MAX:
+            min = std::max(lo(0), lo(1));
+            max = std::max(hi(0), hi(1));
+            break;
+        case ExprOpType::MIN:
+            min = std::min(lo(0), lo(1));
+            max = std::min(hi(0), hi(1));
+            break;
+        case ExprOpType::CLAMP: // max(min(x, max), min)
+            min = std::max(std::min(lo(0), lo(2)), lo(1));
+            max = std::max(std::min(hi(0), hi(2)), hi(1));
+            break;
+        case ExprOpType::CMP: case ExprOpType::AND: case ExprOpType::OR:
+        case ExprOpType::XOR: case ExprOpType::NOT:
+            min = 0;
+            max = 1;
+            break;
+        case ExprOpType::TRUNC: case ExprOpType::ROUND: case ExprOpType::FLOOR:
+            min = lo(0);
+            max = hi(0);
+            break;
+        case ExprOpType::TERNARY:
+            min = std::min(lo(1), lo(2));
+            max = std::max(hi(1), hi(2));
+            break;
+        default:
+            return {};
+        }
+        if (min < INT16_MIN || max > INT16_MAX)
+            return {};
+        ranges[n] = { static_cast<int32_t>(min), static_cast<int32_t>(max) };
+    }
+    return ranges;
+}
+
+// Whether the outputs only depend on constants, N, the plane size and frame properties,
+// hence are the same for every pixel of a frame and only one row has to be computed.
+static bool uniformOutputs(const ExprGraph &graph) {
+    if (!graph.reductions.empty())
+        return false;
+    const std::vector<bool> invariant = graph.frameInvariant();
+    for (int root: graph.roots)
+        if (!invariant[root])
+            return false;
+    return true;
+}
+
+// The inputs of which the plane is a function of the sample values alone (a single clip
+// of up to MAX_LUT_BITS bits or two 8-bit ones), if computing the results for all their
+// values once and then looking them up is cheaper over the whole clip than computing them
+// for every pixel, or an empty vector otherwise.
+static std::vector<int> lutInputs(const ExprGraph &graph, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int lanes) {
+    if (graph.roots.size() != 1 || !graph.reductions.empty())
+        return {};
+    std::vector<int> clips;
+    int work = 0; // in vector instructions, roughly
+    for (int n: graph.schedule()) {
+        const ExprOp &op = graph[n].op;
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD:
+            if (op.x || op.y)
+                return {};
+            if (std::find(clips.begin(), clips.end(), op.imm.i) == clips.end())
+                clips.push_back(op.imm.i);
+            break;
+        case ExprOpType::CONST_LOAD: case ExprOpType::MEM_GATHER:
+            return {};
+        case ExprOpType::CONSTANTI: case ExprOpType::CONSTANTF:
+            break;
+        case ExprOpType::DIV: case ExprOpType::MOD: case ExprOpType::SQRT:
+            work += 4;
+            break;
+        case ExprOpType::EXP: case ExprOpType::LOG:
+        case ExprOpType::SIN: case ExprOpType::COS:
+            work += 16;
+            break;
+        case ExprOpType::POW:
+            work += 32;
+            break;
+        default:
+            work++;
+        }
+    }
+    if (clips.empty() || clips.size() > 2)
+        return {};
+    int bits = 0;
+    for (int clip: clips) {
+        const VSFormat *f = vi[clip]->format;
+        if (f->sampleType != stInteger || f->bitsPerSample > (clips.size() > 1 ? 8 : MAX_LUT_BITS))
+            return {};
+        bits += f->bitsPerSample;
+    }
+    // Each lookup costs about as much as computing a vector of lanes pixels, and the table
+    // as many pixels as it has entries. Clips of variable size are assumed to be 1080p.
+    const double frame = vo->width ? static_cast<double>(vo->width) * vo->height : 1920.0 * 1080.0;
+    const double saved = frame * std::max(vo->numFrames, 1) * (static_cast<double>(work) / lanes - clips.size());
+    if (saved <= static_cast<double>(1 << bits) * work / lanes)
+        return {};
+    return clips;
+}
+
+// Samples beyond the range of the format are looked up as the largest value. The loads
+// of several pixels are issued before their stores, which is about twice as fast.
+template<typename S, typename D>
+static void lookupRows(const Compiled::Lut &lut, uint8_t *const *rwptrs, const int *strides, int width, int ystart, int yend) {
+    const D *table = reinterpret_cast<const D *>(lut.table.data());
+    const uint32_t maxIndex = lut.maxIndex;
+    const int k = 1 + lut.clips[0];
+    for (int y = ystart; y < yend; y++) {
+        const S *src = reinterpret_cast<const S *>(rwptrs[k] + (ptrdiff_t)y * strides[k]);
+        D *dst = reinterpret_cast<D *>(rwptrs[0] + (ptrdiff_t)y * strides[0]);
+        auto at = [&](int x) { return table[sizeof(S) == 1 ? src[x] : std::min<uint32_t>(src[x], maxIndex)]; };
+        int x = 0;
+        for (int x4 = width & ~3; x < x4; x += 4) {
+            D a = at(x), b = at(x + 1), c = at(x + 2), d = at(x + 3);
+            dst[x] = a;
+            dst[x + 1] = b;
+            dst[x + 2] = c;
+            dst[x + 3] = d;
+        }
+        for (; x < width; x++)
+            dst[x] = at(x);
+    }
+}
+
+template<typename D>
+static void lookupPairRows(const Compiled::Lut &lut, uint8_t *const *rwptrs, const int *strides, int width, int ystart, int yend) {
+    const D *table = reinterpret_cast<const D *>(lut.table.data());
+    const int k0 = 1 + lut.clips[0], k1 = 1 + lut.clips[1];
+    for (int y = ystart; y < yend; y++) {
+        const uint8_t *src0 = rwptrs[k0] + (ptrdiff_t)y * strides[k0];
+        const uint8_t *src1 = rwptrs[k1] + (ptrdiff_t)y * strides[k1];
+        D *dst = reinterpret_cast<D *>(rwptrs[0] + (ptrdiff_t)y * strides[0]);
+        auto at = [&](int x) { return table[src0[x] | src1[x] << 8]; };
+        int x = 0;
+        for (int x4 = width & ~3; x < x4; x += 4) {
+            D a = at(x), b = at(x + 1), c = at(x + 2), d = at(x + 3);
+            dst[x] = a;
+            dst[x + 1] = b;
+            dst[x + 2] = c;
+            dst[x + 3] = d;
+        }
+        for (; x < width; x++)
+            dst[x] = at(x);
+    }
+}
+
+static decltype(Compiled::Lut::lookup) lookupFunction(bool pair, int srcBytes, int dstBytes) {
+    if (pair)
+        return dstBytes == 1 ? lookupPairRows<uint8_t> : dstBytes == 2 ? lookupPairRows<uint16_t> : lookupPairRows<uint32_t>;
+    if (srcBytes == 1)
+        return dstBytes == 1 ? lookupRows<uint8_t, uint8_t> : dstBytes == 2 ? lookupRows<uint8_t, uint16_t> : lookupRows<uint8_t, uint32_t>;
+    return dstBytes == 1 ? lookupRows<uint16_t, uint8_t> : dstBytes == 2 ? lookupRows<uint16_t, uint16_t> : lookupRows<uint16_t, uint32_t>;
+}
+
+// Widest vector the host can execute natively (NEON has 4 lanes too).
+static int hostLanes() {
+    if (rr::CPUID::supportsAVX512F())
+        return 16;
+    if (rr::CPUID::supportsAVX())
+        return 8;
+    return 4;
+}
+
+// Whether the host converts half precision floats in vectors: with F16C on x86, and with
+// the FCVTL/FCVTN of NEON on AArch64.
+static bool hostHalf() {
+    return rr::CPUID::supportsF16C() || rr::CPUID::supportsNEON();
+}
+
+// The key of a compiled routine: the full description of what it computes, which is hashed
+// once, as generated expressions may be hundreds of KB long. Copies share the text.
+struct ExprKey {
+    std::shared_ptr<const std::string> text;
+    size_t hash = 0;
+
+    ExprKey() {}
+    explicit ExprKey(std::string s) : text(std::make_shared<const std::string>(std::move(s))), hash(std::hash<std::string>()(*text)) {}
+    bool operator==(const ExprKey &rhs) const { return hash == rhs.hash && (text == rhs.text || *text == *rhs.text); }
+
+    struct Hash {
+        size_t operator()(const ExprKey &key) const { return key.hash; }
+    };
+};
+
+// Compiled routines shared by all Expr instances in the process, which may be created by
+// several cores from different threads. Concurrent requests for the same key wait for a
+// single compilation. The least recently used routines are dropped once the memory they
+// hold exceeds the limit; instances that use them keep them alive regardless.
+class ExprCache {
+public:
+    struct EntryInfo {
+        std::string key;
+        size_t size;
+        double seconds; // spent compiling it
+        int64_t hits;
+    };
+    // Over the lifetime of the process, see JITInfo.
+    struct Stats {
+        int64_t compiles = 0; // including the routines loaded from the disk cache
+        int64_t diskHits = 0;
+        int64_t hits = 0;
+        double seconds = 0;
+        size_t size = 0;
+        size_t limit = 0;
+        std::vector<EntryInfo> entries; // most recently used first
+    };
+
+private:
+    struct Entry {
+        Compiled compiled;
+        size_t size;
+        std::list<ExprKey>::iterator lru;
+        double seconds;
+        int64_t hits;
+    };
+    std::mutex lock;
+    std::unordered_map<ExprKey, Entry, ExprKey::Hash> entries;
+    std::list<ExprKey> lru; // most recently used first
+    struct Pending {
+        std::promise<Compiled> promise;
+        std::shared_future<Compiled> future;
+    };
+    std::unordered_map<ExprKey, Pending, ExprKey::Hash> pending;
+    size_t size = 0;
+    size_t limit = EXPR_CACHE_LIMIT;
+    Stats totals;
+
+    void claimLocked(const ExprKey &key) {
+        Pending &p = pending[key];
+        p.future = p.promise.get_future().share();
+    }
+
+    void evict() {
+        // Always keep the entry that was just added.
+        while (size > limit && entries.size() > 1) {
+            auto it = entries.find(lru.back());
+            size -= it->second.size;
+            entries.erase(it);
+            lru.pop_back();
+        }
+    }
+
+public:
+    void setLimit(size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        limit = bytes;
+        evict();
+    }
+
+    Compiled get(const ExprKey &key, const std::function<Compiled()> &compile) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                lru.splice(lru.begin(), lru, it->second.lru);
+                it->second.hits++;
+                totals.hits++;
+                return it->second.compiled;
+            }
+            auto p = pending.find(key);
+            if (p != pending.end()) {
+                auto future = p->second.future;
+                totals.hits++;
+                guard.unlock();
+                return future.get();
+            }
+            claimLocked(key);
+        }
+
+        Compiled r;
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            r = compile();
+        } catch (...) {
+            abandon(key, std::current_exception());
+            throw;
+        }
+        add(key, r, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return r;
+    }
+
+    // Whether the caller is to compile the routine of key, which it then passes to add (or
+    // its error to abandon). Otherwise it is cached or being compiled already, and get
+    // returns it.
+    bool claim(const ExprKey &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (entries.count(key) || pending.count(key))
+            return false;
+        claimLocked(key);
+        return true;
+    }
+
+    void add(const ExprKey &key, const Compiled &r, double seconds) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto p = pending.find(key);
+        // Routines of several expressions are split evenly among them.
+        size_t bytes = std::max<size_t>(r.routine->getMemoryUsage() / r.batchSize, 1);
+        lru.push_front(key);
+        entries.emplace(key, Entry{ r, bytes, lru.begin(), seconds, 0 });
+        size += bytes;
+        totals.compiles++;
+        totals.seconds += seconds;
+        evict();
+        p->second.promise.set_value(r);
+        pending.erase(p);
+    }
+
+    void abandon(const ExprKey &key, std::exception_ptr error) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto p = pending.find(key);
+        p->second.promise.set_exception(error);
+        pending.erase(p);
+    }
+
+    // Called by the compiler when it loads a routine from the disk cache instead of
+    // compiling it.
+    void noteDiskHit() {
+        std::lock_guard<std::mutex> guard(lock);
+        totals.diskHits++;
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        Stats s = totals;
+        s.size = size;
+        s.limit = limit;
+        for (const auto &key : lru) {
+            const Entry &e = entries.at(key);
+            s.entries.push_back({ *key.text, e.size, e.seconds, e.hits });
+        }
+        return s;
+    }
+};
+
+static ExprCache exprCache;
+
+template<int lanes>
+class Compiler {
+    struct Context {
+        // One expression per output, all of the vo format.
+        const std::vector<std::string> exprs;
+        std::vector<std::vector<ExprOp>> ops;
+        const VSVideoInfo *vo;
+        std::vector<const VSVideoInfo *> vi;
+        int numInputs;
+        int optMask;
+        bool mirror;
+        int unroll; // 0 means automatic
+        int jitLevel;
+        ExprPrecision precision;
+        InputSampling sampling;
+        bool dither; // ordered dithering of the float results stored to integer formats
+        Context(const std::vector<std::string> &exprs, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, int opt, int mirror, int unroll, int jitLevel,
+                ExprPrecision precision, const InputSampling &sampling, bool dither):
+            exprs(exprs), vo(vo), vi(vi, vi + numInputs), numInputs(numInputs), optMask(opt), mirror(!!mirror), unroll(unroll), jitLevel(jitLevel),
+            precision(precision), sampling(sampling), dither(dither) {
+            for (const auto &expr: exprs) {
+                ops.emplace_back();
+                forEachToken(expr, [&](std::string_view tok) {
+                    auto op = decodeToken(tok);
+                    if (op.bc == BoundaryCondition::Unspecified)
+                        op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
+                    ops.back().push_back(std::move(op));
+                });
+            }
+            cacheKey = buildKey();
+        }
+        enum {
+            flagUseInteger = 1<<0,
+            flagNoTreeOpt = 1<<1,
+        };
+        static std::string videoInfoKey(const VSVideoInfo *vi) {
+            return std::string(vi->format->name) + ";";
+        }
+        // Built once, as the expressions are copied into it.
+        ExprKey cacheKey;
+        ExprKey buildKey() const {
+            size_t size = 256;
+            for (const auto &expr: exprs)
+                size += expr.size() + 16;
+            std::string key;
+            key.reserve(size);
+            key += "n=" + std::to_string(numInputs) + "|lanes=" + std::to_string(lanes) + "|opt=" + std::to_string(optMask) + "|mirror=" + std::to_string(mirror) +
+                "|unroll=" + std::to_string(unroll) + "|jit=" + std::to_string(jitLevel) + "|prec=" + std::to_string(static_cast<int>(precision)) +
+                "|dither=" + std::to_string(dither);
+            // The code (and the signature of procPlane) also depends on this build of the
+            // plugin, so objects stored by other builds are never loaded.
+            key += "|build=" VERSION;
+            key += "|expr=";
+            key += exprs[0];
+            key += "|vo=" + videoInfoKey(vo);
+            for (size_t i = 1; i < exprs.size(); i++) {
+                key += "|expr" + std::to_string(i) + "=";
+                key += exprs[i];
+            }
+            for (int i = 0; i < numInputs; i++)
+                key += "|vi" + std::to_string(i) + "=" + videoInfoKey(vi[i]);
+            if (sampling.any())
+                key += "|sampling=" + sampling.key();
+            return ExprKey(std::move(key));
+        }
+        const ExprKey &key() const { return cacheKey; }
+        bool forceFloat() const { return !(optMask & flagUseInteger); }
+    } ctx;
+    ExprGraph graph;
+
+    using pointer = rr::Pointer<rr::Byte>;
+    using Types = VectorTypes<lanes>;
+    using ByteV = typename Types::Byte;
+    using UShortV = typename Types::UShort;
+    using IntV = typename Types::Int;
+    using FloatV = typename Types::Float;
+    using NarrowByteV = typename Types::NarrowByte;
+    using ShortV = typename Types::Short;
+
+    struct Helper {
+        using ftype = rr::ModuleFunction<FloatV(FloatV)>;
+        using ftype2 = rr::ModuleFunction<FloatV(FloatV, FloatV)>;
+        std::unique_ptr<ftype> Exp;
+        std::unique_ptr<ftype> Log;
+        std::unique_ptr<ftype> Sin;
+        std::unique_ptr<ftype> Cos;
+        std::unique_ptr<ftype2> Pow;
+    };
+    rr::RValue<FloatV> Exp_(rr::RValue<FloatV>);
+    // exp(x) for |x| <= ln(2) / 2.
+    rr::RValue<FloatV> ExpReduced_(rr::RValue<FloatV>);
+    rr::RValue<FloatV> Log_(rr::RValue<FloatV>);
+    // Splits log(x) into e * ln(2) + f + c, where e is an integer, f is in [sqrt(0.5) - 1, sqrt(2) - 1)
+    // and c is much smaller than f. invalid is set for x <= 0.
+    void LogParts_(rr::RValue<FloatV> x, FloatV &e, FloatV &f, FloatV &c, IntV &invalid);
+    // x ** y of ExprPrecision::Accurate.
+    rr::RValue<FloatV> Pow_(rr::RValue<FloatV> x, rr::RValue<FloatV> y);
+    rr::RValue<FloatV> SinCos_(rr::RValue<FloatV>, bool issin);
+
+    class Value {
+        std::variant<IntV, FloatV> v;
+        bool constant;
+
+    public:
+        bool isFloat() { return std::holds_alternative<FloatV>(v); }
+        bool isConst() { return constant; }
+
+        Value(int x) : v(IntV(x)), constant(true) {}
+        Value(float x) : v(FloatV(x)), constant(true) {}
+
+        Value(IntV i) : v(i), constant(false) {}
+        Value(rr::RValue<IntV> i) : v(IntV(i)), constant(false) {}
+        Value(rr::Reference<IntV> i) : v(IntV(i)), constant(false) {}
+        Value(FloatV f) : v(f), constant(false) {}
+        Value(rr::RValue<FloatV> f) : v(FloatV(f)), constant(false) {}
+        Value(rr::Reference<FloatV> f) : v(FloatV(f)), constant(false) {}
+
+        FloatV f() { return std::get<FloatV>(v); }
+        IntV i() { return std::get<IntV>(v); }
+
+        FloatV ensureFloat() { return isFloat() ? f() : FloatV(i()); }
+
+    };
+
+    struct State {
+        std::vector<pointer> wptrs;
+        rr::Int strides[MAX_EXPR_OUTPUTS+MAX_EXPR_INPUTS];
+        rr::Pointer<rr::Float> consts;
+        rr::Int width;
+        rr::Int height;
+        IntV xvec;
+
+        rr::Int y;
+        rr::Int x;
+
+        // Values of the frame invariant nodes, computed before the loop.
+        std::vector<bool> invariant;
+        std::map<int, Value> invariants;
+
+        // Per lane results of the reductions for the current row.
+        std::vector<FloatV> reductions;
+        rr::Pointer<rr::Float> rowReductions;
+    };
+
+    // The operand of the float ADD or SUB node n that is a float product to fuse into it,
+    // or -1. Products computed before the loop are left alone unless n is too.
+    int fusedProduct(const State &state, int n) const;
+    // The fused ADD or SUB node n, see fusedProduct().
+    FloatV fuseMulAdd(std::vector<Value> &values, const std::vector<int> &slot, const State &state, int n) const;
+
+    template<typename T>
+    static rr::RValue<T> reduce(ReductionType type, rr::RValue<T> a, rr::RValue<T> b) {
+        if (type == ReductionType::MIN)
+            return Min(a, b);
+        if (type == ReductionType::MAX)
+            return Max(a, b);
+        return a + b;
+    }
+
+    // Rows start at an aligned address, so do vectors at multiples of the lane count.
+    static constexpr int vectorAlignment(int bytesPerSample) { return std::min(lanes * bytesPerSample, ALIGNMENT); }
+    static rr::RValue<IntV> tailMask(State &state, rr::RValue<rr::Int> x) {
+        return CmpLT(state.xvec + IntV(x), IntV(state.width));
+    }
+    // The ordered dithering offsets of the vector starting at x of the current row, as
+    // computed by the interpreter, see ::ditherOffset().
+    static rr::RValue<FloatV> ditherOffset(State &state, rr::RValue<rr::Int> x) {
+        using namespace rr;
+        Int y = state.y;
+        IntV v = (state.xvec + IntV(x)) ^ IntV(y);
+        Int yb = (y & 1) << 4 | (y & 2) << 1 | (y & 4) >> 2;
+        IntV m = (v & IntV(1)) << 5 | (v & IntV(2)) << 2 | (v & IntV(4)) >> 1 | IntV(yb);
+        return FloatV(m) * FloatV(1.0f / 64) + FloatV(0.5f / 64 - 0.5f);
+    }
+
+    // Memory beyond the row width is never touched, so that the vector starting at x may
+    // have to be accessed partially.
+    enum class Extent { Full, MaybePartial, Partial };
+    template<typename T>
+    static rr::RValue<T> loadRow(State &state, rr::Pointer<rr::Byte> p, int align, rr::Int &x, Extent extent) {
+        using namespace rr;
+        if (extent == Extent::Full)
+            return *Pointer<T>(p, align);
+        if (extent == Extent::Partial)
+            return MaskedLoad(Pointer<T>(p, align), tailMask(state, x), align, true);
+        T v;
+        If(x + lanes <= state.width) {
+            v = RValue<T>(*Pointer<T>(p, align));
+        } Else {
+            v = MaskedLoad(Pointer<T>(p, align), tailMask(state, x), align, true);
+        }
+        return v;
+    }
+    template<typename T>
+    static void storeRow(State &state, rr::Pointer<rr::Byte> p, int align, rr::Int &x, bool partial, rr::RValue<T> v) {
+        using namespace rr;
+        if (partial)
+            MaskedStore(Pointer<T>(p, align), v, tailMask(state, x), align);
+        else
+            *Pointer<T>(p, align) = v;
+    }
+
+    Helper buildHelpers(rr::Module &mod);
+    // Interior iterations are known to only access pixels within the plane.
+    void buildIters(const Helper &helpers, State &state, int unroll, bool tail, bool interior = false, bool prologue = false);
+    // Loads an input of another subsampling than the output at the pixels of the vector at x.
+    Value loadResampled(State &state, rr::Int &x, const ExprOp &op);
+    // Loads the pixels at the coordinates x and y of the output plane, see MEM_GATHER.
+    Value loadGather(State &state, Value x, Value y, const ExprOp &op);
+    // Full vectors of 2 * lanes pixels in 16-bit lanes, for the nodes of the given ranges.
+    void buildNarrowIters(State &state, const std::vector<ValueRange> &ranges, int unroll);
+    // Adds the table of the results for all values of the inputs, see lutInputs().
+    Compiled withLut(Compiled c);
+    // Whether the routine was loaded from the disk cache into c.
+    bool loadCached(Compiled &c);
+    // Adds the routine processing a plane to the module.
+    void define(rr::Module &mod, const Helper &helpers, const char *name);
+    Compiled build();
+    Compiled buildModule();
+
+public:
+    Compiler(const std::vector<std::string> &exprs, const VSVideoInfo *vo, const VSVideoInfo * const *vi, int numInputs, int opt = 0, int mirror = 0, int unroll = 0, int jitLevel = DEFAULT_JIT_LEVEL,
+             ExprPrecision precision = ExprPrecision::Default, const InputSampling &sampling = InputSampling(), bool dither = false) :
+        ctx(exprs, vo, vi, numInputs, opt, mirror, unroll, jitLevel, precision, sampling, dither),
+        graph(ctx.ops, ctx.exprs, ctx.vi.data(), ctx.numInputs, ctx.forceFloat(), !(ctx.optMask & Context::flagNoTreeOpt)) {}
+
+    Compiled compile();
+    // Compiles several expressions with the same jitLevel and precision into one routine, see ExprBatch.
+    // Returns the results in the same order.
+    static std::vector<Compiled> buildBatch(const std::vector<Compiler *> &batch);
+    const ExprKey &key() const { return ctx.key(); }
+    int jitLevel() const { return ctx.jitLevel; }
+    ExprPrecision precision() const { return ctx.precision; }
+    const ExprGraph &getGraph() const { return graph; }
+    const InputSampling &getSampling() const { return ctx.sampling; }
+};
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Exp_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+{
+    FloatV x = x_;
+    using namespace rr;
+    const float exp_hi = 88.3762626647949f, exp_lo = -88.3762626647949f, log2e  = 1.44269504088896341f,
+          exp_c1 = 0.693359375f, exp_c2 = -2.12194440e-4f;
+    x = Min(x, FloatV(exp_hi));
+    x = Max(x, FloatV(exp_lo));
+    FloatV fx = FloatV(log2e);
+    fx = FMA(fx, x, FloatV(0.5f));
+#if defined(__aarch64__)
+    // FRINTM, where SSE2 has no floor.
+    fx = Floor(fx);
+#else
+    IntV emm0 = RoundInt(fx);
+    FloatV etmp = FloatV(emm0);
+    FloatV mask = As<FloatV>(As<IntV>(FloatV(1.0f)) & CmpGT(etmp, fx));
+    fx = etmp - mask;
+#endif
+    x = FMA(fx, FloatV(-exp_c1), x);
+    x = FMA(fx, FloatV(-exp_c2), x);
+    FloatV y = ExpReduced_(x);
+#if defined(__aarch64__)
+    // fx is integral, so FCVTZS is exact.
+    IntV emm0 = IntV(fx);
+#else
+    emm0 = RoundInt(fx);
+#endif
+    emm0 = emm0 + IntV(0x7f);
+    emm0 = emm0 << 23;
+    x = y * As<FloatV>(emm0);
+    return x;
+}
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::ExpReduced_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+{
+    FloatV x = x_;
+    using namespace rr;
+    FloatV z = x * x;
+    FloatV y;
+    if (ctx.precision == ExprPrecision::Fast) {
+        // Relative error below 1.3e-4.
+        const float exp_f0 = 5.0394103e-1f, exp_f1 = 1.6662811e-1f;
+        y = FMA(FloatV(exp_f1), x, FloatV(exp_f0));
+    } else {
+        const float exp_p0 = 1.9875691500E-4f, exp_p1 = 1.3981999507E-3f, exp_p2 = 8.3334519073E-3f,
+              exp_p3 = 4.1665795894E-2f, exp_p4 = 1.6666665459E-1f, exp_p5 = 5.0000001201E-1f;
+        y = FloatV(exp_p0);
+        y = FMA(y, x, FloatV(exp_p1));
+        y = FMA(y, x, FloatV(exp_p2));
+        y = FMA(y, x, FloatV(exp_p3));
+        y = FMA(y, x, FloatV(exp_p4));
+        y = FMA(y, x, FloatV(exp_p5));
+    }
+    y = FMA(y, z, x);
+    return y + FloatV(1.0f);
+}
+
+template<int lanes>
+void Compiler<lanes>::LogParts_(rr::RValue<typename Compiler<lanes>::FloatV> x_, FloatV &e, FloatV &f, FloatV &c, IntV &invalid)
+{
+    FloatV x = x_;
+    using namespace rr;
+    const uint32_t min_norm_pos = 0x00800000, inv_mant_mask = ~0x7F800000;
+    const float float_half = 0.5f, sqrt_1_2 = 0.707106781186547524f;
+    const float zero = 0.0f, one = 1.0f;
+    invalid = CmpLE(x, FloatV(zero));
+    x = Max(x, As<FloatV>(IntV(min_norm_pos)));
+    IntV emm0i = As<IntV>(x) >> 23;
+    x = As<FloatV>(As<IntV>(x) & IntV(inv_mant_mask));
+    x = As<FloatV>(As<IntV>(x) | As<IntV>(FloatV(float_half)));
+    emm0i = emm0i - IntV(0x7f);
+    FloatV emm0 = FloatV(emm0i);
     emm0 = emm0 + FloatV(one);
     IntV mask = CmpLT(x, FloatV(sqrt_1_2));
     FloatV etmp = As<FloatV>(mask & As<IntV>(x));
@@ -517,23 +2475,76 @@ rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Log_(rr::RValue<ty
     emm0 = emm0 - maskf;
     x = x + etmp;
     FloatV z = x * x;
-    FloatV y = FloatV(log_p0);
-    y = FMA(y, x, FloatV(log_p1));
-    y = FMA(y, x, FloatV(log_p2));
-    y = FMA(y, x, FloatV(log_p3));
-    y = FMA(y, x, FloatV(log_p4));
-    y = FMA(y, x, FloatV(log_p5));
-    y = FMA(y, x, FloatV(log_p6));
-    y = FMA(y, x, FloatV(log_p7));
-    y = FMA(y, x, FloatV(log_p8));
+    FloatV y;
+    if (ctx.precision == ExprPrecision::Fast) {
+        // Relative error below 1e-4.
+        const float log_f0 = 1.7325000e-1f, log_f1 = -2.6461247e-1f, log_f2 = 3.3567333e-1f;
+        y = FloatV(log_f0);
+        y = FMA(y, x, FloatV(log_f1));
+        y = FMA(y, x, FloatV(log_f2));
+    } else {
+        const float log_p0 = 7.0376836292E-2f, log_p1 = -1.1514610310E-1f, log_p2 = 1.1676998740E-1f,
+              log_p3 = -1.2420140846E-1f, log_p4 = +1.4249322787E-1f, log_p5 = -1.6668057665E-1f,
+              log_p6 = +2.0000714765E-1f, log_p7 = -2.4999993993E-1f, log_p8 = +3.3333331174E-1f;
+        y = FloatV(log_p0);
+        y = FMA(y, x, FloatV(log_p1));
+        y = FMA(y, x, FloatV(log_p2));
+        y = FMA(y, x, FloatV(log_p3));
+        y = FMA(y, x, FloatV(log_p4));
+        y = FMA(y, x, FloatV(log_p5));
+        y = FMA(y, x, FloatV(log_p6));
+        y = FMA(y, x, FloatV(log_p7));
+        y = FMA(y, x, FloatV(log_p8));
+    }
     y = y * x;
     y = y * z;
-    y = FMA(emm0, FloatV(log_q1), y);
-    y = FMA(z, FloatV(-float_half), y);
-    x = x + y;
-    x = FMA(emm0, FloatV(log_q2), x);
-    x = As<FloatV>(invalid_mask | As<IntV>(x));
-    return x;
+    e = emm0;
+    f = x;
+    c = FMA(z, FloatV(-float_half), y);
+}
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Log_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+{
+    using namespace rr;
+    const float log_q2 = 0.693359375f, log_q1 = -2.12194440e-4f;
+    FloatV e, f, c;
+    IntV invalid;
+    LogParts_(x_, e, f, c, invalid);
+    c = FMA(e, FloatV(log_q1), c);
+    FloatV x = f + c;
+    x = FMA(e, FloatV(log_q2), x);
+    return As<FloatV>(invalid | As<IntV>(x));
+}
+
+// x ** y = 2 ** (y * e) * exp(y * (f + c)) for log(x) = e * ln(2) + f + c (see LogParts_).
+// Both exponents are split into an integer and a rest with FMAs, where exp(log(x) * y) rounds
+// their sum to single precision, with an error growing with y * log(x).
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Pow_(rr::RValue<typename Compiler<lanes>::FloatV> x_, rr::RValue<typename Compiler<lanes>::FloatV> y_)
+{
+    using namespace rr;
+    const float log2e = 1.44269504088896341f, ln2 = 0.693147180559945309f, ln2_hi = 0.693359375f, ln2_lo = -2.12194440e-4f;
+    FloatV y = y_;
+    FloatV e, f, c;
+    IntV invalid;
+    LogParts_(x_, e, f, c, invalid);
+    // y * e = k + r
+    FloatV k = Round(y * e);
+    FloatV r = FMA(y, e, -k);
+    // r * ln(2) + y * (f + c) = n * ln(2) + t
+    FloatV n = Round(FMA(y, f + c, r * FloatV(ln2)) * FloatV(log2e));
+    FloatV t = FMA(y, f, -n * FloatV(ln2_hi));
+    t = FMA(y, c, t);
+    t = FMA(r, FloatV(ln2), t);
+    t = FMA(n, FloatV(-ln2_lo), t);
+    // 2 ** (k + n), saturated and applied in two halves to stay in the range of the exponent.
+    IntV ki = RoundInt(Min(Max(k + n, FloatV(-252.0f)), FloatV(254.0f)));
+    IntV k1 = ki >> 1;
+    FloatV p = ExpReduced_(t);
+    p = p * As<FloatV>((k1 + IntV(0x7f)) << 23);
+    p = p * As<FloatV>((ki - k1 + IntV(0x7f)) << 23);
+    return As<FloatV>(invalid | As<IntV>(p));
 }
 
 template<int lanes>
@@ -548,15 +2559,7 @@ rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::SinCos_(rr::RValue
            float_pi1 = conv(0x40490000),
            float_pi2 = conv(0x3a7da000),
            float_pi3 = conv(0x34222000),
-           float_pi4 = conv(0x2cb4611a),
-           float_sinC3 = conv(0xbe2aaaa6),
-           float_sinC5 = conv(0x3c08876a),
-           float_sinC7 = conv(0xb94fb7ff),
-           float_sinC9 = conv(0x362edef8),
-           float_cosC2 = conv(0xBEFFFFE2),
-           float_cosC4 = conv(0x3D2AA73C),
-           float_cosC6 = conv(0XBAB58D50),
-           float_cosC8 = conv(0x37C1AD76);
+           float_pi4 = conv(0x2cb4611a);
     IntV sign;
     if (issin)
         sign = As<IntV>(x) & ~absmask;
@@ -565,19 +2568,44 @@ rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::SinCos_(rr::RValue
     FloatV t1 = Abs(x);
     // Range reduction
     FloatV t2 = t1 * float_invpi;
+#if defined(__aarch64__)
+    // Round by adding 1.5 * 2^23, which leaves the parity of the result in the lowest bit
+    // of the mantissa, rather than converting to integers and back (FRINTN, FCVTZS and
+    // SCVTF). Both round to nearest even for t2 < 2^22.
+    FloatV t2r = t2 + float_rintf;
+    IntV t4 = As<IntV>(t2r) << 31;
+    sign = sign ^ t4;
+    t2 = t2r - float_rintf;
+#else
     IntV t2i = RoundInt(t2);
     IntV t4 = t2i << 31;
     sign = sign ^ t4;
     t2 = FloatV(t2i);
+#endif
 
     t1 = FMA(t2, -float_pi1, t1);
     t1 = FMA(t2, -float_pi2, t1);
     t1 = FMA(t2, -float_pi3, t1);
     t1 = FMA(t2, -float_pi4, t1);
 
-    if (issin) {
+    const bool fast = ctx.precision == ExprPrecision::Fast;
+    if (issin && fast) {
+        // minimax polynomial for sin(x) in [-pi/2, pi/2] interval, with relative error below 1.4e-4.
+        // compute X + X * X^2 * (C3 + X^2 * C5)
+        FloatV float_sinC3 = FloatV(-1.6612919e-1f),
+               float_sinC5 = FloatV(7.6565451e-3f);
+        t2 = t1 * t1;
+        FloatV t3 = FMA(t2, float_sinC5, float_sinC3);
+        t3 = t3 * t2;
+        t3 = t3 * t1;
+        t1 = t1 + t3;
+    } else if (issin) {
         // minimax polynomial for sin(x) in [-pi/2, pi/2] interval.
         // compute X + X * X^2 * (C3 + X^2 * (C5 + X^2 * (C7 + X^2 * C9)))
+        FloatV float_sinC3 = conv(0xbe2aaaa6),
+               float_sinC5 = conv(0x3c08876a),
+               float_sinC7 = conv(0xb94fb7ff),
+               float_sinC9 = conv(0x362edef8);
         t2 = t1 * t1;
         FloatV t3 = FMA(t2, float_sinC9, float_sinC7);
         t3 = FMA(t3, t2, float_sinC5);
@@ -585,9 +2613,23 @@ rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::SinCos_(rr::RValue
         t3 = t3 * t2;
         t3 = t3 * t1;
         t1 = t1 + t3;
+    } else if (fast) {
+        // minimax polynomial for cos(x) in [-pi/2, pi/2] interval, with absolute error below 8e-6.
+        // compute 1 + X^2 * (C2 + X^2 * (C4 + X^2 * C6))
+        FloatV float_cosC2 = FloatV(-4.9993563e-1f),
+               float_cosC4 = FloatV(4.1507067e-2f),
+               float_cosC6 = FloatV(-1.2757520e-3f);
+        t1 = t1 * t1;
+        FloatV t2 = FMA(t1, float_cosC6, float_cosC4);
+        t2 = FMA(t2, t1, float_cosC2);
+        t1 = FMA(t2, t1, FloatV(1.0f));
     } else {
         // minimax polynomial for cos(x) in [-pi/2, pi/2] interval.
         // compute 1 + X^2 * (C2 + X^2 * (C4 + X^2 * (C6 + X^2 * C8)))
+        FloatV float_cosC2 = conv(0xBEFFFFE2),
+               float_cosC4 = conv(0x3D2AA73C),
+               float_cosC6 = conv(0XBAB58D50),
+               float_cosC8 = conv(0x37C1AD76);
         t1 = t1 * t1;
         FloatV t2 = FMA(t1, float_cosC8, float_cosC6);
         t2 = FMA(t2, t1, float_cosC4);
@@ -646,415 +2688,651 @@ static VType relativeAccessAdjust(rr::Int &x, rr::Int &alignedx, rr::Int &width,
                 }
                 v = Swizzle(v, select);
                 Nucleus::createBr(contBb);
-            }
-            Nucleus::setInsertBlock(defaultBb);
-            v = Swizzle(v, 0);
-            Nucleus::createBr(contBb);
-        }
-        Nucleus::setInsertBlock(contBb);
-    }
-    return v;
-}
-
-typedef std::vector<std::pair<int, int>> SortingNetwork;
-static const SortingNetwork &buildSortNet(int n) {
-    static std::map<int, SortingNetwork> built;
-    auto it = built.find(n);
-    if (it != built.end()) return it->second;
-
-    built.insert({ n, {} });
-    auto &sn = built.find(n)->second;
-
-    int t = 0;
-    while (n > (1<<t)) t++;
-    int p = 1 << (t - 1);
-    while (p > 0) {
-        int q = 1 << (t - 1), r = 0, d = p;
-        while (d > 0) {
-            for (int i = 0; i < n - d; i++)
-                if ((i & p) == r)
-                    sn.emplace_back(i, i+d);
-            d = q - p;
-            q >>= 1;
-            r = p;
+            }
+            Nucleus::setInsertBlock(defaultBb);
+            v = Swizzle(v, 0);
+            Nucleus::createBr(contBb);
         }
-        p >>= 1;
+        Nucleus::setInsertBlock(contBb);
     }
-    return sn;
+    return v;
 }
 
 template<int lanes>
-void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
+int Compiler<lanes>::fusedProduct(const State &state, int n) const
 {
-    constexpr unsigned char numOperands[] = {
-        0, // MEM_LOAD
-        0, // CONSTANTI
-        0, // CONSTANTF
-        0, // CONST_LOAD
-        0, // VAR_LOAD
-        1, // VAR_STORE
-        2, // ADD
-        2, // SUB
-        2, // MUL
-        2, // DIV
-        2, // MOD
-        1, // SQRT
-        1, // ABS
-        2, // MAX
-        2, // MIN
-        3, // CLAMP
-        2, // CMP
-        1, // TRUNC
-        1, // ROUND
-        1, // FLOOR
-        2, // AND
-        2, // OR
-        2, // XOR
-        1, // NOT
-        1, // EXP
-        1, // LOG
-        2, // POW
-        1, // SIN
-        1, // COS
-        3, // TERNARY
-        0, // SORT
-        0, // DUP
-        0, // SWAP
-        0, // DROP
-    };
-    static_assert(sizeof(numOperands) == static_cast<unsigned>(ExprOpType::DROP) + 1, "invalid table");
+    const ExprNode &node = graph[n];
+    if (!node.isFloat)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        const ExprNode &arg = graph[node.args[i]];
+        if (arg.op.type != ExprOpType::MUL || !arg.isFloat)
+            continue;
+        if (state.invariant[node.args[i]] && !state.invariant[n])
+            continue;
+        // The conversions of integers to float (see ExprGraph::toFloat).
+        const ExprNode &r = graph[arg.args[1]];
+        if (r.op.type == ExprOpType::CONSTANTF && r.op.imm.f == 1.0f)
+            continue;
+        return i;
+    }
+    return -1;
+}
 
+template<int lanes>
+typename Compiler<lanes>::FloatV Compiler<lanes>::fuseMulAdd(std::vector<Value> &values, const std::vector<int> &slot, const State &state, int n) const
+{
     using namespace rr;
-    std::vector<Value> stack;
-
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        const ExprOp &op = ctx.ops[i];
-
-        // Check validity.
-        if (op.type == ExprOpType::MEM_LOAD && op.imm.i >= ctx.numInputs)
-            throw std::runtime_error("reference to undefined clip: " + tok);
-        if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
-            throw std::runtime_error("insufficient values on stack: " + tok);
-        if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size())
-            throw std::runtime_error("insufficient values on stack: " + tok);
-        if (stack.size() < numOperands[static_cast<size_t>(op.type)])
-            throw std::runtime_error("insufficient values on stack: " + tok);
-
-#define OUT(x) stack.push_back(x)
-        switch (op.type) {
-        case ExprOpType::DUP:
-            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
-            break;
-        case ExprOpType::SWAP: {
-            std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
-            break;
-        }
-        case ExprOpType::DROP: {
-            for (unsigned i = 0; i < op.imm.u; i++)
-                stack.pop_back();
-            break;
-        }
+    const ExprNode &node = graph[n];
+    const int m = fusedProduct(state, n);
+    const ExprNode &mul = graph[node.args[m]];
+    FloatV a = values[slot[mul.args[0]]].ensureFloat();
+    FloatV b = values[slot[mul.args[1]]].ensureFloat();
+    FloatV c = values[slot[node.args[1 - m]]].ensureFloat();
+    if (node.op.type == ExprOpType::ADD)
+        return FMulAdd(a, b, c);
+    // a * b - c or c - a * b.
+    return m == 0 ? FMulAdd(a, b, -c) : FMulAdd(-a, b, c);
+}
 
-        case ExprOpType::SORT: {
-            // "3 7 1 2 0 4 6 5 sort8" -> "7 6 5 4 3 2 1 0"
-            auto at = [&stack](int i) -> Value& { return stack.at(stack.size() - 1 - i); };
-            const auto &sn = buildSortNet(op.imm.u);
-            for (auto cmp: sn) {
-                auto &a = at(cmp.first), &b = at(cmp.second);
-                Value min = a.Min(b), max = a.Max(b);
-                a = min, b = max;
-            }
-            break;
+template<int lanes>
+void Compiler<lanes>::buildIters(const Helper &helpers, State &state, int unroll, bool tail, bool interior, bool prologue)
+{
+    using namespace rr;
+    // The unrolled iterations are independent, so they are emitted node by node
+    // to interleave their instructions.
+    std::vector<std::vector<Value>> iters(unroll);
+    std::vector<Int> xs;
+    xs.reserve(unroll);
+    for (int k = 0; k < unroll && !prologue; k++)
+        xs.emplace_back(state.x + k * lanes);
+    std::vector<int> slot(graph.size(), -1);
+
+    for (int n: graph.schedule()) {
+        const ExprNode &node = graph[n];
+        const ExprOp &op = node.op;
+        // The prologue (unroll == 1) only computes the frame invariant nodes, which the loop then reuses.
+        if (prologue && !state.invariant[n])
+            continue;
+        slot[n] = (int)iters[0].size();
+        if (!prologue && state.invariants.count(n)) {
+            for (int k = 0; k < unroll; k++)
+                iters[k].push_back(state.invariants.at(n));
+            continue;
         }
 
-        case ExprOpType::MEM_LOAD: {
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
-            const VSFormat *format = ctx.vi[op.imm.i]->format;
-            const bool unaligned = op.x != 0;
-            Int y = state.y, x = state.x;
-            IntV offsets = 0;
-            if (op.bc == BoundaryCondition::Clamped) {
-                if (op.y != 0)
-                    y = Clamp(state.y + op.y, 0, state.height-1);
-                if (op.x != 0)
-                    x = Clamp(state.x + op.x, 0, state.width-1);
-            } else { // Mirrored
-                if (op.y != 0) {
-                    Int sy = state.y + Clamp(op.y, -state.height, state.height);
-                    y = IfThenElse(sy < 0, -1 - sy,
-                            IfThenElse(sy >= state.height, 2*state.height-1 - sy, sy));
+        for (int k = 0; k < unroll; k++) {
+        std::vector<Value> &values = iters[k];
+        Int &ix = xs[k];
+    #define OUT(x) values.push_back(x)
+            switch (op.type) {
+            case ExprOpType::MEM_LOAD: {
+                if (ctx.sampling.resampled(op.imm.i)) {
+                    OUT(loadResampled(state, ix, op));
+                    break;
                 }
-                if (op.x != 0) {
-                    Int cx = Clamp(op.x, -state.width, state.width);
-                    Int w2m1 = 2 * state.width - 1;
-                    for (int i = 0; i < lanes; i++) {
-                        Int sx = x + i + cx;
-                        Int xi = IfThenElse(sx < 0, -1 - sx,
-                                    IfThenElse(sx >= state.width, w2m1 - sx, sx));
-                        offsets = Insert(offsets, xi, i);
+                const int ptr = (int)graph.roots.size() + op.imm.i;
+                Pointer<Byte> p = state.wptrs[ptr];
+                const VSFormat *format = ctx.vi[op.imm.i]->format;
+                const bool unaligned = op.x != 0;
+                Int y = state.y, x = ix;
+                IntV offsets = 0;
+                if (interior) {
+                    if (op.y != 0)
+                        y = state.y + op.y;
+                    if (op.x != 0)
+                        x = ix + op.x;
+                } else if (op.bc == BoundaryCondition::Clamped) {
+                    if (op.y != 0)
+                        y = Clamp(state.y + op.y, 0, state.height-1);
+                    if (op.x != 0)
+                        x = Clamp(ix + op.x, 0, state.width-1);
+                } else { // Mirrored
+                    if (op.y != 0) {
+                        Int sy = state.y + Clamp(op.y, -state.height, state.height);
+                        y = IfThenElse(sy < 0, -1 - sy,
+                                IfThenElse(sy >= state.height, 2*state.height-1 - sy, sy));
+                    }
+                    if (op.x != 0) {
+                        Int cx = Clamp(op.x, -state.width, state.width);
+                        Int w2m1 = 2 * state.width - 1;
+                        for (int i = 0; i < lanes; i++) {
+                            Int sx = x + i + cx;
+                            Int xi = IfThenElse(sx < 0, -1 - sx,
+                                        IfThenElse(sx >= state.width, w2m1 - sx, sx));
+                            offsets = Insert(offsets, xi, i);
+                        }
+                        offsets = offsets * IntV(format->bytesPerSample);
+                        x = 0;
                     }
-                    offsets = offsets * IntV(format->bytesPerSample);
-                    x = 0;
                 }
-            }
-            p += y * state.strides[op.imm.i + 1] + x * format->bytesPerSample;
-            const bool regularLoad = op.bc != BoundaryCondition::Mirrored || op.x == 0;
-            if (format->sampleType == stInteger) {
-                IntV v;
-                if (format->bytesPerSample == 1) {
-                    if (regularLoad)
-                        v = IntV(*Pointer<ByteV>(p, (unaligned ? 1:lanes)*sizeof(uint8_t)));
-                    else
-                        v = IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t)));
-                } else if (format->bytesPerSample == 2) {
-                    if (regularLoad)
-                        v = IntV(*Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t)));
-                    else
-                        v = IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
-                } else if (format->bytesPerSample == 4) {
-                    if (regularLoad)
-                        v = IntV(*Pointer<IntV>(p, (unaligned ? 1:lanes)*sizeof(uint32_t)));
+                p += y * state.strides[ptr] + x * format->bytesPerSample;
+                const bool regularLoad = interior || op.bc != BoundaryCondition::Mirrored || op.x == 0;
+                const int align = unaligned ? format->bytesPerSample : vectorAlignment(format->bytesPerSample);
+                // Within the main loop only a clamped load to the right can cross the end of the row.
+                const Extent extent = tail ? Extent::Partial :
+                    !interior && op.bc == BoundaryCondition::Clamped && op.x > 0 ? Extent::MaybePartial : Extent::Full;
+                IntV mask = tail ? IntV(tailMask(state, ix)) : IntV(~0);
+                if (format->sampleType == stInteger) {
+                    IntV v;
+                    if (format->bytesPerSample == 1) {
+                        if (regularLoad)
+                            v = IntV(loadRow<ByteV>(state, p, align, x, extent));
+                        else
+                            v = IntV(Gather(Pointer<Byte>(p), offsets, mask, sizeof(uint8_t)));
+                    } else if (format->bytesPerSample == 2) {
+                        if (regularLoad)
+                            v = IntV(loadRow<UShortV>(state, p, align, x, extent));
+                        else
+                            v = IntV(Gather(Pointer<UShort>(p), offsets, mask, sizeof(uint16_t)));
+                    } else if (format->bytesPerSample == 4) {
+                        if (regularLoad)
+                            v = loadRow<IntV>(state, p, align, x, extent);
+                        else
+                            v = IntV(Gather(Pointer<Int>(p), offsets, mask, sizeof(uint32_t)));
+                    }
+                    if (!interior)
+                        v = relativeAccessAdjust<lanes>(x, ix, state.width, op, v);
+                    if (ctx.forceFloat())
+                        OUT(FloatV(v));
                     else
-                        v = IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint16_t)));
-                }
-                v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
-                if (ctx.forceFloat())
-                    OUT(FloatV(v));
-                else
+                        OUT(v);
+                } else if (format->sampleType == stFloat) {
+                    FloatV v;
+                    if (format->bytesPerSample == 2) {
+                        UShortV h;
+                        if (regularLoad)
+                            h = loadRow<UShortV>(state, p, align, x, extent);
+                        else
+                            h = Gather(Pointer<UShort>(p), offsets, mask, sizeof(uint16_t));
+                        v = HalfToFloat(h);
+                    } else if (format->bytesPerSample == 4) {
+                        if (regularLoad)
+                            v = loadRow<FloatV>(state, p, align, x, extent);
+                        else
+                            v = Gather(Pointer<Float>(p), offsets, mask, sizeof(float));
+                    }
+                    if (!interior)
+                        v = relativeAccessAdjust<lanes>(x, ix, state.width, op, v);
                     OUT(v);
-            } else if (format->sampleType == stFloat) {
-                FloatV v;
-                if (format->bytesPerSample == 2)
-                    abort(); // XXX: f16 not supported
-                else if (format->bytesPerSample == 4) {
-                    if (regularLoad)
-                        v = *Pointer<FloatV>(p, (unaligned ? 1:lanes)*sizeof(float));
-                    else
-                        v = Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float));
                 }
-                v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
-                OUT(v);
+                break;
             }
-            break;
-        }
-        case ExprOpType::CONSTANTI:
-            OUT((int)op.imm.i);
-            break;
-        case ExprOpType::CONSTANTF:
-            if (op.imm.f == (float)(int)op.imm.f)
-                OUT((int)op.imm.f);
-            else
+            case ExprOpType::MEM_GATHER:
+                OUT(loadGather(state, values[slot[node.args[0]]], values[slot[node.args[1]]], op));
+                break;
+            case ExprOpType::CONSTANTI:
+                OUT((int)op.imm.i);
+                break;
+            case ExprOpType::CONSTANTF:
                 OUT(op.imm.f);
-            break;
-        case ExprOpType::CONST_LOAD: {
-            switch (static_cast<LoadConstType>(op.imm.i)) {
-            case LoadConstType::N:
-                OUT(IntV(Pointer<Int>(state.consts)[static_cast<int>(LoadConstIndex::N)]));
                 break;
-            case LoadConstType::Y:
-                OUT(IntV(state.y));
+            case ExprOpType::CONST_LOAD: {
+                switch (static_cast<LoadConstType>(op.imm.i)) {
+                case LoadConstType::N:
+                    OUT(IntV(Pointer<Int>(state.consts)[static_cast<int>(LoadConstIndex::N)]));
+                    break;
+                case LoadConstType::Y:
+                    OUT(IntV(state.y));
+                    break;
+                case LoadConstType::X:
+                    OUT(state.xvec + IntV(ix));
+                    break;
+                case LoadConstType::Width:
+                    OUT(IntV(state.width));
+                    break;
+                case LoadConstType::Height:
+                    OUT(IntV(state.height));
+                    break;
+                default: {
+                    constexpr int bias = static_cast<int>(LoadConstIndex::LAST) - static_cast<int>(LoadConstType::LAST);
+                    OUT(FloatV(state.consts[op.imm.i + bias]));
+                }
+                }
+                break;
+            }
+
+    #define LOAD1(x) \
+                Value x = values[slot[node.args[0]]]
+    #define LOAD2(l, r) \
+                Value l = values[slot[node.args[0]]]; \
+                Value r = values[slot[node.args[1]]]
+    #define LOAD3(x, l, r) \
+                Value x = values[slot[node.args[0]]]; \
+                Value l = values[slot[node.args[1]]]; \
+                Value r = values[slot[node.args[2]]]
+    #define BINARYOP(op, forceFloat) { \
+                LOAD2(l, r); \
+                if (l.isFloat() && r.isFloat()) \
+                    OUT(op(l.f(), r.f())); \
+                else if (l.isFloat()) \
+                    OUT(op(l.f(), FloatV(r.i()))); \
+                else if (r.isFloat()) \
+                    OUT(op(FloatV(l.i()), r.f())); \
+                else if (forceFloat) \
+                    OUT(op(FloatV(l.i()), FloatV(r.i()))); \
+                else \
+                    OUT(op(l.i(), r.i())); \
+                break; \
+            }
+    #define BINARYOPF(op) { \
+                LOAD2(l, r); \
+                OUT(op(l.ensureFloat(), r.ensureFloat())); \
+                break; \
+            }
+    #define UNARYOP(op, forceFloat) { \
+                LOAD1(x); \
+                if (x.isFloat()) \
+                    OUT(op(x.f())); \
+                else if (forceFloat) \
+                    OUT(op(FloatV(x.i()))); \
+                else \
+                    OUT(op(x.i())); \
+                break; \
+            }
+    #define UNARYOPF(op) { \
+                LOAD1(x); \
+                OUT(op(x.ensureFloat())); \
+                break; \
+            }
+    #define LOGICOP(op) { \
+                LOAD2(l, r); \
+                IntV li = l.isFloat() ? CmpGT(l.f(), FloatV(0.0)) : CmpGT(l.i(), IntV(0)); \
+                IntV ri = r.isFloat() ? CmpGT(r.f(), FloatV(0.0)) : CmpGT(r.i(), IntV(0)); \
+                auto x = op(li, ri); \
+                OUT(x & IntV(1)); \
+                break; \
+            }
+
+            // Products are added with FMAs explicitly, rather than relying on LLVM to contract them.
+            case ExprOpType::ADD:
+                if (fusedProduct(state, n) < 0)
+                    BINARYOP(operator +, false);
+                OUT(fuseMulAdd(values, slot, state, n));
                 break;
-            case LoadConstType::X:
-                OUT(state.xvec + IntV(state.x));
+            case ExprOpType::SUB:
+                if (fusedProduct(state, n) < 0)
+                    BINARYOP(operator -, false);
+                OUT(fuseMulAdd(values, slot, state, n));
                 break;
-            case LoadConstType::Width:
-                OUT(IntV(state.width));
+            case ExprOpType::MUL: BINARYOP(operator *, false);
+            case ExprOpType::DIV: BINARYOP(operator /, true);
+            case ExprOpType::MOD: BINARYOP(operator %, true);
+            case ExprOpType::SQRT: UNARYOPF([](RValue<FloatV> x) -> FloatV { return Sqrt(Max(x, FloatV(0.0))); });
+            case ExprOpType::ABS: UNARYOP(Abs, ctx.forceFloat());
+            case ExprOpType::MAX: BINARYOP(Max, ctx.forceFloat());
+            case ExprOpType::MIN: BINARYOP(Min, ctx.forceFloat());
+            case ExprOpType::CLAMP: {
+                LOAD3(x, min, max);
+                if (x.isFloat() || min.isFloat() || max.isFloat() || ctx.forceFloat()) {
+                    FloatV xf = x.ensureFloat();
+                    FloatV minf = min.ensureFloat();
+                    FloatV maxf = max.ensureFloat();
+                    OUT(Max(Min(xf, maxf), minf));
+                } else
+                    OUT(Max(Min(x.i(), max.i()), min.i()));
                 break;
-            case LoadConstType::Height:
-                OUT(IntV(state.height));
+            }
+    #define CMP(l, r) \
+                switch (static_cast<ComparisonType>(op.imm.u)) { \
+                case ComparisonType::EQ:  x = CmpEQ(l, r);  break; \
+                case ComparisonType::LT:  x = CmpLT(l, r);  break; \
+                case ComparisonType::LE:  x = CmpLE(l, r);  break; \
+                case ComparisonType::NEQ: x = CmpNEQ(l, r); break; \
+                case ComparisonType::NLT: x = CmpNLT(l, r); break; \
+                case ComparisonType::NLE: x = CmpNLE(l, r); break; \
+                }
+            case ExprOpType::CMP: {
+                LOAD2(l, r);
+                IntV x;
+                if (l.isFloat() || r.isFloat()) {
+                    FloatV lf = l.ensureFloat();
+                    FloatV rf = r.ensureFloat();
+                    CMP(lf, rf);
+                } else {
+                    CMP(l.i(), r.i());
+                }
+                OUT(x & IntV(1));
                 break;
-            default: {
-                constexpr int bias = static_cast<int>(LoadConstIndex::LAST) - static_cast<int>(LoadConstType::LAST);
-                OUT(FloatV(state.consts[op.imm.i + bias]));
             }
+    #undef CMP
+
+            case ExprOpType::AND: LOGICOP(operator &);
+            case ExprOpType::OR: LOGICOP(operator |);
+            case ExprOpType::XOR: LOGICOP(operator ^);
+            case ExprOpType::NOT: {
+                LOAD1(x);
+                IntV xi = x.isFloat() ? CmpLE(x.f(), FloatV(0.0f)) : CmpLE(x.i(), IntV(0));
+                OUT(xi & IntV(1));
+                break;
             }
-            break;
+
+            case ExprOpType::TRUNC: UNARYOPF(Trunc);
+            case ExprOpType::ROUND: UNARYOPF(Round);
+            case ExprOpType::FLOOR: UNARYOPF(Floor);
+
+            case ExprOpType::EXP: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Exp->Call(x); });
+            case ExprOpType::LOG: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Log->Call(x); });
+            case ExprOpType::POW: {
+                LOAD2(l, r);
+                if (!r.isFloat()) {
+                    OUT(IfThenElse(RValue<IntV>(r.i()).IsConstant(),
+                            BuiltinPow(l.ensureFloat(), FloatV(r.i())),
+                            helpers.Pow->Call(l.ensureFloat(), r.ensureFloat())));
+                } else {
+                    OUT(helpers.Pow->Call(l.ensureFloat(), r.ensureFloat()));
+                }
+                break;
+            }
+            case ExprOpType::SIN: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Sin->Call(x); });
+            case ExprOpType::COS: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Cos->Call(x); });
+
+            case ExprOpType::TERNARY: {
+                LOAD3(c, t, f);
+                auto ci = c.isFloat() ? CmpGT(c.f(), FloatV(0.0f)) : CmpGT(c.i(), IntV(0));
+                if (t.isFloat() || f.isFloat()) {
+                    FloatV tf = t.ensureFloat();
+                    FloatV ff = f.ensureFloat();
+                    OUT(As<FloatV>((As<IntV>(tf) & ci) | (As<IntV>(ff) & ~ci)));
+                } else
+                    OUT((t.i() & ci) | (f.i() & ~ci));
+                break;
+            }
+    #undef LOGICOP
+    #undef UNARYOP
+    #undef BINARYOP
+    #undef OUT
+    #undef LOAD3
+    #undef LOAD2
+    #undef LOAD1
+            default:
+                // Stack manipulation and variables are resolved by ExprGraph.
+                abort();
+            } // switch
         }
+    }
 
-#define LOAD1(x) \
-            Value x = stack.back(); stack.pop_back()
-#define LOAD2(l, r) \
-            LOAD1(r); \
-            LOAD1(l)
-#define BINARYOP(op, forceFloat) { \
-            LOAD2(l, r); \
-            if (l.isFloat() && r.isFloat()) \
-                OUT(op(l.f(), r.f())); \
-            else if (l.isFloat()) \
-                OUT(op(l.f(), FloatV(r.i()))); \
-            else if (r.isFloat()) \
-                OUT(op(FloatV(l.i()), r.f())); \
-            else if (forceFloat) \
-                OUT(op(FloatV(l.i()), FloatV(r.i()))); \
-            else \
-                OUT(op(l.i(), r.i())); \
-            break; \
-        }
-#define BINARYOPF(op) { \
-            LOAD2(l, r); \
-            OUT(op(l.ensureFloat(), r.ensureFloat())); \
-            break; \
-        }
-#define UNARYOP(op, forceFloat) { \
-            LOAD1(x); \
-            if (x.isFloat()) \
-                OUT(op(x.f())); \
-            else if (forceFloat) \
-                OUT(op(FloatV(x.i()))); \
-            else \
-                OUT(op(x.i())); \
-            break; \
-        }
-#define UNARYOPF(op) { \
-            LOAD1(x); \
-            OUT(op(x.ensureFloat())); \
-            break; \
-        }
-#define LOGICOP(op) { \
-            LOAD2(l, r); \
-            IntV li = l.isFloat() ? CmpGT(l.f(), FloatV(0.0)) : CmpGT(l.i(), IntV(0)); \
-            IntV ri = l.isFloat() ? CmpGT(r.f(), FloatV(0.0)) : CmpGT(r.i(), IntV(0)); \
-            auto x = op(li, ri); \
-            OUT(x & IntV(1)); \
-            break; \
-        }
-
-        case ExprOpType::VAR_LOAD:
-            OUT(state.variables[op.imm.i]);
-            break;
-        case ExprOpType::VAR_STORE: {
-            LOAD1(x);
-            state.variables[op.imm.i] = x;
-            break;
+    if (prologue) {
+        for (int n = 0; n < (int)graph.size(); n++) {
+            auto type = graph[n].op.type;
+            if (slot[n] >= 0 && type != ExprOpType::CONSTANTI && type != ExprOpType::CONSTANTF)
+                state.invariants.emplace(n, iters[0][slot[n]]);
         }
+        return;
+    }
 
-        case ExprOpType::ADD: BINARYOP(operator +, false);
-        case ExprOpType::SUB: BINARYOP(operator -, false);
-        case ExprOpType::MUL: BINARYOP(operator *, false);
-        case ExprOpType::DIV: BINARYOP(operator /, true);
-        case ExprOpType::MOD: BINARYOP(operator %, true);
-        case ExprOpType::SQRT: UNARYOPF([](RValue<FloatV> x) -> FloatV { return Sqrt(Max(x, FloatV(0.0))); });
-        case ExprOpType::ABS: UNARYOP(Abs, ctx.forceFloat());
-        case ExprOpType::MAX: BINARYOP(Max, ctx.forceFloat());
-        case ExprOpType::MIN: BINARYOP(Min, ctx.forceFloat());
-        case ExprOpType::CLAMP: {
-            LOAD2(min, max);
-            LOAD1(x);
-            if (x.isFloat() || min.isFloat() || max.isFloat() || ctx.forceFloat()) {
-                FloatV xf = x.ensureFloat();
-                FloatV minf = min.ensureFloat();
-                FloatV maxf = max.ensureFloat();
-                OUT(Max(Min(xf, maxf), minf));
-            } else
-                OUT(Max(Min(x.i(), max.i()), min.i()));
-            break;
+    for (size_t r = 0; r < graph.reductions.size(); r++) {
+        const ReductionType type = graph.reductions[r].type;
+        for (int k = 0; k < unroll; k++) {
+            FloatV v = iters[k][slot[graph.reductions[r].node]].ensureFloat();
+            if (tail) {
+                IntV mask = tailMask(state, xs[k]);
+                v = As<FloatV>((As<IntV>(v) & mask) | (As<IntV>(FloatV(reductionIdentity(type))) & ~mask));
+            }
+            state.reductions[r] = reduce<FloatV>(type, state.reductions[r], v);
         }
-#define CMP(l, r) \
-            switch (static_cast<ComparisonType>(op.imm.u)) { \
-            case ComparisonType::EQ:  x = CmpEQ(l, r);  break; \
-            case ComparisonType::LT:  x = CmpLT(l, r);  break; \
-            case ComparisonType::LE:  x = CmpLE(l, r);  break; \
-            case ComparisonType::NEQ: x = CmpNEQ(l, r); break; \
-            case ComparisonType::NLT: x = CmpNLT(l, r); break; \
-            case ComparisonType::NLE: x = CmpNLE(l, r); break; \
-            }
-        case ExprOpType::CMP: {
-            LOAD2(l, r);
-            IntV x;
-            if (l.isFloat() || r.isFloat()) {
-                FloatV lf = l.ensureFloat();
-                FloatV rf = r.ensureFloat();
-                CMP(lf, rf);
-            } else {
-                CMP(l.i(), r.i());
+    }
+
+    auto format = ctx.vo->format;
+    for (size_t j = 0; j < graph.roots.size(); j++) {
+        for (int k = 0; k < unroll; k++) {
+            auto res = iters[k][slot[graph.roots[j]]];
+            Pointer<Byte> p = state.wptrs[j];
+            p += state.y * state.strides[j] + xs[k] * format->bytesPerSample;
+            if (format->sampleType == stInteger) {
+                IntV rounded;
+                const int maxval = (1<<format->bitsPerSample) - 1;
+                if (res.isFloat()) {
+                    FloatV f = res.f();
+                    if (ctx.dither)
+                        f = f + ditherOffset(state, xs[k]);
+                    FloatV clamped = Min(Max(f, FloatV(0)), FloatV(maxval));
+                    rounded = RoundInt(clamped);
+                } else if (format->bitsPerSample < 32)
+                    rounded = Min(Max(res.i(), IntV(0)), IntV(maxval));
+                else
+                    rounded = res.i();
+                const int align = vectorAlignment(format->bytesPerSample);
+                if (format->bytesPerSample == 1)
+                    storeRow<ByteV>(state, p, align, xs[k], tail, ByteV(UShortV(rounded)));
+                else if (format->bytesPerSample == 2)
+                    storeRow<UShortV>(state, p, align, xs[k], tail, UShortV(rounded));
+                else if (format->bytesPerSample == 4)
+                    storeRow<IntV>(state, p, align, xs[k], tail, rounded);
+            } else if (format->sampleType == stFloat) {
+                const int align = vectorAlignment(format->bytesPerSample);
+                if (format->bytesPerSample == 2)
+                    storeRow<UShortV>(state, p, align, xs[k], tail, FloatToHalf(res.ensureFloat()));
+                else if (format->bytesPerSample == 4)
+                    storeRow<FloatV>(state, p, align, xs[k], tail, res.ensureFloat());
             }
-            OUT(x & IntV(1));
-            break;
         }
-#undef CMP
+    }
+}
 
-        case ExprOpType::AND: LOGICOP(operator &);
-        case ExprOpType::OR: LOGICOP(operator |);
-        case ExprOpType::XOR: LOGICOP(operator ^);
-        case ExprOpType::NOT: {
-            LOAD1(x);
-            IntV xi = x.isFloat() ? CmpLE(x.f(), FloatV(0.0f)) : CmpLE(x.i(), IntV(0));
-            OUT(xi & IntV(1));
-            break;
+// The coordinates of the output plane are mapped as in ExprInterpreter::load(), with all
+// the lanes gathered from the (clamped) sample positions.
+template<int lanes>
+typename Compiler<lanes>::Value Compiler<lanes>::loadResampled(State &state, rr::Int &ix, const ExprOp &op)
+{
+    using namespace rr;
+    const int ptr = (int)graph.roots.size() + op.imm.i;
+    const VSFormat *format = ctx.vi[op.imm.i]->format;
+    const int sx = ctx.sampling.scale[op.imm.i].first, sy = ctx.sampling.scale[op.imm.i].second;
+    const bool isFloat = ctx.forceFloat() || format->sampleType == stFloat;
+
+    // The pixels of the output plane, with the boundary condition applied, also to the
+    // lanes beyond the end of the row.
+    IntV w = IntV(state.width);
+    IntV ox = state.xvec + IntV(ix + op.x);
+    Int oy = state.y + op.y;
+    if (op.bc == BoundaryCondition::Mirrored) {
+        IntV low = CmpLT(ox, IntV(0)), high = CmpNLT(ox, w);
+        ox = (low & (IntV(-1) - ox)) | (high & (w + w - IntV(1) - ox)) | (~(low | high) & ox);
+        oy = IfThenElse(oy < 0, -1 - oy, IfThenElse(oy >= state.height, 2 * state.height - 1 - oy, oy));
+    }
+    ox = Max(Min(ox, w - IntV(1)), IntV(0));
+    oy = Clamp(oy, 0, state.height - 1);
+
+    Pointer<Byte> base = state.wptrs[ptr];
+    auto fetch = [&](Int y, IntV x) -> Value {
+        Pointer<Byte> p = base + y * state.strides[ptr];
+        IntV offsets = x * IntV(format->bytesPerSample);
+        IntV mask = IntV(~0);
+        if (format->sampleType == stFloat) {
+            if (format->bytesPerSample == 2)
+                return FloatV(HalfToFloat(Gather(Pointer<UShort>(p), offsets, mask, sizeof(uint16_t))));
+            return FloatV(Gather(Pointer<Float>(p), offsets, mask, sizeof(float)));
         }
+        if (format->bytesPerSample == 1)
+            return IntV(Gather(Pointer<Byte>(p), offsets, mask, sizeof(uint8_t)));
+        if (format->bytesPerSample == 2)
+            return IntV(Gather(Pointer<UShort>(p), offsets, mask, sizeof(uint16_t)));
+        return IntV(Gather(Pointer<Int>(p), offsets, mask, sizeof(uint32_t)));
+    };
 
-        case ExprOpType::TRUNC: UNARYOPF(Trunc);
-        case ExprOpType::ROUND: UNARYOPF(Round);
-        case ExprOpType::FLOOR: UNARYOPF(Floor);
+    if (!ctx.sampling.bilinear) {
+        IntV x = sx >= 0 ? IntV(ox << sx) : IntV(ox >> -sx);
+        Int y = sy >= 0 ? Int(oy << Int(sy)) : Int(oy >> Int(-sy));
+        Value v = fetch(y, x);
+        if (isFloat)
+            return v.ensureFloat();
+        return v;
+    }
 
-        case ExprOpType::EXP: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Exp->Call(x); });
-        case ExprOpType::LOG: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Log->Call(x); });
-        case ExprOpType::POW: {
-            LOAD2(l, r);
-            if (!r.isFloat()) {
-                OUT(IfThenElse(RValue<IntV>(r.i()).IsConstant(),
-                        BuiltinPow(l.ensureFloat(), FloatV(r.i())),
-                        helpers.Pow->Call(l.ensureFloat(), r.ensureFloat())));
-            } else {
-                OUT(helpers.Pow->Call(l.ensureFloat(), r.ensureFloat()));
-            }
-            break;
+    // See samplePosition(), horizontally only upsampled planes are interpolated.
+    IntV x0, x1;
+    FloatV wx;
+    if (sx >= 0)
+        x0 = ox << sx;
+    else {
+        x0 = ox >> -sx;
+        x1 = Min(x0 + IntV(1), IntV((state.width >> Int(-sx)) - 1));
+        wx = FloatV(ox & IntV((1 << -sx) - 1)) * FloatV(1.0f / (1 << -sx));
+    }
+    Int y0 = oy, y1;
+    Float wy;
+    if (sy != 0) {
+        Int num = sy > 0 ? Int((((2 * oy + 1) << Int(sy)) - 1)) : Int(2 * oy + 1 - (1 << -sy));
+        const int shift = sy > 0 ? 1 : 1 - sy;
+        Int i0 = num >> Int(shift);
+        Int h = sy > 0 ? Int(state.height << Int(sy)) : Int(state.height >> Int(-sy));
+        y0 = Max(i0, Int(0));
+        y1 = Min(i0 + 1, h - 1);
+        wy = Float(num & Int((1 << shift) - 1)) * (1.0f / (1 << shift));
+    }
+    auto row = [&](Int y) {
+        FloatV a = fetch(y, x0).ensureFloat();
+        if (sx < 0) {
+            FloatV b = fetch(y, x1).ensureFloat();
+            a = a + (b - a) * wx;
         }
-        case ExprOpType::SIN: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Sin->Call(x); });
-        case ExprOpType::COS: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Cos->Call(x); });
-
-        case ExprOpType::TERNARY: {
-            LOAD2(t, f);
-            LOAD1(c);
-            auto ci = c.isFloat() ? CmpGT(c.f(), FloatV(0.0f)) : CmpGT(c.i(), IntV(0));
-            if (t.isFloat() || f.isFloat()) {
-                FloatV tf = t.ensureFloat();
-                FloatV ff = f.ensureFloat();
-                OUT(As<FloatV>((As<IntV>(tf) & ci) | (As<IntV>(ff) & ~ci)));
-            } else
-                OUT((t.i() & ci) | (f.i() & ~ci));
-            break;
+        return a;
+    };
+    FloatV v = row(y0);
+    if (sy != 0) {
+        FloatV v1 = row(y1);
+        v = v + (v1 - v) * FloatV(wy);
+    }
+    if (isFloat)
+        return v;
+    return IntV(RoundInt(v));
+}
+
+// The coordinates are rounded to integers and clamped (or mirrored once and then clamped)
+// into the plane, so the lanes may be gathered from anywhere in it.
+template<int lanes>
+typename Compiler<lanes>::Value Compiler<lanes>::loadGather(State &state, Value x, Value y, const ExprOp &op)
+{
+    using namespace rr;
+    const int ptr = (int)graph.roots.size() + op.imm.i;
+    const VSFormat *format = ctx.vi[op.imm.i]->format;
+
+    auto coordinate = [&](Value v, Int size) {
+        IntV s = IntV(size);
+        IntV c = v.isFloat() ? IntV(RoundInt(v.f())) : v.i();
+        if (op.bc == BoundaryCondition::Mirrored) {
+            IntV low = CmpLT(c, IntV(0)), high = CmpNLT(c, s);
+            c = (low & (IntV(-1) - c)) | (high & (s + s - IntV(1) - c)) | (~(low | high) & c);
         }
-#undef LOGICOP
-#undef UNARYOP
-#undef BINARYOP
-#undef OUT
-#undef LOAD2
-#undef LOAD1
-        } // switch
+        return Max(Min(c, s - IntV(1)), IntV(0));
+    };
+    IntV ix = coordinate(x, state.width), iy = coordinate(y, state.height);
+    if (ctx.sampling.resampled(op.imm.i)) {
+        const int sx = ctx.sampling.scale[op.imm.i].first, sy = ctx.sampling.scale[op.imm.i].second;
+        ix = sx >= 0 ? IntV(ix << sx) : IntV(ix >> -sx);
+        iy = sy >= 0 ? IntV(iy << sy) : IntV(iy >> -sy);
     }
 
-    if (stack.empty())
-        throw std::runtime_error("empty expression: " + ctx.expr);
-    if (stack.size() > 1)
-        throw std::runtime_error("unconsumed values on stack: " + ctx.expr);
+    Pointer<Byte> p = state.wptrs[ptr];
+    IntV offsets = iy * IntV(state.strides[ptr]) + ix * IntV(format->bytesPerSample);
+    IntV mask = IntV(~0);
+    if (format->sampleType == stFloat) {
+        if (format->bytesPerSample == 2)
+            return FloatV(HalfToFloat(Gather(Pointer<UShort>(p), offsets, mask, sizeof(uint16_t))));
+        return FloatV(Gather(Pointer<Float>(p), offsets, mask, sizeof(float)));
+    }
+    IntV v;
+    if (format->bytesPerSample == 1)
+        v = IntV(Gather(Pointer<Byte>(p), offsets, mask, sizeof(uint8_t)));
+    else if (format->bytesPerSample == 2)
+        v = IntV(Gather(Pointer<UShort>(p), offsets, mask, sizeof(uint16_t)));
+    else
+        v = Gather(Pointer<Int>(p), offsets, mask, sizeof(uint32_t));
+    if (ctx.forceFloat())
+        return FloatV(v);
+    return v;
+}
 
-    auto res = stack.back();
-    auto format = ctx.vo->format;
-    Pointer<Byte> p = state.wptrs[0];
-    p += state.y * state.strides[0] + state.x * format->bytesPerSample;
-    if (format->sampleType == stInteger) {
-        IntV rounded;
-        const int maxval = (1<<format->bitsPerSample) - 1;
-        if (res.isFloat()) {
-            FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV(maxval));
-            rounded = RoundInt(clamped);
-        } else if (format->bitsPerSample < 32)
-            rounded = Min(Max(res.i(), IntV(0)), IntV(maxval));
-        else
-            rounded = res.i();
-        if (format->bytesPerSample == 1)
-            *Pointer<ByteV>(p, lanes*sizeof(uint8_t)) = ByteV(UShortV(rounded));
-        else if (format->bytesPerSample == 2)
-            *Pointer<UShortV>(p, lanes*sizeof(uint16_t)) = UShortV(rounded);
-        else if (format->bytesPerSample == 4)
-            *Pointer<IntV>(p, lanes*sizeof(uint32_t)) = rounded;
-    } else if (format->sampleType == stFloat) {
-        if (format->bytesPerSample == 2) // XXX: f16 not supported.
-            abort();
-        else if (format->bytesPerSample == 4)
-            *Pointer<FloatV>(p, lanes*sizeof(float)) = res.ensureFloat();
+template<int lanes>
+void Compiler<lanes>::buildNarrowIters(State &state, const std::vector<ValueRange> &ranges, int unroll)
+{
+    using namespace rr;
+    constexpr int width = 2 * lanes;
+    std::vector<std::vector<ShortV>> iters(unroll);
+    std::vector<int> slot(graph.size(), -1);
+
+    for (int n: graph.schedule()) {
+        const ExprNode &node = graph[n];
+        const ExprOp &op = node.op;
+        slot[n] = (int)iters[0].size();
+
+        for (int k = 0; k < unroll; k++) {
+            std::vector<ShortV> &values = iters[k];
+            auto arg = [&](int i) { return RValue<ShortV>(values[slot[node.args[i]]]); };
+            auto boolean = [](RValue<ShortV> x) { return x & ShortV(1); };
+            switch (op.type) {
+            case ExprOpType::MEM_LOAD: {
+                const int ptr = (int)graph.roots.size() + op.imm.i;
+                const int bytesPerSample = ctx.vi[op.imm.i]->format->bytesPerSample;
+                const int align = std::min(width * bytesPerSample, ALIGNMENT);
+                Pointer<Byte> p = state.wptrs[ptr];
+                p += state.y * state.strides[ptr] + (state.x + k * width) * bytesPerSample;
+                if (bytesPerSample == 1)
+                    values.push_back(ShortV(*Pointer<NarrowByteV>(p, align)));
+                else // at most 15 bits
+                    values.push_back(*Pointer<ShortV>(p, align));
+                break;
+            }
+            case ExprOpType::CONSTANTI: case ExprOpType::CONSTANTF:
+                values.emplace_back(static_cast<short>(ranges[n].first));
+                break;
+            case ExprOpType::ADD: values.push_back(arg(0) + arg(1)); break;
+            case ExprOpType::SUB: values.push_back(arg(0) - arg(1)); break;
+            case ExprOpType::MUL: values.push_back(arg(0) * arg(1)); break;
+            case ExprOpType::ABS: values.push_back(Abs(arg(0))); break;
+            case ExprOpType::MAX: values.push_back(Max(arg(0), arg(1))); break;
+            case ExprOpType::MIN: values.push_back(Min(arg(0), arg(1))); break;
+            case ExprOpType::CLAMP: values.push_back(Max(Min(arg(0), arg(2)), arg(1))); break;
+            case ExprOpType::CMP: {
+                RValue<ShortV> l = arg(0), r = arg(1);
+                switch (static_cast<ComparisonType>(op.imm.u)) {
+                case ComparisonType::EQ:  values.push_back(boolean(CmpEQ(l, r)));  break;
+                case ComparisonType::LT:  values.push_back(boolean(CmpLT(l, r)));  break;
+                case ComparisonType::LE:  values.push_back(boolean(CmpLE(l, r)));  break;
+                case ComparisonType::NEQ: values.push_back(boolean(CmpNEQ(l, r))); break;
+                case ComparisonType::NLT: values.push_back(boolean(CmpNLT(l, r))); break;
+                case ComparisonType::NLE: values.push_back(boolean(CmpNLE(l, r))); break;
+                }
+                break;
+            }
+            case ExprOpType::AND: values.push_back(boolean(CmpGT(arg(0), ShortV(0)) & CmpGT(arg(1), ShortV(0)))); break;
+            case ExprOpType::OR: values.push_back(boolean(CmpGT(arg(0), ShortV(0)) | CmpGT(arg(1), ShortV(0)))); break;
+            case ExprOpType::XOR: values.push_back(boolean(CmpGT(arg(0), ShortV(0)) ^ CmpGT(arg(1), ShortV(0)))); break;
+            case ExprOpType::NOT: values.push_back(boolean(CmpLE(arg(0), ShortV(0)))); break;
+            case ExprOpType::TRUNC: case ExprOpType::ROUND: case ExprOpType::FLOOR:
+                values.push_back(arg(0));
+                break;
+            case ExprOpType::TERNARY: {
+                ShortV c = CmpGT(arg(0), ShortV(0));
+                values.push_back((arg(1) & c) | (arg(2) & ~c));
+                break;
+            }
+            default:
+                // Rejected by narrowRanges.
+                abort();
+            }
+        }
+    }
+
+    const VSFormat *format = ctx.vo->format;
+    const int maxval = (1 << format->bitsPerSample) - 1;
+    const int align = std::min(width * format->bytesPerSample, ALIGNMENT);
+    for (size_t j = 0; j < graph.roots.size(); j++) {
+        const ValueRange range = ranges[graph.roots[j]];
+        for (int k = 0; k < unroll; k++) {
+            ShortV v = iters[k][slot[graph.roots[j]]];
+            if (range.first < 0)
+                v = Max(v, ShortV(0));
+            if (range.second > maxval)
+                v = Min(v, ShortV(maxval));
+            Pointer<Byte> p = state.wptrs[j];
+            p += state.y * state.strides[j] + (state.x + k * width) * format->bytesPerSample;
+            if (format->bytesPerSample == 1)
+                *Pointer<NarrowByteV>(p, align) = NarrowByteV(v);
+            else
+                *Pointer<ShortV>(p, align) = v;
+        }
     }
 }
 
@@ -1093,7 +3371,10 @@ typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
     {
         FloatV x = h.Pow->template Arg<0>();
         FloatV y = h.Pow->template Arg<1>();
-        Return(h.Exp->Call(h.Log->Call(x) * y));
+        if (ctx.precision == ExprPrecision::Accurate)
+            Return(Pow_(x, y));
+        else
+            Return(h.Exp->Call(h.Log->Call(x) * y));
     }
 
     return h;
@@ -1102,186 +3383,1057 @@ typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
 template<int lanes>
 Compiled Compiler<lanes>::compile()
 {
-    if (ctx.cached) {
-        return ctx.getCached();
-    }
+#ifdef USE_EXPR_CACHE
+    return exprCache.get(ctx.key(), [this] { return build(); });
+#else
+    return build();
+#endif
+}
 
-    using namespace rr;
-    Module mod;
+template<int lanes>
+Compiled Compiler<lanes>::withLut(Compiled c)
+{
+    // Dithered results also depend on the position of the pixel.
+    const std::vector<int> clips = ctx.sampling.any() || ctx.dither ? std::vector<int>() : lutInputs(graph, ctx.vo, ctx.vi.data(), lanes);
+    if (clips.empty())
+        return c;
+    // The routine computes a plane holding every sample value of the first clip in each
+    // row, and row y of the second one in row y.
+    const bool pair = clips.size() > 1;
+    const int srcBytes = ctx.vi[clips[0]]->format->bytesPerSample;
+    const int dstBytes = ctx.vo->format->bytesPerSample;
+    const int width = 1 << ctx.vi[clips[0]]->format->bitsPerSample;
+    const int height = pair ? 256 : 1;
+    const size_t entries = (size_t)width * height;
+    std::vector<uint8_t> buf(entries * dstBytes + (size_t)width * srcBytes + (pair ? entries : 0) + 3 * ALIGNMENT);
+    uint8_t *dstp = buf.data() + (-reinterpret_cast<uintptr_t>(buf.data()) & (ALIGNMENT - 1));
+    uint8_t *srcp = dstp + entries * dstBytes + ALIGNMENT;
+    for (int v = 0; v < width; v++) {
+        if (srcBytes == 1)
+            srcp[v] = static_cast<uint8_t>(v);
+        else
+            reinterpret_cast<uint16_t *>(srcp)[v] = static_cast<uint16_t>(v);
+    }
+    void *rwptrs[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = { dstp };
+    int strides[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = { width * dstBytes };
+    rwptrs[1 + clips[0]] = srcp;
+    if (pair) {
+        uint8_t *rowsp = srcp + (size_t)width * srcBytes + ALIGNMENT;
+        for (int y = 0; y < height; y++)
+            std::fill_n(rowsp + (size_t)y * width, width, static_cast<uint8_t>(y));
+        rwptrs[1 + clips[1]] = rowsp;
+        strides[1 + clips[1]] = width;
+    }
+    ExprUnion consts[static_cast<int>(LoadConstIndex::LAST)] = {};
+    auto proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(c.code()));
+    proc(rwptrs, strides, reinterpret_cast<float *>(consts), width, height, 0, height, nullptr);
+
+    auto lut = std::make_shared<Compiled::Lut>();
+    lut->clips[0] = clips[0];
+    lut->clips[1] = pair ? clips[1] : -1;
+    lut->maxIndex = width - 1;
+    lut->table.assign(dstp, dstp + entries * dstBytes);
+    lut->lookup = lookupFunction(pair, srcBytes, dstBytes);
+    c.lut = lut;
+    return c;
+}
 
-    std::map<std::pair<int, std::string>, int> paMap;
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        ExprOp &op = ctx.ops[i];
+template<int lanes>
+bool Compiler<lanes>::loadCached(Compiled &c)
+{
+    // Compiled by an earlier process?
+    if (auto routine = rr::loadCachedRoutine(*ctx.key().text, "procPlane")) {
+        exprCache.noteDiskHit();
+        c = withLut(Compiled { routine, graph.propAccess });
+        return true;
+    }
+    return false;
+}
 
-        constexpr int last = static_cast<int>(LoadConstType::LAST);
-        if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last) continue;
+template<int lanes>
+Compiled Compiler<lanes>::build()
+{
+    Compiled c;
+    if (loadCached(c))
+        return c;
+    return buildModule();
+}
 
-        int id = op.imm.i - last;
-        if (id >= ctx.numInputs)
-            throw std::runtime_error("reference to undefined clip: " + tok);
+template<int lanes>
+Compiled Compiler<lanes>::buildModule()
+{
+    rr::Module mod;
+    mod.setVectorWidth(lanes * 32);
+    mod.setCacheKey(*ctx.key().text);
+    Helper helpers = buildHelpers(mod);
+    define(mod, helpers, "procPlane");
+    return withLut(Compiled { mod.acquire("proc", jitConfig(ctx.jitLevel)), graph.propAccess });
+}
 
-        auto key = std::make_pair(id, op.name);
-        auto it = paMap.find(key);
-        if (it == paMap.end())
-            paMap.insert({key, (int)paMap.size()});
-        op.imm.i = last + paMap.at(key);
+template<int lanes>
+std::vector<Compiled> Compiler<lanes>::buildBatch(const std::vector<Compiler *> &batch)
+{
+    std::vector<Compiled> r(batch.size());
+    std::vector<size_t> todo;
+    for (size_t i = 0; i < batch.size(); i++)
+        if (!batch[i]->loadCached(r[i]))
+            todo.push_back(i);
+    if (todo.size() == 1)
+        r[todo[0]] = batch[todo[0]]->buildModule();
+    if (todo.size() <= 1)
+        return r;
+
+    // Not stored in the disk cache, whose objects hold a single expression.
+    rr::Module mod;
+    mod.setVectorWidth(lanes * 32);
+    Helper helpers = batch[0]->buildHelpers(mod);
+    std::vector<std::string> names;
+    for (size_t i: todo) {
+        names.push_back("procPlane" + std::to_string(names.size()));
+        batch[i]->define(mod, helpers, names.back().c_str());
+    }
+    auto routine = mod.acquire("proc", names, jitConfig(batch[0]->ctx.jitLevel));
+    for (size_t k = 0; k < todo.size(); k++) {
+        Compiler *c = batch[todo[k]];
+        r[todo[k]] = c->withLut(Compiled { routine, c->graph.propAccess, nullptr, (int)k, (int)todo.size() });
     }
-    std::vector<Compiled::PropAccess> pa(paMap.size());
-    for (const auto &item: paMap) {
-        pa[item.second] = Compiled::PropAccess{ item.first.first, item.first.second };
+    return r;
+}
+
+template<int lanes>
+void Compiler<lanes>::define(rr::Module &mod, const Helper &helpers, const char *name)
+{
+    using namespace rr;
+    //            void *rwptrs, int strides[], float *props, int width, int height, int ystart, int yend, float *rowReductions
+    // with the destinations followed by the inputs in rwptrs and strides.
+    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int, Int, Int, Pointer<Byte>)> function(mod, name);
+
+    State state;
+    pointer rwptrs = function.Arg<0>();
+    Pointer<Int> strides = Pointer<Int>(Pointer<Byte>(function.Arg<1>()));
+    state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
+    state.width = function.Arg<3>();
+    state.height = function.Arg<4>();
+    Int ystart = function.Arg<5>();
+    Int yend = function.Arg<6>();
+    state.rowReductions = Pointer<Float>(Pointer<Byte>(function.Arg<7>()));
+    const int numReductions = (int)graph.reductions.size();
+    state.reductions.reserve(numReductions);
+    for (int r = 0; r < numReductions; r++)
+        state.reductions.emplace_back();
+
+    for (int i = 0; i < lanes; i++)
+        state.xvec = Insert(state.xvec, i, i);
+
+    for (int i = 0; i < (int)graph.roots.size() + ctx.numInputs; i++) {
+        state.wptrs.push_back(*Pointer<Pointer<Byte>>(rwptrs + sizeof(void *) * i));
+        state.strides[i] = strides[i];
     }
 
-    std::map<std::string, int> varMap;
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        ExprOp &op = ctx.ops[i];
+    state.invariant = graph.frameInvariant();
+    buildIters(helpers, state, 1, false, false, true);
 
-        if (op.type != ExprOpType::VAR_LOAD && op.type != ExprOpType::VAR_STORE) continue;
-        auto it = varMap.find(op.name);
-        if (it == varMap.end()) {
-            if (op.type == ExprOpType::VAR_LOAD)
-                throw std::runtime_error("reference to uninitialized variable: " + tok);
-            varMap.insert({ op.name, (int)varMap.size() });
+    const int unroll = ctx.unroll > 0 ? ctx.unroll : autoUnroll(graph);
+    auto &y = state.y, &x = state.x;
+    const RelativeExtent extent = relativeExtent(graph);
+    const std::vector<ValueRange> ranges = lanes > 4 && !ctx.sampling.any() ? narrowRanges(graph, ctx.vo, ctx.vi.data()) : std::vector<ValueRange>();
+    const bool narrow = !ranges.empty();
+    // Columns [xstart, xend) of rows [ystart, yend). Only the last tile ends at the row
+    // width, the others are a multiple of the unrolled vectors wide.
+    auto processRows = [&](Int &xstart, Int &xend) {
+        For(y = ystart, y < yend, y++)
+        {
+            for (int r = 0; r < numReductions; r++)
+                state.reductions[r] = FloatV(reductionIdentity(graph.reductions[r].type));
+            x = xstart;
+            if (extent.any()) {
+                // The vectors in [xinterior, xborder) of rows far enough from the top and
+                // bottom are loaded directly, without any boundary handling.
+                Int xinterior = xstart, xborder = xstart;
+                If(y >= -extent.minY && y < state.height - extent.maxY)
+                {
+                    xinterior = Max(xstart, Int(-extent.minX));
+                    xborder = Min(xend, state.width - extent.maxX);
+                }
+                While(x < xinterior && x + lanes <= xend)
+                {
+                    buildIters(helpers, state, 1, false);
+                    x += lanes;
+                }
+                if (unroll > 1) {
+                    While(x + lanes * unroll <= xborder)
+                    {
+                        buildIters(helpers, state, unroll, false, true);
+                        x += lanes * unroll;
+                    }
+                }
+                While(x + lanes <= xborder)
+                {
+                    buildIters(helpers, state, 1, false, true);
+                    x += lanes;
+                }
+            }
+            if constexpr (lanes > 4) {
+                if (narrow) {
+                    if (unroll > 1) {
+                        While(x + 2 * lanes * unroll <= xend)
+                        {
+                            buildNarrowIters(state, ranges, unroll);
+                            x += 2 * lanes * unroll;
+                        }
+                    }
+                    While(x + 2 * lanes <= xend)
+                    {
+                        buildNarrowIters(state, ranges, 1);
+                        x += 2 * lanes;
+                    }
+                }
+            }
+            // The right border, or whole rows without relative accesses.
+            if (unroll > 1 && !narrow) {
+                While(x + lanes * unroll <= xend)
+                {
+                    buildIters(helpers, state, unroll, false);
+                    x += lanes * unroll;
+                }
+            }
+            // Remaining full vectors of the row.
+            While(x + lanes <= xend)
+            {
+                buildIters(helpers, state, 1, false);
+                x += lanes;
+            }
+            // The last partial vector.
+            If(x < xend)
+            {
+                buildIters(helpers, state, 1, true);
+            }
+            for (int r = 0; r < numReductions; r++) {
+                const ReductionType type = graph.reductions[r].type;
+                Float v = Extract(state.reductions[r], 0);
+                for (int i = 1; i < lanes; i++)
+                    v = reduce<Float>(type, v, Extract(state.reductions[r], i));
+                Int index = y * numReductions + r;
+                state.rowReductions[index] = reduce<Float>(type, state.rowReductions[index], v);
+            }
+        }
+    };
+    if (int tile = tileWidth(graph, ctx.vo, ctx.vi.data(), lanes * unroll)) {
+        Int xstart;
+        For(xstart = 0, xstart < state.width, xstart += tile)
+        {
+            Int xend = Min(xstart + tile, state.width);
+            processRows(xstart, xend);
         }
-        op.imm.i = varMap.at(op.name);
+    } else {
+        Int xstart = 0;
+        processRows(xstart, state.width);
     }
+    Return();
+}
 
-    Helper helpers = buildHelpers(mod);
-
-    //            void *rwptrs, int strides[], float *props, int width, int height
-    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int)> function(mod, "procPlane");
 
-    State state;
-    pointer rwptrs = function.Arg<0>();
-    Pointer<Int> strides = Pointer<Int>(Pointer<Byte>(function.Arg<1>()));
-    state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
-    state.width = function.Arg<3>();
-    state.height = function.Arg<4>();
+static void VS_CC exprInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    ExprData *d = static_cast<ExprData *>(*instanceData);
+    vsapi->setVideoInfo(&d->vi, 1, node);
+}
 
-    for (size_t i = 0; i < varMap.size(); i++)
-        state.variables.push_back(Value(IntV(0)));
+using StatsClock = std::chrono::steady_clock;
 
-    for (int i = 0; i < lanes; i++)
-        state.xvec = Insert(state.xvec, i, i);
+static double secondsSince(StatsClock::time_point start) {
+    return std::chrono::duration<double>(StatsClock::now() - start).count();
+}
 
-    for (int i = 0; i < ctx.numInputs + 1; i++) {
-        state.wptrs.push_back(*Pointer<Pointer<Byte>>(rwptrs + sizeof(void *) * i));
-        state.strides[i] = strides[i];
-    }
+// The time (in seconds) spent waiting for the input frames, gathering their properties,
+// running the code of each plane (0 for those that are copied) and on the whole frame
+// once the inputs were ready.
+struct FrameTimes {
+    double fetch = 0;
+    double props = 0;
+    double kernel[3] = {};
+    StatsClock::time_point ready = StatsClock::now();
+};
 
-    auto &y = state.y, &x = state.x;
-    For(y = 0, y < state.height, y++)
-    {
-        For(x = 0, x < state.width, x+=LANES*UNROLL)
-        {
-            for (int k = 0; k < UNROLL; k++)
-                buildOneIter(helpers, state);
-        }
-    }
-    Return();
+static void setTimeProps(VSFrameRef *dst, const FrameTimes &t, int numPlanes, const VSAPI *vsapi) {
+    VSMap *props = vsapi->getFramePropsRW(dst);
+    vsapi->propSetFloat(props, "_AkarinTimeFetch", t.fetch, paReplace);
+    vsapi->propSetFloat(props, "_AkarinTimeProps", t.props, paReplace);
+    vsapi->propSetFloatArray(props, "_AkarinTimeKernel", t.kernel, numPlanes);
+    vsapi->propSetFloat(props, "_AkarinTimeTotal", secondsSince(t.ready), paReplace);
+}
 
-    Compiled r { mod.acquire("proc"), pa };
-#ifdef USE_EXPR_CACHE
-    exprCache.insert({ctx.key(), r});
-#endif
-    return r;
+// The frame of input i that is read for frame n.
+static int inputFrame(const ExprData *d, int i, int n, const VSAPI *vsapi) {
+    if (!d->frameOffset[i])
+        return n;
+    return std::min(std::max(n + d->frameOffset[i], 0), vsapi->getVideoInfo(d->node[i])->numFrames - 1);
 }
 
+// N followed by the frame properties of propAccess.
+static void loadProps(ExprUnion *consts, int n, const std::vector<Compiled::PropAccess> &propAccess, const VSFrameRef *const *src, const VSAPI *vsapi) {
+    consts[0] = static_cast<int32_t>(n);
+    for (size_t k = 0; k < propAccess.size(); k++) {
+        const auto &pa = propAccess[k];
+        auto m = vsapi->getFramePropsRO(src[pa.clip]);
+        int err = 0;
+        float val = vsapi->propGetInt(m, pa.name.c_str(), 0, &err);
+        if (err == peType)
+            val = vsapi->propGetFloat(m, pa.name.c_str(), 0, &err);
+        if (err != 0)
+            val = std::nanf(""); // XXX: should we warn the user?
+        consts[k + 1] = val;
+    }
+}
 
-static void VS_CC exprInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    ExprData *d = static_cast<ExprData *>(*instanceData);
-    vsapi->setVideoInfo(&d->vi, 1, node);
+// Whether the condition of frame n is true (greater than 0). It is evaluated by the
+// interpreter on a single pixel, as it only depends on N and the frame properties.
+static bool exprCondition(const ExprData *d, int n, const VSFrameRef *const *src, const VSAPI *vsapi) {
+    std::vector<ExprUnion> consts(d->condition->propAccess.size() + 1);
+    loadProps(consts.data(), n, d->condition->propAccess, src, vsapi);
+    float result = 0.0f;
+    uint8_t *rwptrs[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = { reinterpret_cast<uint8_t *>(&result) };
+    int strides[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = {};
+    d->condition->process(rwptrs, strides, reinterpret_cast<const float *>(consts.data()), 1, 1, 0, 1, nullptr);
+    return result > 0.0f;
 }
 
+// The state of a frame between the calls of exprGetFrame.
+struct ExprFrameState {
+    StatsClock::time_point requested = StatsClock::now();
+    // Whether the condition was found true, so that the other inputs were requested.
+    bool conditionTrue = false;
+};
+
 static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(*instanceData);
     int numInputs = d->numInputs;
 
+    std::unique_ptr<ExprFrameState> state(static_cast<ExprFrameState *>(*frameData));
+    *frameData = nullptr;
+
     if (activationReason == arInitial) {
+        if (d->stats || d->condition)
+            *frameData = new ExprFrameState;
         for (int i = 0; i < numInputs; i++)
-            vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+            if (!d->condition || d->conditionInput[i])
+                vsapi->requestFrameFilter(inputFrame(d, i, n, vsapi), d->node[i], frameCtx);
     } else if (activationReason == arAllFramesReady) {
+        FrameTimes times;
+        if (d->stats)
+            times.fetch = std::chrono::duration<double>(times.ready - state->requested).count();
+        const bool conditionKnown = !d->condition || state->conditionTrue;
         const VSFrameRef *src[MAX_EXPR_INPUTS] = {};
         for (int i = 0; i < numInputs; i++)
-            src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
+            if (conditionKnown || d->conditionInput[i])
+                src[i] = vsapi->getFrameFilter(inputFrame(d, i, n, vsapi), d->node[i], frameCtx);
+
+        // The frame of the first clip is passed through as is, for all outputs.
+        if (!conditionKnown && !exprCondition(d, n, src, vsapi)) {
+            for (int i = 1; i < MAX_EXPR_INPUTS; i++)
+                vsapi->freeFrame(src[i]);
+            if (d->numOutputs == 1)
+                return src[0];
+            VSFrameRef *dst = vsapi->copyFrame(src[0], core);
+            VSMap *props = vsapi->getFramePropsRW(dst);
+            vsapi->propDeleteKey(props, EXPR_OUTPUTS_PROP);
+            for (int k = 1; k < d->numOutputs; k++)
+                vsapi->propSetFrame(props, EXPR_OUTPUTS_PROP, src[0], paAppend);
+            vsapi->freeFrame(src[0]);
+            return dst;
+        }
+        if (!conditionKnown) {
+            bool pending = false;
+            for (int i = 0; i < numInputs; i++) {
+                if (!d->conditionInput[i]) {
+                    vsapi->requestFrameFilter(inputFrame(d, i, n, vsapi), d->node[i], frameCtx);
+                    pending = true;
+                }
+            }
+            if (pending) {
+                for (int i = 0; i < numInputs; i++)
+                    vsapi->freeFrame(src[i]);
+                state->conditionTrue = true;
+                *frameData = state.release();
+                return nullptr;
+            }
+        }
 
         const VSFormat *fi = d->vi.format;
         int height = vsapi->getFrameHeight(src[0], 0);
         int width = vsapi->getFrameWidth(src[0], 0);
         int planes[3] = { 0, 1, 2 };
-        const VSFrameRef *srcf[3] = { d->plane[0] != poCopy ? nullptr : src[0], d->plane[1] != poCopy ? nullptr : src[0], d->plane[2] != poCopy ? nullptr : src[0] };
-        VSFrameRef *dst = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[0], core);
+        VSFrameRef *dst[MAX_EXPR_OUTPUTS] = {};
+        for (int k = 0; k < d->numOutputs; k++) {
+            const int *op = d->plane[k];
+            const VSFrameRef *srcf[3] = { op[0] != poCopy ? nullptr : src[0], op[1] != poCopy ? nullptr : src[0], op[2] != poCopy ? nullptr : src[0] };
+            dst[k] = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[0], core);
+        }
 
-        const uint8_t *srcp[MAX_EXPR_INPUTS] = {};
-        int strides[MAX_EXPR_INPUTS + 1] = {};
+        int strides[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = {};
+        uint8_t *rwptrs[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = {};
+
+        // The reductions of all planes into each property of each output.
+        struct Total {
+            ReductionType type;
+            double value;
+            int64_t count;
+        };
+        std::map<std::pair<int, std::string>, Total> totals;
+
+        // N followed by the frame properties of all planes, on the stack unless there are a lot of them.
+        StatsClock::time_point start = StatsClock::now();
+        const size_t numConsts = d->frameProps.size() + 1;
+        ExprUnion frameConstsBuf[MAX_STACK_CONSTS], planeConstsBuf[MAX_STACK_CONSTS];
+        std::unique_ptr<ExprUnion[]> constsHeap;
+        ExprUnion *frameConsts = frameConstsBuf, *planeConsts = planeConstsBuf;
+        if (numConsts > MAX_STACK_CONSTS) {
+            constsHeap.reset(new ExprUnion[2 * numConsts]);
+            frameConsts = constsHeap.get();
+            planeConsts = frameConsts + numConsts;
+        }
+        loadProps(frameConsts, n, d->frameProps, src, vsapi);
+        if (d->stats)
+            times.props += secondsSince(start);
 
         for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
-            if (d->plane[plane] != poProcess)
+            const std::vector<int> &outputs = d->planeOutputs[plane];
+            if (outputs.empty())
                 continue;
 
-            strides[0] = vsapi->getStride(dst, plane);
+            // Use the interpreter until the compiler is done.
+            const ExprInterpreter *interpreter = d->isCompiled(plane) ? nullptr : d->interpreter[plane].get();
+            try {
+                if (!interpreter && d->pending[plane].valid())
+                    d->pending[plane].get();
+            } catch (std::exception &e) {
+                vsapi->setFilterError((std::string{ "Expr: " } + e.what()).c_str(), frameCtx);
+                for (int i = 0; i < MAX_EXPR_INPUTS; i++)
+                    vsapi->freeFrame(src[i]);
+                for (int k = 0; k < d->numOutputs; k++)
+                    vsapi->freeFrame(dst[k]);
+                return nullptr;
+            }
+
+            const int numOutputs = (int)outputs.size();
+            for (int j = 0; j < numOutputs; j++) {
+                rwptrs[j] = vsapi->getWritePtr(dst[outputs[j]], plane);
+                strides[j] = vsapi->getStride(dst[outputs[j]], plane);
+            }
             for (int i = 0; i < numInputs; i++) {
                 if (d->node[i]) {
-                    srcp[i] = vsapi->getReadPtr(src[i], plane);
-                    strides[i + 1] = vsapi->getStride(src[i], plane);
+                    rwptrs[numOutputs + i] = const_cast<uint8_t *>(vsapi->getReadPtr(src[i], plane));
+                    strides[numOutputs + i] = vsapi->getStride(src[i], plane);
                 }
             }
 
-            uint8_t *dstp = vsapi->getWritePtr(dst, plane);
-            int h = vsapi->getFrameHeight(dst, plane);
-            int w = vsapi->getFrameWidth(dst, plane);
-
-            uint8_t *rwptrs[MAX_EXPR_INPUTS + 1] = { dstp };
-            for (int i = 0; i < numInputs; i++) {
-                rwptrs[i + 1] = const_cast<uint8_t *>(srcp[i]);
+            int h = vsapi->getFrameHeight(dst[0], plane);
+            int w = vsapi->getFrameWidth(dst[0], plane);
+
+            // N followed by the frame properties of the plane.
+            ExprUnion *consts = frameConsts;
+            if (!d->readsFrameProps(plane)) {
+                const std::vector<int> &index = d->propIndex[plane];
+                consts = planeConsts;
+                consts[0] = frameConsts[0];
+                for (size_t k = 0; k < index.size(); k++)
+                    consts[k + 1] = frameConsts[index[k] + 1];
             }
 
-            union U {
-                int i;
-                float f;
-                U(int i = 0) : i(i) {}
-                U(float f) : f(f) {}
+            // The reductions are computed in single precision for each row, and the rows
+            // are combined in double precision afterwards.
+            const std::vector<ExprReduction> &reductions = d->reductions[plane];
+            std::vector<float> rowReductions((size_t)h * reductions.size());
+            for (size_t i = 0; i < rowReductions.size(); i++)
+                rowReductions[i] = reductionIdentity(reductions[i % reductions.size()].type);
+
+            ExprData::ProcessProc proc = d->proc[plane];
+            const Compiled::Lut *lut = interpreter ? nullptr : d->compiled[plane].lut.get();
+            float *props = reinterpret_cast<float*>(consts);
+            auto run = [&](int ystart, int yend) {
+                if (interpreter)
+                    interpreter->process(rwptrs, strides, props, w, h, ystart, yend, rowReductions.data());
+                else if (lut)
+                    lut->lookup(*lut, rwptrs, strides, w, ystart, yend);
+                else
+                    proc(rwptrs, strides, props, w, h, ystart, yend, rowReductions.data());
             };
-            std::vector<U> consts = { n };
-            for (const auto &pa : d->compiled[plane].propAccess) {
-                auto m = vsapi->getFramePropsRO(src[pa.clip]);
-                int err = 0;
-                float val = vsapi->propGetInt(m, pa.name.c_str(), 0, &err);
-                if (err == peType)
-                    val = vsapi->propGetFloat(m, pa.name.c_str(), 0, &err);
-                if (err != 0)
-                    val = std::nanf(""); // XXX: should we warn the user?
-                consts.push_back(val);
+            start = StatsClock::now();
+            if (d->uniform[plane]) {
+                run(0, 1);
+                const size_t rowBytes = (size_t)w * fi->bytesPerSample;
+                for (int j = 0; j < numOutputs; j++)
+                    for (int y = 1; y < h; y++)
+                        memcpy(rwptrs[j] + (ptrdiff_t)y * strides[j], rwptrs[j], rowBytes);
+            } else if (d->threads > 1 && h > 1) {
+                // A few stripes per thread so that uneven progress can be balanced.
+                const int stripes = std::min(h, d->threads * 4);
+                lexpr::ThreadPool::instance().parallelFor(stripes, d->threads, [&](int i) {
+                    run((int)((int64_t)h * i / stripes), (int)((int64_t)h * (i + 1) / stripes));
+                }, d->numa);
+            } else
+                run(0, h);
+            if (d->stats)
+                times.kernel[plane] = secondsSince(start);
+
+            for (size_t r = 0; r < reductions.size(); r++) {
+                const ExprReduction &red = reductions[r];
+                auto it = totals.find({ red.output, red.name });
+                if (it == totals.end())
+                    it = totals.insert({ { red.output, red.name }, { red.type, reductionIdentity(red.type), 0 } }).first;
+                for (int y = 0; y < h; y++)
+                    it->second.value = reduce<double>(red.type, it->second.value, rowReductions[(size_t)y * reductions.size() + r]);
+                it->second.count += (int64_t)w * h;
             }
+        }
 
-            ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[plane].routine->getEntry()));
-            proc(rwptrs, strides, reinterpret_cast<float*>(&consts[0]), w, h);
+        for (const auto &t : totals) {
+            const Total &total = t.second;
+            double value = total.type == ReductionType::AVG ? total.value / total.count : total.value;
+            vsapi->propSetFloat(vsapi->getFramePropsRW(dst[t.first.first]), t.first.second.c_str(), value, paReplace);
         }
 
         for (int i = 0; i < MAX_EXPR_INPUTS; i++) {
             vsapi->freeFrame(src[i]);
         }
+        if (d->stats) {
+            for (int k = 0; k < d->numOutputs; k++)
+                setTimeProps(dst[k], times, d->vi.format->numPlanes, vsapi);
+        }
+        // The other outputs are extracted by their own filters, see exprOutputGetFrame.
+        VSMap *props = vsapi->getFramePropsRW(dst[0]);
+        for (int k = 1; k < d->numOutputs; k++) {
+            vsapi->propSetFrame(props, EXPR_OUTPUTS_PROP, dst[k], paAppend);
+            vsapi->freeFrame(dst[k]);
+        }
+        return dst[0];
+    }
+
+    return nullptr;
+}
+
+struct ExprOutputData {
+    VSNodeRef *node;
+    int index;
+};
+
+static void VS_CC exprOutputInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    ExprOutputData *d = static_cast<ExprOutputData *>(*instanceData);
+    vsapi->setVideoInfo(vsapi->getVideoInfo(d->node), 1, node);
+}
+
+// Output index of an Expr with several outputs, which are all computed (and cached) together.
+static const VSFrameRef *VS_CC exprOutputGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ExprOutputData *d = static_cast<ExprOutputData *>(*instanceData);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        const VSFrameRef *dst;
+        if (d->index == 0) {
+            VSFrameRef *f = vsapi->copyFrame(src, core);
+            vsapi->propDeleteKey(vsapi->getFramePropsRW(f), EXPR_OUTPUTS_PROP);
+            dst = f;
+        } else
+            dst = vsapi->propGetFrame(vsapi->getFramePropsRO(src), EXPR_OUTPUTS_PROP, d->index - 1, nullptr);
+        vsapi->freeFrame(src);
         return dst;
     }
 
     return nullptr;
 }
 
+static void VS_CC exprOutputFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    ExprOutputData *d = static_cast<ExprOutputData *>(instanceData);
+    vsapi->freeNode(d->node);
+    delete d;
+}
+
+static void unregisterFusionSource(const VSVideoInfo *key);
+
 static void VS_CC exprFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(instanceData);
+    if (d->fusionKey)
+        unregisterFusionSource(d->fusionKey);
+    // The compilers still refer to the video info.
+    for (auto &p : d->pending)
+        if (p.valid())
+            p.wait();
     for (int i = 0; i < MAX_EXPR_INPUTS; i++)
         vsapi->freeNode(d->node[i]);
     delete d;
 }
 
+static std::string clipName(int clip) {
+    return std::string(1, clip < 3 ? 'x' + clip : 'a' + clip - 3);
+}
+
+// Planes computed by table lookups (see lutInputs()) are logged, as their speed depends a lot
+// on which is chosen.
+static void setCompiled(ExprData *d, int plane, const Compiled &c, const VSAPI *vsapi) {
+    d->setCompiled(plane, c);
+    if (const Compiled::Lut *lut = c.lut.get()) {
+        std::string clips = clipName(lut->clips[0]);
+        if (lut->clips[1] >= 0)
+            clips += " and " + clipName(lut->clips[1]);
+        vsapi->logMessage(mtDebug, ("Expr: plane " + std::to_string(plane) + " is looked up in a table of all values of " + clips).c_str());
+    }
+}
+
+// Lazily compiled planes wait in a queue until a worker of the thread pool takes all those
+// queued up to then, at most exprBatchSize with the same jit_level and precision, and compiles them into
+// one module. This saves the setup of LLVM for each routine, and packs the code of many
+// small routines into the same pages. As long as there are idle workers each plane is
+// still compiled on its own, so only the planes of a script that are created faster than
+// they can be compiled are batched.
+static size_t exprBatchSize = 1; // AKARIN_EXPR_BATCH, 1 compiles every plane on its own
+
+template<int lanes>
+class ExprBatch {
+public:
+    // Called with the function returning the compiled plane (or throwing its error).
+    using Done = std::function<void(const std::function<Compiled()> &)>;
+
+    static void submit(const std::shared_ptr<Compiler<lanes>> &compiler, const Done &done) {
+        {
+            std::lock_guard<std::mutex> guard(lock());
+            queue().push_back({ compiler, done });
+        }
+        lexpr::ThreadPool::instance().submit(run);
+    }
+
+private:
+    struct Job {
+        std::shared_ptr<Compiler<lanes>> compiler;
+        Done done;
+    };
+
+    static std::mutex &lock() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::deque<Job> &queue() {
+        static std::deque<Job> q;
+        return q;
+    }
+
+    static void run() {
+        std::vector<Job> jobs;
+        {
+            std::lock_guard<std::mutex> guard(lock());
+            auto &q = queue();
+            // Empty if the jobs were taken by an earlier run.
+            for (auto it = q.begin(); it != q.end() && jobs.size() < exprBatchSize;) {
+                if (jobs.empty() || (it->compiler->jitLevel() == jobs[0].compiler->jitLevel() &&
+                                     it->compiler->precision() == jobs[0].compiler->precision())) {
+                    jobs.push_back(std::move(*it));
+                    it = q.erase(it);
+                } else
+                    ++it;
+            }
+        }
+
+        // The planes that are cached or being compiled elsewhere are only looked up, once
+        // the others (which may have the same key) are in the cache.
+        std::vector<Compiler<lanes> *> claimed;
+        std::vector<ExprKey> keys;
+        std::vector<int> index(jobs.size(), -1);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const ExprKey &key = jobs[i].compiler->key();
+            if (exprCache.claim(key)) {
+                index[i] = (int)claimed.size();
+                claimed.push_back(jobs[i].compiler.get());
+                keys.push_back(key);
+            }
+        }
+        std::vector<Compiled> compiled;
+        std::exception_ptr error;
+        if (!claimed.empty()) {
+            const auto start = std::chrono::steady_clock::now();
+            try {
+                compiled = Compiler<lanes>::buildBatch(claimed);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / claimed.size();
+            for (size_t k = 0; k < claimed.size(); k++) {
+                if (error)
+                    exprCache.abandon(keys[k], error);
+                else
+                    exprCache.add(keys[k], compiled[k], seconds);
+            }
+        }
+
+        for (size_t i = 0; i < jobs.size(); i++) {
+            jobs[i].done([&]() -> Compiled {
+                if (index[i] < 0)
+                    return jobs[i].compiler->compile();
+                if (error)
+                    std::rethrow_exception(error);
+                return compiled[index[i]];
+            });
+        }
+    }
+};
+
+// The expression is parsed (and errors are thrown) right away, but with lazy set
+// the code is generated in the background, while the rest of the script is evaluated
+// and the first frames are processed by the interpreter.
+template<int lanes>
+static void compilePlane(ExprData *d, int plane, const std::vector<std::string> &exprs, const VSVideoInfo *const *vi, int optMask, int mirror, int unroll, int jitLevel,
+                         ExprPrecision precision, bool bilinear, bool dither, bool lazy, const VSAPI *vsapi) {
+    const InputSampling sampling = inputSampling(&d->vi, vi, d->numInputs, plane, bilinear);
+    auto compiler = std::make_shared<Compiler<lanes>>(exprs, &d->vi, vi, d->numInputs, optMask, mirror, unroll, jitLevel, precision, sampling, dither);
+    // Dithering makes the rows of a uniform plane differ.
+    d->uniform[plane] = !dither && uniformOutputs(compiler->getGraph());
+    d->addProps(plane, compiler->getGraph().propAccess);
+    for (ExprReduction r: compiler->getGraph().reductions) {
+        r.output = d->planeOutputs[plane][r.output];
+        d->reductions[plane].push_back(r);
+    }
+    if (lazy) {
+        d->interpreter[plane].reset(new ExprInterpreter(compiler->getGraph(), &d->vi, vi, d->numInputs, sampling, dither));
+        auto done = std::make_shared<std::promise<void>>();
+        d->pending[plane] = done->get_future().share();
+        // The filter may be freed as soon as done is set.
+        auto finish = [d, plane, done, vsapi](const std::function<Compiled()> &compile) {
+            try {
+                setCompiled(d, plane, compile(), vsapi);
+                done->set_value();
+            } catch (...) {
+                done->set_exception(std::current_exception());
+            }
+        };
+        if (exprBatchSize > 1)
+            ExprBatch<lanes>::submit(compiler, finish);
+        else
+            lexpr::ThreadPool::instance().submit([compiler, finish] { finish([&] { return compiler->compile(); }); });
+    } else
+        setCompiled(d, plane, compiler->compile(), vsapi);
+}
+
+// Half precision floats are converted with F16C or NEON.
+static bool isSupportedFormat(const VSFormat *format) {
+    int bits = format->bitsPerSample;
+    if (format->sampleType == stInteger)
+        return bits <= 16 || bits == 32;
+    return bits == 32 || (bits == 16 && hostHalf());
+}
+
+static std::string formatError(const std::string &what) {
+    if (hostHalf())
+        return what + " must be 8-16/32 bit integer or 16/32 bit float format";
+    return what + " must be 8-16/32 bit integer or 32 bit float format (16 bit float requires F16C)";
+}
+
+// Exprs with a single output that only access the pixel being computed, by the video info
+// pointer of their node, which identifies it for as long as it exists. The clips are those
+// of the ExprData, and the expressions those of each plane.
+struct FusionSource {
+    std::vector<VSNodeRef *> clips;
+    std::vector<const VSVideoInfo *> vi;
+    std::string expr[3];
+    int optMask;
+    ExprPrecision precision;
+};
+
+static std::mutex fusionLock;
+static std::map<const VSVideoInfo *, FusionSource> fusionSources;
+
+static void unregisterFusionSource(const VSVideoInfo *key) {
+    std::lock_guard<std::mutex> guard(fusionLock);
+    fusionSources.erase(key);
+}
+
+// An input that is itself an Expr without relative pixel access is replaced by its inputs,
+// and each of its loads by the expression of the plane, so that both run in one routine and
+// the intermediate frames are never created. The value is converted as it would be stored,
+// hence half precision and 32 bit integer intermediates are kept, as are inputs accessed at
+// other pixels. Evaluating the expressions in float (opt=0) is required of both, as
+// integers may wrap around differently in the other's context.
+static void fuseInputs(ExprData *d, const VSVideoInfo **vi, std::string expr[][3], int optMask, ExprPrecision precision, const VSAPI *vsapi) {
+    if (optMask & 1)
+        return;
+
+    for (int i = 0; i < d->numInputs; i++) {
+        FusionSource src;
+        {
+            std::lock_guard<std::mutex> guard(fusionLock);
+            auto it = fusionSources.find(vi[i]);
+            if (it == fusionSources.end())
+                continue;
+            src = it->second;
+        }
+        if (d->frameOffset[i] || src.optMask != optMask || src.precision != precision || d->numInputs + src.clips.size() - 1 > MAX_EXPR_INPUTS)
+            continue;
+
+        // The expression would be evaluated at the samples that are interpolated instead.
+        const VSFormat *f = vi[i]->format;
+        if (f->subSamplingW != d->vi.format->subSamplingW || f->subSamplingH != d->vi.format->subSamplingH)
+            continue;
+        std::string convert;
+        if (f->sampleType == stInteger && f->bitsPerSample <= 16)
+            convert = " 0 max " + std::to_string((1 << f->bitsPerSample) - 1) + " min round";
+        else if (f->sampleType != stFloat || f->bitsPerSample != 32)
+            continue;
+
+        // Clip 0 of the source takes the place of the input, so that its properties (those
+        // of the frames of the source) are still there, and the others are appended.
+        auto clip = [&](int j) { return clipName(j == 0 ? i : d->numInputs + j - 1); };
+        std::string inlined[3];
+        for (int p = 0; p < f->numPlanes; p++) {
+            for (const auto &token : tokenize(src.expr[p])) {
+                ExprOp op = decodeToken(token);
+                if (op.type == ExprOpType::MEM_LOAD)
+                    inlined[p] += clip(op.imm.i);
+                else if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= static_cast<int>(LoadConstType::LAST))
+                    inlined[p] += clip(op.imm.i - static_cast<int>(LoadConstType::LAST)) + std::string(token.substr(1));
+                else if (op.type == ExprOpType::VAR_LOAD || op.type == ExprOpType::VAR_STORE)
+                    inlined[p] += "up" + std::to_string(i) + ":" + std::string(token);
+                else
+                    inlined[p] += token;
+                inlined[p] += ' ';
+            }
+            inlined[p] += convert;
+        }
+
+        // Malformed expressions are left for the compiler to report.
+        std::string fused[MAX_EXPR_OUTPUTS][3];
+        bool ok = true;
+        for (int k = 0; k < d->numOutputs && ok; k++) {
+            for (int p = 0; p < f->numPlanes && ok; p++) {
+                std::string e = expr[k][p];
+                // Copied from the first input.
+                if (e.empty() && i == 0 && d->vi.format->bitsPerSample == f->bitsPerSample && d->vi.format->sampleType == f->sampleType)
+                    e = "x";
+                size_t count = 0;
+                for (const auto &token : tokenize(e)) {
+                    try {
+                        ExprOp op = decodeToken(token);
+                        if (op.type == ExprOpType::MEM_GATHER && op.imm.i == i)
+                            ok = false;
+                        if (op.type == ExprOpType::MEM_LOAD && op.imm.i == i) {
+                            if (op.x || op.y)
+                                ok = false;
+                            fused[k][p] += inlined[p];
+                            count += tokenize(inlined[p]).size();
+                        } else {
+                            fused[k][p] += token;
+                            count++;
+                        }
+                        fused[k][p] += ' ';
+                    } catch (std::runtime_error &) {
+                        ok = false;
+                    }
+                }
+                if (e.empty())
+                    fused[k][p].clear();
+                if (count > MAX_FUSED_TOKENS)
+                    ok = false;
+            }
+        }
+        if (!ok)
+            continue;
+
+        for (int k = 0; k < d->numOutputs; k++)
+            for (int p = 0; p < f->numPlanes; p++)
+                expr[k][p] = fused[k][p];
+        vsapi->freeNode(d->node[i]);
+        d->node[i] = vsapi->cloneNodeRef(src.clips[0]);
+        vi[i] = src.vi[0];
+        for (size_t j = 1; j < src.clips.size(); j++) {
+            d->node[d->numInputs] = vsapi->cloneNodeRef(src.clips[j]);
+            d->frameOffset[d->numInputs] = 0;
+            vi[d->numInputs++] = src.vi[j];
+        }
+    }
+}
+
+// Called once the filter is created, with its planes as compiled.
+static void registerFusionSource(ExprData *d, VSMap *out, const std::string expr[3], int optMask, ExprPrecision precision, const VSAPI *vsapi) {
+    // The time properties would be lost.
+    if (d->numOutputs != 1 || d->stats)
+        return;
+    FusionSource src;
+    for (int p = 0; p < d->vi.format->numPlanes; p++) {
+        if (d->plane[0][p] == poUndefined || !d->reductions[p].empty())
+            return;
+        src.expr[p] = d->plane[0][p] == poCopy ? "x" : expr[p];
+        for (const auto &token : tokenize(src.expr[p])) {
+            ExprOp op = decodeToken(token);
+            if ((op.type == ExprOpType::MEM_LOAD && (op.x || op.y)) || op.type == ExprOpType::MEM_GATHER)
+                return;
+        }
+    }
+    for (int i = 0; i < d->numInputs; i++) {
+        if (d->frameOffset[i])
+            return;
+        src.clips.push_back(d->node[i]);
+        src.vi.push_back(vsapi->getVideoInfo(d->node[i]));
+        if (src.vi[i]->format->subSamplingW != d->vi.format->subSamplingW || src.vi[i]->format->subSamplingH != d->vi.format->subSamplingH)
+            return;
+    }
+    src.optMask = optMask;
+    src.precision = precision;
+
+    VSNodeRef *node = vsapi->propGetNode(out, "clip", 0, nullptr);
+    d->fusionKey = vsapi->getVideoInfo(node);
+    vsapi->freeNode(node);
+    std::lock_guard<std::mutex> guard(fusionLock);
+    fusionSources[d->fusionKey] = src;
+}
+
+// x[dx,dy,dt] reads clip x at frame n + dt (clamped to the clip) instead of n. Each clip and
+// offset used is appended as another input, which takes the place of the clip in the token,
+// so that the frame is requested once per offset and the compiler only sees 2D accesses.
+static void temporalInputs(ExprData *d, const VSVideoInfo **vi, std::string expr[][3], const VSAPI *vsapi) {
+    const int numClips = d->numInputs;
+    auto rewrite = [&](std::string &e) {
+        std::string r;
+        bool changed = false;
+        for (const auto &token : tokenize(e)) {
+            // Parsed as x[-?N,-?N,-?N] with an optional :c or :m; the spatial offsets and the
+            // suffix are kept as written.
+            std::string_view rest = token.size() > 2 && token[1] == '[' ? token.substr(2) : std::string_view();
+            int dx, dy, dt;
+            BoundaryCondition bc;
+            std::string_view spatial;
+            bool temporal = token[0] >= 'a' && token[0] <= 'z' && consumeInt(rest, true, dx) && consume(rest, ',') && consumeInt(rest, true, dy);
+            if (temporal) {
+                spatial = token.substr(2, token.size() - 2 - rest.size());
+                temporal = consume(rest, ',') && consumeInt(rest, true, dt) && consume(rest, ']') && consumeBoundary(rest, bc);
+            }
+            if (!temporal) {
+                r += token;
+                r += ' ';
+                continue;
+            }
+            const int clip = clipIndex(token[0]);
+            if (clip >= numClips)
+                throw std::runtime_error("reference to undefined clip: " + std::string(token));
+            int input = dt ? -1 : clip;
+            for (int i = numClips; i < d->numInputs && input < 0; i++)
+                if (vi[i] == vi[clip] && d->frameOffset[i] == dt)
+                    input = i;
+            if (input < 0) {
+                if (d->numInputs >= MAX_EXPR_INPUTS)
+                    throw std::runtime_error("More than 26 input clips and frame offsets used");
+                input = d->numInputs++;
+                d->node[input] = vsapi->cloneNodeRef(d->node[clip]);
+                d->frameOffset[input] = dt;
+                vi[input] = vi[clip];
+            }
+            r += clipName(input) + "[" + std::string(spatial) + "]" + std::string(rest) + ' ';
+            changed = true;
+        }
+        if (!changed)
+            return;
+        // The clips appended are only referred to by the tokens above.
+        for (const auto &token : tokenize(e)) {
+            if (token[0] < 'a' || token[0] > 'z' || (token.size() > 1 && token[1] != '[' && token[1] != '.'))
+                continue;
+            if (clipIndex(token[0]) >= numClips)
+                throw std::runtime_error("reference to undefined clip: " + std::string(token));
+        }
+        e = r;
+    };
+    for (int k = 0; k < d->numOutputs; k++)
+        for (int p = 0; p < 3; p++)
+            rewrite(expr[k][p]);
+}
+
+// Clips passed more than once (e.g. clips=[a, a, b], or inputs of fused Exprs that are also
+// inputs of this one) are only fetched and read once: the expressions refer to their first
+// entry instead, and the others are dropped.
+static void dedupeInputs(ExprData *d, const VSVideoInfo **vi, std::string expr[][3], std::string *condition, const VSAPI *vsapi) {
+    int remap[MAX_EXPR_INPUTS];
+    int numInputs = 0;
+    for (int i = 0; i < d->numInputs; i++) {
+        remap[i] = -1;
+        for (int j = 0; j < i && remap[i] < 0; j++)
+            if (vi[j] == vi[i] && d->frameOffset[j] == d->frameOffset[i])
+                remap[i] = remap[j];
+        if (remap[i] >= 0) {
+            vsapi->freeNode(d->node[i]);
+            d->node[i] = nullptr;
+            continue;
+        }
+        remap[i] = numInputs;
+        d->node[numInputs] = d->node[i];
+        d->frameOffset[numInputs] = d->frameOffset[i];
+        vi[numInputs] = vi[i];
+        if (numInputs != i)
+            d->node[i] = nullptr;
+        numInputs++;
+    }
+    if (numInputs == d->numInputs)
+        return;
+
+    // Malformed tokens and clips out of range are left for the compiler to report.
+    auto rewrite = [&](std::string &e) {
+        std::string r;
+        for (const auto &token : tokenize(e)) {
+            std::string t(token);
+            try {
+                ExprOp op = decodeToken(token);
+                int clip = -1;
+                if (op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::MEM_GATHER)
+                    clip = op.imm.i;
+                else if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= static_cast<int>(LoadConstType::LAST))
+                    clip = op.imm.i - static_cast<int>(LoadConstType::LAST);
+                if (clip >= 0 && clip < d->numInputs)
+                    t = clipName(remap[clip]) + std::string(token.substr(1));
+            } catch (std::runtime_error &) {
+            }
+            r += t + ' ';
+        }
+        e = r;
+    };
+    for (int k = 0; k < d->numOutputs; k++)
+        for (int p = 0; p < 3; p++)
+            rewrite(expr[k][p]);
+    if (condition)
+        rewrite(*condition);
+    d->numInputs = numInputs;
+}
+
+// The interpreter evaluating the condition argument, which may only depend on N and the
+// frame properties.
+static std::unique_ptr<ExprInterpreter> conditionInterpreter(const std::string &expr, const VSVideoInfo *const *vi, int numInputs, VSCore *core, const VSAPI *vsapi) {
+    std::vector<std::vector<ExprOp>> ops(1);
+    forEachToken(expr, [&](std::string_view tok) { ops[0].push_back(decodeToken(tok)); });
+    ExprGraph graph(ops, { expr }, vi, numInputs, true, true);
+    const std::vector<bool> invariant = graph.frameInvariant();
+    for (int n: graph.schedule()) {
+        const ExprOp &op = graph[n].op;
+        const bool size = op.type == ExprOpType::CONST_LOAD &&
+            (op.imm.i == static_cast<int>(LoadConstType::Width) || op.imm.i == static_cast<int>(LoadConstType::Height));
+        if (!invariant[n] || size || op.type == ExprOpType::REDUCE)
+            throw std::runtime_error("condition may only use N, frame properties and constants");
+    }
+    VSVideoInfo vo = {};
+    vo.format = vsapi->getFormatPreset(pfGrayS, core);
+    vo.width = vo.height = 1;
+    return std::unique_ptr<ExprInterpreter>(new ExprInterpreter(graph, &vo, vi, numInputs));
+}
+
+// Why AKARIN_EXPR_TARGET can't be used, which fails every Expr rather than quietly
+// compiling for the host instead.
+static std::string exprTargetError;
+
 static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<ExprData> d(new ExprData);
+    std::string expr[MAX_EXPR_OUTPUTS][3];
+    int optMask;
+    ExprPrecision precision;
+    bool dither;
     int err;
 
-#define EXPR_F16C_TEST (false)
-
     try {
+        if (!exprTargetError.empty())
+            throw std::runtime_error("AKARIN_EXPR_TARGET: " + exprTargetError);
+
         d->numInputs = vsapi->propNumElements(in, "clips");
         if (d->numInputs > 26)
             throw std::runtime_error("More than 26 input clips provided");
@@ -1300,24 +4452,20 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             if (!isConstantFormat(vi[i]))
                 throw std::runtime_error("Only clips with constant format and dimensions allowed");
             if (vi[0]->format->numPlanes != vi[i]->format->numPlanes
-                || vi[0]->format->subSamplingW != vi[i]->format->subSamplingW
-                || vi[0]->format->subSamplingH != vi[i]->format->subSamplingH
                 || vi[0]->width != vi[i]->width
                 || vi[0]->height != vi[i]->height)
             {
-                throw std::runtime_error("All inputs must have the same number of planes and the same dimensions, subsampling included");
+                throw std::runtime_error("All inputs must have the same number of planes and the same dimensions");
             }
-
-            int bits = vi[i]->format->bitsPerSample;
-            if (EXPR_F16C_TEST) {
-                if (((bits > 32 || (bits > 16 && bits < 32)) && vi[i]->format->sampleType == stInteger)
-                    || (bits != 16 && bits != 32 && vi[i]->format->sampleType == stFloat))
-                    throw std::runtime_error("Input clips must be 8-16/32 bit integer or 16/32 bit float format");
-            } else {
-                if (((bits > 32 || (bits > 16 && bits < 32)) && vi[i]->format->sampleType == stInteger)
-                    || (bits != 32 && vi[i]->format->sampleType == stFloat))
-                    throw std::runtime_error("Input clips must be 8-16/32 bit integer or 32 bit float format");
+            // The chroma planes of other sizes are resampled, see InputSampling.
+            if ((vi[0]->format->subSamplingW != vi[i]->format->subSamplingW || vi[0]->format->subSamplingH != vi[i]->format->subSamplingH)
+                && (vi[0]->format->colorFamily != cmYUV || vi[i]->format->colorFamily != cmYUV))
+            {
+                throw std::runtime_error("Only YUV inputs may have different subsampling");
             }
+
+            if (!isSupportedFormat(vi[i]->format))
+                throw std::runtime_error(formatError("Input clips"));
         }
 
         d->vi = *vi[0];
@@ -1330,45 +4478,147 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 if (d->vi.format->numPlanes != f->numPlanes)
                     throw std::runtime_error("The number of planes in the inputs and output must match");
                 d->vi.format = vsapi->registerFormat(d->vi.format->colorFamily, f->sampleType, f->bitsPerSample, d->vi.format->subSamplingW, d->vi.format->subSamplingH, core);
+                if (!isSupportedFormat(d->vi.format))
+                    throw std::runtime_error(formatError("The output format"));
             }
         }
 
+        d->numOutputs = int64ToIntS(vsapi->propGetInt(in, "outputs", 0, &err));
+        if (err) d->numOutputs = 1;
+        if (d->numOutputs < 1 || d->numOutputs > MAX_EXPR_OUTPUTS)
+            throw std::runtime_error("outputs must be between 1 and " + std::to_string(MAX_EXPR_OUTPUTS));
+
+        // The expressions of each output follow those of the previous one.
         int nexpr = vsapi->propNumElements(in, "expr");
+        if (nexpr < d->numOutputs || nexpr % d->numOutputs != 0)
+            throw std::runtime_error("The number of expressions must be a multiple of outputs");
+        nexpr /= d->numOutputs;
         if (nexpr > d->vi.format->numPlanes)
             throw std::runtime_error("More expressions given than there are planes");
 
-        std::string expr[3];
-        for (int i = 0; i < nexpr; i++) {
-            expr[i] = vsapi->propGetData(in, "expr", i, nullptr);
-        }
-        for (int i = nexpr; i < 3; ++i) {
-            expr[i] = expr[nexpr - 1];
+        for (int k = 0; k < d->numOutputs; k++) {
+            for (int i = 0; i < nexpr; i++) {
+                expr[k][i] = vsapi->propGetData(in, "expr", k * nexpr + i, nullptr);
+            }
+            for (int i = nexpr; i < 3; ++i) {
+                expr[k][i] = expr[k][nexpr - 1];
+            }
         }
 
-        int optMask = int64ToIntS(vsapi->propGetInt(in, "opt", 0, &err));
+        optMask = int64ToIntS(vsapi->propGetInt(in, "opt", 0, &err));
         if (err) optMask = 0;
 
         int mirror = int64ToIntS(vsapi->propGetInt(in, "boundary", 0, &err));
         if (err) mirror = 0;
 
+        int unroll = int64ToIntS(vsapi->propGetInt(in, "unroll", 0, &err));
+        if (err) unroll = 0;
+        if (unroll < 0 || unroll > MAX_UNROLL)
+            throw std::runtime_error("unroll must be between 0 (automatic) and " + std::to_string(MAX_UNROLL));
+
+        int jitLevel = int64ToIntS(vsapi->propGetInt(in, "jit_level", 0, &err));
+        if (err) jitLevel = DEFAULT_JIT_LEVEL;
+        if (jitLevel < 0 || jitLevel > MAX_JIT_LEVEL)
+            throw std::runtime_error("jit_level must be between 0 and " + std::to_string(MAX_JIT_LEVEL));
+
+        int prec = int64ToIntS(vsapi->propGetInt(in, "precision", 0, &err));
+        if (err) prec = static_cast<int>(ExprPrecision::Default);
+        if (prec < 0 || prec > MAX_PRECISION)
+            throw std::runtime_error("precision must be 0 (fast), 1 (default) or 2 (accurate)");
+        precision = static_cast<ExprPrecision>(prec);
+
+        d->threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+        if (err) d->threads = 1;
+        if (d->threads < 1 || d->threads > MAX_EXPR_THREADS)
+            throw std::runtime_error("threads must be between 1 and " + std::to_string(MAX_EXPR_THREADS));
+
+        const char *numa = vsapi->propGetData(in, "numa", 0, &err);
+        if (!err) {
+            if (strcmp(numa, "auto") && strcmp(numa, "off"))
+                throw std::runtime_error("numa must be \"auto\" or \"off\"");
+            d->numa = !strcmp(numa, "auto");
+        }
+
+        int sampling = int64ToIntS(vsapi->propGetInt(in, "sampling", 0, &err));
+        if (err) sampling = 0;
+        if (sampling < 0 || sampling > 1)
+            throw std::runtime_error("sampling must be 0 (nearest) or 1 (bilinear)");
+        const bool bilinear = sampling == 1;
+
+        int ditherMode = int64ToIntS(vsapi->propGetInt(in, "dither", 0, &err));
+        if (err) ditherMode = 0;
+        if (ditherMode < 0 || ditherMode > 1)
+            throw std::runtime_error("dither must be 0 (none) or 1 (ordered)");
+        dither = ditherMode == 1;
+
+        bool lazy = !!vsapi->propGetInt(in, "lazy", 0, &err);
+
+        d->stats = !!vsapi->propGetInt(in, "stats", 0, &err);
+
+        const char *cond = vsapi->propGetData(in, "condition", 0, &err);
+        const bool hasCondition = !err;
+        std::string condition = hasCondition ? cond : "";
+        if (hasCondition && d->vi.format != vi[0]->format)
+            throw std::runtime_error("condition requires the output format to be that of the first clip");
+
+        temporalInputs(d.get(), vi, expr, vsapi);
+        // The first clip is returned when the condition is false, so it is kept as is.
+        if (!hasCondition)
+            fuseInputs(d.get(), vi, expr, optMask, precision, vsapi);
+        dedupeInputs(d.get(), vi, expr, hasCondition ? &condition : nullptr, vsapi);
+        if (hasCondition) {
+            d->condition = conditionInterpreter(condition, vi, d->numInputs, core, vsapi);
+            for (int i = 0; i < d->numInputs; i++)
+                d->conditionInput[i] = i == 0;
+            for (const auto &pa : d->condition->propAccess)
+                d->conditionInput[pa.clip] = true;
+        }
+
         for (int i = 0; i < d->vi.format->numPlanes; i++) {
-            if (!expr[i].empty()) {
-                d->plane[i] = poProcess;
-            } else {
-                if (d->vi.format->bitsPerSample == vi[0]->format->bitsPerSample && d->vi.format->sampleType == vi[0]->format->sampleType)
-                    d->plane[i] = poCopy;
-                else
-                    d->plane[i] = poUndefined;
+            // All outputs of the plane are computed by one routine.
+            std::vector<std::string> exprs;
+            for (int k = 0; k < d->numOutputs; k++) {
+                if (!expr[k][i].empty()) {
+                    d->plane[k][i] = poProcess;
+                    d->planeOutputs[i].push_back(k);
+                    exprs.push_back(expr[k][i]);
+                } else {
+                    if (d->vi.format->bitsPerSample == vi[0]->format->bitsPerSample && d->vi.format->sampleType == vi[0]->format->sampleType)
+                        d->plane[k][i] = poCopy;
+                    else
+                        d->plane[k][i] = poUndefined;
+                }
             }
 
-            if (d->plane[i] != poProcess)
+            if (exprs.empty())
                 continue;
 
-            Compiler<LANES> comp(expr[i], &d->vi, vi, d->numInputs, optMask, mirror);
-            d->compiled[i] = comp.compile();
-            d->proc[i] = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[i].routine->getEntry()));
+            switch (hostLanes()) {
+            case 16:
+                compilePlane<16>(d.get(), i, exprs, vi, optMask, mirror, unroll, jitLevel, precision, bilinear, dither, lazy, vsapi);
+                break;
+            case 8:
+                compilePlane<8>(d.get(), i, exprs, vi, optMask, mirror, unroll, jitLevel, precision, bilinear, dither, lazy, vsapi);
+                break;
+            default:
+                compilePlane<4>(d.get(), i, exprs, vi, optMask, mirror, unroll, jitLevel, precision, bilinear, dither, lazy, vsapi);
+                break;
+            }
+        }
+
+        // The planes of an output are reduced into the same property.
+        std::map<std::pair<int, std::string>, ReductionType> reductionTypes;
+        for (const auto &reductions : d->reductions) {
+            for (const auto &r : reductions) {
+                auto it = reductionTypes.insert({ { r.output, r.name }, r.type }).first;
+                if (it->second != r.type)
+                    throw std::runtime_error("Different reductions into frame property " + r.name);
+            }
         }
     } catch (std::runtime_error &e) {
+        for (auto &p : d->pending)
+            if (p.valid())
+                p.wait();
         for (int i = 0; i < MAX_EXPR_INPUTS; i++) {
             vsapi->freeNode(d->node[i]);
         }
@@ -1376,10 +4626,40 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         return;
     }
 
-    vsapi->createFilter(in, out, "Expr", exprInit, exprGetFrame, exprFree, fmParallel, 0, d.release(), core);
+    if (d->numOutputs == 1) {
+        ExprData *data = d.release();
+        vsapi->createFilter(in, out, "Expr", exprInit, exprGetFrame, exprFree, fmParallel, 0, data, core);
+        // The dithered output can't be reproduced by the expressions it would be fused into.
+        if (!vsapi->getError(out) && !data->condition && !dither)
+            registerFusionSource(data, out, expr[0], optMask, precision, vsapi);
+        return;
+    }
+
+    // The frames of the other outputs are attached to those of the first one, so that
+    // a single filter (and cache) is needed for all of them.
+    const int numOutputs = d->numOutputs;
+    VSMap *tmp = vsapi->createMap();
+    vsapi->createFilter(in, tmp, "Expr", exprInit, exprGetFrame, exprFree, fmParallel, 0, d.release(), core);
+    if (vsapi->getError(tmp)) {
+        vsapi->setError(out, vsapi->getError(tmp));
+        vsapi->freeMap(tmp);
+        return;
+    }
+    VSNodeRef *node = vsapi->propGetNode(tmp, "clip", 0, nullptr);
+    vsapi->freeMap(tmp);
+    for (int k = 0; k < numOutputs; k++)
+        vsapi->createFilter(in, out, "ExprOutput", exprOutputInit, exprOutputGetFrame, exprOutputFree, fmParallel, 0,
+                            new ExprOutputData{ vsapi->cloneNodeRef(node), k }, core);
+    vsapi->freeNode(node);
 }
 
+static std::once_flag exprInitOnce;
+
 static void initExpr() {
+    // Before anything is compiled, and before hostLanes() is called.
+    if (const char *cpu = getenv("AKARIN_EXPR_TARGET"))
+        exprTargetError = rr::setTargetCPU(cpu);
+
     auto cfg = rr::Config::Edit()
         .set(rr::Optimization::Level::Aggressive)
         .set(rr::Optimization::FMF::FastMath)
@@ -1397,16 +4677,49 @@ static void initExpr() {
         ;
 
     rr::Nucleus::adjustDefaultConfig(cfg);
+
+    if (const char *dir = getenv("AKARIN_EXPR_CACHE"))
+        rr::setObjectCacheDirectory(dir);
+    if (const char *mb = getenv("AKARIN_EXPR_CACHE_SIZE"))
+        exprCache.setLimit((size_t)std::strtoull(mb, nullptr, 10) << 20);
+    if (const char *n = getenv("AKARIN_EXPR_BATCH"))
+        exprBatchSize = std::max<size_t>(std::strtoull(n, nullptr, 10), 1);
+
+    // Filters that are never freed may still be compiled in the background at exit,
+    // which must finish before the static destructors tear LLVM down.
+    std::atexit([] { lexpr::ThreadPool::instance().waitSubmitted(); });
 }
 
 void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
 {
     vsapi->propSetData(out, "version", VERSION, -1, paAppend);
     vsapi->propSetData(out, "expr_backend", "llvm", -1, paAppend);
+    vsapi->propSetInt(out, "expr_lanes", hostLanes(), paAppend);
+    vsapi->propSetData(out, "expr_target", rr::getTargetCPU().c_str(), -1, paAppend);
+    vsapi->propSetInt(out, "expr_max_unroll", MAX_UNROLL, paAppend);
+    vsapi->propSetInt(out, "expr_max_jit_level", MAX_JIT_LEVEL, paAppend);
     for (const auto &f : features)
         vsapi->propSetData(out, "expr_features", f.c_str(), -1, paAppend);
 }
 
+void VS_CC jitInfoCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
+{
+    ExprCache::Stats s = exprCache.stats();
+    vsapi->propSetInt(out, "compiles", s.compiles, paAppend);
+    vsapi->propSetInt(out, "cache_hits", s.hits, paAppend);
+    vsapi->propSetInt(out, "disk_cache_hits", s.diskHits, paAppend);
+    vsapi->propSetFloat(out, "compile_ms", s.seconds * 1e3, paAppend);
+    vsapi->propSetInt(out, "code_bytes", rr::allocatedMemoryPageBytes(), paAppend);
+    vsapi->propSetInt(out, "cache_bytes", s.size, paAppend);
+    vsapi->propSetInt(out, "cache_limit", s.limit, paAppend);
+    for (const auto &e : s.entries) {
+        vsapi->propSetData(out, "entry_key", e.key.c_str(), (int)e.key.size(), paAppend);
+        vsapi->propSetInt(out, "entry_bytes", e.size, paAppend);
+        vsapi->propSetFloat(out, "entry_compile_ms", e.seconds * 1e3, paAppend);
+        vsapi->propSetInt(out, "entry_hits", e.hits, paAppend);
+    }
+}
+
 } // namespace
 
 
@@ -1415,7 +4728,126 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
 
 void VS_CC exprInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
     //configFunc("com.vapoursynth.expr", "expr", "VapourSynth Expr Filter", VAPOURSYNTH_API_VERSION, 1, plugin);
-    registerFunc("Expr", "clips:clip[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;", exprCreate, nullptr, plugin);
+    registerFunc("Expr", "clips:clip[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;unroll:int:opt;jit_level:int:opt;precision:int:opt;sampling:int:opt;dither:int:opt;threads:int:opt;lazy:int:opt;outputs:int:opt;stats:int:opt;condition:data:opt;numa:data:opt;", exprCreate, nullptr, plugin);
     registerFunc("Version", "", versionCreate, nullptr, plugin);
-    initExpr();
+    registerFunc("JITInfo", "", jitInfoCreate, nullptr, plugin);
+    std::call_once(exprInitOnce, initExpr);
+}
+
+//////////////////////////////////////////
+// C API, see lexpr.h
+
+namespace {
+
+// What an LExprKernel handle points to. The handle stays opaque, as Compiled has internal
+// linkage.
+struct ExprKernel {
+    Compiled compiled;
+    ExprData::ProcessProc proc;
+    int numInputs;
+};
+
+ExprKernel *kernelOf(LExprKernel *kernel) { return reinterpret_cast<ExprKernel *>(kernel); }
+const ExprKernel *kernelOf(const LExprKernel *kernel) { return reinterpret_cast<const ExprKernel *>(kernel); }
+
+} // namespace
+
+template<int lanes>
+static Compiled compileKernel(const char *expr, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, int opt, int boundary, int jitLevel) {
+    Compiler<lanes> compiler({ expr }, vo, vi, numInputs, opt, boundary, 0, jitLevel);
+    if (!compiler.getGraph().reductions.empty())
+        throw std::runtime_error("Reductions are not supported by kernels");
+    return compiler.compile();
+}
+
+static LExprKernel *VS_CC lexprCompile(const char *expr, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs,
+    int opt, int boundary, int jitLevel, char *errorMsg, int errorSize) {
+    try {
+        if (!exprTargetError.empty())
+            throw std::runtime_error("AKARIN_EXPR_TARGET: " + exprTargetError);
+        if (numInputs < 1 || numInputs > MAX_EXPR_INPUTS)
+            throw std::runtime_error("numInputs must be between 1 and " + std::to_string(MAX_EXPR_INPUTS));
+        if (!isSupportedFormat(vo->format))
+            throw std::runtime_error(formatError("The output format"));
+        for (int i = 0; i < numInputs; i++) {
+            if (!isSupportedFormat(vi[i]->format))
+                throw std::runtime_error(formatError("Input formats"));
+        }
+        if (jitLevel < 0 || jitLevel > MAX_JIT_LEVEL)
+            throw std::runtime_error("jitLevel must be between 0 and " + std::to_string(MAX_JIT_LEVEL));
+
+        std::unique_ptr<ExprKernel> k(new ExprKernel);
+        switch (hostLanes()) {
+        case 16: k->compiled = compileKernel<16>(expr, vo, vi, numInputs, opt, boundary, jitLevel); break;
+        case 8: k->compiled = compileKernel<8>(expr, vo, vi, numInputs, opt, boundary, jitLevel); break;
+        default: k->compiled = compileKernel<4>(expr, vo, vi, numInputs, opt, boundary, jitLevel); break;
+        }
+        k->proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(k->compiled.code()));
+        k->numInputs = numInputs;
+        return reinterpret_cast<LExprKernel *>(k.release());
+    } catch (std::exception &e) {
+        if (errorMsg && errorSize > 0)
+            snprintf(errorMsg, errorSize, "Expr: %s", e.what());
+        return nullptr;
+    }
+}
+
+static void VS_CC lexprFreeKernel(LExprKernel *kernel) {
+    delete kernelOf(kernel);
+}
+
+static int VS_CC lexprNumProps(const LExprKernel *handle) {
+    const ExprKernel *kernel = kernelOf(handle);
+    return (int)kernel->compiled.propAccess.size();
+}
+
+static const char *VS_CC lexprPropName(const LExprKernel *handle, int index, int *clip) {
+    const ExprKernel *kernel = kernelOf(handle);
+    const auto &pa = kernel->compiled.propAccess[index];
+    if (clip)
+        *clip = pa.clip;
+    return pa.name.c_str();
+}
+
+static void VS_CC lexprProcess(const LExprKernel *handle, void *const *ptrs, const int *strides, int width, int height,
+    int ystart, int yend, int n, const float *props) {
+    const ExprKernel *kernel = kernelOf(handle);
+    void *rwptrs[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = {};
+    int rwstrides[MAX_EXPR_OUTPUTS + MAX_EXPR_INPUTS] = {};
+    std::copy_n(ptrs, kernel->numInputs + 1, rwptrs);
+    std::copy_n(strides, kernel->numInputs + 1, rwstrides);
+
+    if (const Compiled::Lut *lut = kernel->compiled.lut.get()) {
+        lut->lookup(*lut, reinterpret_cast<uint8_t *const *>(rwptrs), rwstrides, width, ystart, yend);
+        return;
+    }
+
+    // N followed by the frame properties, on the stack unless there are a lot of them.
+    const size_t numProps = kernel->compiled.propAccess.size();
+    ExprUnion constsBuf[MAX_STACK_CONSTS];
+    std::unique_ptr<ExprUnion[]> constsHeap;
+    ExprUnion *consts = constsBuf;
+    if (numProps + 1 > MAX_STACK_CONSTS) {
+        constsHeap.reset(new ExprUnion[numProps + 1]);
+        consts = constsHeap.get();
+    }
+    consts[0] = static_cast<int32_t>(n);
+    for (size_t k = 0; k < numProps; k++)
+        consts[k + 1] = props[k];
+    kernel->proc(rwptrs, rwstrides, reinterpret_cast<float *>(consts), width, height, ystart, yend, nullptr);
+}
+
+static const LExprAPI lexprAPI = {
+    lexprCompile,
+    lexprFreeKernel,
+    lexprNumProps,
+    lexprPropName,
+    lexprProcess,
+};
+
+VS_EXTERNAL_API(const LExprAPI *) getLExprAPI(int version) {
+    if (version != LEXPR_API_VERSION)
+        return nullptr;
+    std::call_once(exprInitOnce, initExpr);
+    return &lexprAPI;
 }
@@ -0,0 +1,63 @@
+/*
+* Copyright (c) 2021-     Akarin
+*
+* lexpr is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 3 of the License, or (at your option) any later version.
+*
+* lexpr is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with lexpr; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// The C API of the lexpr compiler, for other plugins that run expressions on their own
+// buffers instead of through an Expr node. The akarin plugin exports getLExprAPI(); find
+// its library with getPluginPath(getPluginById("info.akarin.vsplugin", core)), and look
+// the function up with dlsym() or GetProcAddress() after loading it again (which returns
+// the instance VapourSynth loaded).
+//
+// Kernels are compiled with the same code, and shared through the same cache of compiled
+// routines, as the planes of Expr.
+
+#ifndef LEXPR_H
+#define LEXPR_H
+
+#include "VapourSynth.h"
+
+#define LEXPR_API_VERSION 1
+
+typedef struct LExprKernel LExprKernel;
+
+typedef struct LExprAPI {
+    // Compiles expr for planes of the vo format from numInputs planes of the vi formats,
+    // which are named x, y, z, a, b... in it. The formats must be those of VapourSynth,
+    // as they are identified by their names. opt, boundary and jitLevel are the arguments
+    // of Expr (0, 0 and 2 by default). Expressions with reductions are not supported.
+    // Returns NULL with the reason in errorMsg on failure.
+    LExprKernel *(VS_CC *compile)(const char *expr, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs,
+        int opt, int boundary, int jitLevel, char *errorMsg, int errorSize);
+    void (VS_CC *freeKernel)(LExprKernel *kernel);
+
+    // The frame properties read by the kernel, which are passed to process() in this order.
+    // clip is the index of the input they are read from.
+    int (VS_CC *numProps)(const LExprKernel *kernel);
+    const char *(VS_CC *propName)(const LExprKernel *kernel, int index, int *clip);
+
+    // Computes rows [ystart, yend) of the width x height destination plane. ptrs and strides
+    // (in bytes) hold the destination followed by the inputs, which must be 32 byte aligned,
+    // like the frames of VapourSynth. n is the frame number, N in the expression. Rows of the
+    // same plane may be processed by several threads at once.
+    void (VS_CC *process)(const LExprKernel *kernel, void *const *ptrs, const int *strides, int width, int height,
+        int ystart, int yend, int n, const float *props);
+} LExprAPI;
+
+// The type of getLExprAPI(), which returns NULL if the version is not supported.
+typedef const LExprAPI *(VS_CC *GetLExprAPI)(int version);
+
+#endif // LEXPR_H
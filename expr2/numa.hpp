@@ -0,0 +1,146 @@
+/*
+* Copyright (c) 2021-     Akarin
+*
+* lexpr is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 3 of the License, or (at your option) any later version.
+*
+* lexpr is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with lexpr; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef LEXPR_NUMA_HPP
+#define LEXPR_NUMA_HPP
+
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <cstdio>
+#define LEXPR_NUMA_LINUX 1
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#if _WIN32_WINNT >= 0x0601
+#define LEXPR_NUMA_WINDOWS 1
+#endif
+#endif
+
+namespace lexpr {
+
+// The NUMA nodes with CPUs this process may run on, for Linux and (Windows 7 and later) Windows.
+// Elsewhere, or on machines with a single such node, there is one node and bind() does nothing.
+class NumaTopology {
+#ifdef LEXPR_NUMA_LINUX
+    std::vector<cpu_set_t> nodeCpus;
+
+    // Parses a sysfs cpu list such as "0-15,32-47".
+    static cpu_set_t parseCpuList(const char *path) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            return set;
+        unsigned first, last;
+        int n;
+        while ((n = fscanf(f, "%u-%u", &first, &last)) >= 1) {
+            if (n == 1)
+                last = first;
+            for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, &set);
+            if (fgetc(f) != ',')
+                break;
+        }
+        fclose(f);
+        return set;
+    }
+
+    NumaTopology() {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof allowed, &allowed))
+            return;
+        cpu_set_t online = parseCpuList("/sys/devices/system/node/online");
+        for (int node = 0; node < CPU_SETSIZE; node++) {
+            if (!CPU_ISSET(node, &online))
+                continue;
+            char path[64];
+            snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+            cpu_set_t cpus = parseCpuList(path);
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus) > 0)
+                nodeCpus.push_back(cpus);
+        }
+        if (nodeCpus.size() < 2)
+            nodeCpus.clear();
+    }
+
+public:
+    int nodes() const { return nodeCpus.empty() ? 1 : (int)nodeCpus.size(); }
+
+    int currentNode() const {
+        int cpu = sched_getcpu();
+        for (size_t node = 0; node < nodeCpus.size() && cpu >= 0; node++)
+            if (CPU_ISSET(cpu, &nodeCpus[node]))
+                return (int)node;
+        return 0;
+    }
+
+    // Restricts the calling thread to the CPUs of node.
+    void bind(int node) const {
+        if (node >= 0 && node < (int)nodeCpus.size())
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &nodeCpus[node]);
+    }
+#elif defined(LEXPR_NUMA_WINDOWS)
+    int count = 1;
+
+    NumaTopology() {
+        ULONG highest;
+        if (GetNumaHighestNodeNumber(&highest))
+            count = (int)highest + 1;
+    }
+
+public:
+    int nodes() const { return count; }
+
+    int currentNode() const {
+        PROCESSOR_NUMBER processor;
+        USHORT node;
+        GetCurrentProcessorNumberEx(&processor);
+        if (!GetNumaProcessorNodeEx(&processor, &node) || node == 0xffff)
+            return 0;
+        return node;
+    }
+
+    void bind(int node) const {
+        GROUP_AFFINITY affinity = {};
+        if (count > 1 && node >= 0 && node < count && GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) && affinity.Mask)
+            SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+    }
+#else
+    NumaTopology() {}
+
+public:
+    int nodes() const { return 1; }
+    int currentNode() const { return 0; }
+    void bind(int) const {}
+#endif
+
+    static const NumaTopology &instance() {
+        static const NumaTopology topology;
+        return topology;
+    }
+};
+
+} // namespace lexpr
+
+#endif // LEXPR_NUMA_HPP
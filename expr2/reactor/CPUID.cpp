@@ -37,6 +37,10 @@ bool CPUID::SSE3 = detectSSE3();
 bool CPUID::SSSE3 = detectSSSE3();
 bool CPUID::SSE4_1 = detectSSE4_1();
 bool CPUID::AVX = detectAVX();
+bool CPUID::AVX2 = detectAVX2();
+bool CPUID::AVX512F = detectAVX512F();
+bool CPUID::F16C = detectF16C();
+bool CPUID::NEON = detectNEON();
 
 bool CPUID::enableMMX = true;
 bool CPUID::enableCMOV = true;
@@ -46,6 +50,10 @@ bool CPUID::enableSSE3 = true;
 bool CPUID::enableSSSE3 = true;
 bool CPUID::enableSSE4_1 = true;
 bool CPUID::enableAVX = true;
+bool CPUID::enableAVX2 = true;
+bool CPUID::enableAVX512F = true;
+bool CPUID::enableF16C = true;
+bool CPUID::enableNEON = true;
 
 void CPUID::setEnableMMX(bool enable)
 {
@@ -178,6 +186,45 @@ void CPUID::setEnableAVX(bool enable)
 	}
 }
 
+void CPUID::setEnableAVX2(bool enable)
+{
+	enableAVX2 = enable;
+
+	if(enableAVX2)
+	{
+		setEnableAVX(true);
+	}
+	else
+	{
+		enableAVX512F = false;
+	}
+}
+
+void CPUID::setEnableAVX512F(bool enable)
+{
+	enableAVX512F = enable;
+
+	if(enableAVX512F)
+	{
+		setEnableAVX2(true);
+	}
+}
+
+void CPUID::setEnableF16C(bool enable)
+{
+	enableF16C = enable;
+
+	if(enableF16C)
+	{
+		setEnableAVX(true);
+	}
+}
+
+void CPUID::setEnableNEON(bool enable)
+{
+	enableNEON = enable;
+}
+
 static void cpuid(int registers[4], int info)
 {
 #if defined(__i386__) || defined(__x86_64__)
@@ -196,6 +243,24 @@ static void cpuid(int registers[4], int info)
 #endif
 }
 
+static void cpuidex(int registers[4], int info, int subleaf)
+{
+#if defined(__i386__) || defined(__x86_64__)
+#	if defined(_WIN32)
+	__cpuidex(registers, info, subleaf);
+#	else
+	__asm volatile("cpuid"
+	               : "=a"(registers[0]), "=b"(registers[1]), "=c"(registers[2]), "=d"(registers[3])
+	               : "a"(info), "c"(subleaf));
+#	endif
+#else
+	registers[0] = 0;
+	registers[1] = 0;
+	registers[2] = 0;
+	registers[3] = 0;
+#endif
+}
+
 static unsigned long long xgetbv(unsigned ecx) {
 #if defined(__i386__) || defined(__x86_64__)
 #	if defined(_WIN32)
@@ -270,4 +335,45 @@ bool CPUID::detectAVX()
 	return false;
 }
 
+bool CPUID::detectAVX2()
+{
+	int registers[4];
+	cpuid(registers, 0);
+	if (registers[0] < 7 || !detectAVX())
+		return AVX2 = false;
+	cpuidex(registers, 7, 0);
+	return AVX2 = (registers[1] & (1 << 5)) != 0;
+}
+
+bool CPUID::detectAVX512F()
+{
+	int registers[4];
+	cpuid(registers, 0);
+	if (registers[0] < 7 || !detectAVX())
+		return AVX512F = false;
+	cpuidex(registers, 7, 0);
+	if (registers[1] & (1 << 16)) {
+		// The OS must save the opmask and both halves of the upper zmm registers.
+		unsigned long long xedxeax = xgetbv(0);
+		return AVX512F = ((xedxeax & 0xE6) == 0xE6);
+	}
+	return AVX512F = false;
+}
+
+bool CPUID::detectF16C()
+{
+	int registers[4];
+	cpuid(registers, 1);
+	return F16C = (registers[2] & (1 << 29)) != 0 && detectAVX();
+}
+
+bool CPUID::detectNEON()
+{
+#if defined(__aarch64__) || defined(_M_ARM64)
+	return NEON = true;
+#else
+	return NEON = false;
+#endif
+}
+
 }  // namespace rr
@@ -37,6 +37,12 @@ public:
 	static bool supportsSSSE3();
 	static bool supportsSSE4_1();
 	static bool supportsAVX();
+	static bool supportsAVX2();
+	static bool supportsAVX512F();
+	static bool supportsF16C();
+	// Advanced SIMD on AArch64, where it is part of the base ISA, including the half
+	// precision conversions.
+	static bool supportsNEON();
 
 	static void setEnableMMX(bool enable);
 	static void setEnableCMOV(bool enable);
@@ -46,6 +52,10 @@ public:
 	static void setEnableSSSE3(bool enable);
 	static void setEnableSSE4_1(bool enable);
 	static void setEnableAVX(bool enable);
+	static void setEnableAVX2(bool enable);
+	static void setEnableAVX512F(bool enable);
+	static void setEnableF16C(bool enable);
+	static void setEnableNEON(bool enable);
 
 private:
 	static bool MMX;
@@ -56,6 +66,10 @@ private:
 	static bool SSSE3;
 	static bool SSE4_1;
 	static bool AVX;
+	static bool AVX2;
+	static bool AVX512F;
+	static bool F16C;
+	static bool NEON;
 
 	static bool enableMMX;
 	static bool enableCMOV;
@@ -65,6 +79,10 @@ private:
 	static bool enableSSSE3;
 	static bool enableSSE4_1;
 	static bool enableAVX;
+	static bool enableAVX2;
+	static bool enableAVX512F;
+	static bool enableF16C;
+	static bool enableNEON;
 
 	static bool detectMMX();
 	static bool detectCMOV();
@@ -74,6 +92,10 @@ private:
 	static bool detectSSSE3();
 	static bool detectSSE4_1();
 	static bool detectAVX();
+	static bool detectAVX2();
+	static bool detectAVX512F();
+	static bool detectF16C();
+	static bool detectNEON();
 };
 
 }  // namespace rr
@@ -127,6 +149,26 @@ inline bool CPUID::supportsAVX()
 	return AVX && enableAVX;
 }
 
+inline bool CPUID::supportsAVX2()
+{
+	return AVX2 && enableAVX2 && supportsAVX();
+}
+
+inline bool CPUID::supportsAVX512F()
+{
+	return AVX512F && enableAVX512F && supportsAVX2();
+}
+
+inline bool CPUID::supportsF16C()
+{
+	return F16C && enableF16C && supportsAVX();
+}
+
+inline bool CPUID::supportsNEON()
+{
+	return NEON && enableNEON;
+}
+
 }  // namespace rr
 
 #endif  // rr_CPUID_hpp
@@ -31,12 +31,16 @@
 #	include <sys/mman.h>
 #	include <stdlib.h>
 #	include <unistd.h>
+#	if defined(__linux__)
+#		include <sys/syscall.h>
+#	endif
 #endif
 
 #if defined(__ANDROID__) && !defined(ANDROID_HOST_BUILD) && !defined(ANDROID_NDK_BUILD)
 #	include <sys/prctl.h>
 #endif
 
+#include <atomic>
 #include <memory.h>
 
 #undef allocate
@@ -261,6 +265,9 @@ inline uintptr_t roundUp(uintptr_t x, uintptr_t m)
 	return (x + m - 1) & ~(m - 1);
 }
 
+// Bytes held by the allocations of allocateMemoryPages(), in whole pages.
+static std::atomic<size_t> pageBytes;
+
 void *allocateMemoryPages(size_t bytes, int permissions, bool need_exec)
 {
 	size_t pageSize = memoryPageSize();
@@ -349,6 +356,10 @@ void *allocateMemoryPages(size_t bytes, int permissions, bool need_exec)
 	protectMemoryPages(mapping, length, permissions);
 #endif
 
+	if(mapping)
+	{
+		pageBytes += length;
+	}
 	return mapping;
 }
 
@@ -381,6 +392,8 @@ void protectMemoryPages(void *memory, size_t bytes, int permissions)
 
 void deallocateMemoryPages(void *memory, size_t bytes)
 {
+	pageBytes -= roundUp(bytes, memoryPageSize());
+
 #if defined(_WIN32)
 	unsigned long oldProtection;
 	BOOL result =
@@ -405,4 +418,117 @@ void deallocateMemoryPages(void *memory, size_t bytes)
 #endif
 }
 
+size_t allocatedMemoryPageBytes()
+{
+	return pageBytes;
+}
+
+size_t hugePageSize()
+{
+	return 2 << 20;
+}
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+// Maps |bytes| of |fd| at an address aligned to |alignment|, as the kernel only backs
+// aligned ranges by huge pages. Returns nullptr on failure.
+static void *mapAligned(int fd, size_t bytes, size_t alignment, int prot)
+{
+	void *reservation = mmap(nullptr, bytes + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(reservation == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	uintptr_t start = roundUp(reinterpret_cast<uintptr_t>(reservation), alignment);
+	size_t head = start - reinterpret_cast<uintptr_t>(reservation);
+	void *mapping = mmap(reinterpret_cast<void *>(start), bytes, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+	if(head)
+	{
+		munmap(reservation, head);
+	}
+	if(alignment - head)
+	{
+		munmap(reinterpret_cast<void *>(start + bytes), alignment - head);
+	}
+	if(mapping == MAP_FAILED)
+	{
+		munmap(reinterpret_cast<void *>(start), bytes);
+		return nullptr;
+	}
+	return mapping;
+}
+
+// Maps the memory of |fd| at both addresses of the mapping.
+static bool mapTwice(int fd, DualMapping &mapping)
+{
+	mapping.writable = mapAligned(fd, mapping.bytes, hugePageSize(), PROT_READ | PROT_WRITE);
+	if(!mapping.writable)
+	{
+		return false;
+	}
+	mapping.executable = mapAligned(fd, mapping.bytes, hugePageSize(), PROT_READ | PROT_EXEC);
+	if(!mapping.executable)
+	{
+		munmap(mapping.writable, mapping.bytes);
+		return false;
+	}
+	return true;
+}
+#endif
+
+bool allocateDualMapping(size_t bytes, DualMapping &mapping)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+	const unsigned int cloexec = 0x1U;  // MFD_CLOEXEC
+	const unsigned int hugetlb = 0x4U;  // MFD_HUGETLB
+	mapping.bytes = roundUp(bytes, hugePageSize());
+
+	// Explicit huge pages only exist if the administrator reserved some.
+	int fd = syscall(SYS_memfd_create, "reactor-code", cloexec | hugetlb);
+	if(fd != -1)
+	{
+		bool ok = ftruncate(fd, mapping.bytes) == 0 && mapTwice(fd, mapping);
+		close(fd);
+		if(ok)
+		{
+			pageBytes += mapping.bytes;
+			return true;
+		}
+	}
+
+	// Otherwise transparent huge pages, if they are enabled for shared memory.
+	fd = syscall(SYS_memfd_create, "reactor-code", cloexec);
+	if(fd == -1)
+	{
+		return false;
+	}
+	bool ok = ftruncate(fd, mapping.bytes) == 0 && mapTwice(fd, mapping);
+	close(fd);
+	if(!ok)
+	{
+		return false;
+	}
+#	ifdef MADV_HUGEPAGE
+	madvise(mapping.writable, mapping.bytes, MADV_HUGEPAGE);
+	madvise(mapping.executable, mapping.bytes, MADV_HUGEPAGE);
+#	endif
+	pageBytes += mapping.bytes;
+	return true;
+#else
+	(void)bytes;
+	(void)mapping;
+	return false;
+#endif
+}
+
+void deallocateDualMapping(const DualMapping &mapping)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+	pageBytes -= mapping.bytes;
+	munmap(mapping.writable, mapping.bytes);
+	munmap(mapping.executable, mapping.bytes);
+#else
+	(void)mapping;
+#endif
+}
+
 }  // namespace rr
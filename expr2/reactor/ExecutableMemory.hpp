@@ -40,6 +40,30 @@ void protectMemoryPages(void *memory, size_t bytes, int permissions);
 // Releases memory allocated with allocateMemoryPages().
 void deallocateMemoryPages(void *memory, size_t bytes);
 
+// Bytes of whole pages currently allocated with allocateMemoryPages() and
+// allocateDualMapping().
+size_t allocatedMemoryPageBytes();
+
+// The size of the huge pages that allocateDualMapping() tries to use.
+size_t hugePageSize();
+
+// Memory mapped twice, read/write at |writable| and read/execute at |executable|, so that
+// code can be written to it while other code in it runs, without ever changing the
+// permissions of either mapping. It is backed by huge pages if the OS provides them, for
+// which |bytes| should be a multiple of hugePageSize().
+struct DualMapping
+{
+	void *writable;
+	void *executable;
+	size_t bytes;
+};
+
+// Returns false if the OS can't map memory twice.
+bool allocateDualMapping(size_t bytes, DualMapping &mapping);
+
+// Releases memory allocated with allocateDualMapping().
+void deallocateDualMapping(const DualMapping &mapping);
+
 template<typename P>
 P unaligned_read(P *address)
 {
@@ -14,9 +14,11 @@
 
 #include "LLVMReactor.hpp"
 
+#include "CPUID.hpp"
 #include "Debug.hpp"
 #include "ExecutableMemory.hpp"
 #include "LLVMAsm.hpp"
+#include "Module.hpp"
 #include "Routine.hpp"
 
 // TODO(b/143539525): Eliminate when warning has been fixed.
@@ -25,20 +27,35 @@ __pragma(warning(push))
     __pragma(warning(disable : 4146))  // unary minus operator applied to unsigned type, result still unsigned
 #endif
 
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#if LLVM_VERSION_MAJOR >= 14
+#	include "llvm/MC/TargetRegistry.h"
+#else
+#	include "llvm/Support/TargetRegistry.h"
+#endif
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Instrumentation/MemorySanitizer.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Vectorize.h"
 
 #ifdef _MSC_VER
     __pragma(warning(pop))
@@ -113,6 +130,73 @@ static void *getTLSAddress(void *control)
 
 namespace {
 
+// The CPU to generate code for instead of the host, see rr::setTargetCPU().
+std::string &targetCPUOverride()
+{
+	static std::string cpu;
+	return cpu;
+}
+
+// The subtarget info of the named CPU for the default triple, or nullptr if it is unknown.
+std::unique_ptr<llvm::MCSubtargetInfo> createSubtargetInfo(const std::string &cpu)
+{
+	llvm::InitializeNativeTarget();
+	std::string error;
+	const llvm::Target *target = llvm::TargetRegistry::lookupTarget(LLVM_DEFAULT_TARGET_TRIPLE, error);
+	if(!target)
+	{
+		return nullptr;
+	}
+	std::unique_ptr<llvm::MCSubtargetInfo> sti(target->createMCSubtargetInfo(LLVM_DEFAULT_TARGET_TRIPLE, cpu, ""));
+	if(!sti || !sti->isCPUStringValid(cpu))
+	{
+		return nullptr;
+	}
+	return sti;
+}
+
+// The features of the subtarget which the host lacks, so that it can't run its code.
+std::vector<std::string> missingHostFeatures(const llvm::MCSubtargetInfo &sti)
+{
+	llvm::StringMap<bool> host;
+	llvm::sys::getHostCPUFeatures(host);
+	std::vector<std::string> missing;
+	for(const auto &feature : host)
+	{
+		if(!feature.second && sti.checkFeatures("+" + feature.first().str()))
+		{
+			missing.push_back(feature.first().str());
+		}
+	}
+	return missing;
+}
+
+// The generic CPUs whose code the host can run, best first, under which routines compiled
+// by other hosts are looked up in the object cache.
+const std::vector<std::string> &compatibleGenericCPUs()
+{
+	static const std::vector<std::string> cpus = [] {
+		std::vector<std::string> r;
+		std::vector<const char *> generic;
+#if defined(__x86_64__)
+		generic = { "x86-64-v4", "x86-64-v3", "x86-64-v2", "x86-64" };
+#elif defined(__aarch64__)
+		// Every AArch64 CPU has NEON, which is all Reactor uses.
+		generic = { "generic" };
+#endif
+		for(const char *cpu : generic)
+		{
+			auto sti = createSubtargetInfo(cpu);
+			if(sti && missingHostFeatures(*sti).empty())
+			{
+				r.push_back(cpu);
+			}
+		}
+		return r;
+	}();
+	return cpus;
+}
+
 // TODO(b/174587935): Eliminate command-line parsing.
 bool parseCommandLineOptionsOnce(int argc, const char *const *argv)
 {
@@ -134,6 +218,10 @@ public:
 	llvm::orc::JITTargetMachineBuilder getTargetMachineBuilder(rr::Optimization::Level optLevel) const;
 	const llvm::DataLayout &getDataLayout() const;
 	const llvm::Triple &getTargetTriple() const;
+	// Everything besides the module itself that the generated code depends on.
+	std::string getTargetDescription() const;
+	// That of the code generated for the named CPU with setTargetCPU() on any host.
+	std::string getTargetDescription(const std::string &cpu) const;
 
 private:
 	JITGlobals(llvm::orc::JITTargetMachineBuilder &&jitTargetMachineBuilder, llvm::DataLayout &&dataLayout);
@@ -173,28 +261,36 @@ JITGlobals *JITGlobals::get()
 		// rather than a valid triple for the current process. Once fixed, we can use that function instead.
 		llvm::orc::JITTargetMachineBuilder jitTargetMachineBuilder(llvm::Triple(LLVM_DEFAULT_TARGET_TRIPLE));
 
-		// Retrieve host CPU name and sub-target features and add them to builder.
-		// Relocation model, code model and codegen opt level are kept to default values.
-		llvm::StringMap<bool> cpuFeatures;
-		bool ok = llvm::sys::getHostCPUFeatures(cpuFeatures);
+		if(!targetCPUOverride().empty())
+		{
+			// Only the features of the CPU itself, so that the code runs on any host that has them.
+			jitTargetMachineBuilder.setCPU(targetCPUOverride());
+		}
+		else
+		{
+			// Retrieve host CPU name and sub-target features and add them to builder.
+			// Relocation model, code model and codegen opt level are kept to default values.
+			llvm::StringMap<bool> cpuFeatures;
+			bool ok = llvm::sys::getHostCPUFeatures(cpuFeatures);
 
 #if defined(__i386__) || defined(__x86_64__) || \
     (defined(__linux__) && (defined(__arm__) || defined(__aarch64__)))
-		ASSERT_MSG(ok, "llvm::sys::getHostCPUFeatures returned false");
+			ASSERT_MSG(ok, "llvm::sys::getHostCPUFeatures returned false");
 #else
-		(void)ok;  // getHostCPUFeatures always returns false on other platforms
+			(void)ok;  // getHostCPUFeatures always returns false on other platforms
 #endif
 
-		for(auto &feature : cpuFeatures)
-		{
-			jitTargetMachineBuilder.getFeatures().AddFeature(feature.first(), feature.second);
-		}
+			for(auto &feature : cpuFeatures)
+			{
+				jitTargetMachineBuilder.getFeatures().AddFeature(feature.first(), feature.second);
+			}
 
 #if LLVM_VERSION_MAJOR >= 11 /* TODO(b/165000222): Unconditional after LLVM 11 upgrade */
-		jitTargetMachineBuilder.setCPU(std::string(llvm::sys::getHostCPUName()));
+			jitTargetMachineBuilder.setCPU(std::string(llvm::sys::getHostCPUName()));
 #else
-		jitTargetMachineBuilder.setCPU(llvm::sys::getHostCPUName());
+			jitTargetMachineBuilder.setCPU(llvm::sys::getHostCPUName());
 #endif
+		}
 
 		// Set small code model so that calls will be rip-relative, rather than always movabs and call indirectly.
 		// Verified that external functions will be called via PLT, so there shouldn't be any issues as long as
@@ -237,6 +333,22 @@ const llvm::Triple &JITGlobals::getTargetTriple() const
 	return jitTargetMachineBuilder.getTargetTriple();
 }
 
+std::string JITGlobals::getTargetDescription() const
+{
+	return "triple=" + jitTargetMachineBuilder.getTargetTriple().str() +
+	       "|cpu=" + jitTargetMachineBuilder.getCPU() +
+	       "|features=" + jitTargetMachineBuilder.getFeatures().getString() +
+	       "|llvm=" LLVM_VERSION_STRING;
+}
+
+std::string JITGlobals::getTargetDescription(const std::string &cpu) const
+{
+	return "triple=" + jitTargetMachineBuilder.getTargetTriple().str() +
+	       "|cpu=" + cpu +
+	       "|features=" +
+	       "|llvm=" LLVM_VERSION_STRING;
+}
+
 JITGlobals::JITGlobals(llvm::orc::JITTargetMachineBuilder &&jitTargetMachineBuilder, llvm::DataLayout &&dataLayout)
     : jitTargetMachineBuilder(jitTargetMachineBuilder)
     , dataLayout(dataLayout)
@@ -288,6 +400,7 @@ public:
 		    numBytes, flagsToPermissions(flags), need_exec);
 		if(!addr)
 			return llvm::sys::MemoryBlock();
+		allocated += numBytes;
 		return llvm::sys::MemoryBlock(addr, numBytes);
 	}
 
@@ -313,9 +426,12 @@ public:
 		size_t size = block.allocatedSize();
 
 		rr::deallocateMemoryPages(block.base(), size);
+		allocated -= size;
 		return std::error_code();
 	}
 
+	size_t getAllocated() const { return allocated; }
+
 private:
 	int flagsToPermissions(unsigned flags)
 	{
@@ -334,6 +450,8 @@ private:
 		}
 		return result;
 	}
+
+	size_t allocated = 0;
 };
 
 template<typename T>
@@ -362,6 +480,172 @@ void alignedFree(void *ptr)
 	delete[] allocation;
 }
 
+// CodeArena packs the code of all routines into huge page regions mapped twice (see
+// rr::allocateDualMapping()), instead of giving each routine pages of its own. Code is
+// written through the writable view and run from the executable one, so no permissions
+// are ever changed, and routines can be added while others in the same region are running.
+// Regions are released once all the routines in them are.
+class CodeArena
+{
+public:
+	struct Region
+	{
+		rr::DualMapping mapping;
+		size_t used;
+		size_t live;
+	};
+
+	struct Block
+	{
+		Region *region;
+		uint8_t *writable;
+		uint8_t *executable;
+		size_t bytes;
+	};
+
+	// Returns nullptr if the OS doesn't support dual mappings.
+	static CodeArena *get()
+	{
+		static CodeArena *arena = []() -> CodeArena * {
+			rr::DualMapping probe;
+			if(!rr::allocateDualMapping(rr::hugePageSize(), probe))
+			{
+				return nullptr;
+			}
+			auto arena = new CodeArena();
+			arena->current = new Region{ probe, 0, 0 };
+			return arena;
+		}();
+		return arena;
+	}
+
+	bool allocate(size_t bytes, size_t alignment, Block &block)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		size_t offset = alignUp(current->used, alignment);
+		if(offset + bytes > current->mapping.bytes)
+		{
+			rr::DualMapping mapping;
+			if(!rr::allocateDualMapping(std::max(bytes, rr::hugePageSize()), mapping))
+			{
+				return false;
+			}
+			Region *previous = current;
+			current = new Region{ mapping, 0, 0 };
+			if(previous->live == 0)
+			{
+				rr::deallocateDualMapping(previous->mapping);
+				delete previous;
+			}
+			offset = 0;
+		}
+		current->used = offset + bytes;
+		current->live += bytes;
+		block.region = current;
+		block.writable = static_cast<uint8_t *>(current->mapping.writable) + offset;
+		block.executable = static_cast<uint8_t *>(current->mapping.executable) + offset;
+		block.bytes = bytes;
+		return true;
+	}
+
+	void release(const Block &block)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		Region *region = block.region;
+		region->live -= block.bytes;
+		if(region->live > 0)
+		{
+			return;
+		}
+		if(region == current)
+		{
+			region->used = 0;  // Start over, nothing runs in it anymore.
+		}
+		else
+		{
+			rr::deallocateDualMapping(region->mapping);
+			delete region;
+		}
+	}
+
+private:
+	std::mutex mutex;
+	Region *current = nullptr;
+};
+
+// ArenaMemoryManager places the code sections of an object in the CodeArena, and its data
+// sections on the heap. The data can be anywhere, as the code generated by the JIT target
+// machines addresses it absolutely.
+class ArenaMemoryManager final : public llvm::RTDyldMemoryManager
+{
+public:
+	ArenaMemoryManager(CodeArena *arena, size_t *allocated)
+	    : arena(arena)
+	    , allocated(allocated)
+	{}
+
+	~ArenaMemoryManager() final
+	{
+		for(auto &block : code)
+		{
+			arena->release(block);
+		}
+		for(auto data : this->data)
+		{
+			alignedFree(data);
+		}
+	}
+
+	uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment, unsigned sectionID,
+	                             llvm::StringRef sectionName) final
+	{
+		CodeArena::Block block;
+		if(!arena->allocate(std::max<size_t>(size, 1), std::max(alignment, 16u), block))
+		{
+			return nullptr;
+		}
+		code.push_back(block);
+		*allocated += block.bytes;
+		return block.writable;
+	}
+
+	uint8_t *allocateDataSection(uintptr_t size, unsigned alignment, unsigned sectionID,
+	                             llvm::StringRef sectionName, bool isReadOnly) final
+	{
+		auto ptr = static_cast<uint8_t *>(alignedAlloc(size, std::max(alignment, 1u)));
+		data.push_back(ptr);
+		*allocated += size;
+		return ptr;
+	}
+
+	using llvm::RTDyldMemoryManager::notifyObjectLoaded;
+
+	// Called before the relocations are applied, so that they refer to the executable view.
+	void notifyObjectLoaded(llvm::RuntimeDyld &dyld, const llvm::object::ObjectFile &object) final
+	{
+		for(; mapped < code.size(); mapped++)
+		{
+			dyld.mapSectionAddress(code[mapped].writable, reinterpret_cast<uint64_t>(code[mapped].executable));
+		}
+	}
+
+	bool finalizeMemory(std::string *errorMessage) final
+	{
+		for(auto &block : code)
+		{
+			llvm::sys::Memory::InvalidateInstructionCache(block.executable, block.bytes);
+		}
+		return false;
+	}
+
+private:
+	CodeArena *arena;
+	size_t *allocated;
+	std::vector<CodeArena::Block> code;
+	std::vector<uint8_t *> data;
+	size_t mapped = 0;
+};
+
 template<typename T>
 static void atomicLoad(void *ptr, void *ret, llvm::AtomicOrdering ordering)
 {
@@ -706,6 +990,117 @@ struct FatalDiagnosticsHandler : public llvm::DiagnosticHandler
 	bool *fatal;
 };
 
+// ObjectFileCache keeps the objects of compiled routines in a directory, so that later
+// processes can load them instead of compiling the same module again. Each file starts
+// with the full key, which guards against hash collisions and stale files.
+class ObjectFileCache final : public llvm::ObjectCache
+{
+public:
+	static void setDirectory(const std::string &dir)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		directory() = dir;
+	}
+
+	static bool enabled()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return !directory().empty();
+	}
+
+	explicit ObjectFileCache(const std::string &key)
+	    : ObjectFileCache(key, JITGlobals::get()->getTargetDescription())
+	{}
+
+	// The object compiled for another target.
+	ObjectFileCache(const std::string &key, const std::string &target)
+	    : key(key + "|" + target)
+	{}
+
+	std::unique_ptr<llvm::MemoryBuffer> load()
+	{
+		auto file = llvm::MemoryBuffer::getFile(path(), -1, false);
+		if(!file)
+		{
+			return nullptr;
+		}
+		llvm::StringRef contents = (*file)->getBuffer();
+		if(!contents.consume_front(header()))
+		{
+			return nullptr;
+		}
+		return llvm::MemoryBuffer::getMemBufferCopy(contents, key);
+	}
+
+	// Called by the compiler with the object of a newly compiled module.
+	void notifyObjectCompiled(const llvm::Module *, llvm::MemoryBufferRef obj) override
+	{
+		// Write to a temporary file first, so that concurrent readers never see partial objects.
+		std::string filename = path();
+		if(filename.empty() || llvm::sys::fs::create_directories(llvm::sys::path::parent_path(filename)))
+		{
+			return;
+		}
+		int fd;
+		llvm::SmallString<128> tmp;
+		if(llvm::sys::fs::createUniqueFile(filename + ".tmp%%%%%%", fd, tmp))
+		{
+			return;
+		}
+		bool ok;
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			os << header() << obj.getBuffer();
+			os.close();
+			ok = !os.has_error();
+			if(!ok)
+			{
+				os.clear_error();
+			}
+		}
+		if(!ok || llvm::sys::fs::rename(tmp, filename))
+		{
+			llvm::sys::fs::remove(tmp);
+		}
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *) override
+	{
+		return nullptr;
+	}
+
+private:
+	static std::string &directory()
+	{
+		static std::string dir;
+		return dir;
+	}
+
+	std::string header() const
+	{
+		return "rrobj\n" + std::to_string(key.size()) + "\n" + key;
+	}
+
+	std::string path() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(directory().empty())
+		{
+			return "";
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.rrobj", (unsigned long long)llvm::xxHash64(key));
+		llvm::SmallString<256> p(directory());
+		llvm::sys::path::append(p, name);
+		return std::string(p.str());
+	}
+
+	static std::mutex mutex;
+	const std::string key;
+};
+
+std::mutex ObjectFileCache::mutex;
+
 // JITRoutine is a rr::Routine that holds a LLVM JIT session, compiler and
 // object layer as each routine may require different target machine
 // settings and no Reactor routine directly links against another.
@@ -718,7 +1113,98 @@ public:
 	    const char *name,
 	    llvm::Function **funcs,
 	    size_t count,
-	    const rr::Config &config)
+	    const rr::Config &config,
+	    const std::string &cacheKey)
+	    : JITRoutine(name, count)
+	{
+		bool fatalCompileIssue = false;
+		context->setDiagnosticHandler(std::make_unique<FatalDiagnosticsHandler>(&fatalCompileIssue), true);
+
+		llvm::SmallVector<std::string, 8> functionNames(count);
+		for(size_t i = 0; i < count; i++)
+		{
+			auto func = funcs[i];
+
+			if(!func->hasName())
+			{
+				func->setName("f" + llvm::Twine(i).str());
+			}
+
+			functionNames[i] = func->getName().str();
+		}
+
+#ifdef ENABLE_RR_EMIT_ASM_FILE
+		const auto asmFilename = rr::AsmFile::generateFilename(name);
+		rr::AsmFile::emitAsmFile(asmFilename, JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()), *module);
+#endif
+
+		// Once the module is passed to the compileLayer, the llvm::Functions are freed.
+		// Make sure funcs are not referenced after this point.
+		funcs = nullptr;
+
+		std::unique_ptr<ObjectFileCache> cache;
+		if(!cacheKey.empty() && ObjectFileCache::enabled())
+		{
+			cache = std::make_unique<ObjectFileCache>(cacheKey);
+		}
+		llvm::orc::IRCompileLayer compileLayer(session, objectLayer, std::make_unique<llvm::orc::ConcurrentIRCompiler>(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()), cache.get()));
+		llvm::cantFail(compileLayer.add(dylib, llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+
+		// This is where the actual compilation happens.
+		resolve(functionNames, &fatalCompileIssue);
+
+#ifdef ENABLE_RR_EMIT_ASM_FILE
+		rr::AsmFile::fixupAsmFile(asmFilename, addresses);
+#endif
+	}
+
+	// Links a previously compiled object.
+	JITRoutine(
+	    std::unique_ptr<llvm::MemoryBuffer> object,
+	    const char *name,
+	    const char *const *functionNames,
+	    size_t count)
+	    : JITRoutine(name, count)
+	{
+		llvm::cantFail(objectLayer.add(dylib, std::move(object)));
+		resolve(llvm::SmallVector<std::string, 8>(functionNames, functionNames + count), nullptr);
+	}
+
+	~JITRoutine()
+	{
+#if LLVM_VERSION_MAJOR >= 12 /* TODO(b/165000222): Unconditional after LLVM 11 upgrade */
+		if(auto err = session.endSession())
+		{
+			session.reportError(std::move(err));
+		}
+#endif
+	}
+
+	const void *getEntry(int index) const override
+	{
+		return addresses[index];
+	}
+
+	size_t getMemoryUsage() const override
+	{
+		return memoryMapper.getAllocated() + arenaAllocated;
+	}
+
+	// Whether all functions could be resolved; a loaded object might not contain them.
+	bool valid() const
+	{
+		for(auto address : addresses)
+		{
+			if(!address)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	JITRoutine(const char *name, size_t count)
 	    : name(name)
 #if LLVM_VERSION_MAJOR >= 13
 	    , session([]() -> std::unique_ptr<llvm::orc::SelfExecutorProcessControl> {
@@ -727,14 +1213,16 @@ public:
 		    return std::move(*p);
 	    }())
 #endif
-	    , objectLayer(session, [this]() {
+	    , objectLayer(session, [this]() -> std::unique_ptr<llvm::RuntimeDyld::MemoryManager> {
+		    if(auto arena = CodeArena::get())
+		    {
+			    return std::make_unique<ArenaMemoryManager>(arena, &arenaAllocated);
+		    }
 		    return std::make_unique<llvm::SectionMemoryManager>(&memoryMapper);
 	    })
+	    , dylib(Unwrap(session.createJITDylib("<routine>")))
 	    , addresses(count)
 	{
-		bool fatalCompileIssue = false;
-		context->setDiagnosticHandler(std::make_unique<FatalDiagnosticsHandler>(&fatalCompileIssue), true);
-
 #ifdef ENABLE_RR_DEBUG_INFO
 		// TODO(b/165000222): Update this on next LLVM roll.
 		// https://github.com/llvm/llvm-project/commit/98f2bb4461072347dcca7d2b1b9571b3a6525801
@@ -758,51 +1246,36 @@ public:
 			objectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
 		}
 
-		llvm::SmallVector<llvm::orc::SymbolStringPtr, 8> functionNames(count);
+		dylib.addGenerator(std::make_unique<ExternalSymbolGenerator>());
+	}
+
+	// Resolve the function addresses, compiling the module if it hasn't been yet.
+	void resolve(const llvm::SmallVector<std::string, 8> &functionNames, bool *fatalCompileIssue)
+	{
 		llvm::orc::MangleAndInterner mangle(session, JITGlobals::get()->getDataLayout());
 
-		for(size_t i = 0; i < count; i++)
+		for(size_t i = 0; i < functionNames.size(); i++)
 		{
-			auto func = funcs[i];
-
-			if(!func->hasName())
+			if(fatalCompileIssue)
 			{
-				func->setName("f" + llvm::Twine(i).str());
+				*fatalCompileIssue = false;  // May be set to true by session.lookup()
 			}
 
-			functionNames[i] = mangle(func->getName());
-		}
-
-#ifdef ENABLE_RR_EMIT_ASM_FILE
-		const auto asmFilename = rr::AsmFile::generateFilename(name);
-		rr::AsmFile::emitAsmFile(asmFilename, JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()), *module);
-#endif
-
-		// Once the module is passed to the compileLayer, the llvm::Functions are freed.
-		// Make sure funcs are not referenced after this point.
-		funcs = nullptr;
-
-		llvm::orc::IRCompileLayer compileLayer(session, objectLayer, std::make_unique<llvm::orc::ConcurrentIRCompiler>(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel())));
-		llvm::orc::JITDylib &dylib(Unwrap(session.createJITDylib("<routine>")));
-		dylib.addGenerator(std::make_unique<ExternalSymbolGenerator>());
-
-		llvm::cantFail(compileLayer.add(dylib, llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
-
-		// Resolve the function addresses.
-		for(size_t i = 0; i < count; i++)
-		{
-			fatalCompileIssue = false;  // May be set to true by session.lookup()
-
-			// This is where the actual compilation happens.
-			auto symbol = session.lookup({ &dylib }, functionNames[i]);
+			auto symbol = session.lookup({ &dylib }, mangle(functionNames[i]));
 
 			if (!symbol) {
+				if(!fatalCompileIssue)  // A cached object, the caller will compile it instead.
+				{
+					llvm::consumeError(symbol.takeError());
+					addresses[i] = nullptr;
+					continue;
+				}
 				llvm::errs() << "Failed to lookup address of routine function " << i << ": " <<
 					llvm::toString(symbol.takeError()) << '\n';
 				abort();
 			}
 
-			if(fatalCompileIssue)
+			if(fatalCompileIssue && *fatalCompileIssue)
 			{
 				addresses[i] = nullptr;
 			}
@@ -811,32 +1284,15 @@ public:
 				addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress()));
 			}
 		}
-
-#ifdef ENABLE_RR_EMIT_ASM_FILE
-		rr::AsmFile::fixupAsmFile(asmFilename, addresses);
-#endif
-	}
-
-	~JITRoutine()
-	{
-#if LLVM_VERSION_MAJOR >= 12 /* TODO(b/165000222): Unconditional after LLVM 11 upgrade */
-		if(auto err = session.endSession())
-		{
-			session.reportError(std::move(err));
-		}
-#endif
-	}
-
-	const void *getEntry(int index) const override
-	{
-		return addresses[index];
 	}
 
 private:
 	std::string name;
 	llvm::orc::ExecutionSession session;
 	MemoryMapper memoryMapper;
+	size_t arenaAllocated = 0;  // By the ArenaMemoryManagers.
 	llvm::orc::RTDyldObjectLinkingLayer objectLayer;
+	llvm::orc::JITDylib &dylib;
 	std::vector<const void *> addresses;
 };
 
@@ -874,6 +1330,26 @@ void JITBuilder::optimize(const rr::Config &cfg)
 	}
 #endif
 
+	// The vectorizers only see vector registers through the target's cost model.
+	std::unique_ptr<llvm::TargetMachine> targetMachine;
+	for(auto pass : cfg.getOptimization().getPasses())
+	{
+		if(pass == rr::Optimization::Pass::LoopVectorize || pass == rr::Optimization::Pass::SLPVectorize)
+		{
+			auto tm = JITGlobals::get()->getTargetMachineBuilder(cfg.getOptimization().getLevel()).createTargetMachine();
+			if(tm)
+			{
+				targetMachine = std::move(tm.get());
+				passManager.add(llvm::createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+			}
+			else
+			{
+				llvm::consumeError(tm.takeError());
+			}
+			break;
+		}
+	}
+
 	for(auto pass : cfg.getOptimization().getPasses())
 	{
 		switch(pass)
@@ -890,6 +1366,10 @@ void JITBuilder::optimize(const rr::Config &cfg)
 		case rr::Optimization::Pass::ScalarReplAggregates: passManager.add(llvm::createSROAPass()); break;
 		case rr::Optimization::Pass::EarlyCSEPass: passManager.add(llvm::createEarlyCSEPass()); break;
 		case rr::Optimization::Pass::Inline: passManager.add(llvm::createFunctionInliningPass()); break;
+		case rr::Optimization::Pass::LoopRotate: passManager.add(llvm::createLoopRotatePass()); break;
+		case rr::Optimization::Pass::LoopUnroll: passManager.add(llvm::createLoopUnrollPass()); break;
+		case rr::Optimization::Pass::LoopVectorize: passManager.add(llvm::createLoopVectorizePass()); break;
+		case rr::Optimization::Pass::SLPVectorize: passManager.add(llvm::createSLPVectorizerPass()); break;
 		default:
 			UNREACHABLE("pass: %d", int(pass));
 		}
@@ -901,7 +1381,82 @@ void JITBuilder::optimize(const rr::Config &cfg)
 std::shared_ptr<rr::Routine> JITBuilder::acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg)
 {
 	ASSERT(module);
-	return std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs, count, cfg);
+	return std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs, count, cfg, cacheKey);
+}
+
+void setObjectCacheDirectory(const std::string &dir)
+{
+	ObjectFileCache::setDirectory(dir);
+}
+
+std::shared_ptr<Routine> loadCachedRoutine(const std::string &key, const char *name)
+{
+	if(!ObjectFileCache::enabled())
+	{
+		return nullptr;
+	}
+	auto object = ObjectFileCache(key).load();
+	// Otherwise the best of those compiled for a generic target by other hosts.
+	if(targetCPUOverride().empty())
+	{
+		for(const auto &cpu : compatibleGenericCPUs())
+		{
+			if(object)
+			{
+				break;
+			}
+			object = ObjectFileCache(key, JITGlobals::get()->getTargetDescription(cpu)).load();
+		}
+	}
+	if(!object)
+	{
+		return nullptr;
+	}
+	auto routine = std::make_shared<JITRoutine>(std::move(object), name, &name, 1);
+	if(!routine->valid())
+	{
+		return nullptr;
+	}
+	return routine;
+}
+
+std::string setTargetCPU(const std::string &cpu)
+{
+	auto sti = createSubtargetInfo(cpu);
+	if(!sti)
+	{
+		return "unknown CPU " + cpu;
+	}
+	// Some routines are run right after they are compiled.
+	auto missing = missingHostFeatures(*sti);
+	if(!missing.empty())
+	{
+		std::string features;
+		for(const auto &feature : missing)
+		{
+			features += (features.empty() ? "" : ", ") + feature;
+		}
+		return cpu + " has features the host lacks: " + features;
+	}
+	targetCPUOverride() = cpu;
+#if defined(__i386__) || defined(__x86_64__)
+	// The instructions Reactor emits depend on these.
+	CPUID::setEnableSSE3(sti->checkFeatures("+sse3"));
+	CPUID::setEnableSSSE3(sti->checkFeatures("+ssse3"));
+	CPUID::setEnableSSE4_1(sti->checkFeatures("+sse4.1"));
+	CPUID::setEnableAVX(sti->checkFeatures("+avx"));
+	CPUID::setEnableAVX2(sti->checkFeatures("+avx2"));
+	CPUID::setEnableAVX512F(sti->checkFeatures("+avx512f"));
+	CPUID::setEnableF16C(sti->checkFeatures("+f16c"));
+#elif defined(__aarch64__)
+	CPUID::setEnableNEON(sti->checkFeatures("+neon"));
+#endif
+	return "";
+}
+
+std::string getTargetCPU()
+{
+	return JITGlobals::get()->getTargetMachineBuilder(Optimization::Level::Default).getCPU();
 }
 
 }  // namespace rr
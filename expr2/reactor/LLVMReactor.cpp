@@ -34,6 +34,7 @@
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -576,23 +577,12 @@ Config Nucleus::getDefaultConfig()
 	return ::defaultConfig();
 }
 
-std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+// Optimizes and compiles the module of the current JITBuilder into a routine with an entry
+// point for each of the functions.
+static std::shared_ptr<Routine> acquireFunctions(const char *name, llvm::Function *const *funcs, size_t count, const Config::Edit &cfgEdit)
 {
-	if(jit->builder->GetInsertBlock()->empty() || !jit->builder->GetInsertBlock()->back().isTerminator())
-	{
-		llvm::Type *type = jit->function->getReturnType();
-
-		if(type->isVoidTy())
-		{
-			createRetVoid();
-		}
-		else
-		{
-			createRet(V(llvm::UndefValue::get(type)));
-		}
-	}
-
 	std::shared_ptr<Routine> routine;
+	std::vector<llvm::Function *> entries(funcs, funcs + count);
 
 	auto acquire = [&](rr::JITBuilder *jit) {
 		// ::jit is thread-local, so when this is executed on a separate thread (see JIT_IN_SEPARATE_THREAD)
@@ -631,7 +621,7 @@ std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config:
 			jit->module->print(file, 0);
 		}
 
-		routine = jit->acquireRoutine(name, &jit->function, 1, cfg);
+		routine = jit->acquireRoutine(name, entries.data(), entries.size(), cfg);
 	};
 
 #ifdef JIT_IN_SEPARATE_THREAD
@@ -648,6 +638,25 @@ std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config:
 	return routine;
 }
 
+std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+{
+	if(jit->builder->GetInsertBlock()->empty() || !jit->builder->GetInsertBlock()->back().isTerminator())
+	{
+		llvm::Type *type = jit->function->getReturnType();
+
+		if(type->isVoidTy())
+		{
+			createRetVoid();
+		}
+		else
+		{
+			createRet(V(llvm::UndefValue::get(type)));
+		}
+	}
+
+	return acquireFunctions(name, &jit->function, 1, cfgEdit);
+}
+
 Value *Nucleus::allocateStackVariable(Type *type, int arraySize)
 {
 	// Need to allocate it in the entry block for mem2reg to work
@@ -1198,6 +1207,194 @@ static llvm::Value *createGather(llvm::Value *base, llvm::Type *elTy, llvm::Valu
 	}
 }
 
+// Masked loads and stores of narrow integer vectors. The emulated types are wider than
+// their number of elements, so the result is padded with zeros (or the value truncated).
+static llvm::Value *createNarrowMaskedLoad(Value *base, Type *elTy, Value *mask, unsigned int alignment, bool zeroMaskedLanes, unsigned int resultSize)
+{
+	unsigned int numEls = llvm::cast<llvm::FixedVectorType>(V(mask)->getType())->getNumElements();
+	llvm::Value *ptr = jit->builder->CreatePointerCast(V(base), llvm::VectorType::get(T(elTy), numEls, false)->getPointerTo());
+	llvm::Value *x = V(Nucleus::createMaskedLoad(V(ptr), elTy, mask, alignment, zeroMaskedLanes));
+	if(numEls == resultSize)
+	{
+		return x;
+	}
+	llvm::SmallVector<CreateShuffleVectorIndexType, 16> vec;
+	for(unsigned int i = 0; i < resultSize; i++)
+	{
+		vec.push_back(i < numEls ? i : numEls);
+	}
+	return jit->builder->CreateShuffleVector(x, llvm::Constant::getNullValue(x->getType()), vec);
+}
+
+static void createNarrowMaskedStore(Value *base, Value *val, Value *mask, unsigned int alignment)
+{
+	llvm::Value *x = V(val);
+	unsigned int numEls = llvm::cast<llvm::FixedVectorType>(V(mask)->getType())->getNumElements();
+	if(llvm::cast<llvm::FixedVectorType>(x->getType())->getNumElements() != numEls)
+	{
+		llvm::SmallVector<CreateShuffleVectorIndexType, 16> vec;
+		for(unsigned int i = 0; i < numEls; i++)
+		{
+			vec.push_back(i);
+		}
+		x = jit->builder->CreateShuffleVector(x, x, vec);
+	}
+	llvm::Value *ptr = jit->builder->CreatePointerCast(V(base), x->getType()->getPointerTo());
+	Nucleus::createMaskedStore(V(ptr), V(x), mask, alignment);
+}
+
+RValue<Byte4> MaskedLoad(RValue<Pointer<Byte4>> base, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Byte4>(V(createNarrowMaskedLoad(base.value(), Byte::type(), mask.value(), alignment, zeroMaskedLanes, 16)));
+}
+
+RValue<Byte8> MaskedLoad(RValue<Pointer<Byte8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Byte8>(V(createNarrowMaskedLoad(base.value(), Byte::type(), mask.value(), alignment, zeroMaskedLanes, 16)));
+}
+
+RValue<Byte16> MaskedLoad(RValue<Pointer<Byte16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Byte16>(V(createNarrowMaskedLoad(base.value(), Byte::type(), mask.value(), alignment, zeroMaskedLanes, 16)));
+}
+
+RValue<UShort4> MaskedLoad(RValue<Pointer<UShort4>> base, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<UShort4>(V(createNarrowMaskedLoad(base.value(), UShort::type(), mask.value(), alignment, zeroMaskedLanes, 8)));
+}
+
+RValue<UShort8> MaskedLoad(RValue<Pointer<UShort8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<UShort8>(V(createNarrowMaskedLoad(base.value(), UShort::type(), mask.value(), alignment, zeroMaskedLanes, 8)));
+}
+
+RValue<UShort16> MaskedLoad(RValue<Pointer<UShort16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<UShort16>(V(createNarrowMaskedLoad(base.value(), UShort::type(), mask.value(), alignment, zeroMaskedLanes, 16)));
+}
+
+void MaskedStore(RValue<Pointer<Byte4>> base, RValue<Byte4> val, RValue<Int4> mask, unsigned int alignment)
+{
+	createNarrowMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<Byte8>> base, RValue<Byte8> val, RValue<Int8> mask, unsigned int alignment)
+{
+	createNarrowMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<Byte16>> base, RValue<Byte16> val, RValue<Int16> mask, unsigned int alignment)
+{
+	createNarrowMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<UShort4>> base, RValue<UShort4> val, RValue<Int4> mask, unsigned int alignment)
+{
+	createNarrowMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<UShort8>> base, RValue<UShort8> val, RValue<Int8> mask, unsigned int alignment)
+{
+	createNarrowMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<UShort16>> base, RValue<UShort16> val, RValue<Int16> mask, unsigned int alignment)
+{
+	createNarrowMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+// The first numEls elements of the (possibly emulated) 16-bit vector are converted.
+static llvm::Value *createHalfToFloat(Value *val, unsigned int numEls)
+{
+	llvm::Value *x = V(val);
+	if(llvm::cast<llvm::FixedVectorType>(x->getType())->getNumElements() != numEls)
+	{
+		llvm::SmallVector<CreateShuffleVectorIndexType, 16> vec;
+		for(unsigned int i = 0; i < numEls; i++)
+		{
+			vec.push_back(i);
+		}
+		x = jit->builder->CreateShuffleVector(x, x, vec);
+	}
+	x = jit->builder->CreateBitCast(x, llvm::FixedVectorType::get(jit->builder->getHalfTy(), numEls));
+	return jit->builder->CreateFPExt(x, llvm::FixedVectorType::get(jit->builder->getFloatTy(), numEls));
+}
+
+// The result is padded with zeros to resultSize elements.
+static llvm::Value *createFloatToHalf(Value *val, unsigned int resultSize)
+{
+	llvm::Value *x = V(val);
+	unsigned int numEls = llvm::cast<llvm::FixedVectorType>(x->getType())->getNumElements();
+	x = jit->builder->CreateFPTrunc(x, llvm::FixedVectorType::get(jit->builder->getHalfTy(), numEls));
+	x = jit->builder->CreateBitCast(x, llvm::FixedVectorType::get(jit->builder->getInt16Ty(), numEls));
+	if(numEls == resultSize)
+	{
+		return x;
+	}
+	llvm::SmallVector<CreateShuffleVectorIndexType, 16> vec;
+	for(unsigned int i = 0; i < resultSize; i++)
+	{
+		vec.push_back(i < numEls ? i : numEls);
+	}
+	return jit->builder->CreateShuffleVector(x, llvm::Constant::getNullValue(x->getType()), vec);
+}
+
+RValue<Float4> HalfToFloat(RValue<UShort4> x)
+{
+	return As<Float4>(V(createHalfToFloat(x.value(), 4)));
+}
+
+RValue<Float8> HalfToFloat(RValue<UShort8> x)
+{
+	return As<Float8>(V(createHalfToFloat(x.value(), 8)));
+}
+
+RValue<Float16> HalfToFloat(RValue<UShort16> x)
+{
+	return As<Float16>(V(createHalfToFloat(x.value(), 16)));
+}
+
+RValue<UShort4> FloatToHalf(RValue<Float4> x)
+{
+	return As<UShort4>(V(createFloatToHalf(x.value(), 8)));
+}
+
+RValue<UShort8> FloatToHalf(RValue<Float8> x)
+{
+	return As<UShort8>(V(createFloatToHalf(x.value(), 8)));
+}
+
+RValue<UShort16> FloatToHalf(RValue<Float16> x)
+{
+	return As<UShort16>(V(createFloatToHalf(x.value(), 16)));
+}
+
+RValue<Float4> Gather(RValue<Pointer<Float>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Float4>(V(createGather(V(base.value()), T(Float::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<Byte4> Gather(RValue<Pointer<Byte>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	llvm::Value *x = createGather(V(base.value()), T(Byte::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes);
+	llvm::Value *zero = llvm::Constant::getNullValue(x->getType());
+	const llvm::SmallVector<CreateShuffleVectorIndexType, 16> vec = {0,1,2,3,4,4,4,4,4,4,4,4,4,4,4,4};
+	return As<Byte4>(V(jit->builder->CreateShuffleVector(x, zero, vec)));
+}
+
+RValue<UShort4> Gather(RValue<Pointer<UShort>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	llvm::Value *x = createGather(V(base.value()), T(UShort::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes);
+	llvm::Value *zero = llvm::Constant::getNullValue(x->getType());
+	const llvm::SmallVector<CreateShuffleVectorIndexType, 8> vec = {0,1,2,3,4,4,4,4};
+	return As<UShort4>(V(jit->builder->CreateShuffleVector(x, zero, vec)));
+}
+
+RValue<Int4> Gather(RValue<Pointer<Int>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Int4>(V(createGather(V(base.value()), T(Int::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
 RValue<Float8> Gather(RValue<Pointer<Float>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
 {
 	return As<Float8>(V(createGather(V(base.value()), T(Float::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
@@ -1221,6 +1418,26 @@ RValue<Int8> Gather(RValue<Pointer<Int>> base, RValue<Int8> offsets, RValue<Int8
 	return As<Int8>(V(createGather(V(base.value()), T(Int::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
 }
 
+RValue<Float16> Gather(RValue<Pointer<Float>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Float16>(V(createGather(V(base.value()), T(Float::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<Byte16> Gather(RValue<Pointer<Byte>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Byte16>(V(createGather(V(base.value()), T(Byte::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<UShort16> Gather(RValue<Pointer<UShort>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<UShort16>(V(createGather(V(base.value()), T(UShort::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<Int16> Gather(RValue<Pointer<Int>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Int16>(V(createGather(V(base.value()), T(Int::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
 static void createScatter(llvm::Value *base, llvm::Value *val, llvm::Value *offsets, llvm::Value *mask, unsigned int alignment)
 {
 	ASSERT(base->getType()->isPointerTy());
@@ -1826,8 +2043,8 @@ Value *Nucleus::createConstantVector(const int64_t *constants, Type *type)
 	ASSERT(llvm::isa<llvm::VectorType>(T(type)));
 	const int numConstants = elementCount(type);                                           // Number of provided constants for the (emulated) type.
 	const int numElements = llvm::cast<llvm::FixedVectorType>(T(type))->getNumElements();  // Number of elements of the underlying vector type.
-	ASSERT(numElements <= 16 && numConstants <= numElements);
-	llvm::Constant *constantVector[16];
+	ASSERT(numElements <= 32 && numConstants <= numElements);
+	llvm::Constant *constantVector[32];
 
 	for(int i = 0; i < numElements; i++)
 	{
@@ -1843,8 +2060,8 @@ Value *Nucleus::createConstantVector(const double *constants, Type *type)
 	ASSERT(llvm::isa<llvm::VectorType>(T(type)));
 	const int numConstants = elementCount(type);                                           // Number of provided constants for the (emulated) type.
 	const int numElements = llvm::cast<llvm::FixedVectorType>(T(type))->getNumElements();  // Number of elements of the underlying vector type.
-	ASSERT(numElements <= 8 && numConstants <= numElements);
-	llvm::Constant *constantVector[8];
+	ASSERT(numElements <= 32 && numConstants <= numElements);
+	llvm::Constant *constantVector[32];
 
 	for(int i = 0; i < numElements; i++)
 	{
@@ -3084,6 +3301,76 @@ RValue<UInt8> operator>>(RValue<UInt8> lhs, unsigned char rhs)
 	return As<UInt8>(V(lowerVectorLShr(V(lhs.value()), rhs)));
 }
 
+Type *UShort16::type()
+{
+	return T(llvm::VectorType::get(T(UShort::type()), 16, false));
+}
+
+Type *Int16::type()
+{
+	return T(llvm::VectorType::get(T(Int::type()), 16, false));
+}
+
+RValue<Int16> operator<<(RValue<Int16> lhs, unsigned char rhs)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerVectorShl(V(lhs.value()), rhs)));
+}
+
+RValue<Int16> operator>>(RValue<Int16> lhs, unsigned char rhs)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerVectorAShr(V(lhs.value()), rhs)));
+}
+
+RValue<Int16> CmpEQ(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpEQ(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLT(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSLT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLE(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSLE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNEQ(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpNE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLT(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSGE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLE(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSGT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> Max(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SGT)));
+}
+
+RValue<Int16> Min(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SLT)));
+}
+
 Type *Half::type()
 {
 	return T(llvm::Type::getInt16Ty(*jit->context));
@@ -3808,6 +4095,7 @@ RValue<FloatT> Log2(RValue<FloatT> v)
 INSTANTIATE_FUNCS(Float4);
 INSTANTIATE_FUNCS(Float8);
 #undef INSTANTIATE_FUNCS
+template RValue<Float16> BuiltinPow<Float16>(RValue<Float16> x, RValue<Float16> y);
 
 RValue<UInt> Ctlz(RValue<UInt> v, bool isZeroUndef)
 {
@@ -4014,6 +4302,205 @@ RValue<Float8> Sqrt(RValue<Float8> x)
 	return As<Float8>(V(lowerSQRT(V(x.value()))));
 }
 
+Type *Short16::type()
+{
+	return T(llvm::VectorType::get(T(Short::type()), 16, false));
+}
+
+RValue<Short16> CmpEQ(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short16>(Nucleus::createSExt(Nucleus::createICmpEQ(x.value(), y.value()), Short16::type()));
+}
+
+RValue<Short16> CmpLT(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short16>(Nucleus::createSExt(Nucleus::createICmpSLT(x.value(), y.value()), Short16::type()));
+}
+
+RValue<Short16> CmpLE(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short16>(Nucleus::createSExt(Nucleus::createICmpSLE(x.value(), y.value()), Short16::type()));
+}
+
+RValue<Short16> CmpNEQ(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short16>(Nucleus::createSExt(Nucleus::createICmpNE(x.value(), y.value()), Short16::type()));
+}
+
+RValue<Short16> CmpNLT(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short16>(Nucleus::createSExt(Nucleus::createICmpSGE(x.value(), y.value()), Short16::type()));
+}
+
+RValue<Short16> CmpNLE(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short16>(Nucleus::createSExt(Nucleus::createICmpSGT(x.value(), y.value()), Short16::type()));
+}
+
+RValue<Short16> Max(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Short16>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SGT)));
+}
+
+RValue<Short16> Min(RValue<Short16> x, RValue<Short16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Short16>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SLT)));
+}
+
+Type *Short32::type()
+{
+	return T(llvm::VectorType::get(T(Short::type()), 32, false));
+}
+
+RValue<Short32> CmpEQ(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short32>(Nucleus::createSExt(Nucleus::createICmpEQ(x.value(), y.value()), Short32::type()));
+}
+
+RValue<Short32> CmpLT(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short32>(Nucleus::createSExt(Nucleus::createICmpSLT(x.value(), y.value()), Short32::type()));
+}
+
+RValue<Short32> CmpLE(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short32>(Nucleus::createSExt(Nucleus::createICmpSLE(x.value(), y.value()), Short32::type()));
+}
+
+RValue<Short32> CmpNEQ(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short32>(Nucleus::createSExt(Nucleus::createICmpNE(x.value(), y.value()), Short32::type()));
+}
+
+RValue<Short32> CmpNLT(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short32>(Nucleus::createSExt(Nucleus::createICmpSGE(x.value(), y.value()), Short32::type()));
+}
+
+RValue<Short32> CmpNLE(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Short32>(Nucleus::createSExt(Nucleus::createICmpSGT(x.value(), y.value()), Short32::type()));
+}
+
+RValue<Short32> Max(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Short32>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SGT)));
+}
+
+RValue<Short32> Min(RValue<Short32> x, RValue<Short32> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Short32>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SLT)));
+}
+
+Type *Byte32::type()
+{
+	return T(llvm::VectorType::get(T(Byte::type()), 32, false));
+}
+
+Type *Float16::type()
+{
+	return T(llvm::VectorType::get(T(Float::type()), 16, false));
+}
+
+RValue<Float16> operator%(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFRem(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> CmpEQ(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOEQ(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLT(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOLT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLE(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOLE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNEQ(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpONE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLT(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOGE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLE(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOGT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Float16> Max(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Float16>(V(lowerPFMINMAX(V(x.value()), V(y.value()), llvm::FCmpInst::FCMP_OGT)));
+}
+
+RValue<Float16> Min(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Float16>(V(lowerPFMINMAX(V(x.value()), V(y.value()), llvm::FCmpInst::FCMP_OLT)));
+}
+
+RValue<Float16> Round(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return Float16(RoundInt(x));
+}
+
+RValue<Int16> RoundInt(RValue<Float16> cast)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerRoundInt(V(cast.value()), T(Int16::type()))));
+}
+
+RValue<Float16> Trunc(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Float16>(V(lowerTrunc(V(x.value()))));
+}
+
+RValue<Float16> Floor(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Float16>(V(lowerFloor(V(x.value()))));
+}
+
+RValue<Float16> Sqrt(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Float16>(V(lowerSQRT(V(x.value()))));
+}
+
 RValue<Long> Ticks()
 {
 	RR_DEBUG_INFO_UPDATE_LOC();
@@ -4930,9 +5417,13 @@ void Module::add(llvm::Function *f, const char *name)
 		f->setName(name);
 }
 
-std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+void Module::finish()
 {
 	for (auto f: functions) {
+		if (vectorWidth) {
+			f->addFnAttr("min-legal-vector-width", std::to_string(vectorWidth));
+			f->addFnAttr("prefer-vector-width", std::to_string(vectorWidth));
+		}
 		// Return creates a new basicblock, which we have to terminate with a return instruction.
 		jit->builder->SetInsertPoint(&f->back());
 		if(jit->builder->GetInsertBlock()->empty() || !jit->builder->GetInsertBlock()->back().isTerminator())
@@ -4950,9 +5441,27 @@ std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &c
 			}
 		}
 	}
+	jit->cacheKey = cacheKey;
+}
+
+std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+{
+	finish();
 	return core->acquireRoutine(name, cfgEdit);
 }
 
+std::shared_ptr<Routine> Module::acquire(const char *name, const std::vector<std::string> &entries, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+{
+	finish();
+	std::vector<llvm::Function *> funcs;
+	for (const auto &entry: entries) {
+		auto it = std::find_if(functions.begin(), functions.end(), [&](llvm::Function *f) { return f->getName() == entry; });
+		ASSERT_MSG(it != functions.end(), "no function %s in the module", entry.c_str());
+		funcs.push_back(*it);
+	}
+	return acquireFunctions(name, funcs.data(), funcs.size(), cfgEdit);
+}
+
 
 /* Parameterized Vector Operations */
 template<typename FloatT>
@@ -4964,13 +5473,24 @@ RValue<FloatT> FMA(RValue<FloatT> a, RValue<FloatT> b, RValue<FloatT> c)
 	return As<FloatT>(V(jit->builder->CreateCall(intrinsic, { va, vb, vc })));
 }
 
+template<typename FloatT>
+RValue<FloatT> FMulAdd(RValue<FloatT> a, RValue<FloatT> b, RValue<FloatT> c)
+{
+	llvm::Value *va = V(a.value()), *vb = V(b.value()), *vc = V(c.value());
+	llvm::Function *intrinsic = llvm::Intrinsic::getDeclaration(jit->module.get(), llvm::Intrinsic::fmuladd, va->getType());
+
+	return As<FloatT>(V(jit->builder->CreateCall(intrinsic, { va, vb, vc })));
+}
+
 // specialize for all float types
 #define SPECIALIZE(type) \
 	template RValue<type> FMA(RValue<type> a, RValue<type> b, RValue<type> c); \
+	template RValue<type> FMulAdd(RValue<type> a, RValue<type> b, RValue<type> c); \
 
 SPECIALIZE(Float);
 SPECIALIZE(Float4);
 SPECIALIZE(Float8);
+SPECIALIZE(Float16);
 #undef SPECIALIZE
 
 }  // namespace rr
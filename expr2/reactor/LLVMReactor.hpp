@@ -99,6 +99,8 @@ public:
 	std::unique_ptr<llvm::Module> module;
 	std::unique_ptr<llvm::IRBuilder<>> builder;
 	llvm::Function *function = nullptr;
+	// Non-empty if the compiled object should be stored in the object cache under this key.
+	std::string cacheKey;
 
 	struct CoroutineState
 	{
@@ -14,6 +14,7 @@
 
 #include "Reactor.hpp"
 
+#include <string>
 #include <vector>
 
 #ifndef rr_Module_hpp
@@ -51,15 +52,54 @@ class Module
 {
 	std::vector<llvm::Function *> functions;
 	std::unique_ptr<Nucleus> core;
+	unsigned vectorWidth = 0;
+	std::string cacheKey;
 public:
 	Module() : core(new Nucleus()) {}
 
 	//Nucleus *getCore() { return core.get(); }
 	void add(llvm::Function *f, const char *name);
 
+	// Tell the backend the widest vector (in bits) the functions are meant to use,
+	// otherwise wider vectors might be split on CPUs tuned to prefer narrower ones.
+	void setVectorWidth(unsigned bits) { vectorWidth = bits; }
+
+	// Store the compiled object in the object cache (if enabled) under the given key,
+	// so that loadCachedRoutine() can return it without compiling the module again.
+	// The key must identify everything the generated code depends on.
+	void setCacheKey(const std::string &key) { cacheKey = key; }
+
 	std::shared_ptr<Routine> acquire(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+
+	// Like acquire, but the routine has an entry point for each of the named functions, in
+	// that order. Independent functions compiled this way share the compilation and the
+	// pages of their code.
+	std::shared_ptr<Routine> acquire(const char *name, const std::vector<std::string> &entries, const Config::Edit &cfgEdit = Config::Edit::None);
+
+private:
+	// Terminates the functions, which are then ready to be compiled.
+	void finish();
 };
 
+// Enable the on-disk object cache, which keeps compiled routines in the given directory.
+// An empty string disables it.
+void setObjectCacheDirectory(const std::string &dir);
+
+// Load the routine previously compiled from a module with the given cache key, whose entry
+// point is the named function. Unless a target CPU is set, the routines compiled for the
+// generic CPUs the host can run are tried too, the newest first. Returns nullptr if it
+// isn't in the object cache.
+std::shared_ptr<Routine> loadCachedRoutine(const std::string &key, const char *entry);
+
+// Generate code for the named CPU (e.g. "x86-64-v3") instead of the host, and with only its
+// features, so that the objects stored in the object cache can be loaded by other hosts.
+// Must be called before anything is compiled. Returns why it failed if the CPU is unknown
+// or has features the host lacks, and the host is still targeted then.
+std::string setTargetCPU(const std::string &cpu);
+
+// The CPU that code is generated for.
+std::string getTargetCPU();
+
 // Internal use only.
 Value *Call(llvm::Function *func, std::initializer_list<Value *> args);
 void setPure(llvm::Function *func);
@@ -71,6 +71,10 @@ public:
 		ScalarReplAggregates,
 		EarlyCSEPass,
 		Inline,
+		LoopRotate,
+		LoopUnroll,
+		LoopVectorize,
+		SLPVectorize,
 
 		Count,
 	};
@@ -282,6 +282,18 @@ static Value *createSwizzle8(Value *val, uint32_t select)
 	return Nucleus::createShuffleVector(val, val, swizzle);
 }
 
+// Same as createSwizzle8, but with 16 lanes and 4-bit indices.
+static Value *createSwizzle16(Value *val, uint64_t select)
+{
+	int swizzle[16];
+	for(int i = 0; i < 16; i++)
+	{
+		swizzle[i] = static_cast<int>((select >> (60 - 4 * i)) & 0x0F);
+	}
+
+	return Nucleus::createShuffleVector(val, val, swizzle);
+}
+
 static Value *createMask4(Value *lhs, Value *rhs, uint16_t select)
 {
 	bool mask[4] = { false, false, false, false };
@@ -1778,6 +1790,16 @@ RValue<Byte16> Byte16::operator=(const Reference<Byte16> &rhs)
 	return store(rhs.load());
 }
 
+Byte16::Byte16(RValue<UShort16> cast)
+{
+	storeValue(Nucleus::createTrunc(cast.value(), Byte16::type()));
+}
+
+Byte16::Byte16(RValue<Short16> cast)
+{
+	storeValue(Nucleus::createTrunc(cast.value(), Byte16::type()));
+}
+
 RValue<Byte16> Swizzle(RValue<Byte16> x, uint64_t select)
 {
 	int shuffle[16] = {
@@ -4898,6 +4920,347 @@ RValue<Float8> Swizzle(RValue<Float8> x, uint32_t select)
 	return RValue<Float8>(createSwizzle8(x.value(), select));
 }
 
+UShort16::UShort16(RValue<Int16> cast)
+{
+	storeValue(Nucleus::createTrunc(cast.value(), UShort16::type()));
+}
+
+UShort16::UShort16(RValue<UShort16> rhs)
+{
+	store(rhs);
+}
+
+UShort16::UShort16(const UShort16 &rhs)
+{
+	store(rhs.load());
+}
+
+UShort16::UShort16(const Reference<UShort16> &rhs)
+{
+	store(rhs.load());
+}
+
+RValue<UShort16> UShort16::operator=(RValue<UShort16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<UShort16> UShort16::operator=(const UShort16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<UShort16> UShort16::operator=(const Reference<UShort16> &rhs)
+{
+	return store(rhs.load());
+}
+
+Int16::Int16()
+{
+}
+
+Int16::Int16(RValue<Byte16> cast)
+{
+	storeValue(Nucleus::createZExt(cast.value(), Int16::type()));
+}
+
+Int16::Int16(RValue<UShort16> cast)
+{
+	storeValue(Nucleus::createZExt(cast.value(), Int16::type()));
+}
+
+Int16::Int16(RValue<Float16> cast)
+{
+	storeValue(Nucleus::createFPToSI(cast.value(), Int16::type()));
+}
+
+Int16::Int16(int x)
+{
+	int64_t constantVector[16] = { x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x };
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+Int16::Int16(RValue<Int16> rhs)
+{
+	store(rhs);
+}
+
+Int16::Int16(const Int16 &rhs)
+{
+	store(rhs.load());
+}
+
+Int16::Int16(const Reference<Int16> &rhs)
+{
+	store(rhs.load());
+}
+
+Int16::Int16(RValue<Int> rhs)
+{
+	Value *vector = loadValue();
+	Value *insert = Nucleus::createInsertElement(vector, rhs.value(), 0);
+
+	int swizzle[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	Value *replicate = Nucleus::createShuffleVector(insert, insert, swizzle);
+
+	storeValue(replicate);
+}
+
+Int16::Int16(const Int &rhs)
+{
+	*this = RValue<Int>(rhs.loadValue());
+}
+
+Int16::Int16(const Reference<Int> &rhs)
+{
+	*this = RValue<Int>(rhs.loadValue());
+}
+
+RValue<Int16> Int16::operator=(RValue<Int16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Int16> Int16::operator=(const Int16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Int16> Int16::operator=(const Reference<Int16> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Int16> operator+(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createAdd(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator-(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createSub(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator*(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createMul(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator/(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createSDiv(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator%(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createSRem(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator&(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createAnd(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator|(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createOr(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator^(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createXor(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator<<(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createShl(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator>>(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createAShr(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator+(RValue<Int16> val)
+{
+	return val;
+}
+
+RValue<Int16> operator-(RValue<Int16> val)
+{
+	return RValue<Int16>(Nucleus::createNeg(val.value()));
+}
+
+RValue<Int16> operator~(RValue<Int16> val)
+{
+	return RValue<Int16>(Nucleus::createNot(val.value()));
+}
+
+RValue<Int16> Abs(RValue<Int16> x)
+{
+	auto negative = x >> 31;
+	return (x ^ negative) - negative;
+}
+
+RValue<Int16> Insert(RValue<Int16> x, RValue<Int> element, int i)
+{
+	return RValue<Int16>(Nucleus::createInsertElement(x.value(), element.value(), i));
+}
+
+RValue<Int> Extract(RValue<Int16> x, int i)
+{
+	return RValue<Int>(Nucleus::createExtractElement(x.value(), Int::type(), i));
+}
+
+RValue<Int16> Swizzle(RValue<Int16> x, uint64_t select)
+{
+	return RValue<Int16>(createSwizzle16(x.value(), select));
+}
+
+Float16::Float16(RValue<Int16> cast)
+{
+	storeValue(Nucleus::createSIToFP(cast.value(), Float16::type()));
+}
+
+Float16::Float16()
+{
+}
+
+Float16::Float16(float x)
+{
+	// See Float(float) constructor for the rationale behind this assert.
+	ASSERT(std::isfinite(x));
+
+	double constantVector[16] = { x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x };
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+Float16::Float16(RValue<Float16> rhs)
+{
+	store(rhs);
+}
+
+Float16::Float16(const Float16 &rhs)
+{
+	store(rhs.load());
+}
+
+Float16::Float16(const Reference<Float16> &rhs)
+{
+	store(rhs.load());
+}
+
+Float16::Float16(RValue<Float> rhs)
+{
+	Value *vector = loadValue();
+	Value *insert = Nucleus::createInsertElement(vector, rhs.value(), 0);
+
+	int swizzle[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	Value *replicate = Nucleus::createShuffleVector(insert, insert, swizzle);
+
+	storeValue(replicate);
+}
+
+Float16::Float16(const Float &rhs)
+{
+	*this = RValue<Float>(rhs.loadValue());
+}
+
+Float16::Float16(const Reference<Float> &rhs)
+{
+	*this = RValue<Float>(rhs.loadValue());
+}
+
+Float16::Float16(Argument<Float16> argument)
+{
+	store(argument.rvalue());
+}
+
+RValue<Float16> Float16::operator=(float x)
+{
+	return *this = Float16(x);
+}
+
+RValue<Float16> Float16::operator=(RValue<Float16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Float16> Float16::operator=(const Float16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Float16> Float16::operator=(const Reference<Float16> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Float16> Float16::operator=(RValue<Float> rhs)
+{
+	return *this = Float16(rhs);
+}
+
+RValue<Float16> Float16::operator=(const Float &rhs)
+{
+	return *this = Float16(rhs);
+}
+
+RValue<Float16> Float16::operator=(const Reference<Float> &rhs)
+{
+	return *this = Float16(rhs);
+}
+
+RValue<Float16> operator+(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFAdd(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator-(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFSub(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator*(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFMul(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator/(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFDiv(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator+(RValue<Float16> val)
+{
+	return val;
+}
+
+RValue<Float16> operator-(RValue<Float16> val)
+{
+	return RValue<Float16>(Nucleus::createFNeg(val.value()));
+}
+
+RValue<Float16> Abs(RValue<Float16> x)
+{
+	return As<Float16>(As<Int16>(x) & Int16(0x7FFFFFFF));
+}
+
+RValue<Float16> Insert(RValue<Float16> x, RValue<Float> element, int i)
+{
+	return RValue<Float16>(Nucleus::createInsertElement(x.value(), element.value(), i));
+}
+
+RValue<Float> Extract(RValue<Float16> x, int i)
+{
+	return RValue<Float>(Nucleus::createExtractElement(x.value(), Float::type(), i));
+}
+
+RValue<Float16> Swizzle(RValue<Float16> x, uint64_t select)
+{
+	return RValue<Float16>(createSwizzle16(x.value(), select));
+}
+
 
 RValue<Pointer<Byte>> operator+(RValue<Pointer<Byte>> lhs, int offset)
 {
@@ -4992,6 +5355,251 @@ void MaskedStore(RValue<Pointer<Int4>> base, RValue<Int4> val, RValue<Int4> mask
 	Nucleus::createMaskedStore(base.value(), val.value(), mask.value(), alignment);
 }
 
+RValue<Float8> MaskedLoad(RValue<Pointer<Float8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return RValue<Float8>(Nucleus::createMaskedLoad(base.value(), Float::type(), mask.value(), alignment, zeroMaskedLanes));
+}
+
+RValue<Int8> MaskedLoad(RValue<Pointer<Int8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return RValue<Int8>(Nucleus::createMaskedLoad(base.value(), Int::type(), mask.value(), alignment, zeroMaskedLanes));
+}
+
+void MaskedStore(RValue<Pointer<Float8>> base, RValue<Float8> val, RValue<Int8> mask, unsigned int alignment)
+{
+	Nucleus::createMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<Int8>> base, RValue<Int8> val, RValue<Int8> mask, unsigned int alignment)
+{
+	Nucleus::createMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+RValue<Float16> MaskedLoad(RValue<Pointer<Float16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return RValue<Float16>(Nucleus::createMaskedLoad(base.value(), Float::type(), mask.value(), alignment, zeroMaskedLanes));
+}
+
+RValue<Int16> MaskedLoad(RValue<Pointer<Int16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return RValue<Int16>(Nucleus::createMaskedLoad(base.value(), Int::type(), mask.value(), alignment, zeroMaskedLanes));
+}
+
+void MaskedStore(RValue<Pointer<Float16>> base, RValue<Float16> val, RValue<Int16> mask, unsigned int alignment)
+{
+	Nucleus::createMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+void MaskedStore(RValue<Pointer<Int16>> base, RValue<Int16> val, RValue<Int16> mask, unsigned int alignment)
+{
+	Nucleus::createMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
+
+Short16::Short16(RValue<Byte16> cast)
+{
+	storeValue(Nucleus::createZExt(cast.value(), Short16::type()));
+}
+
+Short16::Short16(short x)
+{
+	int64_t constantVector[16];
+	for(int i = 0; i < 16; i++)
+	{
+		constantVector[i] = x;
+	}
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+Short16::Short16(RValue<Short16> rhs)
+{
+	store(rhs);
+}
+
+Short16::Short16(const Short16 &rhs)
+{
+	store(rhs.load());
+}
+
+Short16::Short16(const Reference<Short16> &rhs)
+{
+	store(rhs.load());
+}
+
+RValue<Short16> Short16::operator=(RValue<Short16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Short16> Short16::operator=(const Short16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Short16> Short16::operator=(const Reference<Short16> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Short16> operator+(RValue<Short16> lhs, RValue<Short16> rhs)
+{
+	return RValue<Short16>(Nucleus::createAdd(lhs.value(), rhs.value()));
+}
+
+RValue<Short16> operator-(RValue<Short16> lhs, RValue<Short16> rhs)
+{
+	return RValue<Short16>(Nucleus::createSub(lhs.value(), rhs.value()));
+}
+
+RValue<Short16> operator*(RValue<Short16> lhs, RValue<Short16> rhs)
+{
+	return RValue<Short16>(Nucleus::createMul(lhs.value(), rhs.value()));
+}
+
+RValue<Short16> operator&(RValue<Short16> lhs, RValue<Short16> rhs)
+{
+	return RValue<Short16>(Nucleus::createAnd(lhs.value(), rhs.value()));
+}
+
+RValue<Short16> operator|(RValue<Short16> lhs, RValue<Short16> rhs)
+{
+	return RValue<Short16>(Nucleus::createOr(lhs.value(), rhs.value()));
+}
+
+RValue<Short16> operator^(RValue<Short16> lhs, RValue<Short16> rhs)
+{
+	return RValue<Short16>(Nucleus::createXor(lhs.value(), rhs.value()));
+}
+
+RValue<Short16> operator~(RValue<Short16> val)
+{
+	return RValue<Short16>(Nucleus::createNot(val.value()));
+}
+
+RValue<Short16> Abs(RValue<Short16> x)
+{
+	return Max(x, RValue<Short16>(Nucleus::createNeg(x.value())));
+}
+
+Short32::Short32(RValue<Byte32> cast)
+{
+	storeValue(Nucleus::createZExt(cast.value(), Short32::type()));
+}
+
+Short32::Short32(short x)
+{
+	int64_t constantVector[32];
+	for(int i = 0; i < 32; i++)
+	{
+		constantVector[i] = x;
+	}
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+Short32::Short32(RValue<Short32> rhs)
+{
+	store(rhs);
+}
+
+Short32::Short32(const Short32 &rhs)
+{
+	store(rhs.load());
+}
+
+Short32::Short32(const Reference<Short32> &rhs)
+{
+	store(rhs.load());
+}
+
+RValue<Short32> Short32::operator=(RValue<Short32> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Short32> Short32::operator=(const Short32 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Short32> Short32::operator=(const Reference<Short32> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Short32> operator+(RValue<Short32> lhs, RValue<Short32> rhs)
+{
+	return RValue<Short32>(Nucleus::createAdd(lhs.value(), rhs.value()));
+}
+
+RValue<Short32> operator-(RValue<Short32> lhs, RValue<Short32> rhs)
+{
+	return RValue<Short32>(Nucleus::createSub(lhs.value(), rhs.value()));
+}
+
+RValue<Short32> operator*(RValue<Short32> lhs, RValue<Short32> rhs)
+{
+	return RValue<Short32>(Nucleus::createMul(lhs.value(), rhs.value()));
+}
+
+RValue<Short32> operator&(RValue<Short32> lhs, RValue<Short32> rhs)
+{
+	return RValue<Short32>(Nucleus::createAnd(lhs.value(), rhs.value()));
+}
+
+RValue<Short32> operator|(RValue<Short32> lhs, RValue<Short32> rhs)
+{
+	return RValue<Short32>(Nucleus::createOr(lhs.value(), rhs.value()));
+}
+
+RValue<Short32> operator^(RValue<Short32> lhs, RValue<Short32> rhs)
+{
+	return RValue<Short32>(Nucleus::createXor(lhs.value(), rhs.value()));
+}
+
+RValue<Short32> operator~(RValue<Short32> val)
+{
+	return RValue<Short32>(Nucleus::createNot(val.value()));
+}
+
+RValue<Short32> Abs(RValue<Short32> x)
+{
+	return Max(x, RValue<Short32>(Nucleus::createNeg(x.value())));
+}
+
+Byte32::Byte32(RValue<Short32> cast)
+{
+	storeValue(Nucleus::createTrunc(cast.value(), Byte32::type()));
+}
+
+Byte32::Byte32(RValue<Byte32> rhs)
+{
+	store(rhs);
+}
+
+Byte32::Byte32(const Byte32 &rhs)
+{
+	store(rhs.load());
+}
+
+Byte32::Byte32(const Reference<Byte32> &rhs)
+{
+	store(rhs.load());
+}
+
+RValue<Byte32> Byte32::operator=(RValue<Byte32> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Byte32> Byte32::operator=(const Byte32 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Byte32> Byte32::operator=(const Reference<Byte32> &rhs)
+{
+	return store(rhs.load());
+}
+
 void Fence(std::memory_order memoryOrder)
 {
 	ASSERT_MSG(memoryOrder == std::memory_order_acquire ||
@@ -116,6 +116,12 @@ class Float;
 class Float2;
 class Float4;
 class Float8;
+class UShort16;
+class Int16;
+class Float16;
+class Short16;
+class Short32;
+class Byte32;
 
 // Returns whether a value is constant after constant folding. Internal use only.
 RValue<Bool> isConstant(Value *);
@@ -786,6 +792,8 @@ public:
 	Byte16(RValue<Byte16> rhs);
 	Byte16(const Byte16 &rhs);
 	Byte16(const Reference<Byte16> &rhs);
+	explicit Byte16(RValue<UShort16> cast);
+	explicit Byte16(RValue<Short16> cast);
 
 	RValue<Byte16> operator=(RValue<Byte16> rhs);
 	RValue<Byte16> operator=(const Byte16 &rhs);
@@ -2378,6 +2386,10 @@ RValue<Float> Max(RValue<Float> x, RValue<Float> y);
 RValue<Float> Min(RValue<Float> x, RValue<Float> y);
 template<typename T> RValue<T> FMA(RValue<T> a, RValue<T> b, RValue<T> c);
 static inline RValue<Float> FMA(RValue<Float> a, RValue<Float> b, RValue<Float> c) { return FMA<Float>(a, b, c); }
+// a * b + c, fused where the target has FMA instructions and with a separate rounding
+// otherwise, rather than through a library call like FMA.
+template<typename T> RValue<T> FMulAdd(RValue<T> a, RValue<T> b, RValue<T> c);
+static inline RValue<Float> FMulAdd(RValue<Float> a, RValue<Float> b, RValue<Float> c) { return FMulAdd<Float>(a, b, c); }
 // Deprecated: use Rcp
 // TODO(b/147516027): Remove when GLES frontend is removed
 RValue<Float> Rcp_pp(RValue<Float> val, bool exactAtPow2 = false);
@@ -2550,6 +2562,7 @@ RValue<Float4> Abs(RValue<Float4> x);
 RValue<Float4> Max(RValue<Float4> x, RValue<Float4> y);
 RValue<Float4> Min(RValue<Float4> x, RValue<Float4> y);
 static inline RValue<Float4> FMA(RValue<Float4> a, RValue<Float4> b, RValue<Float4> c) { return FMA<Float4>(a, b, c); }
+static inline RValue<Float4> FMulAdd(RValue<Float4> a, RValue<Float4> b, RValue<Float4> c) { return FMulAdd<Float4>(a, b, c); }
 
 // Deprecated: use Rcp
 // TODO(b/147516027): Remove when GLES frontend is removed
@@ -2708,6 +2721,7 @@ RValue<Float8> Abs(RValue<Float8> x);
 RValue<Float8> Max(RValue<Float8> x, RValue<Float8> y);
 RValue<Float8> Min(RValue<Float8> x, RValue<Float8> y);
 static inline RValue<Float8> FMA(RValue<Float8> a, RValue<Float8> b, RValue<Float8> c) { return FMA<Float8>(a, b, c); }
+static inline RValue<Float8> FMulAdd(RValue<Float8> a, RValue<Float8> b, RValue<Float8> c) { return FMulAdd<Float8>(a, b, c); }
 
 // Deprecated: use Rcp
 // TODO(b/147516027): Remove when GLES frontend is removed
@@ -2793,6 +2807,265 @@ static inline RValue<Float8> Log(RValue<Float8> x) { return Log<Float8>(x); }
 static inline RValue<Float8> Exp2(RValue<Float8> x) { return Exp2<Float8>(x); }
 static inline RValue<Float8> Log2(RValue<Float8> x) { return Log2<Float8>(x); }
 
+// 16-wide vectors (one AVX-512 register of 32-bit lanes). Only the subset of operations
+// needed by lexpr is provided.
+class UShort16 : public LValue<UShort16>
+{
+public:
+	explicit UShort16(RValue<Int16> cast);
+
+	UShort16() = default;
+	UShort16(RValue<UShort16> rhs);
+	UShort16(const UShort16 &rhs);
+	UShort16(const Reference<UShort16> &rhs);
+
+	RValue<UShort16> operator=(RValue<UShort16> rhs);
+	RValue<UShort16> operator=(const UShort16 &rhs);
+	RValue<UShort16> operator=(const Reference<UShort16> &rhs);
+
+	static Type *type();
+};
+
+class Int16 : public LValue<Int16>
+{
+public:
+	explicit Int16(RValue<Byte16> cast);
+	explicit Int16(RValue<UShort16> cast);
+	explicit Int16(RValue<Float16> cast);
+
+	Int16();
+	Int16(int c);
+
+	Int16(const Int &rhs);
+	Int16(const Int16 &rhs);
+	Int16(RValue<Int>);
+	Int16(RValue<Int16>);
+	Int16(const Reference<Int> &rhs);
+	Int16(const Reference<Int16> &rhs);
+
+	RValue<Int16> operator=(RValue<Int16> rhs);
+	RValue<Int16> operator=(const Int16 &rhs);
+	RValue<Int16> operator=(const Reference<Int16> &rhs);
+
+	static Type *type();
+};
+
+RValue<Int16> operator+(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator-(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator*(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator/(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator%(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator&(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator|(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator^(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator<<(RValue<Int16> lhs, unsigned char rhs);
+RValue<Int16> operator>>(RValue<Int16> lhs, unsigned char rhs);
+RValue<Int16> operator<<(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator>>(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator+(RValue<Int16> val);
+RValue<Int16> operator-(RValue<Int16> val);
+RValue<Int16> operator~(RValue<Int16> val);
+
+RValue<Int16> CmpEQ(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpLT(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpLE(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpNEQ(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpNLT(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpNLE(RValue<Int16> x, RValue<Int16> y);
+inline RValue<Int16> CmpGT(RValue<Int16> x, RValue<Int16> y)
+{
+	return CmpNLE(x, y);
+}
+inline RValue<Int16> CmpGE(RValue<Int16> x, RValue<Int16> y)
+{
+	return CmpNLT(x, y);
+}
+
+RValue<Int> Extract(RValue<Int16> val, int i);
+RValue<Int16> Insert(RValue<Int16> val, RValue<Int> element, int i);
+
+RValue<Int16> Max(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> Min(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> RoundInt(RValue<Float16> cast);
+RValue<Int16> Abs(RValue<Int16> x);
+
+RValue<Int16> Swizzle(RValue<Int16> x, uint64_t select);
+
+class Float16 : public LValue<Float16>
+{
+public:
+	explicit Float16(RValue<Int16> cast);
+
+	Float16();
+	Float16(float x);
+	Float16(RValue<Float16> rhs);
+	Float16(const Float16 &rhs);
+	Float16(const Reference<Float16> &rhs);
+	Float16(RValue<Float> rhs);
+	Float16(const Float &rhs);
+	Float16(const Reference<Float> &rhs);
+	Float16(Argument<Float16> argument);
+
+	RValue<Float16> operator=(float replicate);
+	RValue<Float16> operator=(RValue<Float16> rhs);
+	RValue<Float16> operator=(const Float16 &rhs);
+	RValue<Float16> operator=(const Reference<Float16> &rhs);
+	RValue<Float16> operator=(RValue<Float> rhs);
+	RValue<Float16> operator=(const Float &rhs);
+	RValue<Float16> operator=(const Reference<Float> &rhs);
+
+	static Type *type();
+};
+
+RValue<Float16> operator+(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator-(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator*(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator/(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator%(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator+(RValue<Float16> val);
+RValue<Float16> operator-(RValue<Float16> val);
+
+RValue<Float16> Abs(RValue<Float16> x);
+RValue<Float16> Max(RValue<Float16> x, RValue<Float16> y);
+RValue<Float16> Min(RValue<Float16> x, RValue<Float16> y);
+static inline RValue<Float16> FMA(RValue<Float16> a, RValue<Float16> b, RValue<Float16> c) { return FMA<Float16>(a, b, c); }
+static inline RValue<Float16> FMulAdd(RValue<Float16> a, RValue<Float16> b, RValue<Float16> c) { return FMulAdd<Float16>(a, b, c); }
+RValue<Float16> Sqrt(RValue<Float16> x);
+RValue<Float16> Insert(RValue<Float16> val, RValue<Float> element, int i);
+RValue<Float> Extract(RValue<Float16> x, int i);
+RValue<Float16> Swizzle(RValue<Float16> x, uint64_t select);
+
+RValue<Int16> CmpEQ(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpLT(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpLE(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpNEQ(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpNLT(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpNLE(RValue<Float16> x, RValue<Float16> y);
+inline RValue<Int16> CmpGT(RValue<Float16> x, RValue<Float16> y)
+{
+	return CmpNLE(x, y);
+}
+inline RValue<Int16> CmpGE(RValue<Float16> x, RValue<Float16> y)
+{
+	return CmpNLT(x, y);
+}
+
+RValue<Float16> Round(RValue<Float16> x);
+RValue<Float16> Trunc(RValue<Float16> x);
+RValue<Float16> Floor(RValue<Float16> x);
+
+static inline RValue<Float16> BuiltinPow(RValue<Float16> x, RValue<Float16> y) { return BuiltinPow<Float16>(x, y); }
+
+// Vectors of 16-bit integers filling an AVX (Short16) or AVX-512 (Short32) register, as
+// used by lexpr for expressions whose values all fit in 16 bits. Only the subset of
+// operations it needs is provided.
+class Short16 : public LValue<Short16>
+{
+public:
+	explicit Short16(RValue<Byte16> cast);
+
+	Short16() = default;
+	Short16(short c);
+	Short16(RValue<Short16> rhs);
+	Short16(const Short16 &rhs);
+	Short16(const Reference<Short16> &rhs);
+
+	RValue<Short16> operator=(RValue<Short16> rhs);
+	RValue<Short16> operator=(const Short16 &rhs);
+	RValue<Short16> operator=(const Reference<Short16> &rhs);
+
+	static Type *type();
+};
+
+RValue<Short16> operator+(RValue<Short16> lhs, RValue<Short16> rhs);
+RValue<Short16> operator-(RValue<Short16> lhs, RValue<Short16> rhs);
+RValue<Short16> operator*(RValue<Short16> lhs, RValue<Short16> rhs);
+RValue<Short16> operator&(RValue<Short16> lhs, RValue<Short16> rhs);
+RValue<Short16> operator|(RValue<Short16> lhs, RValue<Short16> rhs);
+RValue<Short16> operator^(RValue<Short16> lhs, RValue<Short16> rhs);
+RValue<Short16> operator~(RValue<Short16> val);
+
+RValue<Short16> CmpEQ(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> CmpLT(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> CmpLE(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> CmpNEQ(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> CmpNLT(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> CmpNLE(RValue<Short16> x, RValue<Short16> y);
+inline RValue<Short16> CmpGT(RValue<Short16> x, RValue<Short16> y)
+{
+	return CmpNLE(x, y);
+}
+inline RValue<Short16> CmpGE(RValue<Short16> x, RValue<Short16> y)
+{
+	return CmpNLT(x, y);
+}
+
+RValue<Short16> Max(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> Min(RValue<Short16> x, RValue<Short16> y);
+RValue<Short16> Abs(RValue<Short16> x);
+
+class Short32 : public LValue<Short32>
+{
+public:
+	explicit Short32(RValue<Byte32> cast);
+
+	Short32() = default;
+	Short32(short c);
+	Short32(RValue<Short32> rhs);
+	Short32(const Short32 &rhs);
+	Short32(const Reference<Short32> &rhs);
+
+	RValue<Short32> operator=(RValue<Short32> rhs);
+	RValue<Short32> operator=(const Short32 &rhs);
+	RValue<Short32> operator=(const Reference<Short32> &rhs);
+
+	static Type *type();
+};
+
+RValue<Short32> operator+(RValue<Short32> lhs, RValue<Short32> rhs);
+RValue<Short32> operator-(RValue<Short32> lhs, RValue<Short32> rhs);
+RValue<Short32> operator*(RValue<Short32> lhs, RValue<Short32> rhs);
+RValue<Short32> operator&(RValue<Short32> lhs, RValue<Short32> rhs);
+RValue<Short32> operator|(RValue<Short32> lhs, RValue<Short32> rhs);
+RValue<Short32> operator^(RValue<Short32> lhs, RValue<Short32> rhs);
+RValue<Short32> operator~(RValue<Short32> val);
+
+RValue<Short32> CmpEQ(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> CmpLT(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> CmpLE(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> CmpNEQ(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> CmpNLT(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> CmpNLE(RValue<Short32> x, RValue<Short32> y);
+inline RValue<Short32> CmpGT(RValue<Short32> x, RValue<Short32> y)
+{
+	return CmpNLE(x, y);
+}
+inline RValue<Short32> CmpGE(RValue<Short32> x, RValue<Short32> y)
+{
+	return CmpNLT(x, y);
+}
+
+RValue<Short32> Max(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> Min(RValue<Short32> x, RValue<Short32> y);
+RValue<Short32> Abs(RValue<Short32> x);
+
+class Byte32 : public LValue<Byte32>
+{
+public:
+	explicit Byte32(RValue<Short32> cast);
+
+	Byte32() = default;
+	Byte32(RValue<Byte32> rhs);
+	Byte32(const Byte32 &rhs);
+	Byte32(const Reference<Byte32> &rhs);
+
+	RValue<Byte32> operator=(RValue<Byte32> rhs);
+	RValue<Byte32> operator=(const Byte32 &rhs);
+	RValue<Byte32> operator=(const Reference<Byte32> &rhs);
+
+	static Type *type();
+};
+
 // Bit Manipulation functions.
 // TODO: Currently unimplemented for Subzero.
 
@@ -2897,6 +3170,35 @@ RValue<Float4> MaskedLoad(RValue<Pointer<Float4>> base, RValue<Int4> mask, unsig
 RValue<Int4> MaskedLoad(RValue<Pointer<Int4>> base, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 void MaskedStore(RValue<Pointer<Float4>> base, RValue<Float4> val, RValue<Int4> mask, unsigned int alignment);
 void MaskedStore(RValue<Pointer<Int4>> base, RValue<Int4> val, RValue<Int4> mask, unsigned int alignment);
+RValue<Float8> MaskedLoad(RValue<Pointer<Float8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Int8> MaskedLoad(RValue<Pointer<Int8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+void MaskedStore(RValue<Pointer<Float8>> base, RValue<Float8> val, RValue<Int8> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<Int8>> base, RValue<Int8> val, RValue<Int8> mask, unsigned int alignment);
+RValue<Float16> MaskedLoad(RValue<Pointer<Float16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Int16> MaskedLoad(RValue<Pointer<Int16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+void MaskedStore(RValue<Pointer<Float16>> base, RValue<Float16> val, RValue<Int16> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<Int16>> base, RValue<Int16> val, RValue<Int16> mask, unsigned int alignment);
+RValue<Byte4> MaskedLoad(RValue<Pointer<Byte4>> base, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Byte8> MaskedLoad(RValue<Pointer<Byte8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Byte16> MaskedLoad(RValue<Pointer<Byte16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<UShort4> MaskedLoad(RValue<Pointer<UShort4>> base, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<UShort8> MaskedLoad(RValue<Pointer<UShort8>> base, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<UShort16> MaskedLoad(RValue<Pointer<UShort16>> base, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+void MaskedStore(RValue<Pointer<Byte4>> base, RValue<Byte4> val, RValue<Int4> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<Byte8>> base, RValue<Byte8> val, RValue<Int8> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<Byte16>> base, RValue<Byte16> val, RValue<Int16> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<UShort4>> base, RValue<UShort4> val, RValue<Int4> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<UShort8>> base, RValue<UShort8> val, RValue<Int8> mask, unsigned int alignment);
+void MaskedStore(RValue<Pointer<UShort16>> base, RValue<UShort16> val, RValue<Int16> mask, unsigned int alignment);
+
+// Conversions between floats and IEEE half precision values stored in 16-bit integers.
+// Float to half conversions round to nearest even.
+RValue<Float4> HalfToFloat(RValue<UShort4> x);
+RValue<Float8> HalfToFloat(RValue<UShort8> x);
+RValue<Float16> HalfToFloat(RValue<UShort16> x);
+RValue<UShort4> FloatToHalf(RValue<Float4> x);
+RValue<UShort8> FloatToHalf(RValue<Float8> x);
+RValue<UShort16> FloatToHalf(RValue<Float16> x);
 
 RValue<Float4> Gather(RValue<Pointer<Float>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 RValue<Float8> Gather(RValue<Pointer<Float>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
@@ -2906,6 +3208,10 @@ RValue<UShort4> Gather(RValue<Pointer<UShort>> base, RValue<Int4> offsets, RValu
 RValue<UShort8> Gather(RValue<Pointer<UShort>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 RValue<Int4> Gather(RValue<Pointer<Int>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 RValue<Int8> Gather(RValue<Pointer<Int>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Float16> Gather(RValue<Pointer<Float>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Byte16> Gather(RValue<Pointer<Byte>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<UShort16> Gather(RValue<Pointer<UShort>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Int16> Gather(RValue<Pointer<Int>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 void Scatter(RValue<Pointer<Float>> base, RValue<Float4> val, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment);
 void Scatter(RValue<Pointer<Int>> base, RValue<Int4> val, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment);
 
@@ -15,6 +15,7 @@
 #ifndef rr_Routine_hpp
 #define rr_Routine_hpp
 
+#include <cstddef>
 #include <memory>
 
 namespace rr {
@@ -26,6 +27,9 @@ public:
 	virtual ~Routine() = default;
 
 	virtual const void *getEntry(int index = 0) const = 0;
+
+	// Bytes of memory pages held by the routine, if known.
+	virtual size_t getMemoryUsage() const { return 0; }
 };
 
 // RoutineT is a type-safe wrapper around a Routine and its function entry, returned by FunctionT
@@ -36,6 +36,7 @@ class Half;
 class Float;
 class Float4;
 class Float8;
+class Float16;
 
 template<class T>
 class Pointer;
@@ -312,6 +313,11 @@ struct CanBeUsedAsReturn<Float8>
 {
 	static constexpr bool value = true;
 };
+template<>
+struct CanBeUsedAsReturn<Float16>
+{
+	static constexpr bool value = true;
+};
 template<typename T>
 struct CanBeUsedAsReturn<Pointer<T>>
 {
@@ -349,6 +355,11 @@ struct CanBeUsedAsParameter<Float8>
 {
 	static constexpr bool value = true;
 };
+template<>
+struct CanBeUsedAsParameter<Float16>
+{
+	static constexpr bool value = true;
+};
 template<typename T>
 struct CanBeUsedAsParameter<Pointer<T>>
 {
@@ -0,0 +1,213 @@
+/*
+* Copyright (c) 2021-     Akarin
+*
+* lexpr is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 3 of the License, or (at your option) any later version.
+*
+* lexpr is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with lexpr; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef LEXPR_THREADPOOL_HPP
+#define LEXPR_THREADPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numa.hpp"
+
+namespace lexpr {
+
+// A process wide pool of worker threads used to split a single frame.
+//
+// Every parallelFor() call is an independent job: the items are divided evenly between the
+// participating threads (the caller included), and a thread that runs out of items steals
+// half of the remaining ones from another participant. submit() queues a job of a single
+// item for the workers alone. Workers are only ever added, and never joined, as they may
+// still be blocked when the plugin is unloaded at exit.
+//
+// On a NUMA machine, parallelFor() can be restricted to workers pinned to the node of the
+// calling thread, so that the stripes of a frame run next to the memory the caller works on.
+// Each node has its own queue and workers, and the unpinned workers have another one.
+class ThreadPool {
+    struct Job {
+        std::function<void(int)> fn;
+        // [begin, end) of the items owned by each participant, packed as begin << 32 | end.
+        std::unique_ptr<std::atomic<uint64_t>[]> ranges;
+        int participants;
+        std::atomic<int> nextSlot { 0 };
+        std::atomic<int> remaining;
+        std::mutex lock;
+        std::condition_variable finished;
+
+        static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t)begin << 32 | end; }
+
+        Job(int n, int participants, const std::function<void(int)> &fn) :
+            fn(fn), ranges(new std::atomic<uint64_t>[participants]), participants(participants), remaining(n) {
+            for (int i = 0; i < participants; i++)
+                ranges[i] = pack((uint32_t)((int64_t)n * i / participants), (uint32_t)((int64_t)n * (i + 1) / participants));
+        }
+
+        bool pop(int slot, int &item) {
+            uint64_t r = ranges[slot].load();
+            for (;;) {
+                uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+                if (begin >= end)
+                    return false;
+                if (ranges[slot].compare_exchange_weak(r, pack(begin + 1, end))) {
+                    item = begin;
+                    return true;
+                }
+            }
+        }
+
+        // Move the back half of some other participant's items to our (empty) range.
+        bool steal(int slot) {
+            for (int i = 1; i < participants; i++) {
+                int victim = (slot + i) % participants;
+                uint64_t r = ranges[victim].load();
+                for (;;) {
+                    uint32_t begin = (uint32_t)(r >> 32), end = (uint32_t)r;
+                    if (begin >= end)
+                        break;
+                    uint32_t mid = end - (end - begin + 1) / 2;
+                    if (ranges[victim].compare_exchange_weak(r, pack(begin, mid))) {
+                        ranges[slot] = pack(mid, end);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void run() {
+            int slot = nextSlot++;
+            if (slot >= participants)
+                return;
+            int item;
+            do {
+                while (pop(slot, item)) {
+                    fn(item);
+                    if (--remaining == 0) {
+                        std::lock_guard<std::mutex> guard(lock);
+                        finished.notify_all();
+                    }
+                }
+            } while (steal(slot));
+        }
+    };
+
+    struct Queue {
+        std::condition_variable wakeup;
+        std::deque<std::shared_ptr<Job>> jobs;
+        int numWorkers = 0;
+    };
+
+    std::mutex lock;
+    // The queue of the unpinned workers, followed by those of the workers of each node.
+    std::vector<Queue> queues;
+    int numSubmitted = 0; // submitted jobs that haven't finished yet
+    std::condition_variable submittedDone;
+
+    ThreadPool() : queues(1 + NumaTopology::instance().nodes()) {}
+
+    void worker(int q) {
+        if (q > 0)
+            NumaTopology::instance().bind(q - 1);
+        Queue &queue = queues[q];
+        for (;;) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                queue.wakeup.wait(guard, [&queue] { return !queue.jobs.empty(); });
+                job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+            }
+            job->run();
+        }
+    }
+
+public:
+    static ThreadPool &instance() {
+        static ThreadPool *pool = new ThreadPool();
+        return *pool;
+    }
+
+    // Call fn(i) for 0 <= i < n, using up to threads threads including the calling one.
+    // With numa, the other threads are pinned to the node the calling thread is running on.
+    // Returns once all calls have completed.
+    void parallelFor(int n, int threads, const std::function<void(int)> &fn, bool numa = false) {
+        if (threads > n)
+            threads = n;
+        if (threads <= 1) {
+            for (int i = 0; i < n; i++)
+                fn(i);
+            return;
+        }
+
+        const NumaTopology &topology = NumaTopology::instance();
+        const int q = numa && topology.nodes() > 1 ? 1 + topology.currentNode() : 0;
+        Queue &queue = queues[q];
+        auto job = std::make_shared<Job>(n, threads, fn);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (; queue.numWorkers < threads - 1; queue.numWorkers++)
+                std::thread(&ThreadPool::worker, this, q).detach();
+            for (int i = 0; i < threads - 1; i++)
+                queue.jobs.push_back(job);
+        }
+        queue.wakeup.notify_all();
+
+        job->run();
+        std::unique_lock<std::mutex> guard(job->lock);
+        job->finished.wait(guard, [&job] { return job->remaining == 0; });
+    }
+
+    // Call fn() on an unpinned worker thread and return immediately. Up to one worker per
+    // hardware thread is started for the submitted jobs, so that they run in parallel.
+    void submit(const std::function<void()> &fn) {
+        auto job = std::make_shared<Job>(1, 1, [this, fn](int) {
+            fn();
+            std::lock_guard<std::mutex> guard(lock);
+            if (--numSubmitted == 0)
+                submittedDone.notify_all();
+        });
+        Queue &queue = queues[0];
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (queue.numWorkers < (int)std::max(1u, std::thread::hardware_concurrency())) {
+                std::thread(&ThreadPool::worker, this, 0).detach();
+                queue.numWorkers++;
+            }
+            queue.jobs.push_back(job);
+            numSubmitted++;
+        }
+        queue.wakeup.notify_one();
+    }
+
+    // Wait for all submitted jobs to finish.
+    void waitSubmitted() {
+        std::unique_lock<std::mutex> guard(lock);
+        submittedDone.wait(guard, [this] { return numSubmitted == 0; });
+    }
+};
+
+} // namespace lexpr
+
+#endif // LEXPR_THREADPOOL_HPP
@@ -19,6 +19,8 @@ typedef struct CUfunc_st *CUfunction; /**< CUDA function */
 typedef struct CUstream_st *CUstream; /**< CUDA stream */
 typedef struct CUevent_st *CUevent;   /**< CUDA event */
 typedef struct CUarray_st *CUarray;
+typedef struct CUgraph_st *CUgraph;         /**< CUDA graph */
+typedef struct CUgraphExec_st *CUgraphExec; /**< CUDA executable graph */
 
 typedef enum {
     CUDA_SUCCESS = 0,
@@ -181,6 +183,10 @@ typedef enum CUmemorytype_enum {
 
 // cuMemHostAlloc flags
 #define CU_MEMHOSTALLOC_WRITECOMBINED 0x04
+// cuStreamCreate flags
+#define CU_STREAM_NON_BLOCKING 0x1
+// cuEventCreate flags
+#define CU_EVENT_DISABLE_TIMING 0x2
 
 typedef struct CUDA_MEMCPY3D_st {
     size_t srcXInBytes;         /**< Source X in bytes */
@@ -239,6 +245,12 @@ typedef struct CUDA_MEMCPY2D_st {
 } CUDA_MEMCPY2D_v2;
 typedef CUDA_MEMCPY2D_v2 CUDA_MEMCPY2D;
 
+typedef enum CUstreamCaptureMode_enum {
+    CU_STREAM_CAPTURE_MODE_GLOBAL = 0,
+    CU_STREAM_CAPTURE_MODE_THREAD_LOCAL = 1,
+    CU_STREAM_CAPTURE_MODE_RELAXED = 2
+} CUstreamCaptureMode;
+
 typedef int CUjit_option;
 
 #ifndef CUDA_FN
@@ -270,10 +282,13 @@ CUDA_FN(CUresult, cuCtxPopCurrent, (CUcontext * pctx));
 CUDA_FN(CUresult, cuProfilerStop, ());
 CUDA_FN(CUresult, cuCtxGetApiVersion, (CUcontext ctx, unsigned int *version));
 CUDA_FN(CUresult, cuCtxGetDevice, (CUdevice *));
+CUDA_FN(CUresult, cuDevicePrimaryCtxRetain, (CUcontext *pctx, CUdevice dev));
+CUDA_FN(CUresult, cuDevicePrimaryCtxRelease, (CUdevice dev));
 CUDA_FN(CUresult, cuModuleLoadData, (CUmodule * module, const void *image));
 CUDA_FN(CUresult, cuModuleLoadDataEx, (CUmodule * module, const void *image, unsigned int numOptions, CUjit_option *options, void **optionValues));
 CUDA_FN(CUresult, cuModuleUnload, (CUmodule module));
 CUDA_FN(CUresult, cuModuleGetFunction, (CUfunction * hfunc, CUmodule hmod, const char *name));
+CUDA_FN(CUresult, cuLaunchKernel, (CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ, unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ, unsigned int sharedMemBytes, CUstream hStream, void **kernelParams, void **extra));
 CUDA_FN_3020(CUresult, cuMemAlloc, cuMemAlloc_v2, (CUdeviceptr * dptr, size_t bytesize));
 CUDA_FN_3020(CUresult, cuMemFree, cuMemFree_v2, (CUdeviceptr dptr));
 CUDA_FN(CUresult, cuMemHostAlloc, (void** pp, size_t bytesize, unsigned int flags));
@@ -281,12 +296,30 @@ CUDA_FN(CUresult, cuMemFreeHost, (void* p));
 CUDA_FN_3020(CUresult, cuMemcpyHtoD, cuMemcpyHtoD_v2, (CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount));
 CUDA_FN_3020(CUresult, cuMemcpyDtoH, cuMemcpyDtoH_v2, (void *dstHost, CUdeviceptr srcDevice, size_t ByteCount));
 CUDA_FN_3020(CUresult, cuMemcpyDtoD, cuMemcpyDtoD_v2, (CUdeviceptr dstHost, CUdeviceptr srcDevice, size_t ByteCount));
+CUDA_FN_3020(CUresult, cuMemcpyHtoDAsync, cuMemcpyHtoDAsync_v2, (CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount, CUstream hStream));
+CUDA_FN_3020(CUresult, cuMemcpyDtoHAsync, cuMemcpyDtoHAsync_v2, (void *dstHost, CUdeviceptr srcDevice, size_t ByteCount, CUstream hStream));
 CUDA_FN(CUresult, cuMemcpy2DAsync_v2, (const CUDA_MEMCPY2D* pCopy, CUstream hStream));
 
+CUDA_FN(CUresult, cuStreamCreate, (CUstream *phStream, unsigned int Flags));
+CUDA_FN_4000(CUresult, cuStreamDestroy, cuStreamDestroy_v2, (CUstream hStream));
 CUDA_FN(CUresult, cuStreamSynchronize, (CUstream hStream));
+CUDA_FN(CUresult, cuStreamWaitEvent, (CUstream hStream, CUevent hEvent, unsigned int Flags));
+
+CUDA_FN(CUresult, cuEventCreate, (CUevent *phEvent, unsigned int Flags));
+CUDA_FN_4000(CUresult, cuEventDestroy, cuEventDestroy_v2, (CUevent hEvent));
+CUDA_FN(CUresult, cuEventRecord, (CUevent hEvent, CUstream hStream));
+CUDA_FN(CUresult, cuEventSynchronize, (CUevent hEvent));
 
 CUDA_FN(CUresult, cuMemsetD8Async, (CUdeviceptr devPtr, int value, size_t count, CUstream st));
 
+// Graphs (CUDA 11.4 drivers), which are only declared where CUDA_FN_OPTIONAL is defined.
+CUDA_FN_OPTIONAL(CUresult, cuStreamBeginCapture_v2, (CUstream hStream, CUstreamCaptureMode mode));
+CUDA_FN_OPTIONAL(CUresult, cuStreamEndCapture, (CUstream hStream, CUgraph *phGraph));
+CUDA_FN_OPTIONAL(CUresult, cuGraphInstantiateWithFlags, (CUgraphExec *phGraphExec, CUgraph hGraph, unsigned long long flags));
+CUDA_FN_OPTIONAL(CUresult, cuGraphLaunch, (CUgraphExec hGraphExec, CUstream hStream));
+CUDA_FN_OPTIONAL(CUresult, cuGraphExecDestroy, (CUgraphExec hGraphExec));
+CUDA_FN_OPTIONAL(CUresult, cuGraphDestroy, (CUgraph hGraph));
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <utility>
@@ -57,18 +62,307 @@ static const wchar_t *dllPath(const wchar_t *suffix) {
 }
 #endif
 
+using StatsClock = std::chrono::steady_clock;
+
+static double secondsSince(StatsClock::time_point start) {
+    return std::chrono::duration<double>(StatsClock::now() - start).count();
+}
+
 static void *cudaMalloc(size_t size) {
     void *ptr = nullptr;
     CK_CUDA(cuMemAlloc_v2(&ptr, size));
     return ptr;
 }
 
+// Conversions between the planar float frames, uploaded and downloaded as they are, and
+// the interleaved RGB32F images of the feature (or tiles of the frames), with the samples
+// multiplied by scale, as PTX that the driver compiles when the module is loaded. The
+// planes are pitch bytes apart per row and plane bytes apart from each other.
+// ngx_blend adds the output of a tile into the planes instead, weighted by the ramps of
+// its seams.
+static const char ngxPtx[] = R"(
+.version 6.3
+.target sm_75
+.address_size 64
+
+.entry ngx_interleave(
+    .param .u64 planar, .param .u64 plane, .param .u32 pitch,
+    .param .u64 packed, .param .u32 width, .param .u32 height, .param .f32 scale)
+{
+    .reg .pred p;
+    .reg .u32 x, y, w, h, t, tmp;
+    .reg .u64 src, dst, step, off;
+    .reg .f32 k, v;
+
+    mov.u32 x, %ctaid.x;
+    mov.u32 tmp, %ntid.x;
+    mov.u32 t, %tid.x;
+    mad.lo.u32 x, x, tmp, t;
+    mov.u32 y, %ctaid.y;
+    mov.u32 tmp, %ntid.y;
+    mov.u32 t, %tid.y;
+    mad.lo.u32 y, y, tmp, t;
+    ld.param.u32 w, [width];
+    ld.param.u32 h, [height];
+    setp.ge.u32 p, x, w;
+    @p exit;
+    setp.ge.u32 p, y, h;
+    @p exit;
+
+    ld.param.u64 src, [planar];
+    ld.param.u64 step, [plane];
+    ld.param.u32 tmp, [pitch];
+    mul.wide.u32 off, y, tmp;
+    add.u64 src, src, off;
+    mul.wide.u32 off, x, 4;
+    add.u64 src, src, off;
+    ld.param.u64 dst, [packed];
+    mad.lo.u32 t, y, w, x;
+    mul.wide.u32 off, t, 12;
+    add.u64 dst, dst, off;
+    ld.param.f32 k, [scale];
+
+    ld.global.f32 v, [src];
+    mul.f32 v, v, k;
+    st.global.f32 [dst], v;
+    add.u64 src, src, step;
+    ld.global.f32 v, [src];
+    mul.f32 v, v, k;
+    st.global.f32 [dst+4], v;
+    add.u64 src, src, step;
+    ld.global.f32 v, [src];
+    mul.f32 v, v, k;
+    st.global.f32 [dst+8], v;
+    exit;
+}
+
+.entry ngx_deinterleave(
+    .param .u64 planar, .param .u64 plane, .param .u32 pitch,
+    .param .u64 packed, .param .u32 width, .param .u32 height, .param .f32 scale)
+{
+    .reg .pred p;
+    .reg .u32 x, y, w, h, t, tmp;
+    .reg .u64 src, dst, step, off;
+    .reg .f32 k, v;
+
+    mov.u32 x, %ctaid.x;
+    mov.u32 tmp, %ntid.x;
+    mov.u32 t, %tid.x;
+    mad.lo.u32 x, x, tmp, t;
+    mov.u32 y, %ctaid.y;
+    mov.u32 tmp, %ntid.y;
+    mov.u32 t, %tid.y;
+    mad.lo.u32 y, y, tmp, t;
+    ld.param.u32 w, [width];
+    ld.param.u32 h, [height];
+    setp.ge.u32 p, x, w;
+    @p exit;
+    setp.ge.u32 p, y, h;
+    @p exit;
+
+    ld.param.u64 dst, [planar];
+    ld.param.u64 step, [plane];
+    ld.param.u32 tmp, [pitch];
+    mul.wide.u32 off, y, tmp;
+    add.u64 dst, dst, off;
+    mul.wide.u32 off, x, 4;
+    add.u64 dst, dst, off;
+    ld.param.u64 src, [packed];
+    mad.lo.u32 t, y, w, x;
+    mul.wide.u32 off, t, 12;
+    add.u64 src, src, off;
+    ld.param.f32 k, [scale];
+
+    ld.global.f32 v, [src];
+    mul.f32 v, v, k;
+    st.global.f32 [dst], v;
+    add.u64 dst, dst, step;
+    ld.global.f32 v, [src+4];
+    mul.f32 v, v, k;
+    st.global.f32 [dst], v;
+    add.u64 dst, dst, step;
+    ld.global.f32 v, [src+8];
+    mul.f32 v, v, k;
+    st.global.f32 [dst], v;
+    exit;
+}
+
+.entry ngx_blend(
+    .param .u64 planar, .param .u64 plane, .param .u32 pitch,
+    .param .u64 packed, .param .u32 width, .param .u32 height, .param .f32 scale,
+    .param .align 4 .b8 seams[32])
+{
+    .reg .pred p;
+    .reg .u32 x, y, w, h, t, tmp;
+    .reg .u64 src, dst, step, off;
+    .reg .f32 k, v, acc, fx, fy, wx, wy, s0, s1, s2, s3;
+
+    mov.u32 x, %ctaid.x;
+    mov.u32 tmp, %ntid.x;
+    mov.u32 t, %tid.x;
+    mad.lo.u32 x, x, tmp, t;
+    mov.u32 y, %ctaid.y;
+    mov.u32 tmp, %ntid.y;
+    mov.u32 t, %tid.y;
+    mad.lo.u32 y, y, tmp, t;
+    ld.param.u32 w, [width];
+    ld.param.u32 h, [height];
+    setp.ge.u32 p, x, w;
+    @p exit;
+    setp.ge.u32 p, y, h;
+    @p exit;
+
+    // The weight of the pixel center ramps up from 0 to 1 over [s0, s0 + 1 / s1) and
+    // down over [s2 - 1 / s3, s2), horizontally and then vertically.
+    cvt.rn.f32.u32 fx, x;
+    add.f32 fx, fx, 0f3F000000;
+    cvt.rn.f32.u32 fy, y;
+    add.f32 fy, fy, 0f3F000000;
+    ld.param.f32 s0, [seams+0];
+    ld.param.f32 s1, [seams+4];
+    ld.param.f32 s2, [seams+8];
+    ld.param.f32 s3, [seams+12];
+    sub.f32 v, fx, s0;
+    mul.sat.f32 wx, v, s1;
+    sub.f32 v, s2, fx;
+    mul.sat.f32 v, v, s3;
+    mul.f32 wx, wx, v;
+    ld.param.f32 s0, [seams+16];
+    ld.param.f32 s1, [seams+20];
+    ld.param.f32 s2, [seams+24];
+    ld.param.f32 s3, [seams+28];
+    sub.f32 v, fy, s0;
+    mul.sat.f32 wy, v, s1;
+    sub.f32 v, s2, fy;
+    mul.sat.f32 v, v, s3;
+    mul.f32 wy, wy, v;
+    ld.param.f32 k, [scale];
+    mul.f32 k, k, wx;
+    mul.f32 k, k, wy;
+
+    ld.param.u64 dst, [planar];
+    ld.param.u64 step, [plane];
+    ld.param.u32 tmp, [pitch];
+    mul.wide.u32 off, y, tmp;
+    add.u64 dst, dst, off;
+    mul.wide.u32 off, x, 4;
+    add.u64 dst, dst, off;
+    ld.param.u64 src, [packed];
+    mad.lo.u32 t, y, w, x;
+    mul.wide.u32 off, t, 12;
+    add.u64 src, src, off;
+
+    ld.global.f32 v, [src];
+    ld.global.f32 acc, [dst];
+    fma.rn.f32 acc, v, k, acc;
+    st.global.f32 [dst], acc;
+    add.u64 dst, dst, step;
+    ld.global.f32 v, [src+4];
+    ld.global.f32 acc, [dst];
+    fma.rn.f32 acc, v, k, acc;
+    st.global.f32 [dst], acc;
+    add.u64 dst, dst, step;
+    ld.global.f32 v, [src+8];
+    ld.global.f32 acc, [dst];
+    fma.rn.f32 acc, v, k, acc;
+    st.global.f32 [dst], acc;
+    exit;
+}
+)";
+
+// Converts between the planes at planar and the interleaved image at packed with kernel,
+// or blends the latter into the former with the ramps of seams (which the other kernels
+// ignore).
+static void ngxConvert(CUfunction kernel, CUdeviceptr planar, uint64_t plane, uint32_t pitch, CUdeviceptr packed, uint32_t width, uint32_t height, float scale, CUstream stream, const float *seams = nullptr) {
+    float ramps[8] = {};
+    if (seams)
+        std::copy(seams, seams + 8, ramps);
+    void *params[] = { &planar, &plane, &pitch, &packed, &width, &height, &scale, ramps };
+    CK_CUDA(cuLaunchKernel(kernel, (width + 31) / 32, (height + 7) / 8, 1, 32, 8, 1, 0, stream, params, nullptr));
+}
+
+// The tiles along an axis of length n, of size min(tile, n) (or n if tile is 0), spread
+// evenly so that each overlaps the next by at least overlap. Neighbors are blended over a
+// seam in the middle of their overlap, of width overlap unless they are closer.
+struct NgxTiles {
+    int size = 0;
+    double seam = 0;
+    std::vector<int> pos;
+
+    NgxTiles() {}
+    NgxTiles(int n, int tile, int overlap) {
+        size = tile > 0 ? std::min(tile, n) : n;
+        const int count = size < n ? (n - overlap + (size - overlap) - 1) / (size - overlap) : 1;
+        for (int i = 0; i < count; i++)
+            pos.push_back(count > 1 ? int((int64_t)i * (n - size) / (count - 1)) : 0);
+        seam = overlap;
+        for (size_t i = 1; i < pos.size(); i++)
+            seam = std::min<double>(seam, pos[i] - pos[i - 1]);
+    }
+
+    // The weights of the output of tile i, scaled by scale, ramp up over
+    // [r[0], r[0] + 1 / r[1]) and down over [r[2] - 1 / r[3], r[2]) from its origin, so
+    // that those of neighbors add up to 1.
+    void ramps(size_t i, int scale, float r[4]) const {
+        r[0] = -1e30f, r[1] = 1, r[2] = 1e30f, r[3] = 1;
+        if (i > 0) {
+            const double center = (pos[i - 1] + size + pos[i]) / 2.0;
+            r[0] = float((center - seam / 2 - pos[i]) * scale);
+            r[1] = float(1 / (seam * scale));
+        }
+        if (i + 1 < pos.size()) {
+            const double center = (pos[i] + size + pos[i + 1]) / 2.0;
+            r[2] = float((center + seam / 2 - pos[i]) * scale);
+            r[3] = float(1 / (seam * scale));
+        }
+    }
+};
+
+// The process-wide state of all instances (of all DLISR filters). NGX is initialized
+// once, and the features of each device run on its primary context, which other CUDA
+// filters (e.g. DLVFX) share, rather than on contexts of their own.
+struct NgxGlobal {
+    std::mutex lock;
+    bool inited = false;
+
+    // The primary context of dev, released with cuDevicePrimaryCtxRelease().
+    CUcontext acquire(CUdevice dev) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!inited) {
+            CUcontext ctx;
+            bool hasCtx = cuCtxGetCurrent(&ctx) == CUDA_SUCCESS && ctx;
+            CK_NGX(NVSDK_NGX_CUDA_Init(0, L"./", NVSDK_NGX_Version_API));
+            // We don't expect NVSDK_NGX_CUDA_Init to create a context, but if it did, we need to
+            // switch to save a global CUDA context, instead of the pre-filter context.
+            if (!hasCtx && cuCtxGetCurrent(&ctx) == CUDA_SUCCESS && ctx) {
+                fprintf(stderr, "invariant violated: NVSDK_NGX_CUDA_Init created CUDA context: %p\n", ctx);
+                abort();
+            }
+            inited = true;
+        }
+        CUcontext ctx = nullptr;
+        CK_CUDA(cuDevicePrimaryCtxRetain(&ctx, dev));
+        return ctx;
+    }
+};
+
+static NgxGlobal ngxGlobal;
+
 struct NgxData {
+    // Held while the feature is evaluated, as the NGX API is not thread safe for a
+    // feature. The features of different instances are evaluated concurrently.
     std::mutex lock;
 
+    // The features per device, and the devices the instances are spread over.
+    int num_streams;
+    int num_devices;
+
     VSNodeRef *node;
     VSVideoInfo vi;
     int scale;
+    // Whether the time spent on each frame is attached to it, which synchronizes each step
+    // before starting the next one.
+    bool stats;
 
     typedef float T;
     uint64_t pixel_size() const { return 3 * sizeof(T); }
@@ -81,27 +375,92 @@ struct NgxData {
     uint64_t in_size() const  { return in_image_height()  * in_image_row_bytes(); }
     uint64_t out_size() const { return out_image_height() * out_image_row_bytes(); }
 
+    // The feature runs on each of these tiles of the input in turn, so that its memory use
+    // is bounded by their size.
+    NgxTiles tilesX, tilesY;
+    bool tiled() const { return tilesX.pos.size() * tilesY.pos.size() > 1; }
+    uint64_t tile_in_size() const  { return pixel_size() * tilesX.size * tilesY.size; }
+    uint64_t tile_out_size() const { return tile_in_size() * scale * scale; }
+
     NVSDK_NGX_Parameter *param;
     NVSDK_NGX_Handle *DUHandle;
+    // The device of this instance, by its ordinal, and its primary context, see NgxGlobal.
+    int device_id;
+    CUdevice device;
     CUcontext ctx;
-
-    std::vector<uint8_t> in_host, out_host;
-    CUdeviceptr inp, outp;
+    CUmodule module;
+    CUfunction interleave, deinterleave, blend;
+    // Uploads and downloads, so that they overlap with the evaluation, which runs on the
+    // null stream.
+    CUstream uploadStream, downloadStream;
+
+    // Each frame in flight is staged in its own slot, which it takes from the pool until
+    // it has been downloaded, so that the upload of the next frame and the download of the
+    // previous one proceed while the feature is evaluated.
+    static constexpr int numSlots = 2;
+    struct Slot {
+        // The planes of the frames, staged in pinned memory (as the frames are pageable, from
+        // which the copies would not be asynchronous) and on the device, and the interleaved
+        // images of the feature (of a tile).
+        uint8_t *in_host = nullptr, *out_host = nullptr;
+        CUdeviceptr in_planes = nullptr, out_planes = nullptr;
+        CUdeviceptr inp = nullptr, outp = nullptr;
+        CUevent uploaded = nullptr, processed = nullptr, downloaded = nullptr;
+    } slots[numSlots];
     void allocate() {
-        in_host.resize(in_size());
-        out_host.resize(out_size());
-        inp = cudaMalloc(in_size());
-        outp = cudaMalloc(out_size());
+        CK_CUDA(cuModuleLoadData(&module, ngxPtx));
+        CK_CUDA(cuModuleGetFunction(&interleave, module, "ngx_interleave"));
+        CK_CUDA(cuModuleGetFunction(&deinterleave, module, "ngx_deinterleave"));
+        CK_CUDA(cuModuleGetFunction(&blend, module, "ngx_blend"));
+        for (auto &slot: slots) {
+            CK_CUDA(cuMemHostAlloc((void **)&slot.in_host, in_size(), 0));
+            CK_CUDA(cuMemHostAlloc((void **)&slot.out_host, out_size(), 0));
+            slot.in_planes = cudaMalloc(in_size());
+            slot.out_planes = cudaMalloc(out_size());
+            slot.inp = cudaMalloc(tile_in_size());
+            slot.outp = cudaMalloc(tile_out_size());
+            CK_CUDA(cuEventCreate(&slot.uploaded, CU_EVENT_DISABLE_TIMING));
+            CK_CUDA(cuEventCreate(&slot.processed, CU_EVENT_DISABLE_TIMING));
+            CK_CUDA(cuEventCreate(&slot.downloaded, CU_EVENT_DISABLE_TIMING));
+        }
+        CK_CUDA(cuStreamCreate(&uploadStream, CU_STREAM_NON_BLOCKING));
+        CK_CUDA(cuStreamCreate(&downloadStream, CU_STREAM_NON_BLOCKING));
     }
 
-    NgxData() : node(nullptr), vi(), scale(0), param(nullptr), DUHandle(nullptr), ctx(nullptr), inp(nullptr), outp(nullptr) {}
+    // The idle slots of all devices (only used in the first instance). Frames take the
+    // one that has been idle the longest, or wait until one is released.
+    struct Pool {
+        std::mutex lock;
+        std::condition_variable released;
+        std::deque<std::pair<NgxData *, Slot *>> idle;
+    } pool;
+
+    // Whether the instances are set up at once, and done when they are (only used in the
+    // first instance).
+    bool parallel_init;
+    std::once_flag setup;
+
+    NgxData() : num_streams(0), num_devices(0), node(nullptr), vi(), scale(0), stats(false), param(nullptr), DUHandle(nullptr), device_id(0), device(0), ctx(nullptr), module(nullptr), uploadStream(nullptr), downloadStream(nullptr), parallel_init(false) {}
     ~NgxData() {
         if (ctx) {
             CK_CUDA(cuCtxPushCurrent(ctx));
-            if (inp) CK_CUDA(cuMemFree_v2(inp));
-            if (outp) CK_CUDA(cuMemFree_v2(outp));
+            for (auto &slot: slots) {
+                if (slot.in_host) CK_CUDA(cuMemFreeHost(slot.in_host));
+                if (slot.out_host) CK_CUDA(cuMemFreeHost(slot.out_host));
+                if (slot.in_planes) CK_CUDA(cuMemFree_v2(slot.in_planes));
+                if (slot.out_planes) CK_CUDA(cuMemFree_v2(slot.out_planes));
+                if (slot.inp) CK_CUDA(cuMemFree_v2(slot.inp));
+                if (slot.outp) CK_CUDA(cuMemFree_v2(slot.outp));
+                if (slot.uploaded) CK_CUDA(cuEventDestroy_v2(slot.uploaded));
+                if (slot.processed) CK_CUDA(cuEventDestroy_v2(slot.processed));
+                if (slot.downloaded) CK_CUDA(cuEventDestroy_v2(slot.downloaded));
+            }
+            if (uploadStream) CK_CUDA(cuStreamDestroy_v2(uploadStream));
+            if (downloadStream) CK_CUDA(cuStreamDestroy_v2(downloadStream));
             if (DUHandle) CK_NGX(NVSDK_NGX_CUDA_ReleaseFeature(DUHandle));
+            if (module) CK_CUDA(cuModuleUnload(module));
             cuCtxPopCurrent(nullptr);
+            cuDevicePrimaryCtxRelease(device);
         }
     }
 };
@@ -111,12 +470,62 @@ static void VS_CC ngxInit(VSMap *in, VSMap *out, void **instanceData, VSNode *no
     vsapi->setVideoInfo(&d->vi, 1, node);
 }
 
+// Creates the feature and the buffers of instance d on its device, when the filter is
+// created or, with lazy=True, when the first frame is requested.
+static void ngxSetup(NgxData *d) {
+    CK_CUDA(cuInit(0));
+    CK_CUDA(cuDeviceGet(&d->device, d->device_id));
+    d->ctx = ngxGlobal.acquire(d->device);
+    NV_new_Parameter(&d->param);
+
+    d->param->Set(NVSDK_NGX_Parameter_Width, (uint64_t)d->tilesX.size);
+    d->param->Set(NVSDK_NGX_Parameter_Height, (uint64_t)d->tilesY.size);
+    d->param->Set(NVSDK_NGX_Parameter_Scale, d->scale);
+
+    // Get the scratch buffer size and create the scratch allocation.
+    size_t byteSize{ 0u };
+    CK_NGX(NVSDK_NGX_CUDA_GetScratchBufferSize(NVSDK_NGX_Feature_ImageSuperResolution, d->param, &byteSize));
+    if (byteSize != 0) // should request none.
+        abort();
+
+    // Create the feature
+    CK_CUDA(cuCtxPushCurrent(d->ctx));
+    CK_NGX(NVSDK_NGX_CUDA_CreateFeature(NVSDK_NGX_Feature_ImageSuperResolution, d->param, &d->DUHandle));
+    d->allocate();
+    CK_CUDA(cuCtxPopCurrent(nullptr));
+}
+
+// Sets up all instances, at once with parallel_init=True, as creating the features takes
+// a while.
+static void ngxSetupAll(NgxData *ds) {
+    const int num = ds->num_streams * ds->num_devices;
+    if (!ds->parallel_init) {
+        for (int i = 0; i < num; i++)
+            ngxSetup(&ds[i]);
+        return;
+    }
+    std::vector<std::future<void>> done;
+    for (int i = 0; i < num; i++)
+        done.push_back(std::async(std::launch::async, ngxSetup, &ds[i]));
+    for (auto &f: done)
+        f.get();
+}
+
 static const VSFrameRef *VS_CC ngxGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    NgxData *d = static_cast<NgxData *>(*instanceData);
+    NgxData *ds = static_cast<NgxData *>(*instanceData);
+    NgxData *d = ds;
+
+    // With stats, frameData holds the time the frame was requested.
+    std::unique_ptr<StatsClock::time_point> requested(static_cast<StatsClock::time_point *>(*frameData));
+    *frameData = nullptr;
 
     if (activationReason == arInitial) {
+        if (d->stats)
+            *frameData = new StatsClock::time_point(StatsClock::now());
         vsapi->requestFrameFilter(n, d->node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
+        std::call_once(ds->setup, ngxSetupAll, ds);
+        const double fetch = requested ? secondsSince(*requested) : 0;
         const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
 
         const VSFormat *fi = d->vi.format;
@@ -126,57 +535,109 @@ static const VSFrameRef *VS_CC ngxGetFrame(int n, int activationReason, void **i
         const VSFrameRef *srcf[3] = { nullptr, nullptr, nullptr };
         VSFrameRef *dst = vsapi->newVideoFrame2(fi, d->out_image_width(), d->out_image_height(), srcf, planes, src, core);
 
-        // The NGX API is not thread safe.
-        std::lock_guard<std::mutex> lock(d->lock);
+        std::pair<NgxData *, NgxData::Slot *> taken;
+        {
+            std::unique_lock<std::mutex> lock(ds->pool.lock);
+            ds->pool.released.wait(lock, [ds] { return !ds->pool.idle.empty(); });
+            taken = ds->pool.idle.front();
+            ds->pool.idle.pop_front();
+        }
+        d = taken.first;
+        NgxData::Slot *slot = taken.second;
         CK_CUDA(cuCtxPushCurrent(d->ctx));
 
-        auto params = d->param;
-        params->Set(NVSDK_NGX_Parameter_Width, (uint64_t)d->in_image_width());
-        params->Set(NVSDK_NGX_Parameter_Height, (uint64_t)d->in_image_height());
-        params->Set(NVSDK_NGX_Parameter_Scale, d->scale);
-
-        // Create the feature
-        //CK_NGX(NVSDK_NGX_CUDA_CreateFeature(NVSDK_NGX_Feature_ImageSuperResolution, params, &d->DUHandle));
-
-        void *in_image_dev_ptr = d->inp;
-        void *out_image_dev_ptr = d->outp;;
-
-        uint8_t *host = d->in_host.data();
+        // Upload, run and download times.
+        double seconds[3] = {};
+        StatsClock::time_point start = StatsClock::now();
+        auto step = [&](int k, CUstream stream) {
+            if (d->stats)
+                CK_CUDA(cuStreamSynchronize(stream));
+            seconds[k] = secondsSince(start);
+            start = StatsClock::now();
+        };
+
+        // The planes are copied between the frames and the pinned buffers of the slot as
+        // they are, from which they are uploaded (and downloaded) asynchronously, and
+        // (de)interleaved on the device.
         typedef float T;
         const T factor = 255.0f;
-        for (int plane = 0; plane < 3; plane++) {
-            const size_t stride = vsapi->getStride(src, plane);
-            const uint8_t *ptr = (uint8_t*)vsapi->getReadPtr(src, plane);
-            for (size_t i = 0; i < d->in_image_height(); i++)
-                for (size_t j = 0; j < d->in_image_width(); j++)
-                    *(T*)&host[i * d->in_image_row_bytes() + j * d->pixel_size() + plane * sizeof(T)] = *(T*)&ptr[i * stride + j * sizeof(T)] * factor;
-        }
-        CK_CUDA(cuMemcpyHtoD_v2(in_image_dev_ptr, host, d->in_size()));
-
-        // Pass the pointers to the GPU allocations to the
-        // parameter block along with the format and size.
-        params->Set(NVSDK_NGX_Parameter_Color_SizeInBytes, d->in_size());
-        params->Set(NVSDK_NGX_Parameter_Color_Format, NVSDK_NGX_Buffer_Format_RGB32F);
-        params->Set(NVSDK_NGX_Parameter_Color, in_image_dev_ptr);
-        params->Set(NVSDK_NGX_Parameter_Output_SizeInBytes, d->out_size());
-        params->Set(NVSDK_NGX_Parameter_Output_Format, NVSDK_NGX_Buffer_Format_RGB32F);
-        params->Set(NVSDK_NGX_Parameter_Output, out_image_dev_ptr);
-
-        // Execute the feature.
-        CK_NGX(NVSDK_NGX_CUDA_EvaluateFeature(d->DUHandle, params, nullptr));
-
-        host = d->out_host.data();
-        CK_CUDA(cuMemcpyDtoH_v2(host, out_image_dev_ptr, d->out_size()));
-        for (int plane = 0; plane < 3; plane++) {
-            const size_t stride = vsapi->getStride(dst, plane);
-            uint8_t *ptr = (uint8_t*)vsapi->getWritePtr(dst, plane);
-            for (size_t i = 0; i < d->out_image_height(); i++)
-                for (size_t j = 0; j < d->out_image_width(); j++)
-                    *(T*)&ptr[i * stride + j * sizeof(T)] = *(T*)&host[i * d->out_image_row_bytes() + j * d->pixel_size() + plane * sizeof(T)] / factor;
+        const size_t inRow = d->in_image_width() * sizeof(T), outRow = d->out_image_width() * sizeof(T);
+        for (int plane = 0; plane < 3; plane++)
+            vs_bitblt(slot->in_host + d->in_size() / 3 * plane, (int)inRow, vsapi->getReadPtr(src, plane), vsapi->getStride(src, plane), inRow, d->in_image_height());
+        CK_CUDA(cuMemcpyHtoDAsync_v2(slot->in_planes, slot->in_host, d->in_size(), d->uploadStream));
+        CK_CUDA(cuEventRecord(slot->uploaded, d->uploadStream));
+        step(0, d->uploadStream);
+
+        {
+            std::lock_guard<std::mutex> lock(d->lock);
+            auto params = d->param;
+            params->Set(NVSDK_NGX_Parameter_Width, (uint64_t)d->tilesX.size);
+            params->Set(NVSDK_NGX_Parameter_Height, (uint64_t)d->tilesY.size);
+            params->Set(NVSDK_NGX_Parameter_Scale, d->scale);
+
+            // Pass the pointers to the GPU allocations to the
+            // parameter block along with the format and size.
+            params->Set(NVSDK_NGX_Parameter_Color_SizeInBytes, d->tile_in_size());
+            params->Set(NVSDK_NGX_Parameter_Color_Format, NVSDK_NGX_Buffer_Format_RGB32F);
+            params->Set(NVSDK_NGX_Parameter_Color, slot->inp);
+            params->Set(NVSDK_NGX_Parameter_Output_SizeInBytes, d->tile_out_size());
+            params->Set(NVSDK_NGX_Parameter_Output_Format, NVSDK_NGX_Buffer_Format_RGB32F);
+            params->Set(NVSDK_NGX_Parameter_Output, slot->outp);
+
+            // Execute the feature on the null stream once the input is there, on each tile
+            // in turn, whose outputs are added up with the weights of their seams.
+            const uint64_t inPlane = d->in_size() / 3, outPlane = d->out_size() / 3;
+            const uint32_t inPitch = d->in_image_width() * sizeof(T), outPitch = d->out_image_width() * sizeof(T);
+            const int s = d->scale;
+            CK_CUDA(cuStreamWaitEvent(nullptr, slot->uploaded, 0));
+            if (d->tiled())
+                CK_CUDA(cuMemsetD8Async(slot->out_planes, 0, d->out_size(), nullptr));
+            for (size_t ty = 0; ty < d->tilesY.pos.size(); ty++) {
+                for (size_t tx = 0; tx < d->tilesX.pos.size(); tx++) {
+                    const int x = d->tilesX.pos[tx], y = d->tilesY.pos[ty];
+                    const int w = d->tilesX.size, h = d->tilesY.size;
+                    char *in = static_cast<char*>(slot->in_planes) + (uint64_t)y * inPitch + x * sizeof(T);
+                    char *out = static_cast<char*>(slot->out_planes) + (uint64_t)y * s * outPitch + x * s * sizeof(T);
+                    ngxConvert(d->interleave, in, inPlane, inPitch, slot->inp, w, h, factor, nullptr);
+                    CK_NGX(NVSDK_NGX_CUDA_EvaluateFeature(d->DUHandle, params, nullptr));
+                    if (d->tiled()) {
+                        float seams[8];
+                        d->tilesX.ramps(tx, s, seams);
+                        d->tilesY.ramps(ty, s, seams + 4);
+                        ngxConvert(d->blend, out, outPlane, outPitch, slot->outp, w * s, h * s, 1 / factor, nullptr, seams);
+                    } else {
+                        ngxConvert(d->deinterleave, out, outPlane, outPitch, slot->outp, w * s, h * s, 1 / factor, nullptr);
+                    }
+                }
+            }
+            CK_CUDA(cuEventRecord(slot->processed, nullptr));
         }
+        step(1, nullptr);
 
+        CK_CUDA(cuStreamWaitEvent(d->downloadStream, slot->processed, 0));
+        CK_CUDA(cuMemcpyDtoHAsync_v2(slot->out_host, slot->out_planes, d->out_size(), d->downloadStream));
+        CK_CUDA(cuEventRecord(slot->downloaded, d->downloadStream));
+        CK_CUDA(cuEventSynchronize(slot->downloaded));
+        for (int plane = 0; plane < 3; plane++)
+            vs_bitblt(vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane), slot->out_host + d->out_size() / 3 * plane, (int)outRow, outRow, d->out_image_height());
+
+        step(2, d->downloadStream);
         cuCtxPopCurrent(nullptr);
 
+        {
+            std::lock_guard<std::mutex> lock(ds->pool.lock);
+            ds->pool.idle.push_back(taken);
+        }
+        ds->pool.released.notify_one();
+
+        if (d->stats) {
+            VSMap *props = vsapi->getFramePropsRW(dst);
+            vsapi->propSetFloat(props, "_AkarinTimeFetch", fetch, paReplace);
+            vsapi->propSetFloat(props, "_AkarinTimeUpload", seconds[0], paReplace);
+            vsapi->propSetFloat(props, "_AkarinTimeRun", seconds[1], paReplace);
+            vsapi->propSetFloat(props, "_AkarinTimeDownload", seconds[2], paReplace);
+        }
+
         vsapi->freeFrame(src);
         return dst;
     }
@@ -185,96 +646,123 @@ static const VSFrameRef *VS_CC ngxGetFrame(int n, int activationReason, void **i
 }
 
 static void VS_CC ngxFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    NgxData *d = static_cast<NgxData *>(instanceData);
-    vsapi->freeNode(d->node);
+    NgxData *ds = static_cast<NgxData *>(instanceData);
+    for (int i = 0; i < ds->num_streams * ds->num_devices; ++i)
+        vsapi->freeNode(ds[i].node);
 
-    delete d;
+    delete[] ds;
 }
 
 static void VS_CC ngxCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
-    std::unique_ptr<NgxData> d(new NgxData);
     int err;
 
-    int devid = 0;
-    try {
-        if (autoDllErrors.size() > 0) {
-                std::string error, last;
-                for (const auto &s: autoDllErrors) {
-                    if (error.size()) {
-                        if (last != s)
-                            error += "; " + s;
-                    } else
-                        error = s;
-                    last = s;
-                }
-                throw std::runtime_error(error);
-        }
-
-        d->node = vsapi->propGetNode(in, "clip", 0, &err);
-        d->vi = *vsapi->getVideoInfo(d->node);
-
-        if (!isConstantFormat(&d->vi)) {
-            throw std::runtime_error("Only clips with constant format and dimensions allowed");
-        }
-        if (d->vi.format->numPlanes != 3 || d->vi.format->colorFamily != cmRGB)
-            throw std::runtime_error("input clip must be RGB format");
-        if (d->vi.format->sampleType != stFloat || d->vi.format->bitsPerSample != 32)
-            throw std::runtime_error("input clip must be 32-bit float format");
-
-        int scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
-        if (err) scale = 2;
-        if (scale != 2 && scale != 4 && scale != 8)
-            throw std::runtime_error("scale must be 2/4/8");
-        d->scale = scale;
-
-        devid = int64ToIntS(vsapi->propGetInt(in, "device_id", 0, &err));
+    // num_streams instances per device, each with its own feature, on which frames are
+    // evaluated in parallel. Instance i runs on device i % num_devices.
+    auto num_streams = int64ToIntS(vsapi->propGetInt(in, "num_streams", 0, &err));
+    if (err) num_streams = 1;
+    if (num_streams < 1) {
+        vsapi->setError(out, "DLISR: num_streams must be at least 1");
+        return;
+    }
+    std::vector<int> devices;
+    for (int i = 0; i < vsapi->propNumElements(in, "devices"); i++)
+        devices.push_back(int64ToIntS(vsapi->propGetInt(in, "devices", i, nullptr)));
+    if (devices.empty()) {
+        int devid = int64ToIntS(vsapi->propGetInt(in, "device_id", 0, &err));
         if (err) devid = 0;
-    } catch (std::runtime_error &e) {
-        if (d->node)
-            vsapi->freeNode(d->node);
-        vsapi->setError(out, (std::string{ "DLISR: " } + e.what()).c_str());
+        devices.push_back(devid);
+    } else if (vsapi->propNumElements(in, "device_id") > 0) {
+        vsapi->setError(out, "DLISR: device_id and devices are mutually exclusive");
         return;
     }
-
-    d->vi.width *= d->scale;
-    d->vi.height *= d->scale;
-
-    static bool inited = []() -> bool {
-        CUcontext ctx;
-        bool hasCtx = cuCtxGetCurrent(&ctx) == CUDA_SUCCESS;
-        CK_NGX(NVSDK_NGX_CUDA_Init(0, L"./", NVSDK_NGX_Version_API));
-        // We don't expect NVSDK_NGX_CUDA_Init to create a context, but if it did, we need to
-        // switch to save a global CUDA context, instead of the pre-filter context.
-        if (!hasCtx && cuCtxGetCurrent(&ctx) == CUDA_SUCCESS) {
-            fprintf(stderr, "invariant violated: NVSDK_NGX_CUDA_Init created CUDA context: %p\n", ctx);
-            abort();
+    // The outputs are not cached by default, as they are up to 64 times larger than the
+    // input and usually requested once. cache=2 caches them and makes the requests linear.
+    auto cache = int64ToIntS(vsapi->propGetInt(in, "cache", 0, &err));
+    if (err) cache = 0;
+    if (cache < 0 || cache > 2) {
+        vsapi->setError(out, "DLISR: cache must be 0 (none), 1 (cached) or 2 (linear)");
+        return;
+    }
+    const int flags = cache == 0 ? nfNoCache : cache == 2 ? nfMakeLinear : 0;
+    const int num_devices = (int)devices.size();
+
+    std::unique_ptr<NgxData[]> ds(new NgxData[num_streams * num_devices]);
+    // The instances are set up when the first frame is requested with lazy=True, e.g. for
+    // nodes that are only used by some scripts.
+    const bool lazy = !!vsapi->propGetInt(in, "lazy", 0, &err);
+    ds[0].parallel_init = !!vsapi->propGetInt(in, "parallel_init", 0, &err);
+
+    for (int i = 0; i < num_streams * num_devices; ++i) {
+        auto d = &ds[i];
+        d->num_streams = num_streams;
+        d->num_devices = num_devices;
+        try {
+            if (autoDllErrors.size() > 0) {
+                    std::string error, last;
+                    for (const auto &s: autoDllErrors) {
+                        if (error.size()) {
+                            if (last != s)
+                                error += "; " + s;
+                        } else
+                            error = s;
+                        last = s;
+                    }
+                    throw std::runtime_error(error);
+            }
+
+            d->node = vsapi->propGetNode(in, "clip", 0, &err);
+            d->vi = *vsapi->getVideoInfo(d->node);
+
+            if (!isConstantFormat(&d->vi)) {
+                throw std::runtime_error("Only clips with constant format and dimensions allowed");
+            }
+            if (d->vi.format->numPlanes != 3 || d->vi.format->colorFamily != cmRGB)
+                throw std::runtime_error("input clip must be RGB format");
+            if (d->vi.format->sampleType != stFloat || d->vi.format->bitsPerSample != 32)
+                throw std::runtime_error("input clip must be 32-bit float format");
+
+            int scale = int64ToIntS(vsapi->propGetInt(in, "scale", 0, &err));
+            if (err) scale = 2;
+            if (scale != 2 && scale != 4 && scale != 8)
+                throw std::runtime_error("scale must be 2/4/8");
+            d->scale = scale;
+
+            d->stats = !!vsapi->propGetInt(in, "stats", 0, &err);
+
+            // The size of the tiles in input pixels, or 0 for whole frames.
+            int tile = int64ToIntS(vsapi->propGetInt(in, "tile", 0, &err));
+            if (err) tile = 0;
+            int overlap = int64ToIntS(vsapi->propGetInt(in, "overlap", 0, &err));
+            if (err) overlap = 16;
+            if (tile < 0)
+                throw std::runtime_error("tile must not be negative");
+            if (tile > 0 && (overlap < 1 || overlap >= tile))
+                throw std::runtime_error("overlap must be at least 1 and less than tile");
+            d->tilesX = NgxTiles(d->vi.width, tile, overlap);
+            d->tilesY = NgxTiles(d->vi.height, tile, overlap);
+        } catch (std::runtime_error &e) {
+            for (int j = 0; j <= i; ++j)
+                if (ds[j].node)
+                    vsapi->freeNode(ds[j].node);
+            vsapi->setError(out, (std::string{ "DLISR: " } + e.what()).c_str());
+            return;
         }
-        return true;
-    }();
-    (void) inited;
-    NV_new_Parameter(&d->param);
 
-    d->param->Set(NVSDK_NGX_Parameter_Width, d->in_image_width());
-    d->param->Set(NVSDK_NGX_Parameter_Height, d->in_image_height());
-    d->param->Set(NVSDK_NGX_Parameter_Scale, d->scale);
+        d->vi.width *= d->scale;
+        d->vi.height *= d->scale;
 
-    // Get the scratch buffer size and create the scratch allocation.
-    size_t byteSize{ 0u };
-    CK_NGX(NVSDK_NGX_CUDA_GetScratchBufferSize(NVSDK_NGX_Feature_ImageSuperResolution, d->param, &byteSize));
-    if (byteSize != 0) // should request none.
-        abort();
+        d->device_id = devices[i % num_devices];
+    }
 
-    // Create the feature
-    CUdevice dev = 0;
-    CK_CUDA(cuInit(0));
-    CK_CUDA(cuDeviceGet(&dev, devid));
-    CK_CUDA(cuCtxCreate_v2(&d->ctx, 0, dev));
-    CK_NGX(NVSDK_NGX_CUDA_CreateFeature(NVSDK_NGX_Feature_ImageSuperResolution, d->param, &d->DUHandle));
-    CK_CUDA(cuCtxGetCurrent(&d->ctx));
-    d->allocate();
-    CK_CUDA(cuCtxPopCurrent(nullptr));
+    // One slot of every instance before the second ones, to spread the first frames.
+    for (int j = 0; j < NgxData::numSlots; ++j)
+        for (int i = 0; i < num_streams * num_devices; ++i)
+            ds[0].pool.idle.emplace_back(&ds[i], &ds[i].slots[j]);
+
+    if (!lazy)
+        std::call_once(ds[0].setup, ngxSetupAll, ds.get());
 
-    vsapi->createFilter(in, out, "DLISR", ngxInit, ngxGetFrame, ngxFree, fmParallel, 0, d.release(), core);
+    vsapi->createFilter(in, out, "DLISR", ngxInit, ngxGetFrame, ngxFree, fmParallel, flags, ds.release(), core);
 }
 
 //////////////////////////////////////////
@@ -286,5 +774,5 @@ void VS_CC ngxInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerF
 VS_EXTERNAL_API(void) VS_CC VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
     configFunc("info.akarin.plugin", "akarin2", "Experimental Nvidia DLISR plugin", VAPOURSYNTH_API_VERSION, 1, plugin);
 #endif
-    registerFunc("DLISR", "clip:clip;scale:int:opt;device_id:int:opt;", ngxCreate, nullptr, plugin);
+    registerFunc("DLISR", "clip:clip;scale:int:opt;device_id:int:opt;devices:int[]:opt;num_streams:int:opt;tile:int:opt;overlap:int:opt;lazy:int:opt;parallel_init:int:opt;stats:int:opt;cache:int:opt;", ngxCreate, nullptr, plugin);
 }
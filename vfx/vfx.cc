@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <utility>
@@ -15,6 +21,10 @@
 #else
 static std::vector<std::string> autoDllErrors;
 #define CUDA_DLL L"nvcuda.dll","nvcuda.dll",autoDllErrors
+// The graph functions of newer drivers are null if they are missing, see graph=True.
+static std::vector<std::string> autoDllMissing;
+#define CUDA_DLL_OPTIONAL L"nvcuda.dll","nvcuda.dll",autoDllMissing
+#define CUDA_FN_OPTIONAL(ret, fn, args) EXT_FN(CUDA_DLL_OPTIONAL, ret, fn, args)
 #endif
 #include "../ngx/cuda.h"
 
@@ -37,28 +47,518 @@ static std::vector<std::string> autoDllErrors;
     } \
 } while (0)
 
+using StatsClock = std::chrono::steady_clock;
+
+static double secondsSince(StatsClock::time_point start) {
+    return std::chrono::duration<double>(StatsClock::now() - start).count();
+}
+
+// Conversions between the planes of the frames, staged on the device as they are, and
+// the planar BGR float images of the effect, as PTX that the driver compiles when the
+// module is loaded. The samples of the frames are of type 0 (u8), 1 (u16), 2 (f16) or 3
+// (f32), and their chroma planes (1 and 2) are subsampled by ssw and ssh. Each plane k
+// is computed as coef[4k] * s0 + coef[4k+1] * s1 + coef[4k+2] * s2 + coef[4k+3] from the
+// planes s of the source, with the chroma upsampled by replication in vfx_unpack and
+// downsampled by averaging in vfx_pack. Integer samples are rounded and clamped to
+// [0, peak].
+static const char vfxPtx[] = R"(
+.version 6.3
+.target sm_75
+.address_size 64
+
+.func (.reg .u64 addr) vfx_addr(.reg .u64 base, .reg .u32 x, .reg .u32 y, .reg .u32 pitch, .reg .u32 type)
+{
+    .reg .pred p;
+    .reg .u32 size;
+    .reg .u64 off;
+    setp.eq.u32 p, type, 3;
+    selp.u32 size, 4, 2, p;
+    setp.eq.u32 p, type, 0;
+    selp.u32 size, 1, size, p;
+    mul.wide.u32 off, y, pitch;
+    add.u64 addr, base, off;
+    mul.wide.u32 off, x, size;
+    add.u64 addr, addr, off;
+    ret;
+}
+
+.func (.reg .f32 v) vfx_load(.reg .u64 addr, .reg .u32 type)
+{
+    .reg .pred p;
+    .reg .b16 h;
+    .reg .u32 i;
+    setp.ne.u32 p, type, 0;
+    @p bra LOAD_U16;
+    ld.global.u8 i, [addr];
+    cvt.rn.f32.u32 v, i;
+    ret;
+LOAD_U16:
+    setp.ne.u32 p, type, 1;
+    @p bra LOAD_F16;
+    ld.global.u16 i, [addr];
+    cvt.rn.f32.u32 v, i;
+    ret;
+LOAD_F16:
+    setp.ne.u32 p, type, 2;
+    @p bra LOAD_F32;
+    ld.global.b16 h, [addr];
+    cvt.f32.f16 v, h;
+    ret;
+LOAD_F32:
+    ld.global.f32 v, [addr];
+    ret;
+}
+
+.func vfx_store(.reg .u64 addr, .reg .u32 type, .reg .f32 v, .reg .f32 peak)
+{
+    .reg .pred p;
+    .reg .b16 h;
+    .reg .u32 i;
+    .reg .f32 c;
+    setp.lt.u32 p, type, 2;
+    @p bra STORE_INT;
+    setp.ne.u32 p, type, 2;
+    @p bra STORE_F32;
+    cvt.rn.f16.f32 h, v;
+    st.global.b16 [addr], h;
+    ret;
+STORE_F32:
+    st.global.f32 [addr], v;
+    ret;
+STORE_INT:
+    max.f32 c, v, 0f00000000;
+    min.f32 c, c, peak;
+    cvt.rni.u32.f32 i, c;
+    setp.eq.u32 p, type, 0;
+    @p st.global.u8 [addr], i;
+    @!p st.global.u16 [addr], i;
+    ret;
+}
+
+.entry vfx_unpack(
+    .param .u64 src, .param .u64 srcPlane, .param .u32 srcPitch,
+    .param .u64 dst, .param .u64 dstPlane, .param .u32 dstPitch,
+    .param .u32 width, .param .u32 height,
+    .param .u32 type, .param .u32 ssw, .param .u32 ssh, .param .f32 peak,
+    .param .align 4 .b8 coef[48])
+{
+    .reg .pred p;
+    .reg .u32 x, y, w, h, t, f, sw, sh, cx, cy, pitch, tmp;
+    .reg .u64 base, plane, addr;
+    .reg .f32 s0, s1, s2, v, m<12>;
+
+    mov.u32 x, %ctaid.x;
+    mov.u32 tmp, %ntid.x;
+    mov.u32 t, %tid.x;
+    mad.lo.u32 x, x, tmp, t;
+    mov.u32 y, %ctaid.y;
+    mov.u32 tmp, %ntid.y;
+    mov.u32 t, %tid.y;
+    mad.lo.u32 y, y, tmp, t;
+    ld.param.u32 w, [width];
+    ld.param.u32 h, [height];
+    setp.ge.u32 p, x, w;
+    @p exit;
+    setp.ge.u32 p, y, h;
+    @p exit;
+
+    ld.param.u64 base, [src];
+    ld.param.u64 plane, [srcPlane];
+    ld.param.u32 pitch, [srcPitch];
+    ld.param.u32 t, [type];
+    ld.param.u32 sw, [ssw];
+    ld.param.u32 sh, [ssh];
+    call (addr), vfx_addr, (base, x, y, pitch, t);
+    call (s0), vfx_load, (addr, t);
+    shr.u32 cx, x, sw;
+    shr.u32 cy, y, sh;
+    add.u64 base, base, plane;
+    call (addr), vfx_addr, (base, cx, cy, pitch, t);
+    call (s1), vfx_load, (addr, t);
+    add.u64 base, base, plane;
+    call (addr), vfx_addr, (base, cx, cy, pitch, t);
+    call (s2), vfx_load, (addr, t);
+
+    ld.param.f32 m0, [coef+0];
+    ld.param.f32 m1, [coef+4];
+    ld.param.f32 m2, [coef+8];
+    ld.param.f32 m3, [coef+12];
+    ld.param.f32 m4, [coef+16];
+    ld.param.f32 m5, [coef+20];
+    ld.param.f32 m6, [coef+24];
+    ld.param.f32 m7, [coef+28];
+    ld.param.f32 m8, [coef+32];
+    ld.param.f32 m9, [coef+36];
+    ld.param.f32 m10, [coef+40];
+    ld.param.f32 m11, [coef+44];
+
+    ld.param.u64 base, [dst];
+    ld.param.u64 plane, [dstPlane];
+    ld.param.u32 pitch, [dstPitch];
+    mov.u32 f, 3;
+    call (addr), vfx_addr, (base, x, y, pitch, f);
+    fma.rn.f32 v, m0, s0, m3;
+    fma.rn.f32 v, m1, s1, v;
+    fma.rn.f32 v, m2, s2, v;
+    st.global.f32 [addr], v;
+    add.u64 addr, addr, plane;
+    fma.rn.f32 v, m4, s0, m7;
+    fma.rn.f32 v, m5, s1, v;
+    fma.rn.f32 v, m6, s2, v;
+    st.global.f32 [addr], v;
+    add.u64 addr, addr, plane;
+    fma.rn.f32 v, m8, s0, m11;
+    fma.rn.f32 v, m9, s1, v;
+    fma.rn.f32 v, m10, s2, v;
+    st.global.f32 [addr], v;
+    exit;
+}
+
+.entry vfx_pack(
+    .param .u64 src, .param .u64 srcPlane, .param .u32 srcPitch,
+    .param .u64 dst, .param .u64 dstPlane, .param .u32 dstPitch,
+    .param .u32 width, .param .u32 height,
+    .param .u32 type, .param .u32 ssw, .param .u32 ssh, .param .f32 peak,
+    .param .align 4 .b8 coef[48])
+{
+    .reg .pred p;
+    .reg .u32 x, y, w, h, t, f, sw, sh, nx, ny, dx, dy, px, py, pitch, dpitch, tmp;
+    .reg .u64 base, plane, dbase, dplane, addr;
+    .reg .f32 c0, c1, c2, s, v, pk, m<12>;
+
+    mov.u32 x, %ctaid.x;
+    mov.u32 tmp, %ntid.x;
+    mov.u32 t, %tid.x;
+    mad.lo.u32 x, x, tmp, t;
+    mov.u32 y, %ctaid.y;
+    mov.u32 tmp, %ntid.y;
+    mov.u32 t, %tid.y;
+    mad.lo.u32 y, y, tmp, t;
+    ld.param.u32 w, [width];
+    ld.param.u32 h, [height];
+    setp.ge.u32 p, x, w;
+    @p exit;
+    setp.ge.u32 p, y, h;
+    @p exit;
+
+    ld.param.f32 m0, [coef+0];
+    ld.param.f32 m1, [coef+4];
+    ld.param.f32 m2, [coef+8];
+    ld.param.f32 m3, [coef+12];
+    ld.param.f32 m4, [coef+16];
+    ld.param.f32 m5, [coef+20];
+    ld.param.f32 m6, [coef+24];
+    ld.param.f32 m7, [coef+28];
+    ld.param.f32 m8, [coef+32];
+    ld.param.f32 m9, [coef+36];
+    ld.param.f32 m10, [coef+40];
+    ld.param.f32 m11, [coef+44];
+
+    ld.param.u64 base, [src];
+    ld.param.u64 plane, [srcPlane];
+    ld.param.u32 pitch, [srcPitch];
+    ld.param.u64 dbase, [dst];
+    ld.param.u64 dplane, [dstPlane];
+    ld.param.u32 dpitch, [dstPitch];
+    ld.param.u32 t, [type];
+    ld.param.u32 sw, [ssw];
+    ld.param.u32 sh, [ssh];
+    ld.param.f32 pk, [peak];
+    mov.u32 f, 3;
+
+    call (addr), vfx_addr, (base, x, y, pitch, f);
+    ld.global.f32 c0, [addr];
+    add.u64 addr, addr, plane;
+    ld.global.f32 c1, [addr];
+    add.u64 addr, addr, plane;
+    ld.global.f32 c2, [addr];
+    fma.rn.f32 v, m0, c0, m3;
+    fma.rn.f32 v, m1, c1, v;
+    fma.rn.f32 v, m2, c2, v;
+    call (addr), vfx_addr, (dbase, x, y, dpitch, t);
+    call vfx_store, (addr, t, v, pk);
+
+    // The chroma of each block is computed by its top left pixel.
+    mov.u32 tmp, 1;
+    shl.b32 nx, tmp, sw;
+    shl.b32 ny, tmp, sh;
+    sub.u32 tmp, nx, 1;
+    and.b32 tmp, tmp, x;
+    setp.ne.u32 p, tmp, 0;
+    @p exit;
+    sub.u32 tmp, ny, 1;
+    and.b32 tmp, tmp, y;
+    setp.ne.u32 p, tmp, 0;
+    @p exit;
+
+    mov.f32 c0, 0f00000000;
+    mov.f32 c1, 0f00000000;
+    mov.f32 c2, 0f00000000;
+    mov.u32 dy, 0;
+BLOCK_Y:
+    mov.u32 dx, 0;
+BLOCK_X:
+    add.u32 px, x, dx;
+    add.u32 py, y, dy;
+    call (addr), vfx_addr, (base, px, py, pitch, f);
+    ld.global.f32 s, [addr];
+    add.f32 c0, c0, s;
+    add.u64 addr, addr, plane;
+    ld.global.f32 s, [addr];
+    add.f32 c1, c1, s;
+    add.u64 addr, addr, plane;
+    ld.global.f32 s, [addr];
+    add.f32 c2, c2, s;
+    add.u32 dx, dx, 1;
+    setp.lt.u32 p, dx, nx;
+    @p bra BLOCK_X;
+    add.u32 dy, dy, 1;
+    setp.lt.u32 p, dy, ny;
+    @p bra BLOCK_Y;
+
+    mul.lo.u32 tmp, nx, ny;
+    cvt.rn.f32.u32 s, tmp;
+    rcp.rn.f32 s, s;
+    mul.f32 c0, c0, s;
+    mul.f32 c1, c1, s;
+    mul.f32 c2, c2, s;
+
+    shr.u32 px, x, sw;
+    shr.u32 py, y, sh;
+    add.u64 dbase, dbase, dplane;
+    call (addr), vfx_addr, (dbase, px, py, dpitch, t);
+    fma.rn.f32 v, m4, c0, m7;
+    fma.rn.f32 v, m5, c1, v;
+    fma.rn.f32 v, m6, c2, v;
+    call vfx_store, (addr, t, v, pk);
+    add.u64 dbase, dbase, dplane;
+    call (addr), vfx_addr, (dbase, px, py, dpitch, t);
+    fma.rn.f32 v, m8, c0, m11;
+    fma.rn.f32 v, m9, c1, v;
+    fma.rn.f32 v, m10, c2, v;
+    call vfx_store, (addr, t, v, pk);
+    exit;
+}
+)";
+
+// The parameters of vfx_unpack and vfx_pack, in order.
+struct VfxConvert {
+    CUdeviceptr src;
+    uint64_t srcPlane;
+    uint32_t srcPitch;
+    CUdeviceptr dst;
+    uint64_t dstPlane;
+    uint32_t dstPitch;
+    uint32_t width, height;
+    uint32_t type, ssw, ssh;
+    float peak;
+    float coef[12];
+};
+
+static void vfxLaunch(CUfunction fn, VfxConvert a, CUstream stream) {
+    void *params[] = { &a.src, &a.srcPlane, &a.srcPitch, &a.dst, &a.dstPlane, &a.dstPitch, &a.width, &a.height, &a.type, &a.ssw, &a.ssh, &a.peak, a.coef };
+    CK_CUDA(cuLaunchKernel(fn, (a.width + 31) / 32, (a.height + 7) / 8, 1, 32, 8, 1, 0, stream, params, nullptr));
+}
+
+// The type of the samples of f for the kernels, or -1 if they are not supported.
+static int vfxSampleType(const VSFormat *f) {
+    if (f->sampleType == stInteger && f->bytesPerSample <= 2)
+        return f->bytesPerSample - 1;
+    if (f->sampleType == stFloat && (f->bitsPerSample == 16 || f->bitsPerSample == 32))
+        return f->bitsPerSample / 16 + 1;
+    return -1;
+}
+
+// The planes of f normalize to (sample - offset) * scale, with the chroma of YUV centered
+// on 0.
+static void planeRange(const VSFormat *f, bool fullRange, double offset[3], double scale[3]) {
+    const int bits = f->bitsPerSample;
+    for (int p = 0; p < 3; p++) {
+        const bool chroma = f->colorFamily == cmYUV && p > 0;
+        if (f->sampleType == stFloat) {
+            offset[p] = 0;
+            scale[p] = 1;
+        } else if (f->colorFamily == cmRGB || fullRange) {
+            offset[p] = chroma ? 1 << (bits - 1) : 0;
+            scale[p] = 1.0 / ((1 << bits) - 1);
+        } else {
+            offset[p] = (chroma ? 128 : 16) << (bits - 8);
+            scale[p] = 1.0 / ((chroma ? 224 : 219) << (bits - 8));
+        }
+    }
+}
+
+// The rows R, G, B of the conversion of the normalized planes of f to RGB, and its
+// inverse, for the luma coefficients kr and kb of YUV.
+static void rgbMatrices(const VSFormat *f, double kr, double kb, double toRGB[3][3], double fromRGB[3][3]) {
+    if (f->colorFamily == cmRGB) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                toRGB[i][j] = fromRGB[i][j] = i == j;
+        return;
+    }
+    const double kg = 1 - kr - kb;
+    const double to[3][3] = {
+        { 1, 0, 2 * (1 - kr) },
+        { 1, -2 * kb * (1 - kb) / kg, -2 * kr * (1 - kr) / kg },
+        { 1, 2 * (1 - kb), 0 },
+    };
+    const double from[3][3] = {
+        { kr, kg, kb },
+        { -kr / (2 * (1 - kb)), -kg / (2 * (1 - kb)), 0.5 },
+        { 0.5, -kg / (2 * (1 - kr)), -kb / (2 * (1 - kr)) },
+    };
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++) {
+            toRGB[i][j] = to[i][j];
+            fromRGB[i][j] = from[i][j];
+        }
+}
+
+// Sets up the conversion of unpack from the planes of in to the B, G, R planes of the
+// effect, and that of pack from them to the planes of out.
+static void vfxConversions(VfxConvert &unpack, VfxConvert &pack, const VSFormat *in, const VSFormat *out, bool fullRange, double kr, double kb) {
+    double offset[3], scale[3], toRGB[3][3], fromRGB[3][3];
+
+    planeRange(in, fullRange, offset, scale);
+    rgbMatrices(in, kr, kb, toRGB, fromRGB);
+    for (int c = 0; c < 3; c++) {
+        const double *row = toRGB[2 - c];
+        double bias = 0;
+        for (int p = 0; p < 3; p++) {
+            unpack.coef[4 * c + p] = float(row[p] * scale[p]);
+            bias -= row[p] * scale[p] * offset[p];
+        }
+        unpack.coef[4 * c + 3] = float(bias);
+    }
+    unpack.type = vfxSampleType(in);
+    unpack.ssw = in->subSamplingW;
+    unpack.ssh = in->subSamplingH;
+    unpack.peak = 0;
+
+    planeRange(out, fullRange, offset, scale);
+    rgbMatrices(out, kr, kb, toRGB, fromRGB);
+    for (int p = 0; p < 3; p++) {
+        for (int c = 0; c < 3; c++)
+            pack.coef[4 * p + c] = float(fromRGB[p][2 - c] / scale[p]);
+        pack.coef[4 * p + 3] = float(offset[p]);
+    }
+    pack.type = vfxSampleType(out);
+    pack.ssw = out->subSamplingW;
+    pack.ssh = out->subSamplingH;
+    pack.peak = out->sampleType == stInteger ? float((1 << out->bitsPerSample) - 1) : 0;
+}
+
+// The outputs of frames [first, first + frames.size()), which are computed together by
+// the first of their requests and handed out to each of them once.
+struct VfxBatch {
+    std::promise<void> computed;
+    std::shared_future<void> done;
+    std::vector<VSFrameRef *> frames;
+    size_t returned = 0;
+
+    explicit VfxBatch(int count) : done(computed.get_future().share()), frames(count) {}
+};
+
+// The effects, by op.
+enum { OP_AR, OP_SUPERRES, OP_DENOISE };
+static const NvVFX_EffectSelector vfxSelectors[] = { NVVFX_FX_ARTIFACT_REDUCTION, NVVFX_FX_SUPER_RES, NVVFX_FX_DENOISING };
+
 struct VfxData {
+    // Held while the effect runs, as its input and output images are fixed.
     std::mutex lock;
 
+    // The streams per device, and the devices the instances are spread over.
     int num_streams;
+    int num_devices;
+    // The number of frames the effect runs on at once.
+    int batch;
 
     VSNodeRef *node;
     VSVideoInfo vi;
-    double scale;
-    double strength;
-    int output_depth;
+    // Whether the time spent on each frame is attached to it, which synchronizes the
+    // stream after each step.
+    bool stats;
+    // Whether the work of a frame on stream (the conversions and the effects) is replayed
+    // from a CUDA graph, see vfxCapture(). Cleared if the effects cannot be captured.
+    bool graph;
 
     int in_width, in_height;
 
-    NvVFX_Handle vfx;
+    // The device of this instance, by its ordinal, and its primary context, which is
+    // current while it is used, as the effect runs on the device of the current context.
+    int device_id;
+    CUdevice device;
+    CUcontext ctx;
+
     CUstream stream;
-    CUdeviceptr state;
+    // Uploads and downloads, so that they overlap with the effect on stream.
+    CUstream uploadStream, downloadStream;
 
-    float srcTransferFactor, dstTransferFactor;
+    // The format of the clip, and the conversions between it (or that of vi) and the images
+    // of the effect, of which only the pointers are set per frame.
+    const VSFormat *in_format;
+    CUmodule module;
+    CUfunction unpack, pack;
+    VfxConvert unpackArgs, packArgs;
+
+    // The batch images, one after the other, and a view of the first one for the effect.
     NvCVImage srcGpuImg;
-    NvCVImage dstGpuImg;
-    NvCVImage srcTmpImg, dstTmpImg;
-    void *srcCpuBuf, *dstCpuBuf;
+    NvCVImage srcGpuView;
+
+    // The effects, run one after the other on stream. Each one writes to its own images,
+    // which the next one reads, so that the frames only leave the device once.
+    struct Stage {
+        int op = 0;
+        double scale = 1;
+        double strength = 0;
+        NvVFX_Handle vfx = nullptr;
+        CUdeviceptr state = nullptr;
+        unsigned width = 0, height = 0;
+        NvCVImage dstGpuImg, dstGpuView;
+    };
+    int num_stages;
+    std::unique_ptr<Stage[]> stages;
+    const Stage &last() const { return stages[num_stages - 1]; }
+
+    // Each frame in flight is staged in its own slot, which it takes from the pool until
+    // it has been downloaded, so that the upload of the next frame and the download of the
+    // previous one proceed while the effect runs. The tmp images hold the planes of the
+    // frames as they are, one after the other, on the device and in pinned host memory, as
+    // the copies from and to the (pageable) frames would not be asynchronous.
+    static constexpr int numSlots = 2;
+    struct Slot {
+        NvCVImage srcTmpImg, dstTmpImg;
+        NvCVImage srcHostImg, dstHostImg;
+        CUevent uploaded = nullptr, processed = nullptr, downloaded = nullptr;
+        // The graphs of the work on stream for this slot, by the number of frames of the
+        // batch, and how many times it has been run.
+        struct Graph {
+            int runs = 0;
+            CUgraphExec exec = nullptr;
+        };
+        std::vector<Graph> graphs;
+    } slots[numSlots];
+
+    // The idle slots of all streams (only used in the first instance). Frames take the one
+    // that has been idle the longest, or wait until one is released.
+    struct Pool {
+        std::mutex lock;
+        std::condition_variable released;
+        std::deque<std::pair<VfxData *, Slot *>> idle;
+    } pool;
+
+    // With batch > 1, the batches being computed or not yet returned in full, by their
+    // first frame (only used in the first instance).
+    std::mutex batchLock;
+    std::map<int, std::shared_ptr<VfxBatch>> batches;
+
+    // Whether the instances have been set up, and the error if that failed, and whether
+    // they are set up at once (only used in the first instance).
+    std::mutex setupLock;
+    bool ready;
+    std::string setupError;
+    bool parallel_init;
 
     typedef float T;
     uint64_t in_image_width() const   { return in_width; }
@@ -66,17 +566,35 @@ struct VfxData {
     uint64_t in_image_height() const  { return in_height; }
     uint64_t out_image_height() const { return vi.height; }
 
-    VfxData() : node(nullptr), vi(), scale(0), strength(0), vfx(nullptr), stream(nullptr), state(nullptr) {}
+    VfxData() : batch(1), node(nullptr), vi(), stats(false), graph(false), device_id(0), device(0), ctx(nullptr), stream(nullptr), uploadStream(nullptr), downloadStream(nullptr), in_format(nullptr), module(nullptr), num_stages(0), ready(false), parallel_init(false) {}
     ~VfxData() {
-        if (vfx) NvVFX_DestroyEffect(vfx);
+        if (ctx) cuCtxPushCurrent(ctx);
+        for (int k = 0; k < num_stages; k++) {
+            Stage &s = stages[k];
+            if (s.vfx) NvVFX_DestroyEffect(s.vfx);
+            if (s.state) cuMemFree_v2(s.state);
+            NvCVImage_Dealloc(&s.dstGpuImg);
+        }
         if (stream) NvVFX_CudaStreamDestroy(stream);
-        if (state) cuMemFree_v2(state);
+        if (uploadStream) cuStreamDestroy_v2(uploadStream);
+        if (downloadStream) cuStreamDestroy_v2(downloadStream);
+        if (module) cuModuleUnload(module);
         NvCVImage_Dealloc(&srcGpuImg);
-        NvCVImage_Dealloc(&dstGpuImg);
-        NvCVImage_Dealloc(&srcTmpImg);
-        NvCVImage_Dealloc(&dstTmpImg);
-        cuMemFreeHost(srcCpuBuf);
-        cuMemFreeHost(dstCpuBuf);
+        for (auto &slot: slots) {
+            NvCVImage_Dealloc(&slot.srcTmpImg);
+            NvCVImage_Dealloc(&slot.dstTmpImg);
+            NvCVImage_Dealloc(&slot.srcHostImg);
+            NvCVImage_Dealloc(&slot.dstHostImg);
+            if (slot.uploaded) cuEventDestroy_v2(slot.uploaded);
+            if (slot.processed) cuEventDestroy_v2(slot.processed);
+            if (slot.downloaded) cuEventDestroy_v2(slot.downloaded);
+            for (auto &g: slot.graphs)
+                if (g.exec) cuGraphExecDestroy(g.exec);
+        }
+        if (ctx) {
+            cuCtxPopCurrent(nullptr);
+            cuDevicePrimaryCtxRelease(device);
+        }
     }
 };
 
@@ -85,82 +603,414 @@ static void VS_CC vfxInit(VSMap *in, VSMap *out, void **instanceData, VSNode *no
     vsapi->setVideoInfo(&d->vi, 1, node);
 }
 
+// Image n of a batch of planar images of the given height, which are stored one after the
+// other in full.
+static void nthImage(NvCVImage *view, const NvCVImage &full, unsigned height, int n) {
+    char *pixels = static_cast<char *>(full.pixels) + (size_t)full.pitch * height * full.numComponents * n;
+    CK_VFX(NvCVImage_Init(view, full.width, height, full.pitch, pixels, full.pixelFormat, full.componentType, full.planar, full.gpuMem));
+}
+
+// Enqueues the conversions and the effects on the count frames of slot on the stream of
+// d, with step(0) and step(1) called after the conversion of the input and the effects.
+// Returns the first error of the effects.
+template<typename F>
+static NvCV_Status vfxEnqueue(VfxData *d, VfxData::Slot *slot, int count, F &&step) {
+    for (int i = 0; i < count; i++) {
+        VfxConvert a = d->unpackArgs;
+        a.src = static_cast<char*>(slot->srcTmpImg.pixels) + a.srcPlane * 3 * i;
+        a.dst = static_cast<char*>(d->srcGpuImg.pixels) + a.dstPlane * 3 * i;
+        vfxLaunch(d->unpack, a, d->stream);
+    }
+    step(0);
+    for (int k = 0; k < d->num_stages; k++) {
+        NvCV_Status r = NVCV_SUCCESS;
+        if (d->batch > 1)
+            r = NvVFX_SetU32(d->stages[k].vfx, NVVFX_BATCH_SIZE, count);
+        if (r == NVCV_SUCCESS)
+            r = NvVFX_Run(d->stages[k].vfx, 1);
+        if (r != NVCV_SUCCESS)
+            return r;
+    }
+    step(1);
+    for (int i = 0; i < count; i++) {
+        VfxConvert a = d->packArgs;
+        a.src = static_cast<char*>(d->last().dstGpuImg.pixels) + a.srcPlane * 3 * i;
+        a.dst = static_cast<char*>(slot->dstTmpImg.pixels) + a.dstPlane * 3 * i;
+        vfxLaunch(d->pack, a, d->stream);
+    }
+    return NVCV_SUCCESS;
+}
+
+// Captures the work of vfxEnqueue() into exec, which replays it with a single launch, as
+// the kernels, images and parameters are the same for every frame of the slot. The work
+// is not run. Returns false if the effects cannot be captured (e.g. if they synchronize).
+static bool vfxCapture(VfxData *d, VfxData::Slot *slot, int count, CUgraphExec *exec) {
+    CK_CUDA(cuStreamBeginCapture_v2(d->stream, CU_STREAM_CAPTURE_MODE_THREAD_LOCAL));
+    const NvCV_Status r = vfxEnqueue(d, slot, count, [](int) {});
+    CUgraph graph = nullptr;
+    bool ok = cuStreamEndCapture(d->stream, &graph) == CUDA_SUCCESS && r == NVCV_SUCCESS;
+    ok = ok && cuGraphInstantiateWithFlags(exec, graph, 0) == CUDA_SUCCESS;
+    if (graph)
+        cuGraphDestroy(graph);
+    if (!ok)
+        *exec = nullptr;
+    return ok;
+}
+
+// Runs the effect on the count frames of src into those of dst, on a slot of any stream.
+static void vfxProcess(VfxData *ds, const VSFrameRef *const *src, VSFrameRef *const *dst, int count, double fetch, const VSAPI *vsapi) {
+    std::pair<VfxData *, VfxData::Slot *> taken;
+    {
+        std::unique_lock<std::mutex> lock(ds->pool.lock);
+        ds->pool.released.wait(lock, [ds] { return !ds->pool.idle.empty(); });
+        taken = ds->pool.idle.front();
+        ds->pool.idle.pop_front();
+    }
+    VfxData *d = taken.first;
+    VfxData::Slot *slot = taken.second;
+    CK_CUDA(cuCtxPushCurrent(d->ctx));
+
+    // Upload, run and download times.
+    double seconds[3] = {};
+    StatsClock::time_point start = StatsClock::now();
+    auto step = [&](int k) {
+        if (!d->stats)
+            return;
+        CK_CUDA(cuStreamSynchronize(d->stream));
+        seconds[k] = secondsSince(start);
+        start = StatsClock::now();
+    };
+
+    // The planes are copied between the frames and the pinned tmp images of the slot on
+    // the CPU, and between those and the device asynchronously, with one copy of all the
+    // planes of the batch each way.
+    const VSFormat *in = d->in_format, *out = d->vi.format;
+    auto deviceCopy = [](const NvCVImage &from, const NvCVImage &to, size_t widthBytes, size_t rows, CUstream stream) {
+        CUDA_MEMCPY2D mcp2d {};
+        mcp2d.srcMemoryType = from.gpuMem == NVCV_GPU ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
+        mcp2d.srcHost = from.pixels;
+        mcp2d.srcDevice = (CUdeviceptr)from.pixels;
+        mcp2d.srcPitch = (size_t)from.pitch;
+        mcp2d.dstMemoryType = to.gpuMem == NVCV_GPU ? CU_MEMORYTYPE_DEVICE : CU_MEMORYTYPE_HOST;
+        mcp2d.dstHost = to.pixels;
+        mcp2d.dstDevice = (CUdeviceptr)to.pixels;
+        mcp2d.dstPitch = (size_t)to.pitch;
+        mcp2d.WidthInBytes = widthBytes;
+        mcp2d.Height = rows;
+        CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, stream));
+    };
+    for (int i = 0; i < count; i++) {
+        for (int plane = 0; plane < 3; plane++) {
+            const size_t h = d->in_image_height();
+            const int ssw = plane ? in->subSamplingW : 0, ssh = plane ? in->subSamplingH : 0;
+            uint8_t *host = static_cast<uint8_t *>(slot->srcHostImg.pixels) + slot->srcHostImg.pitch * h * (3 * i + plane);
+            vs_bitblt(host, slot->srcHostImg.pitch, vsapi->getReadPtr(src[i], plane), vsapi->getStride(src[i], plane),
+                (size_t)(d->in_image_width() >> ssw) * in->bytesPerSample, h >> ssh);
+        }
+    }
+    deviceCopy(slot->srcHostImg, slot->srcTmpImg, (size_t)d->in_image_width() * in->bytesPerSample, d->in_image_height() * 3 * count, d->uploadStream);
+    CK_CUDA(cuEventRecord(slot->uploaded, d->uploadStream));
+
+    {
+        std::lock_guard<std::mutex> lock(d->lock);
+        CK_CUDA(cuStreamWaitEvent(d->stream, slot->uploaded, 0));
+        // The graph is captured the second time, as the effects may set themselves up
+        // (e.g. allocate) the first time they run.
+        VfxData::Slot::Graph &graph = slot->graphs[count];
+        if (d->graph && !graph.exec && graph.runs++ > 0 && !vfxCapture(d, slot, count, &graph.exec)) {
+            fprintf(stderr, "DLVFX: the effects cannot be captured as a CUDA graph, which is not used\n");
+            d->graph = false;
+        }
+        if (graph.exec)
+            CK_CUDA(cuGraphLaunch(graph.exec, d->stream));
+        else
+            CK_VFX(vfxEnqueue(d, slot, count, step));
+        CK_CUDA(cuEventRecord(slot->processed, d->stream));
+    }
+
+    CK_CUDA(cuStreamWaitEvent(d->downloadStream, slot->processed, 0));
+    deviceCopy(slot->dstTmpImg, slot->dstHostImg, (size_t)d->out_image_width() * out->bytesPerSample, d->out_image_height() * 3 * count, d->downloadStream);
+    CK_CUDA(cuEventRecord(slot->downloaded, d->downloadStream));
+
+    CK_CUDA(cuEventSynchronize(slot->downloaded));
+    for (int i = 0; i < count; i++) {
+        for (int plane = 0; plane < 3; plane++) {
+            const size_t h = d->out_image_height();
+            const int ssw = plane ? out->subSamplingW : 0, ssh = plane ? out->subSamplingH : 0;
+            const uint8_t *host = static_cast<const uint8_t *>(slot->dstHostImg.pixels) + slot->dstHostImg.pitch * h * (3 * i + plane);
+            vs_bitblt(vsapi->getWritePtr(dst[i], plane), vsapi->getStride(dst[i], plane), host, slot->dstHostImg.pitch,
+                (size_t)(d->out_image_width() >> ssw) * out->bytesPerSample, h >> ssh);
+        }
+    }
+    step(2);
+
+    // The times of a batch are those of all its frames.
+    for (int i = 0; i < count && d->stats; i++) {
+        VSMap *props = vsapi->getFramePropsRW(dst[i]);
+        vsapi->propSetFloat(props, "_AkarinTimeFetch", fetch, paReplace);
+        vsapi->propSetFloat(props, "_AkarinTimeUpload", seconds[0], paReplace);
+        vsapi->propSetFloat(props, "_AkarinTimeRun", seconds[1], paReplace);
+        vsapi->propSetFloat(props, "_AkarinTimeDownload", seconds[2], paReplace);
+    }
+
+    cuCtxPopCurrent(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(ds->pool.lock);
+        ds->pool.idle.push_back(taken);
+    }
+    ds->pool.released.notify_one();
+}
+
+// Creates the effects, streams and images of instance d on its device, with the context
+// of the device current.
+static void vfxSetupDevice(VfxData *d) {
+    const char *modelDir = getenv("MODEL_DIR"); // TODO: configurable model directory?
+    if (modelDir == nullptr)
+        modelDir = "C:\\Program Files\\NVIDIA Corporation\\NVIDIA Video Effects\\models";
+    fprintf(stderr, "MODEL_DIR = %s\n", modelDir);
+
+    CK_VFX(NvVFX_CudaStreamCreate(&d->stream));
+    CK_CUDA(cuStreamCreate(&d->uploadStream, CU_STREAM_NON_BLOCKING));
+    CK_CUDA(cuStreamCreate(&d->downloadStream, CU_STREAM_NON_BLOCKING));
+    CK_CUDA(cuModuleLoadData(&d->module, vfxPtx));
+    CK_CUDA(cuModuleGetFunction(&d->unpack, d->module, "vfx_unpack"));
+    CK_CUDA(cuModuleGetFunction(&d->pack, d->module, "vfx_pack"));
+
+    for (int k = 0; k < d->num_stages; k++) {
+        VfxData::Stage &s = d->stages[k];
+        NvCV_Status r = NvVFX_CreateEffect(vfxSelectors[s.op], &s.vfx);
+        if (r != NVCV_SUCCESS) {
+            const char *err = NvCV_GetErrorStringFromCode(r);
+            fprintf(stderr, "NvVFX_CreateEffect failed: %x (%s)\n", r, err);
+            throw std::runtime_error("unable to create effect: " + std::string(err));
+        }
+
+        CK_VFX(NvVFX_SetCudaStream(s.vfx, NVVFX_CUDA_STREAM, d->stream));
+
+        if (s.op == OP_AR || s.op == OP_SUPERRES)
+            r = NvVFX_SetU32(s.vfx, NVVFX_STRENGTH, int(s.strength));
+        else if (s.op == OP_DENOISE)
+            r = NvVFX_SetF32(s.vfx, NVVFX_STRENGTH, s.strength);
+        else assert(false);
+        if (r != NVCV_SUCCESS) {
+            const char *err = NvCV_GetErrorStringFromCode(r);
+            fprintf(stderr, "NvVFX set strength failed: %x (%s)\n", r, err);
+            throw std::runtime_error("failed to set strength: " + std::string(err));
+        }
+
+        r = NvVFX_SetString(s.vfx, NVVFX_MODEL_DIRECTORY, modelDir);
+        if (r != NVCV_SUCCESS) {
+            fprintf(stderr, "NvVFX set model directory to %s failed: %x (%s)\n", modelDir, r, NvCV_GetErrorStringFromCode(r));
+            throw std::runtime_error("unable to set model directory " + std::string(modelDir));
+        }
+
+        if (d->batch > 1)
+            CK_VFX(NvVFX_SetU32(s.vfx, NVVFX_MODEL_BATCH, d->batch));
+
+        if (s.op == OP_DENOISE) {
+            unsigned int stateSizeInBytes = 0;
+            CK_VFX(NvVFX_GetU32(s.vfx, NVVFX_STATE_SIZE, &stateSizeInBytes));
+            CK_CUDA(cuMemAlloc_v2(&s.state, stateSizeInBytes));
+            CK_CUDA(cuMemsetD8Async(s.state, 0, stateSizeInBytes, d->stream));
+            void *stateArray[1] = { s.state };
+            CK_VFX(NvVFX_SetObject(s.vfx, NVVFX_STATE, (void*)stateArray));
+        }
+    }
+
+    // The images of a batch are stored one after the other, see nthImage(), and so are
+    // the planes of the frames in the tmp images.
+    CK_VFX(NvCVImage_Alloc(&d->srcGpuImg, d->in_image_width(), d->in_image_height() * d->batch, NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU, 0));
+    nthImage(&d->srcGpuView, d->srcGpuImg, d->in_image_height(), 0);
+    for (int k = 0; k < d->num_stages; k++) {
+        VfxData::Stage &s = d->stages[k];
+        CK_VFX(NvCVImage_Alloc(&s.dstGpuImg, s.width, s.height * d->batch, NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU, 0));
+        nthImage(&s.dstGpuView, s.dstGpuImg, s.height, 0);
+    }
+
+    // By the type of vfxSampleType().
+    const NvCVImage_ComponentType componentTypes[] = { NVCV_U8, NVCV_U16, NVCV_F16, NVCV_F32 };
+    for (auto &slot: d->slots) {
+        CK_VFX(NvCVImage_Alloc(&slot.srcTmpImg, d->in_image_width(), d->in_image_height() * 3 * d->batch, NVCV_Y, componentTypes[d->unpackArgs.type], NVCV_CHUNKY, NVCV_GPU, 0));
+        CK_VFX(NvCVImage_Alloc(&slot.dstTmpImg, d->out_image_width(), d->out_image_height() * 3 * d->batch, NVCV_Y, componentTypes[d->packArgs.type], NVCV_CHUNKY, NVCV_GPU, 0));
+        CK_VFX(NvCVImage_Alloc(&slot.srcHostImg, d->in_image_width(), d->in_image_height() * 3 * d->batch, NVCV_Y, componentTypes[d->unpackArgs.type], NVCV_CHUNKY, NVCV_CPU_PINNED, 0));
+        CK_VFX(NvCVImage_Alloc(&slot.dstHostImg, d->out_image_width(), d->out_image_height() * 3 * d->batch, NVCV_Y, componentTypes[d->packArgs.type], NVCV_CHUNKY, NVCV_CPU_PINNED, 0));
+        CK_CUDA(cuEventCreate(&slot.uploaded, CU_EVENT_DISABLE_TIMING));
+        CK_CUDA(cuEventCreate(&slot.processed, CU_EVENT_DISABLE_TIMING));
+        CK_CUDA(cuEventCreate(&slot.downloaded, CU_EVENT_DISABLE_TIMING));
+        slot.graphs.resize(d->batch + 1);
+    }
+
+    d->unpackArgs.srcPitch = d->slots[0].srcTmpImg.pitch;
+    d->unpackArgs.srcPlane = (uint64_t)d->unpackArgs.srcPitch * d->in_image_height();
+    d->unpackArgs.dstPitch = d->srcGpuImg.pitch;
+    d->unpackArgs.dstPlane = (uint64_t)d->unpackArgs.dstPitch * d->in_image_height();
+    d->unpackArgs.width = d->in_image_width();
+    d->unpackArgs.height = d->in_image_height();
+    d->packArgs.srcPitch = d->last().dstGpuImg.pitch;
+    d->packArgs.srcPlane = (uint64_t)d->packArgs.srcPitch * d->out_image_height();
+    d->packArgs.dstPitch = d->slots[0].dstTmpImg.pitch;
+    d->packArgs.dstPlane = (uint64_t)d->packArgs.dstPitch * d->out_image_height();
+    d->packArgs.width = d->out_image_width();
+    d->packArgs.height = d->out_image_height();
+
+    for (int k = 0; k < d->num_stages; k++) {
+        VfxData::Stage &s = d->stages[k];
+        CK_VFX(NvVFX_SetImage(s.vfx, NVVFX_INPUT_IMAGE, k ? &d->stages[k - 1].dstGpuView : &d->srcGpuView));
+        CK_VFX(NvVFX_SetImage(s.vfx, NVVFX_OUTPUT_IMAGE, &s.dstGpuView));
+        CK_VFX(NvVFX_Load(s.vfx));
+    }
+}
+
+// Sets up instance d, when the filter is created or, with lazy=True, when the first frame
+// is requested.
+static void vfxSetup(VfxData *d) {
+    CUdevice device = 0;
+    if (cuInit(0) != CUDA_SUCCESS || cuDeviceGet(&device, d->device_id) != CUDA_SUCCESS)
+        throw std::runtime_error("invalid device " + std::to_string(d->device_id));
+    d->device = device;
+    CK_CUDA(cuDevicePrimaryCtxRetain(&d->ctx, d->device));
+    CK_CUDA(cuCtxPushCurrent(d->ctx));
+    try {
+        vfxSetupDevice(d);
+    } catch (std::runtime_error &) {
+        cuCtxPopCurrent(nullptr);
+        throw;
+    }
+    CK_CUDA(cuCtxPopCurrent(nullptr));
+}
+
+// Sets up all instances, at once with parallel_init=True, as loading the models takes a
+// while. Returns the error of the first one that failed, if any.
+static std::string vfxSetupAll(VfxData *ds) {
+    const int num = ds->num_streams * ds->num_devices;
+    std::vector<std::string> errors(num);
+    auto setup = [&](int i) {
+        try {
+            vfxSetup(&ds[i]);
+        } catch (std::runtime_error &e) {
+            errors[i] = e.what();
+        }
+    };
+    if (ds->parallel_init) {
+        std::vector<std::future<void>> done;
+        for (int i = 0; i < num; i++)
+            done.push_back(std::async(std::launch::async, setup, i));
+        for (auto &f: done)
+            f.get();
+    } else {
+        for (int i = 0; i < num; i++) {
+            setup(i);
+            if (!errors[i].empty())
+                break;
+        }
+    }
+    for (const auto &e: errors)
+        if (!e.empty())
+            return e;
+    return {};
+}
+
+// Whether all instances are set up, which they are after the first call unless that failed.
+static bool vfxReady(VfxData *ds, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    std::lock_guard<std::mutex> lock(ds->setupLock);
+    if (!ds->ready) {
+        ds->setupError = vfxSetupAll(ds);
+        ds->ready = true;
+    }
+    if (!ds->setupError.empty()) {
+        vsapi->setFilterError(("DLVFX: " + ds->setupError).c_str(), frameCtx);
+        return false;
+    }
+    return true;
+}
+
 static const VSFrameRef *VS_CC vfxGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     VfxData *ds = static_cast<VfxData *>(*instanceData);
 
+    // With stats, frameData holds the time the frame was requested.
+    std::unique_ptr<StatsClock::time_point> requested(static_cast<StatsClock::time_point *>(*frameData));
+    *frameData = nullptr;
+
+    // The frames of the batch of frame n, which are all requested by each of them, as any
+    // may be the one that computes the batch.
+    const int first = n - n % ds->batch;
+    const int count = std::min(ds->batch, ds->vi.numFrames - first);
+
     if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, ds->node, frameCtx);
+        if (ds->stats)
+            *frameData = new StatsClock::time_point(StatsClock::now());
+        for (int i = first; i < first + count; i++)
+            vsapi->requestFrameFilter(i, ds->node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        for (int i = 0; i <= ds->num_streams; ++i) {
-            auto d = i < ds->num_streams ? ds + i : ds + rand() % ds->num_streams;
-            std::unique_lock<std::mutex> lock(d->lock, std::defer_lock);
-            if (i < ds->num_streams) {
-                if (!lock.try_lock()) continue;
-            } else {
-                lock.lock();
+        if (!vfxReady(ds, frameCtx, vsapi))
+            return nullptr;
+        const double fetch = requested ? secondsSince(*requested) : 0;
+        auto compute = [&](int first, int count, VSFrameRef **dst) {
+            std::vector<const VSFrameRef *> src(count);
+            for (int i = 0; i < count; i++) {
+                src[i] = vsapi->getFrameFilter(first + i, ds->node, frameCtx);
+                assert(vsapi->getFrameHeight(src[i], 0) == (int)ds->in_image_height());
+                assert(vsapi->getFrameWidth(src[i], 0) == (int)ds->in_image_width());
+                int planes[3] = { 0, 1, 2 };
+                const VSFrameRef *srcf[3] = { nullptr, nullptr, nullptr };
+                dst[i] = vsapi->newVideoFrame2(ds->vi.format, ds->out_image_width(), ds->out_image_height(), srcf, planes, src[i], core);
             }
+            vfxProcess(ds, src.data(), dst, count, fetch, vsapi);
+            for (auto f: src)
+                vsapi->freeFrame(f);
+        };
 
-            const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
-
-            const VSFormat *fi = vsapi->registerFormat(cmRGB, d->output_depth == 32 ? stFloat : stInteger, d->output_depth, 0, 0, core);
-            assert(vsapi->getFrameHeight(src, 0) == (int)d->in_image_height());
-            assert(vsapi->getFrameWidth(src, 0) == (int)d->in_image_width());
-            int planes[3] = { 0, 1, 2 };
-            const VSFrameRef *srcf[3] = { nullptr, nullptr, nullptr };
-            VSFrameRef *dst = vsapi->newVideoFrame2(fi, d->out_image_width(), d->out_image_height(), srcf, planes, src, core);
-
-            auto host = static_cast<char*>(d->srcCpuBuf);
-            for (int plane = 0; plane < 3; plane++) {
-                const auto stride = vsapi->getStride(src, plane);
-                const auto *ptr = vsapi->getReadPtr(src, plane);
-                const size_t w = d->in_image_width(), h = d->in_image_height();
-                const auto pitch = d->srcTmpImg.pitch;
-                vs_bitblt(host + pitch * h * plane, pitch, ptr, stride, w * d->vi.format->bytesPerSample, h);
-            }
+        if (ds->batch == 1) {
+            VSFrameRef *dst;
+            compute(n, 1, &dst);
+            return dst;
+        }
 
+        for (;;) {
+            std::shared_ptr<VfxBatch> b;
+            bool owner = false;
             {
-                CUDA_MEMCPY2D mcp2d {};
-                mcp2d.srcMemoryType = CU_MEMORYTYPE_HOST;
-                mcp2d.srcHost = host;
-                mcp2d.srcPitch = (size_t)d->srcTmpImg.pitch;
-                mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
-                mcp2d.dstDevice = (CUdeviceptr)d->srcTmpImg.pixels;
-                mcp2d.dstPitch = (size_t)d->srcTmpImg.pitch;
-                mcp2d.WidthInBytes = (size_t)d->in_image_width() * d->vi.format->bytesPerSample;
-                mcp2d.Height = d->in_image_height() * 3;
-                CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, d->stream));
+                std::lock_guard<std::mutex> lock(ds->batchLock);
+                auto &entry = ds->batches[first];
+                // A frame requested again after it was returned computes the batch again.
+                if (!entry || (entry->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready && !entry->frames[n - first])) {
+                    entry = std::make_shared<VfxBatch>(count);
+                    owner = true;
+                }
+                b = entry;
             }
-
-            CK_VFX(NvCVImage_Transfer(&d->srcTmpImg, &d->srcGpuImg, d->srcTransferFactor, d->stream, nullptr));
-            CK_VFX(NvVFX_Run(d->vfx, 1));
-            CK_VFX(NvCVImage_Transfer(&d->dstGpuImg, &d->dstTmpImg, d->dstTransferFactor, d->stream, nullptr));
-
-            host = static_cast<char*>(d->dstCpuBuf);
-            {
-                CUDA_MEMCPY2D mcp2d {};
-                mcp2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-                mcp2d.srcDevice = (CUdeviceptr)d->dstTmpImg.pixels;
-                mcp2d.srcPitch = (size_t)d->dstTmpImg.pitch;
-                mcp2d.dstMemoryType = CU_MEMORYTYPE_HOST;
-                mcp2d.dstHost = host;
-                mcp2d.dstPitch = (size_t)d->dstTmpImg.pitch;
-                mcp2d.WidthInBytes = (size_t)d->out_image_width() * d->output_depth / 8;
-                mcp2d.Height = d->out_image_height() * 3;
-                CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, d->stream));
+            if (owner) {
+                compute(first, count, b->frames.data());
+                b->computed.set_value();
+            } else {
+                b->done.wait();
             }
 
-            CK_CUDA(cuStreamSynchronize(d->stream));
-
-            for (int plane = 0; plane < 3; plane++) {
-                const auto stride = vsapi->getStride(dst, plane);
-                auto *ptr = vsapi->getWritePtr(dst, plane);
-                const size_t w = d->out_image_width(), h = d->out_image_height();
-                const auto pitch = d->dstTmpImg.pitch;
-                vs_bitblt(ptr, stride, host + pitch * h * plane, pitch, w * d->output_depth / 8, h);
+            std::lock_guard<std::mutex> lock(ds->batchLock);
+            VSFrameRef *dst = b->frames[n - first];
+            if (!dst)
+                continue;
+            b->frames[n - first] = nullptr;
+            auto drop = [&](std::map<int, std::shared_ptr<VfxBatch>>::iterator it) {
+                for (auto &f: it->second->frames) {
+                    if (f)
+                        vsapi->freeFrame(f);
+                    f = nullptr;
+                }
+                return ds->batches.erase(it);
+            };
+            auto it = ds->batches.find(first);
+            if (++b->returned == b->frames.size() && it != ds->batches.end() && it->second == b)
+                drop(it);
+            // Batches of which some frames are never requested (e.g. when seeking) are dropped,
+            // the lowest first, once there are more than could be in flight.
+            const size_t limit = (size_t)ds->num_streams * ds->num_devices * VfxData::numSlots * 2;
+            for (it = ds->batches.begin(); it != ds->batches.end() && ds->batches.size() > limit;) {
+                if (it->second->done.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                    it = drop(it);
+                else
+                    ++it;
             }
-
-            vsapi->freeFrame(src);
-            lock.unlock();
             return dst;
         }
     }
@@ -170,10 +1020,14 @@ static const VSFrameRef *VS_CC vfxGetFrame(int n, int activationReason, void **i
 
 static void VS_CC vfxFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     VfxData *ds = static_cast<VfxData *>(instanceData);
-    for (int i = 0; i < ds->num_streams; ++i) {
+    for (int i = 0; i < ds->num_streams * ds->num_devices; ++i) {
         auto d = ds + i;
         vsapi->freeNode(d->node);
     }
+    for (const auto &b: ds->batches)
+        for (auto f: b.second->frames)
+            if (f)
+                vsapi->freeFrame(f);
 
     delete[] ds;
 }
@@ -188,11 +1042,35 @@ static void VS_CC vfxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     auto num_streams = int64ToIntS(vsapi->propGetInt(in, "num_streams", 0, &err));
     if (err) num_streams = 1;
 
-    std::unique_ptr<VfxData[]> ds(new VfxData[num_streams]);
+    // The outputs are not cached by default, as they can be very large and are usually
+    // requested once. cache=2 caches them and makes the requests linear.
+    auto cache = int64ToIntS(vsapi->propGetInt(in, "cache", 0, &err));
+    if (err) cache = 0;
+    if (cache < 0 || cache > 2) {
+        vsapi->setError(out, "DLVFX: cache must be 0 (none), 1 (cached) or 2 (linear)");
+        return;
+    }
+    const int flags = cache == 0 ? nfNoCache : cache == 2 ? nfMakeLinear : 0;
+
+    // Instance i runs on device i % num_devices, so that consecutive ones (and the first
+    // slots of the pool) alternate between the devices.
+    std::vector<int> devices;
+    for (int i = 0; i < vsapi->propNumElements(in, "devices"); i++)
+        devices.push_back(int64ToIntS(vsapi->propGetInt(in, "devices", i, nullptr)));
+    if (devices.empty())
+        devices.push_back(0);
+    const int num_devices = (int)devices.size();
+
+    std::unique_ptr<VfxData[]> ds(new VfxData[num_streams * num_devices]);
+    // The instances are set up when the first frame is requested with lazy=True, e.g. for
+    // nodes that are only used by some scripts.
+    const bool lazy = !!vsapi->propGetInt(in, "lazy", 0, &err);
+    ds[0].parallel_init = !!vsapi->propGetInt(in, "parallel_init", 0, &err);
 
-    for (int i = 0; i < num_streams; ++i) {
+    for (int i = 0; i < num_streams * num_devices; ++i) {
         auto d = &ds[i];
         d->num_streams = num_streams;
+        d->num_devices = num_devices;
         try {
             if (autoDllErrors.size() > 0) {
                 std::string error, last;
@@ -212,121 +1090,129 @@ static void VS_CC vfxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             if (!isConstantFormat(&d->vi)) {
                 throw std::runtime_error("Only clips with constant format and dimensions allowed");
             }
-            if (d->vi.format->numPlanes != 3 || d->vi.format->colorFamily != cmRGB)
-                throw std::runtime_error("input clip must be RGB format");
-
-            enum { OP_AR, OP_SUPERRES, OP_DENOISE };
-            const NvVFX_EffectSelector selectors[] = { NVVFX_FX_ARTIFACT_REDUCTION, NVVFX_FX_SUPER_RES, NVVFX_FX_DENOISING };
-            size_t op = int64ToIntS(vsapi->propGetInt(in, "op", 0, &err));
-            if (err) throw std::runtime_error("op is required argument");
-            if (op >= sizeof selectors / sizeof selectors[0])
-                throw std::runtime_error("op is out of range.");
-
-            if (op != OP_SUPERRES)
-                d->scale = 1;
-            else {
-                double scale = vsapi->propGetFloat(in, "scale", 0, &err);
-                if (err) scale = 1;
-                if (scale < 1)
-                    throw std::runtime_error("invalid scale parameter");
-                d->scale = scale;
+            d->in_format = d->vi.format;
+            if (d->in_format->colorFamily != cmRGB && d->in_format->colorFamily != cmYUV)
+                throw std::runtime_error("input clip must be RGB or YUV format");
+            if (vfxSampleType(d->in_format) < 0)
+                throw std::runtime_error("unsupported clip format");
+
+            // Several ops are applied in turn, e.g. op=[0, 1] for artifact reduction and then
+            // super resolution, with strength and scale given once for all or per op.
+            d->num_stages = vsapi->propNumElements(in, "op");
+            if (d->num_stages <= 0) throw std::runtime_error("op is required argument");
+            d->stages.reset(new VfxData::Stage[d->num_stages]);
+            const int num_strengths = vsapi->propNumElements(in, "strength");
+            if (num_strengths > 1 && num_strengths != d->num_stages)
+                throw std::runtime_error("strength must have one value or one per op");
+            const int num_scales = vsapi->propNumElements(in, "scale");
+            if (num_scales > 1 && num_scales != d->num_stages)
+                throw std::runtime_error("scale must have one value or one per op");
+            bool denoise = false;
+            for (int k = 0; k < d->num_stages; k++) {
+                VfxData::Stage &s = d->stages[k];
+                size_t op = int64ToIntS(vsapi->propGetInt(in, "op", k, &err));
+                if (op >= sizeof vfxSelectors / sizeof vfxSelectors[0])
+                    throw std::runtime_error("op is out of range.");
+                s.op = op;
+                denoise |= op == OP_DENOISE;
+
+                if (op == OP_SUPERRES && num_scales > 0) {
+                    s.scale = vsapi->propGetFloat(in, "scale", num_scales > 1 ? k : 0, &err);
+                    if (s.scale < 1)
+                        throw std::runtime_error("invalid scale parameter");
+                }
+                if (num_strengths > 0)
+                    s.strength = vsapi->propGetFloat(in, "strength", num_strengths > 1 ? k : 0, &err);
             }
 
-            double strength = vsapi->propGetFloat(in, "strength", 0, &err);
-            if (err) strength = 0;
-            d->strength = strength;
+            d->stats = !!vsapi->propGetInt(in, "stats", 0, &err);
 
-            const char *modelDir = getenv("MODEL_DIR"); // TODO: configurable model directory?
-            if (modelDir == nullptr)
-                modelDir = "C:\\Program Files\\NVIDIA Corporation\\NVIDIA Video Effects\\models";
-            fprintf(stderr, "MODEL_DIR = %s\n", modelDir);
+            // The launches of each frame are replayed from a CUDA graph with graph=True,
+            // which saves their cost when the frames are small.
+            d->graph = !!vsapi->propGetInt(in, "graph", 0, &err);
+            if (d->graph && d->stats)
+                throw std::runtime_error("graph and stats are mutually exclusive");
+            if (d->graph && !autoDllMissing.empty())
+                throw std::runtime_error("graph requires a newer driver: " + autoDllMissing[0]);
 
-            NvCV_Status r = NvVFX_CreateEffect(selectors[op], &d->vfx);
-            if (r != NVCV_SUCCESS) {
-                const char *err = NvCV_GetErrorStringFromCode(r);
-                fprintf(stderr, "NvVFX_CreateEffect failed: %x (%s)\n", r, err);
-                throw std::runtime_error("unable to create effect: " + std::string(err));
-            }
+            d->batch = int64ToIntS(vsapi->propGetInt(in, "batch", 0, &err));
+            if (err) d->batch = 1;
+            if (d->batch < 1)
+                throw std::runtime_error("batch must be at least 1");
+            // The state of the denoiser carries over from one frame to the next.
+            if (denoise && d->batch > 1)
+                throw std::runtime_error("batch is not supported for denoising");
 
-            CK_VFX(NvVFX_CudaStreamCreate(&d->stream));
-            CK_VFX(NvVFX_SetCudaStream(d->vfx, NVVFX_CUDA_STREAM, d->stream));
-
-            if (op == OP_AR || op == OP_SUPERRES)
-                r = NvVFX_SetU32(d->vfx, NVVFX_STRENGTH, int(d->strength));
-            else if (op == OP_DENOISE)
-                r = NvVFX_SetF32(d->vfx, NVVFX_STRENGTH, d->strength);
-            else assert(false);
-            if (r != NVCV_SUCCESS) {
-                const char *err = NvCV_GetErrorStringFromCode(r);
-                fprintf(stderr, "NvVFX set strength failed: %x (%s)\n", r, err);
-                throw std::runtime_error("failed to set strength: " + std::string(err));
+            // The output has the color family and subsampling of the clip unless format is
+            // given.
+            const VSFormat *out_format = d->in_format;
+            int format = int64ToIntS(vsapi->propGetInt(in, "format", 0, &err));
+            if (!err) {
+                out_format = vsapi->getFormatPreset(format, core);
+                if (vsapi->propNumElements(in, "output_depth") > 0)
+                    throw std::runtime_error("format and output_depth are mutually exclusive");
+            } else {
+                int output_depth = int64ToIntS(vsapi->propGetInt(in, "output_depth", 0, &err));
+                if (!err)
+                    out_format = vsapi->registerFormat(d->in_format->colorFamily, output_depth == 32 ? stFloat : stInteger, output_depth, d->in_format->subSamplingW, d->in_format->subSamplingH, core);
             }
+            if (!out_format || (out_format->colorFamily != cmRGB && out_format->colorFamily != cmYUV) || vfxSampleType(out_format) < 0)
+                throw std::runtime_error("unsupported output format: only RGB or YUV of 8-16 bit integer or 16/32 bit float samples are supported");
 
-            r = NvVFX_SetString(d->vfx, NVVFX_MODEL_DIRECTORY, modelDir);
-            if (r != NVCV_SUCCESS) {
-                fprintf(stderr, "NvVFX set model directory to %s failed: %x (%s)\n", modelDir, r, NvCV_GetErrorStringFromCode(r));
-                throw std::runtime_error("unable to set model directory " + std::string(modelDir));
-            }
+            // _Matrix values.
+            int matrix = int64ToIntS(vsapi->propGetInt(in, "matrix", 0, &err));
+            if (err) matrix = 1;
+            double kr, kb;
+            if (matrix == 1)
+                kr = 0.2126, kb = 0.0722;
+            else if (matrix == 5 || matrix == 6)
+                kr = 0.299, kb = 0.114;
+            else if (matrix == 9)
+                kr = 0.2627, kb = 0.0593;
+            else
+                throw std::runtime_error("unsupported matrix: only 1 (BT.709), 5/6 (BT.601) and 9 (BT.2020) are supported");
+            const bool fullRange = !!vsapi->propGetInt(in, "full_range", 0, &err);
+            vfxConversions(d->unpackArgs, d->packArgs, d->in_format, out_format, fullRange, kr, kb);
 
-            if (op == OP_DENOISE) {
-                unsigned int stateSizeInBytes = 0;
-                CK_VFX(NvVFX_GetU32(d->vfx, NVVFX_STATE_SIZE, &stateSizeInBytes));
-                CK_CUDA(cuMemAlloc_v2(&d->state, stateSizeInBytes));
-                CK_CUDA(cuMemsetD8Async(d->state, 0, stateSizeInBytes, d->stream));
-                void *stateArray[1] = { d->state };
-                CK_VFX(NvVFX_SetObject(d->vfx, NVVFX_STATE, (void*)stateArray));
+            d->device_id = devices[i % num_devices];
+            d->in_width = d->vi.width;
+            d->in_height = d->vi.height;
+            // Each stage scales the output of the previous one.
+            for (int k = 0; k < d->num_stages; k++) {
+                VfxData::Stage &s = d->stages[k];
+                s.width = (k ? d->stages[k - 1].width : d->in_width) * s.scale;
+                s.height = (k ? d->stages[k - 1].height : d->in_height) * s.scale;
             }
+            d->vi.width = d->last().width;
+            d->vi.height = d->last().height;
+            d->vi.format = out_format;
+            if (d->vi.width % (1 << out_format->subSamplingW) || d->vi.height % (1 << out_format->subSamplingH))
+                throw std::runtime_error("output dimensions must be divisible by the subsampling of the output format");
         } catch (std::runtime_error &e) {
             if (d->node)
                 vsapi->freeNode(d->node);
             vsapi->setError(out, (std::string{ "DLVFX: " } + e.what()).c_str());
             return;
         }
+    }
 
-        d->in_width = d->vi.width;
-        d->in_height = d->vi.height;
-        d->vi.width *= d->scale;
-        d->vi.height *= d->scale;
-
-        NvCVImage_ComponentType src_ct, dst_ct;
-        if (auto bps = d->vi.format->bitsPerSample, st = d->vi.format->sampleType; bps == 32 && st == stFloat) {
-            src_ct = NVCV_F32;
-	    d->srcTransferFactor = 1.0f;
-        } else if (bps == 8 && st == stInteger) {
-            src_ct = NVCV_U8;
-	    d->srcTransferFactor = 1.0f/255.0f;
-        } else {
-            throw std::runtime_error("unsupported clip format");
-        }
-
-        int output_depth = int64ToIntS(vsapi->propGetInt(in, "output_depth", 0, &err));
-        if (err) output_depth = d->vi.format->bitsPerSample;
-        d->output_depth = output_depth;
-        if (output_depth == 32) {
-            dst_ct = NVCV_F32;
-	    d->dstTransferFactor = 1.0f;
-        } else if (output_depth == 8) {
-            dst_ct = NVCV_U8;
-	    d->dstTransferFactor = 255.0f;;
-        } else {
-            throw std::runtime_error("unsupported output_depth: only 8 (RGB24) or 32 (RGBS) are supported");
-	}
-
-        CK_VFX(NvCVImage_Alloc(&d->srcTmpImg, d->in_image_width(), d->in_image_height(), NVCV_RGB, src_ct, NVCV_PLANAR, NVCV_GPU, 0));
-        CK_VFX(NvCVImage_Alloc(&d->srcGpuImg, d->in_image_width(), d->in_image_height(), NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU, 0));
-        CK_VFX(NvCVImage_Alloc(&d->dstTmpImg, d->out_image_width(), d->out_image_height(), NVCV_RGB, dst_ct, NVCV_PLANAR, NVCV_GPU, 0));
-        CK_VFX(NvCVImage_Alloc(&d->dstGpuImg, d->out_image_width(), d->out_image_height(), NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU, 0));
-
-        CK_CUDA(cuMemHostAlloc(&d->srcCpuBuf, d->srcTmpImg.pitch * d->in_image_height() * 3, CU_MEMHOSTALLOC_WRITECOMBINED));
-        CK_CUDA(cuMemHostAlloc(&d->dstCpuBuf, d->dstTmpImg.pitch * d->out_image_height() * 3, 0));
-
-        CK_VFX(NvVFX_SetImage(d->vfx, NVVFX_INPUT_IMAGE, &d->srcGpuImg));
-        CK_VFX(NvVFX_SetImage(d->vfx, NVVFX_OUTPUT_IMAGE, &d->dstGpuImg));
+    // One slot of every stream before the second ones, to spread the first frames.
+    for (int j = 0; j < VfxData::numSlots; ++j)
+        for (int i = 0; i < num_streams * num_devices; ++i)
+            ds[0].pool.idle.emplace_back(&ds[i], &ds[i].slots[j]);
 
-        CK_VFX(NvVFX_Load(d->vfx));
+    if (!lazy) {
+        ds[0].setupError = vfxSetupAll(ds.get());
+        ds[0].ready = true;
+        if (!ds[0].setupError.empty()) {
+            for (int i = 0; i < num_streams * num_devices; ++i)
+                vsapi->freeNode(ds[i].node);
+            vsapi->setError(out, ("DLVFX: " + ds[0].setupError).c_str());
+            return;
+        }
     }
 
-    vsapi->createFilter(in, out, "DLVFX", vfxInit, vfxGetFrame, vfxFree, fmParallel, 0, ds.release(), core);
+    vsapi->createFilter(in, out, "DLVFX", vfxInit, vfxGetFrame, vfxFree, fmParallel, flags, ds.release(), core);
 }
 
 //////////////////////////////////////////
@@ -338,5 +1224,5 @@ void VS_CC vfxInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerF
 VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
     configFunc("info.akarin.plugin", "akarin2", "Experimental Nvidia Maxine plugin", VAPOURSYNTH_API_VERSION, 1, plugin);
 #endif
-    registerFunc("DLVFX", "clip:clip;op:int;scale:float:opt;strength:float:opt;output_depth:int:opt;num_streams:int:opt", vfxCreate, nullptr, plugin);
+    registerFunc("DLVFX", "clip:clip;op:int[];scale:float[]:opt;strength:float[]:opt;output_depth:int:opt;format:int:opt;matrix:int:opt;full_range:int:opt;num_streams:int:opt;devices:int[]:opt;batch:int:opt;lazy:int:opt;parallel_init:int:opt;stats:int:opt;cache:int:opt;graph:int:opt", vfxCreate, nullptr, plugin);
 }